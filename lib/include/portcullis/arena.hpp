@@ -0,0 +1,154 @@
+//  ********************************************************************
+//  This file is part of Portcullis.
+//
+//  Portcullis is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  Portcullis is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with Portcullis.  If not, see <http://www.gnu.org/licenses/>.
+//  *******************************************************************
+
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <vector>
+using std::shared_ptr;
+using std::unique_ptr;
+using std::vector;
+
+namespace portcullis {
+
+// Size of each block of memory requested from the system by an arena
+const size_t DEFAULT_ARENA_BLOCK_SIZE = 1 << 16;
+
+/**
+ * A region based memory pool.  Memory is handed out from large blocks by
+ * bumping a pointer, so allocating is cheap and objects allocated together sit
+ * next to each other.  Individual objects are never freed, instead all blocks
+ * are returned to the system in one go when the arena is destroyed.  Not thread
+ * safe, so each thread should allocate from its own arena.
+ */
+class Arena {
+private:
+
+	vector<unique_ptr<char[]>> blocks;
+	size_t blockSize;
+	char* next;
+	size_t remaining;
+	size_t nbBytes;
+
+	void* allocateFromNewBlock(const size_t bytes, const size_t alignment);
+
+public:
+
+	Arena() : Arena(DEFAULT_ARENA_BLOCK_SIZE) {
+	}
+
+	/**
+	 * @param blockSize Size of each block of memory requested from the system
+	 */
+	Arena(const size_t blockSize);
+
+	Arena(const Arena& other) = delete;
+
+	Arena& operator=(const Arena& other) = delete;
+
+	/**
+	 * @return Memory for an object of the given size and alignment, which stays
+	 * valid until the arena is destroyed
+	 */
+	void* allocate(const size_t bytes, const size_t alignment) {
+		const size_t padding = (alignment - ((uintptr_t)next & (alignment - 1))) & (alignment - 1);
+		if (padding + bytes > remaining) {
+			return allocateFromNewBlock(bytes, alignment);
+		}
+		void* p = next + padding;
+		next += padding + bytes;
+		remaining -= padding + bytes;
+		nbBytes += bytes;
+		return p;
+	}
+
+	/**
+	 * Number of blocks requested from the system
+	 */
+	size_t getNbBlocks() const {
+		return blocks.size();
+	}
+
+	/**
+	 * Number of bytes handed out, excluding padding
+	 */
+	size_t getNbBytes() const {
+		return nbBytes;
+	}
+};
+
+typedef shared_ptr<Arena> ArenaPtr;
+
+/**
+ * STL compatible allocator that takes memory from an arena.  Each copy of the
+ * allocator holds a reference to the arena, so objects created with
+ * std::allocate_shared, and containers using this allocator, keep the arena
+ * alive for as long as they need it.  Without an arena this falls back to the
+ * global operator new, so the same container type can be used either way.
+ */
+template<typename T>
+class ArenaAllocator {
+public:
+
+	typedef T value_type;
+	typedef std::true_type propagate_on_container_copy_assignment;
+	typedef std::true_type propagate_on_container_move_assignment;
+	typedef std::true_type propagate_on_container_swap;
+
+	ArenaPtr arena;
+
+	ArenaAllocator() : arena(nullptr) {
+	}
+
+	ArenaAllocator(ArenaPtr arena) : arena(arena) {
+	}
+
+	template<typename U>
+	ArenaAllocator(const ArenaAllocator<U>& other) : arena(other.arena) {
+	}
+
+	T* allocate(const size_t n) {
+		if (arena == nullptr) {
+			return static_cast<T*>(::operator new(n * sizeof(T)));
+		}
+		return static_cast<T*>(arena->allocate(n * sizeof(T), alignof(T)));
+	}
+
+	void deallocate(T* p, const size_t n) {
+		// Memory from an arena is freed with the arena
+		if (arena == nullptr) {
+			::operator delete(p);
+		}
+	}
+
+	template<typename U>
+	bool operator==(const ArenaAllocator<U>& other) const {
+		return arena == other.arena;
+	}
+
+	template<typename U>
+	bool operator!=(const ArenaAllocator<U>& other) const {
+		return arena != other.arena;
+	}
+};
+
+}
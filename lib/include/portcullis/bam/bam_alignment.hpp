@@ -97,6 +97,122 @@ struct CigarOp {
 			return false;
 		}
 	}
+
+	/**
+	 * @return This op packed into 32 bits as in the BAM format
+	 */
+	uint32_t pack() const;
+};
+
+/**
+ * A read only view over a cigar packed as in the BAM format, where each op is
+ * a 32-bit word holding the length in the upper 28 bits and the htslib op code
+ * (e.g. BAM_CMATCH) in the lower 4 bits.  Whether an op consumes the query or
+ * the reference is looked up in htslib's bit table rather than by comparing
+ * characters.  A view over a raw alignment's cigar is only valid while that
+ * alignment record is unchanged.
+ */
+class CigarView {
+private:
+	const uint32_t* ops;
+	uint32_t nbOps;
+
+public:
+
+	CigarView(const uint32_t* _ops, const uint32_t _nbOps) : ops(_ops), nbOps(_nbOps) {
+	}
+
+	uint32_t size() const {
+		return nbOps;
+	}
+
+	bool empty() const {
+		return nbOps == 0;
+	}
+
+	/**
+	 * @return The htslib op code of the op at this index, e.g. BAM_CREF_SKIP
+	 */
+	int op(const uint32_t index) const {
+		return bam_cigar_op(ops[index]);
+	}
+
+	char opChar(const uint32_t index) const {
+		return bam_cigar_opchr(ops[index]);
+	}
+
+	uint32_t length(const uint32_t index) const {
+		return bam_cigar_oplen(ops[index]);
+	}
+
+	bool consumesQuery(const uint32_t index) const {
+		return (bam_cigar_type(bam_cigar_op(ops[index])) & 1) != 0;
+	}
+
+	bool consumesReference(const uint32_t index) const {
+		return (bam_cigar_type(bam_cigar_op(ops[index])) & 2) != 0;
+	}
+
+	CigarOp at(const uint32_t index) const {
+		return CigarOp(opChar(index), length(index));
+	}
+
+	/**
+	 * @return Whether there is an op with the given htslib op code
+	 */
+	bool contains(const uint32_t op) const {
+		for (uint32_t i = 0; i < nbOps; i++) {
+			if (bam_cigar_op(ops[i]) == op) {
+				return true;
+			}
+		}
+		return false;
+	}
+
+	/**
+	 * @return The number of ops with the given htslib op code
+	 */
+	uint32_t count(const uint32_t op) const {
+		uint32_t n = 0;
+		for (uint32_t i = 0; i < nbOps; i++) {
+			if (bam_cigar_op(ops[i]) == op) {
+				n++;
+			}
+		}
+		return n;
+	}
+
+	/**
+	 * @return The number of reference bases covered by this cigar
+	 */
+	int32_t calcReferenceLength() const {
+		int32_t len = 0;
+		for (uint32_t i = 0; i < nbOps; i++) {
+			if (consumesReference(i)) {
+				len += length(i);
+			}
+		}
+		return len;
+	}
+};
+
+/**
+ * How well the aligned bases of a read agree with the reference over a region.
+ * Positions are counted as in the padded sequences from getPaddedQuerySeq and
+ * getPaddedGenomeSeq, so inserted and deleted bases always count as mismatches.
+ */
+struct MatchStats {
+	uint32_t nbPositions;
+	uint32_t nbMismatches;
+	uint32_t nbMatchesFromStart; // Matches before the first mismatch
+	uint32_t nbMatchesFromEnd;   // Matches after the last mismatch
+
+	MatchStats() : nbPositions(0), nbMismatches(0), nbMatchesFromStart(0), nbMatchesFromEnd(0) {
+	}
+
+	uint32_t getNbMatches() const {
+		return nbPositions - nbMismatches;
+	}
 };
 
 class BamAlignment {
@@ -107,18 +223,30 @@ private:
 
 	uint32_t alFlag;
 	int32_t position;
-	int32_t alignedLength;
 	int32_t refId;
 	int32_t mateId;
 	int32_t matePos;
-	vector<CigarOp> cigar;
 	Strandedness strandedness;
 	Orientation orientation;
-	Strand strand;
+
+	// The cigar is read in place from the raw alignment, unless it has been
+	// changed, in which case the packed copy here is used instead
+	vector<uint32_t> editedCigar;
+	bool cigarEdited;
+
+	// Many alignments are only checked for whether they are spliced, so the
+	// aligned length and strand are only worked out when first asked for
+	mutable int32_t alignedLength;
+	mutable bool alignedLengthKnown;
+	mutable Strand strand;
+	mutable bool strandDecoded;
 
 	void init();
 
-	Strand calcStrand();
+	// Copies the cigar so it can be changed, fixing the aligned length first
+	void editCigar();
+
+	Strand calcStrand() const;
 
 public:
 
@@ -158,28 +286,45 @@ public:
 
 	bam1_t* getRaw() const;
 
-	void setCigar(vector<CigarOp>& cig) {
-		cigar = cig;
-	}
+	/**
+	 * Replaces the cigar.  Doesn't change the aligned length.
+	 */
+	void setCigar(const vector<CigarOp>& cig);
 
-	const vector<CigarOp>& getCigar() const {
-		return cigar;
+	/**
+	 * @return A view over the packed cigar, without copying it
+	 */
+	CigarView getCigarView() const {
+		return cigarEdited ?
+			   CigarView(editedCigar.data(), editedCigar.size()) :
+			   CigarView(bam_get_cigar(b), b->core.n_cigar);
 	}
 
+	/**
+	 * @return A copy of the cigar as a list of ops.  Prefer getCigarView.
+	 */
+	vector<CigarOp> getCigar() const;
+
 	const string getCigarAsString() const {
+		const CigarView cigar = getCigarView();
 		stringstream ss;
-		for (const auto & c : cigar) {
-			ss << c.toString();
+		for (uint32_t i = 0; i < cigar.size(); i++) {
+			ss << cigar.length(i) << cigar.opChar(i);
 		}
 		return ss.str();
 	}
 
+	/**
+	 * Replaces one op of the cigar.  Doesn't change the aligned length.
+	 */
 	void setCigarOpAt(uint32_t index, CigarOp cigarOp) {
-		cigar[index] = cigarOp;
+		editCigar();
+		editedCigar[index] = cigarOp.pack();
 	}
 
 	void setAlignedLength(int32_t alignedLength) {
 		this->alignedLength = alignedLength;
+		alignedLengthKnown = true;
 	}
 
 	void setPosition(int32_t position) {
@@ -198,12 +343,12 @@ public:
 		this->matePos = matePos;
 	}
 
-	const CigarOp& getCigarOpAt(uint32_t index) const {
-		return cigar[index];
+	CigarOp getCigarOpAt(uint32_t index) const {
+		return getCigarView().at(index);
 	}
 
 	size_t getNbCigarOps() const {
-		return cigar.size();
+		return getCigarView().size();
 	}
 
 	int32_t getPosition() const {
@@ -219,6 +364,10 @@ public:
 	}
 
 	int32_t getEnd() const {
+		if (!alignedLengthKnown) {
+			alignedLength = getCigarView().calcReferenceLength();
+			alignedLengthKnown = true;
+		}
 		return position + alignedLength - 1;
 	}
 
@@ -238,7 +387,16 @@ public:
 		return b->core.qual;
 	}
 
+	/**
+	 * The strand of the read, from the XS tag if present, otherwise from the
+	 * strandedness and orientation of the library
+	 */
 	Strand getStrand() const {
+		if (!strandDecoded) {
+			const Strand xs = getXSStrand();
+			strand = xs != Strand::UNKNOWN ? xs : calcStrand();
+			strandDecoded = true;
+		}
 		return strand;
 	}
 
@@ -303,13 +461,27 @@ public:
 
 	string deriveName() const;
 
+	/**
+	 * A 64-bit fingerprint of the name returned by deriveName, i.e. the read
+	 * name plus which mate this is.  Calculated directly from the raw alignment
+	 * without allocating.
+	 */
+	uint64_t deriveNameCode() const;
+
 	string getQuerySeq() const;
 	string getQuerySeqAfterClipping() const;
 	string getQuerySeqAfterClipping(const string& query_seq) const;
 
-	bool isSplicedRead() const;
+	/**
+	 * Whether the alignment contains an N cigar op
+	 */
+	bool isSplicedRead() const {
+		return getCigarView().contains(BAM_CREF_SKIP);
+	}
 
-	uint32_t getNbJunctionsInRead() const;
+	uint32_t getNbJunctionsInRead() const {
+		return getCigarView().count(BAM_CREF_SKIP);
+	}
 
 	bool isMultiplySplicedRead() const {
 		return getNbJunctionsInRead() > 1;
@@ -321,6 +493,20 @@ public:
 	string getPaddedQuerySeq(const string& querySeq, uint32_t start, uint32_t end, uint32_t& actual_start, uint32_t& actual_end, const bool include_soft_clips) const;
 	string getPaddedGenomeSeq(const string& fullGenomeSeq, uint32_t start, uint32_t end, uint32_t q_start, uint32_t q_end, const bool include_soft_clips) const;
 
+	/**
+	 * Compares the aligned bases of this read in the given region with the
+	 * reference, excluding soft clips.  This gives the same result as comparing
+	 * the padded query and genome sequences for the region, but works directly
+	 * on the packed read sequence and doesn't allocate any memory.
+	 * @param ref Reference bases as htslib nt16 codes, one per byte
+	 * @param refStart Position of the first base in ref (0-based)
+	 * @param refLength Number of bases in ref
+	 * @param start First position in the region (0-based)
+	 * @param end Last position in the region (0-based, inclusive)
+	 * @return The match stats for the region
+	 */
+	MatchStats compareWithReference(const uint8_t* ref, const int32_t refStart, const size_t refLength, const int32_t start, const int32_t end) const;
+
 	string toString() const;
 	string toString(bool afterClipping) const;
 
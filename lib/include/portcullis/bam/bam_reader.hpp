@@ -41,6 +41,7 @@ using boost::lexical_cast;
 #include <htslib/bgzf.h>
 
 #include <portcullis/bam/bam_alignment.hpp>
+#include <portcullis/bam/bgzf_reader.hpp>
 using portcullis::bam::BamAlignment;
 using portcullis::bam::BamAlignmentPtr;
 using portcullis::bam::RefSeqPtr;
@@ -51,6 +52,12 @@ using portcullis::bam::RefSeqPtrIndexMap;
 namespace portcullis {
 namespace bam {
 
+/**
+ * A loaded BAM index.  Once loaded the index is only ever read, so a single
+ * instance can be shared by any number of BamReaders on different threads,
+ * each of which only needs its own file handle and iterator.
+ */
+typedef shared_ptr<hts_idx_t> BamIndexPtr;
 
 class BamReader {
 
@@ -62,15 +69,28 @@ private:
 	BGZF *fp;
 	bam_hdr_t* header;
 	bam1_t* c;
-	hts_idx_t* index;
+	BamIndexPtr index;
 	hts_itr_t * iter;
 
+	// Used for decompressing the whole file in parallel when not iterating
+	// over a region
+	unique_ptr<ParallelBgzfReader> pipeline;
+
 	BamAlignment b;
 
 public:
 
 	BamReader(const path& _bamFile);
 
+	/**
+	 * Creates a reader which uses the given number of threads for decompressing
+	 * the BAM when streaming through the whole file.
+	 * @param _bamFile The BAM file to read
+	 * @param _threads Number of decompression threads.  1 means decompress on the
+	 * calling thread, as normal.
+	 */
+	BamReader(const path& _bamFile, const uint16_t _threads);
+
 	virtual ~BamReader();
 
 	// **** Methods for extracting reference target sequences ********
@@ -87,16 +107,46 @@ public:
 
 	string bamDetails() const;
 
+	/**
+	 * Opens the BAM file and reads the header.  Also loads the BAM index,
+	 * unless a shared index was provided via setIndex.
+	 */
 	void open();
 
 	void close();
 
+	/**
+	 * Loads the index for the given BAM file, so that it can be shared across
+	 * several readers.
+	 * @param bamFile The BAM file whose index should be loaded
+	 * @return The loaded index
+	 */
+	static BamIndexPtr loadIndex(const path& bamFile);
+
+	BamIndexPtr getIndex() const { return index; }
+
+	/**
+	 * Use a previously loaded index rather than loading a new one when opening
+	 * @param index The shared index, which must have been created from the same
+	 * BAM file
+	 */
+	void setIndex(BamIndexPtr index) { this->index = index; }
+
 	bool next();
 
 	const BamAlignment& current() const;
 
 	void setRegion(const int32_t seqIndex, const int32_t start, const int32_t end);
 
+	/**
+	 * Gets the number of mapped alignments on the given target sequence, as
+	 * recorded in the BAM index.  Requires the BAM to be open.
+	 * @param seqIndex Index of the target sequence
+	 * @return The number of mapped alignments or -1 if the index doesn't hold
+	 * this information
+	 */
+	int64_t getNbMappedAlignments(const int32_t seqIndex) const;
+
 	bool isCoordSortedBam();
 };
 
@@ -0,0 +1,209 @@
+//  ********************************************************************
+//  This file is part of Portcullis.
+//
+//  Portcullis is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  Portcullis is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with Portcullis.  If not, see <http://www.gnu.org/licenses/>.
+//  *******************************************************************
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+using std::string;
+using std::vector;
+
+#include <boost/filesystem/path.hpp>
+using boost::filesystem::path;
+
+#include <htslib/sam.h>
+
+#include <portcullis/bam/bam_master.hpp>
+
+namespace portcullis {
+namespace bam {
+
+/**
+ * Sorts and merges BAM files by coordinate in a single pass, without calling
+ * out to samtools.
+ *
+ * Records from the inputs are read into a buffer, in BAM's on-disk layout,
+ * until the buffer reaches half the memory limit.  The buffer is then sorted
+ * with a radix sort on its coordinate keys and written to a temporary run on a
+ * background thread, while the other half of the memory is filled from the
+ * inputs.  Inputs whose headers say they are coordinate sorted, over the same
+ * target sequences as the first input, are used as runs directly (see
+ * setTrustSorted).  Finally all runs, plus whatever is left in memory, are
+ * merged into the output.  If everything fits in memory, nothing is written to
+ * disk other than the output.
+ *
+ * Records are ordered by target, then position, then strand, with unmapped
+ * records without a target last, as samtools sort does.  Records that tie keep
+ * the order they were read in, so far as possible.
+ *
+ * The output header is the header of the first input, marked as coordinate
+ * sorted, plus any read groups and programs from the other inputs.  Targets
+ * of the other inputs are matched to those in the first header by name.  The
+ * output can be indexed as it is written (see enableIndexing).
+ */
+class BamSorter {
+private:
+
+	// A record in the sort buffer, identified by its offset
+	struct Entry {
+		uint64_t key;
+		uint64_t offset;
+	};
+
+	vector<path> inputs;
+	path output;
+	path tempDir;
+	uint16_t threads;
+	size_t memoryLimit;
+	bool trustSorted;
+	bool indexing;
+	bool useCsi;
+
+	bam_hdr_t* header;
+
+	// For each input, the index in the output header of each of its targets,
+	// and whether it can be used as a run without sorting
+	vector<vector<int32_t>> targetMaps;
+	vector<bool> presorted;
+
+	// Temporary runs written so far
+	vector<path> runs;
+
+	uint64_t nbRecords;
+	size_t nbRuns;
+
+	void readHeaders();
+
+	void spill(vector<uint8_t>& records, vector<Entry>& entries, const path& run) const;
+
+	/**
+	 * Merges the sorted inputs, the runs and the records in memory into the output
+	 * @return A sorted input that turned out not to be sorted, in which case no
+	 * output is written, otherwise an empty path
+	 */
+	path merge(const vector<path>& sortedInputs, const vector<uint8_t>& records, vector<Entry>& entries);
+
+	/**
+	 * Sorts the inputs that aren't presorted into runs, then merges everything
+	 * @return As for merge
+	 */
+	path sortAndMerge();
+
+	void removeRuns();
+
+public:
+
+	/**
+	 * @param inputs The BAM files to sort and merge
+	 * @param output The sorted BAM file to create
+	 */
+	BamSorter(const vector<path>& inputs, const path& output);
+
+	BamSorter(const BamSorter& other) = delete;
+
+	BamSorter& operator=(const BamSorter& other) = delete;
+
+	virtual ~BamSorter();
+
+	/**
+	 * Sets the number of threads used for decompressing the inputs and
+	 * compressing the output
+	 */
+	void setThreads(const uint16_t threads) {
+		this->threads = threads;
+	}
+
+	/**
+	 * Sets the approximate amount of memory to use for holding records.  This
+	 * is split between the buffer being filled and the buffer being sorted.
+	 * @param memoryLimit Limit in bytes
+	 */
+	void setMemoryLimit(const size_t memoryLimit) {
+		this->memoryLimit = memoryLimit;
+	}
+
+	/**
+	 * Sets whether to believe inputs whose headers say they are coordinate
+	 * sorted.  If so, these inputs are merged without sorting them.  If one
+	 * turns out not to be sorted after all, it is sorted like any other input
+	 * and the merge is done again.  Defaults to true.
+	 */
+	void setTrustSorted(const bool trustSorted) {
+		this->trustSorted = trustSorted;
+	}
+
+	/**
+	 * Sets the directory to write temporary runs to.  By default this is the
+	 * directory containing the output.
+	 */
+	void setTempDir(const path& tempDir) {
+		this->tempDir = tempDir;
+	}
+
+	/**
+	 * Builds a BAI or CSI index for the output while it is being written,
+	 * instead of indexing the sorted file afterwards
+	 * @param useCsi Build a CSI index rather than a BAI index
+	 */
+	void enableIndexing(const bool useCsi) {
+		this->indexing = true;
+		this->useCsi = useCsi;
+	}
+
+	/**
+	 * @return Where the index of the output is saved, if indexing
+	 */
+	path getIndexFile() const {
+		return path(output.string() + (useCsi ? ".csi" : ".bai"));
+	}
+
+	/**
+	 * Sorts and merges the inputs into the output
+	 * @throws BamException if an input can't be read, the inputs don't share
+	 * the same target sequences, or the output can't be written
+	 */
+	void sort();
+
+	/**
+	 * @return The number of records written to the output by sort
+	 */
+	uint64_t getNbRecords() const {
+		return nbRecords;
+	}
+
+	/**
+	 * @return The number of runs merged into the output, including inputs
+	 * that were already sorted and the records left in memory
+	 */
+	size_t getNbRuns() const {
+		return nbRuns;
+	}
+
+	/**
+	 * Calculates the key used to sort a record
+	 * @param tid Target index, or -1 if there isn't one
+	 * @param pos Position (0-based), or -1 if there isn't one
+	 * @param reverse Whether the record is on the reverse strand
+	 */
+	static uint64_t sortKey(const int32_t tid, const int32_t pos, const bool reverse) {
+		return ((uint64_t)(uint32_t)tid << 32) | ((uint64_t)(uint32_t)(pos + 1) << 1) | (reverse ? 1 : 0);
+	}
+};
+
+}
+}
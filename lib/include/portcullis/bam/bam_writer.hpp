@@ -17,6 +17,7 @@
 
 #pragma once
 
+#include <cstdint>
 #include <memory>
 #include <sstream>
 #include <string>
@@ -36,29 +37,128 @@ using boost::filesystem::path;
 using boost::lexical_cast;
 
 #include <htslib/faidx.h>
+#include <htslib/hts.h>
+#include <htslib/sam.h>
 
 #include <portcullis/bam/bam_alignment.hpp>
 
 namespace portcullis {
 namespace bam {
 
+/**
+ * Writes alignments to a BAM file.  Optionally builds a BAI or CSI index for
+ * the file as the records are written, so it doesn't have to be read again by
+ * samtools index afterwards.
+ *
+ * htslib's multi-threaded compression doesn't report where each record ends up
+ * in the compressed file, so when indexing, the writer cuts the BGZF blocks
+ * itself and compresses them in batches across the threads.  Once a batch is
+ * written the address of each block is known, and the records in it are added
+ * to the index.
+ */
 class BamWriter {
 private:
+
+	// Where a record ends, as a block number and an offset into that block,
+	// to be added to the index once the block is written
+	struct IndexEntry {
+		int32_t tid;
+		int32_t beg;
+		int32_t end;
+		bool mapped;
+		uint64_t block;
+		uint32_t offset;
+	};
+
 	path bamFile;
+	path indexFile;
+	uint16_t threads;
+	bool indexing;
+	bool useCsi;
 
 	BGZF *fp;
+	hts_idx_t *idx;
+
+	// Full blocks waiting to be compressed, and the block being filled
+	vector<vector<uint8_t>> fullBlocks;
+	vector<uint8_t> block;
+	vector<IndexEntry> entries;
+
+	// The number of blocks and bytes written so far, after the header
+	uint64_t nbBlocks;
+	uint64_t address;
+
+	int append(const uint8_t* prefix, const uint8_t* data, const size_t length,
+			   const int32_t tid, const int32_t beg, const int32_t end, const bool mapped);
+
+	void appendBytes(const uint8_t* data, size_t length);
+
+	void cutBlock();
+
+	bool flushBlocks();
 
 public:
 	BamWriter(const path& _bamFile) {
 		bamFile = _bamFile;
+		threads = 1;
+		indexing = false;
+		useCsi = false;
+		fp = nullptr;
+		idx = nullptr;
+		nbBlocks = 0;
+		address = 0;
 	}
 
-	virtual ~BamWriter() {}
+	/**
+	 * Sets the number of threads used to compress the output.  Must be called
+	 * before opening the file.
+	 * @param threads Number of compression threads
+	 */
+	void setThreads(uint16_t threads) {
+		this->threads = threads;
+	}
+
+	/**
+	 * Builds an index while writing the file, which is saved on close.
+	 * Records must then be written in coordinate order.  Must be called before
+	 * opening the file.
+	 * @param useCsi Build a CSI index rather than a BAI index
+	 * @param indexFile Where to save the index.  By default this is the BAM
+	 * file path plus ".bai" or ".csi", as samtools index would use.
+	 */
+	void enableIndexing(const bool useCsi, const path& indexFile = path()) {
+		this->indexing = true;
+		this->useCsi = useCsi;
+		this->indexFile = indexFile.empty() ? path(bamFile.string() + (useCsi ? ".csi" : ".bai")) : indexFile;
+	}
+
+	/**
+	 * @return Where the index will be saved, or an empty path if the writer
+	 * isn't indexing
+	 */
+	path getIndexFile() const {
+		return indexFile;
+	}
+
+	virtual ~BamWriter();
 
 	void open(bam_hdr_t* header);
 
 	int write(const BamAlignment& ba);
 
+	int write(const bam1_t* b);
+
+	/**
+	 * Writes a record that is already in BAM's on-disk layout, starting with
+	 * its block size
+	 */
+	int writeRecord(const uint8_t* record);
+
+	/**
+	 * Closes the file, and saves the index if there is one
+	 * @throws BamException if the records weren't sorted, so couldn't be
+	 * indexed, or the file or index couldn't be written
+	 */
 	void close();
 };
 
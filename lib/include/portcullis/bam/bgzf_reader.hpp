@@ -0,0 +1,148 @@
+//  ********************************************************************
+//  This file is part of Portcullis.
+//
+//  Portcullis is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  Portcullis is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with Portcullis.  If not, see <http://www.gnu.org/licenses/>.
+//  *******************************************************************
+
+#pragma once
+
+#include <stdio.h>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+using std::condition_variable;
+using std::deque;
+using std::mutex;
+using std::string;
+using std::thread;
+using std::vector;
+
+#include <boost/exception/all.hpp>
+#include <boost/filesystem/path.hpp>
+using boost::filesystem::path;
+
+#include <htslib/bgzf.h>
+#include <htslib/sam.h>
+
+namespace portcullis {
+namespace bam {
+
+/**
+ * Reads a BGZF compressed file (i.e. a BAM file) sequentially, using a pool of
+ * threads to inflate blocks ahead of the consumer.  One thread reads compressed
+ * blocks from disk, the inflater threads decompress them in parallel, and the
+ * consumer is handed the uncompressed blocks in file order.  This removes the
+ * single threaded decompression bottleneck when streaming through a whole BAM.
+ *
+ * Only supports sequential reading.  Use htslib directly for random access.
+ */
+class ParallelBgzfReader {
+private:
+
+	enum class BlockState {
+		FREE,
+		READ,
+		INFLATED,
+		FAILED
+	};
+
+	struct Block {
+		vector<uint8_t> compressed;
+		vector<uint8_t> uncompressed;
+		int32_t compressedLength = 0;
+		int32_t length = 0;
+		BlockState state = BlockState::FREE;
+	};
+
+	path file;
+	uint16_t threads;
+	FILE* fp;
+
+	// Ring of blocks being read, inflated or consumed
+	vector<Block> blocks;
+
+	// Sequence numbers of blocks waiting to be inflated
+	deque<uint64_t> toInflate;
+
+	// Number of blocks read from disk so far
+	uint64_t nbRead;
+
+	// Number of blocks released by the consumer so far
+	uint64_t nbConsumed;
+
+	bool eof;
+	bool failed;
+	bool stopping;
+	string errorMessage;
+
+	mutex blockMutex;
+	condition_variable blockRead;
+	condition_variable blockInflated;
+	condition_variable blockFreed;
+
+	thread readerThread;
+	vector<thread> inflaterThreads;
+
+	// Consumer state
+	Block* current;
+	int32_t currentOffset;
+
+	void readBlocks();
+
+	void inflateBlocks();
+
+	bool nextBlock();
+
+	void stop();
+
+public:
+
+	/**
+	 * Creates a reader for the given BGZF file
+	 * @param _file The file to read
+	 * @param _threads The number of threads used for inflating blocks
+	 */
+	ParallelBgzfReader(const path& _file, const uint16_t _threads);
+
+	virtual ~ParallelBgzfReader();
+
+	/**
+	 * Starts reading from the given virtual offset, as returned by bgzf_tell.
+	 * Typically this is the position immediately after the BAM header.
+	 * @param virtualOffset The position to start reading from
+	 */
+	void open(const int64_t virtualOffset);
+
+	void close();
+
+	/**
+	 * Reads up to len uncompressed bytes into data.  Equivalent to bgzf_read.
+	 * @return The number of bytes read, which is less than len only at the end
+	 * of the file
+	 */
+	ssize_t read(void* data, const size_t len);
+
+	/**
+	 * Reads the next BAM record.  Equivalent to bam_read1.
+	 * @param b The record to populate
+	 * @return Negative number at the end of the file, or on error
+	 */
+	int readBam(bam1_t* b);
+};
+
+}
+}
@@ -39,6 +39,8 @@ using boost::lexical_cast;
 #include <htslib/sam.h>
 #include <htslib/bgzf.h>
 
+#include <portcullis/bam/bgzf_reader.hpp>
+
 namespace portcullis {
 namespace bam {
 
@@ -46,6 +48,7 @@ namespace bam {
 typedef struct {     // auxiliary data structure
 	BGZF* fp;      // the file handler
 	hts_itr_t* iter; // NULL if a region not specified
+	ParallelBgzfReader* pipeline; // NULL if decompressing on the calling thread
 	int min_mapQ, min_len; // mapQ filter; length filter
 } aux_t;
 
@@ -55,6 +58,18 @@ typedef struct {
 	uint32_t depth;
 } depth;
 
+/**
+ * Produces the depth of coverage for each target sequence in a coordinate
+ * sorted BAM, one target at a time.  Coverage level i holds the depth at 0-based
+ * position i - 1.  Depth is the number of alignments with a match, sequence
+ * match or sequence mismatch cigar op covering the position.
+ *
+ * By default depth is calculated by adding +1/-1 events at the start and end of
+ * each aligned block to a difference array, then taking a prefix sum.  The
+ * original htslib pileup engine is still available.  Both apply the same
+ * alignment filters, although the pileup also drops alignments beyond the
+ * 8000th starting at the same position.
+ */
 class DepthParser {
 private:
 
@@ -68,9 +83,22 @@ private:
 	bam_mplp_t mplp;
 
 	depth last;
+	int32_t batchRef;    // Target sequence of the most recent batch
 	bool start;
 	int res;
 
+	// Difference array engine
+	bool usePileup;
+	bam1_t* b;           // Next alignment to process
+	bool pending;        // Whether b holds an alignment that hasn't been counted yet
+
+	bool loadNextPileupBatch(vector<uint32_t>& depths);
+
+	bool loadNextDifferenceBatch(vector<uint32_t>& depths);
+
+	// Reads the next alignment passing the filters into b
+	bool readNext();
+
 protected:
 
 	// This function reads a BAM alignment from one BAM file.
@@ -84,19 +112,42 @@ public:
 
 	DepthParser(path _bamFile, uint8_t _strandSpecific, bool _allowGappedAlignments);
 
+	/**
+	 * As above but decompresses the BAM using the given number of threads
+	 */
+	DepthParser(path _bamFile, uint8_t _strandSpecific, bool _allowGappedAlignments, uint16_t _ioThreads);
+
+	/**
+	 * As above but optionally uses the htslib pileup engine rather than the
+	 * difference array engine
+	 */
+	DepthParser(path _bamFile, uint8_t _strandSpecific, bool _allowGappedAlignments, uint16_t _ioThreads, bool _usePileup);
+
 	virtual ~DepthParser();
 
 
+	/**
+	 * @return The name of the target sequence for the most recent batch
+	 */
 	string getCurrentRefName() const {
-		return string(header->target_name[last.ref]);
+		return string(header->target_name[batchRef]);
 	}
 
+	/**
+	 * @return The index of the target sequence for the most recent batch
+	 */
 	int32_t getCurrentRefIndex() const {
-		return last.ref;
+		return batchRef;
 	}
 
 
 
+	/**
+	 * Loads the coverage levels for the next target sequence with any coverage
+	 * @param depths Cleared and filled with one coverage level per base of the
+	 * target sequence
+	 * @return False if there are no more target sequences with coverage
+	 */
 	bool loadNextBatch(vector<uint32_t>& depths);
 
 };
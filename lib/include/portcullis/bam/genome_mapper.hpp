@@ -17,13 +17,16 @@
 
 #pragma once
 
+#include <algorithm>
 #include <memory>
 #include <sstream>
 #include <string>
+#include <unordered_map>
 #include <vector>
 using std::shared_ptr;
 using std::make_shared;
 using std::string;
+using std::unordered_map;
 using std::vector;
 using std::stringstream;
 
@@ -35,6 +38,7 @@ using boost::filesystem::exists;
 using boost::filesystem::path;
 using boost::lexical_cast;
 
+#include <htslib/bgzf.h>
 #include <htslib/faidx.h>
 #include <htslib/sam.h>
 
@@ -43,14 +47,259 @@ using boost::lexical_cast;
 namespace portcullis {
 namespace bam {
 
+/**
+ * The contents of a fasta index (.fai) file.  Once loaded this is only ever
+ * read, so a single instance can be shared by any number of GenomeMappers on
+ * different threads, each of which only needs its own file handle.
+ */
+class FastaIndex {
+public:
+
+	struct Entry {
+		uint32_t id;        // Position of the sequence in the index
+		int64_t length;     // Length of the sequence
+		uint64_t offset;    // Offset in the fasta file of the first base of the sequence
+		int32_t lineBases;  // Number of bases on each line
+		int32_t lineWidth;  // Number of bytes on each line, including the newline
+	};
+
+	/**
+	 * Loads the given fasta index file
+	 * @param fastaIndexFile Path to the .fai file
+	 */
+	FastaIndex(const path& fastaIndexFile);
+
+	/**
+	 * Gets the index entry for the named sequence
+	 * @param name The sequence name
+	 * @return The entry or nullptr if there is no sequence with this name
+	 */
+	const Entry* find(const string& name) const {
+		auto it = entries.find(name);
+		return it == entries.end() ? nullptr : &(it->second);
+	}
+
+	size_t size() const {
+		return names.size();
+	}
+
+	const string& getName(const size_t index) const {
+		return names[index];
+	}
+
+private:
+	vector<string> names;
+	unordered_map<string, Entry> entries;
+};
+
+typedef shared_ptr<const FastaIndex> FastaIndexPtr;
+
+const string PACKED_GENOME_EXTENSION = ".packed";
+
+class GenomeMapper;
+
+/**
+ * A read only view of a region of a sequence in a PackedGenome.  Nothing is
+ * copied, so looking up a base is just an offset into the mapped file.  The
+ * view is only valid while the packed genome it came from is loaded.
+ */
+class PackedSeqView {
+private:
+
+	const uint8_t* bases;
+	const uint64_t* nMask;
+	const uint64_t* softMask;
+	const uint64_t* exceptions;
+	uint64_t nbExceptions;
+	int64_t start;
+	int64_t length;
+
+	static bool testBit(const uint64_t* bits, const int64_t pos) {
+		return (bits[pos >> 6] >> (pos & 63)) & 1;
+	}
+
+	/**
+	 * Looks up a base in the N mask that isn't actually an N, such as an IUPAC
+	 * ambiguity code.  Exceptions are sorted, each holding the position in the
+	 * sequence in the upper 56 bits and the upper case base in the lowest byte.
+	 */
+	char exception(const int64_t pos) const {
+		const uint64_t* e = std::lower_bound(exceptions, exceptions + nbExceptions, (uint64_t)pos << 8);
+		return e != exceptions + nbExceptions && (int64_t)(*e >> 8) == pos ? (char)(*e & 0xff) : 'N';
+	}
+
+public:
+
+	PackedSeqView() : PackedSeqView(nullptr, nullptr, nullptr, nullptr, 0, 0, 0) {
+	}
+
+	PackedSeqView(const uint8_t* _bases, const uint64_t* _nMask, const uint64_t* _softMask,
+				  const uint64_t* _exceptions, const uint64_t _nbExceptions, const int64_t _start, const int64_t _length) :
+		bases(_bases), nMask(_nMask), softMask(_softMask), exceptions(_exceptions), nbExceptions(_nbExceptions),
+		start(_start), length(_length) {
+	}
+
+	int64_t size() const {
+		return length;
+	}
+
+	bool empty() const {
+		return length == 0;
+	}
+
+	/**
+	 * Position of the first base of the view in its sequence
+	 */
+	int64_t getStart() const {
+		return start;
+	}
+
+	/**
+	 * @return Whether the base at this index in the view is anything other than
+	 * A, C, G or T.  This includes IUPAC ambiguity codes as well as N.
+	 */
+	bool isN(const int64_t i) const {
+		return testBit(nMask, start + i);
+	}
+
+	/**
+	 * @return Whether the base at this index in the view is lower case in the
+	 * fasta file
+	 */
+	bool isSoftMasked(const int64_t i) const {
+		return testBit(softMask, start + i);
+	}
+
+	/**
+	 * @return The 2-bit code of the base at this index in the view: 0 for A,
+	 * 1 for C, 2 for G and 3 for T.  This is 0 if the base is an N.
+	 */
+	uint8_t code(const int64_t i) const {
+		const int64_t pos = start + i;
+		return (bases[pos >> 2] >> ((pos & 3) << 1)) & 3;
+	}
+
+	/**
+	 * @return The base at this index in the view, in upper case.  This is the
+	 * same base as in the fasta file, including any IUPAC ambiguity code.
+	 */
+	char upper(const int64_t i) const {
+		return isN(i) ? (nbExceptions > 0 ? exception(start + i) : 'N') : "ACGT"[code(i)];
+	}
+
+	/**
+	 * @return The base at this index in the view, in lower case if soft masked
+	 */
+	char operator[](const int64_t i) const {
+		const char c = upper(i);
+		return isSoftMasked(i) ? c + ('a' - 'A') : c;
+	}
+
+	/**
+	 * @return The htslib nt16 code (see seq_nt16_table) of the base at this
+	 * index in the view
+	 */
+	uint8_t nt16(const int64_t i) const {
+		return isN(i) ? seq_nt16_table[(uint8_t)upper(i)] : 1 << code(i);
+	}
+
+	/**
+	 * @return The bases in the view as a string, keeping the case of the fasta file
+	 */
+	string toString() const;
+};
+
+/**
+ * A genome packed into a single file with 2 bits per base.  Alongside the bases
+ * there is one bitmap marking bases other than A, C, G or T, and another marking
+ * soft masked (lower case) bases.  Marked bases are read back as N, apart from
+ * those in a short sorted list of exceptions which keep the base from the fasta
+ * file, so IUPAC ambiguity codes come back as they were.  The file is memory
+ * mapped read only, so one instance can be shared by all threads and fetching a
+ * region doesn't involve any file IO.  Sequences are held in the same order as
+ * in the fasta index of the genome.
+ */
+class PackedGenome {
+private:
+
+	struct Entry {
+		uint64_t length;
+		uint64_t basesOffset;
+		uint64_t nMaskOffset;
+		uint64_t softMaskOffset;
+		uint64_t exceptionsOffset;
+		uint64_t nbExceptions;
+	};
+
+	path packedFile;
+	const uint8_t* data;
+	size_t dataSize;
+	const Entry* entries;
+	uint64_t nbSeqs;
+
+public:
+
+	/**
+	 * Memory maps a packed genome file
+	 * @param packedFile The packed genome file
+	 * @param index The fasta index of the genome the file was built from
+	 * @param fastaFile The fasta file the genome was packed from
+	 * @throws BamException if the file can't be mapped, doesn't describe
+	 * the same sequences as the index, or the fasta file has changed since
+	 * it was packed
+	 */
+	PackedGenome(const path& packedFile, const FastaIndex& index, const path& fastaFile);
+
+	PackedGenome(const PackedGenome&) = delete;
+	PackedGenome& operator=(const PackedGenome&) = delete;
+
+	~PackedGenome();
+
+	size_t size() const {
+		return nbSeqs;
+	}
+
+	/**
+	 * Gets a view of a region of a sequence
+	 * @param id Position of the sequence in the fasta index
+	 * @param start First position in the region (0-based)
+	 * @param end Last position in the region (0-based, inclusive)
+	 * @return The view, which must be within the sequence
+	 */
+	PackedSeqView getSeq(const uint32_t id, const int64_t start, const int64_t end) const {
+		const Entry& e = entries[id];
+		return PackedSeqView(data + e.basesOffset, (const uint64_t*)(data + e.nMaskOffset),
+							 (const uint64_t*)(data + e.softMaskOffset), (const uint64_t*)(data + e.exceptionsOffset),
+							 e.nbExceptions, start, end - start + 1);
+	}
+
+	/**
+	 * Packs every sequence in a genome into a new packed genome file
+	 * @param genome Genome mapper for the genome, with its index loaded
+	 * @param packedFile The file to create
+	 */
+	static void build(const GenomeMapper& genome, const path& packedFile);
+};
+
+typedef shared_ptr<const PackedGenome> PackedGenomePtr;
+
 class GenomeMapper {
 private:
 
 	// Path to the original genome file in fasta format
 	path genomeFile;
 
-	// Handle to genome map.  Created by constructor.
-	faidx_t* fastaIndex;
+	// The fasta index, possibly shared with other genome mappers
+	FastaIndexPtr fastaIndex;
+
+	// Handle to the genome file, owned by this genome mapper
+	BGZF* fastaFile;
+
+	// The packed genome, if one has been loaded, possibly shared with other
+	// genome mappers
+	PackedGenomePtr packedGenome;
+
+	void openGenome();
 
 protected:
 
@@ -82,18 +331,47 @@ public:
 		return path(genomeFile.parent_path()) /= path(genomeFile.leaf().string() + ".fai");
 	}
 
+	path getPackedGenomeFile() const {
+		return path(genomeFile.string() + PACKED_GENOME_EXTENSION);
+	}
+
 
 	/**
 	 * Constructs the index for this fasta genome file
 	 */
 	void buildFastaIndex();
 
+	/**
+	 * Packs the genome into a file alongside the genome file, so that it can be
+	 * memory mapped rather than read by later steps.  The index must be loaded.
+	 */
+	void buildPackedGenome();
+
 	/**
 	 * Loads the index for this genome file.  This must be done before using any
-	 * of the fetch commands.
+	 * of the fetch commands.  If a packed genome has been built alongside the
+	 * genome file then that is loaded too, and bases are fetched from it
+	 * rather than from the fasta file.
 	 */
 	void loadFastaIndex();
 
+	/**
+	 * Uses a previously loaded index, and optionally packed genome, for this
+	 * genome file rather than loading new ones.  Either this or loadFastaIndex
+	 * must be called before using any of the fetch commands.
+	 * @param index The shared index
+	 * @param packed The shared packed genome, or nullptr to read from the fasta file
+	 */
+	void loadFastaIndex(FastaIndexPtr index, PackedGenomePtr packed = nullptr);
+
+	FastaIndexPtr getFastaIndex() const {
+		return fastaIndex;
+	}
+
+	PackedGenomePtr getPackedGenome() const {
+		return packedGenome;
+	}
+
 
 	/**
 	 * @abstract    Fetch the sequence in a region.
@@ -113,14 +391,173 @@ public:
 	 */
 	string fetchBases(const char* name, int start, int end, int* len) const;
 
+	/**
+	 * Gets a view of a region from the packed genome, without copying anything
+	 * @param name Sequence name
+	 * @param start First position in the region (0-based)
+	 * @param end Last position in the region (0-based, inclusive)
+	 * @param view Set to the view of the region
+	 * @return False if no packed genome is loaded or the region isn't within
+	 * the sequence
+	 */
+	bool fetchView(const string& name, const int64_t start, const int64_t end, PackedSeqView& view) const;
+
 	/**
 	 * Get the number of sequences / contigs / scaffolds in the genome
 	 * @return
 	 */
 	int getNbSeqs() {
-		return faidx_nseq(fastaIndex);
+		return fastaIndex->size();
+	}
+
+};
+
+/**
+ * Holds a stretch of one target sequence in memory, so that the bases
+ * underneath many alignments can be looked up without going back to the genome
+ * file each time.  Regions are expected to be requested in order along the
+ * sequence, as with coordinate sorted alignments.  Whenever a requested region
+ * isn't held, a new stretch of at least the chunk size is fetched starting at
+ * the beginning of the region.  Bases are converted to upper case.
+ */
+class GenomeBuffer {
+private:
+
+	const GenomeMapper& genome;
+	string name;
+	int64_t length;
+	int32_t chunkSize;
+
+	// The bases held, starting at this position, and their nt16 codes
+	string seq;
+	vector<uint8_t> codes;
+	int32_t start;
+
+public:
+
+	/**
+	 * @param genome Genome to fetch bases from
+	 * @param name Name of the target sequence
+	 * @param chunkSize Minimum number of bases to fetch at once
+	 */
+	GenomeBuffer(const GenomeMapper& genome, const string& name, const int32_t chunkSize);
+
+	/**
+	 * Makes sure that all bases in the given region are held
+	 * @param regionStart First position in the region (0-based)
+	 * @param regionEnd Last position in the region (0-based, inclusive)
+	 * @return False if the region isn't within the target sequence
+	 */
+	bool fetch(const int32_t regionStart, const int32_t regionEnd);
+
+	const string& getSeq() const {
+		return seq;
 	}
 
+	/**
+	 * The bases held as htslib nt16 codes (see seq_nt16_table), one per byte,
+	 * for comparing directly with the packed sequence of a BAM record
+	 */
+	const vector<uint8_t>& getCodes() const {
+		return codes;
+	}
+
+	/**
+	 * Position of the first base held
+	 */
+	int32_t getStart() const {
+		return start;
+	}
+
+	/**
+	 * Position of the last base held
+	 */
+	int32_t getEnd() const {
+		return start + (int32_t)seq.size() - 1;
+	}
+};
+
+/**
+ * A batch of windows on a single target sequence, such as the splice sites,
+ * anchors and flanking regions of a list of junctions.  All windows are added
+ * first, then fetch() reads the sequence covering them in one go and each
+ * window is handed back as a slice of it.  Windows that are close together
+ * are read as one block, so windows shared by neighbouring junctions are only
+ * read once, while long gaps between windows, such as large introns, are
+ * skipped.  Windows are clipped to the sequence bounds exactly as
+ * GenomeMapper::fetchBases would clip them, and the bases keep their case.
+ */
+class GenomeWindows {
+private:
+
+	struct Window {
+		int64_t start;      // Clipped to the sequence bounds
+		int64_t end;
+		size_t block;       // Block holding the window's bases
+		int len;            // As returned by GenomeMapper::fetchBases
+	};
+
+	const GenomeMapper& genome;
+	string name;
+	int64_t length;
+	int32_t maxGap;
+
+	vector<Window> windows;
+	vector<string> blocks;
+	vector<int64_t> blockStarts;
+
+public:
+
+	/**
+	 * @param genome Genome to fetch bases from
+	 * @param name Name of the target sequence
+	 * @param maxGap Windows separated by no more than this many bases are read
+	 * as a single block
+	 */
+	GenomeWindows(const GenomeMapper& genome, const string& name, const int32_t maxGap = 4096);
+
+	/**
+	 * Adds a window to the batch.  Windows get consecutive ids, in the order
+	 * they are added.
+	 * @param start First position in the window (0-based)
+	 * @param end Last position in the window (0-based, inclusive)
+	 * @return Id of the window
+	 */
+	size_t add(const int32_t start, const int32_t end);
+
+	/**
+	 * Reads the bases for all windows added so far
+	 */
+	void fetch();
+
+	/**
+	 * Returns the bases in a window, which must have been fetched
+	 * @param id Id of the window, as returned by add
+	 * @param len Set to the number of bases returned, or to -2 if the target
+	 * sequence isn't in the genome and -1 if it couldn't be read
+	 * @return The bases
+	 */
+	string get(const size_t id, int* len) const;
+
+	const string& getName() const {
+		return name;
+	}
+
+	size_t size() const {
+		return windows.size();
+	}
+
+	/**
+	 * @return The number of blocks of sequence read by the last fetch
+	 */
+	size_t getNbBlocks() const {
+		return blocks.size();
+	}
+
+	/**
+	 * Removes all windows and the bases held for them
+	 */
+	void clear();
 };
 
 }
@@ -0,0 +1,159 @@
+//  ********************************************************************
+//  This file is part of Portcullis.
+//
+//  Portcullis is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  Portcullis is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with Portcullis.  If not, see <http://www.gnu.org/licenses/>.
+//  *******************************************************************
+
+#pragma once
+
+#include <string>
+#include <vector>
+using std::string;
+using std::vector;
+
+#include <boost/exception/all.hpp>
+#include <boost/filesystem/path.hpp>
+using boost::filesystem::path;
+
+namespace portcullis {
+namespace bam {
+
+typedef boost::error_info<struct ReadNameCounterError, string> ReadNameCounterErrorInfo;
+struct ReadNameCounterException: virtual boost::exception, virtual std::exception { };
+
+/**
+ * Counts how many times each read name occurs, where each read name is
+ * represented by a 64-bit fingerprint (see BamAlignment::deriveNameCode).
+ * Fingerprints are held in an open addressing hash table alongside saturating
+ * 16-bit counts, so each distinct read name costs 10 bytes plus the slack in
+ * the table.
+ *
+ * A memory limit can be set, along with a directory for temporary files.  Once
+ * the table would need to grow past the limit, its contents are sorted and
+ * written to disk as a run, and the table is emptied.  Counts can't be looked
+ * up directly after this, instead call resolve with the fingerprints of
+ * interest.  This merges the runs from disk, keeping only those fingerprints.
+ */
+class ReadNameCounter {
+private:
+
+	// Fingerprint 0 marks an empty slot
+	vector<uint64_t> keys;
+	vector<uint16_t> counts;
+	size_t nbKeys;
+	size_t mask;
+
+	size_t memoryLimit;
+	path tempDir;
+	vector<path> runs;
+
+	void grow();
+
+	void spill();
+
+	// Adds to the count without checking whether the table is full
+	void insert(const uint64_t key, const uint32_t count);
+
+	static uint64_t normalise(const uint64_t key) {
+		return key == 0 ? 1 : key;
+	}
+
+	// Mixes the bits of the key so that similar fingerprints spread out
+	static size_t slot(const uint64_t key) {
+		return (size_t)((key * 0x9E3779B97F4A7C15ULL) >> 16);
+	}
+
+public:
+
+	/**
+	 * Creates a counter with no memory limit
+	 */
+	ReadNameCounter();
+
+	/**
+	 * Creates a counter which spills to disk once its table would need more than
+	 * the given amount of memory
+	 * @param memoryLimit Maximum size of the table in bytes, or 0 for no limit
+	 * @param tempDir Directory to write runs to
+	 */
+	ReadNameCounter(const size_t memoryLimit, const path& tempDir);
+
+	ReadNameCounter(const ReadNameCounter& other) = delete;
+
+	ReadNameCounter& operator=(const ReadNameCounter& other) = delete;
+
+	ReadNameCounter(ReadNameCounter&& other);
+
+	ReadNameCounter& operator=(ReadNameCounter&& other);
+
+	virtual ~ReadNameCounter();
+
+	/**
+	 * Adds one occurrence of the read name with this fingerprint
+	 */
+	void add(const uint64_t key) {
+		add(key, 1);
+	}
+
+	/**
+	 * Adds several occurrences of the read name with this fingerprint
+	 */
+	void add(const uint64_t key, const uint32_t count) {
+		if ((nbKeys + 1) * 10 > keys.size() * 7) {
+			grow();
+		}
+		insert(key, count);
+	}
+
+	/**
+	 * Adds all the counts from another counter and empties it.  Takes ownership
+	 * of any runs the other counter spilled to disk.
+	 */
+	void merge(ReadNameCounter& other);
+
+	/**
+	 * @return The number of times the read name with this fingerprint was added,
+	 * up to 65535.  Only valid if nothing was spilled to disk, or after resolve.
+	 */
+	uint16_t count(const uint64_t key) const;
+
+	/**
+	 * Merges any runs spilled to disk, keeping counts only for the given
+	 * fingerprints, so that they can be looked up.  Removes the runs.
+	 * @param queries Fingerprints that will be looked up
+	 */
+	void resolve(vector<uint64_t> queries);
+
+	/**
+	 * Whether any counts are on disk rather than in memory
+	 */
+	bool isSpilled() const {
+		return !runs.empty();
+	}
+
+	/**
+	 * Number of distinct fingerprints in memory
+	 */
+	size_t size() const {
+		return nbKeys;
+	}
+
+	/**
+	 * Removes all counts, including any spilled to disk
+	 */
+	void clear();
+};
+
+}
+}
@@ -0,0 +1,95 @@
+//  ********************************************************************
+//  This file is part of Portcullis.
+//
+//  Portcullis is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  Portcullis is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with Portcullis.  If not, see <http://www.gnu.org/licenses/>.
+//  *******************************************************************
+
+#pragma once
+
+#include <vector>
+using std::vector;
+
+#include <portcullis/bam/bam_alignment.hpp>
+using portcullis::bam::BamAlignment;
+
+namespace portcullis {
+namespace bam {
+
+/**
+ * Records the depth of coverage of alignments on a single target sequence, but
+ * only within a set of windows of interest.  Memory is proportional to the total
+ * length of the windows rather than the length of the target sequence.
+ *
+ * Depth is defined as for DepthParser, i.e. the number of alignments with a
+ * match, sequence match or sequence mismatch cigar op covering the position.
+ * Depth is not capped.  The htslib pileup that coverage was previously taken
+ * from drops alignments beyond its limit of 8000, so in very deep regions the
+ * depth here can be higher.
+ *
+ * Usage: add all the windows, call index, then add the alignments.
+ */
+class SparseDepth {
+private:
+
+	// A run of consecutive positions [start, end) with depths stored from offset
+	struct Segment {
+		int32_t start;
+		int32_t end;
+		size_t offset;
+	};
+
+	vector<Segment> windows;
+	vector<Segment> segments;
+	vector<uint32_t> depths;
+
+	// Finds the first segment ending after pos
+	vector<Segment>::const_iterator findSegment(const int32_t pos) const;
+
+public:
+
+	/**
+	 * Adds a window of interest
+	 * @param start First position of the window (0-based)
+	 * @param end Position after the last position of the window
+	 */
+	void addWindow(const int32_t start, const int32_t end);
+
+	/**
+	 * Merges overlapping windows and allocates the depth counters.  Must be
+	 * called after all windows have been added and before adding alignments.
+	 */
+	void index();
+
+	/**
+	 * Adds the aligned blocks of this alignment to the depth counters.
+	 * Unmapped alignments are ignored.
+	 */
+	void addAlignment(const BamAlignment& al);
+
+	/**
+	 * @param pos 0-based position on the target sequence
+	 * @return The depth at this position, or 0 if it isn't in any window
+	 */
+	uint32_t getDepth(const int32_t pos) const;
+
+	/**
+	 * Total number of positions being tracked
+	 */
+	size_t size() const {
+		return depths.size();
+	}
+};
+
+}
+}
@@ -149,4 +149,46 @@ struct IntronComparator {
 };
 
 typedef shared_ptr<Intron> IntronPtr;
+
+/**
+ * Identifies an intron by the index of its target sequence and its position,
+ * in the same way as Intron's equality operator, but without the target name
+ * and length.  Small enough to build on the stack for every N cigar op when
+ * looking up junctions.
+ */
+struct IntronKey {
+	int32_t refIndex;
+	int32_t start;
+	int32_t end;
+
+	IntronKey() : IntronKey(-1, -1, -1) {}
+
+	IntronKey(const int32_t _refIndex, const int32_t _start, const int32_t _end) :
+		refIndex(_refIndex), start(_start), end(_end) {
+	}
+
+	IntronKey(const Intron& intron) : IntronKey(intron.ref.index, intron.start, intron.end) {
+	}
+
+	bool operator==(const IntronKey& other) const {
+		return refIndex == other.refIndex && start == other.start && end == other.end;
+	}
+
+	bool operator!=(const IntronKey& other) const {
+		return !((*this) == other);
+	}
+
+	/**
+	 * Packs the start and end into one 64-bit word, mixes in the target index,
+	 * then scrambles the bits so that nearby introns spread out
+	 */
+	uint64_t hash() const {
+		uint64_t h = ((uint64_t)(uint32_t)start << 32) | (uint32_t)end;
+		h ^= (uint64_t)(uint32_t)refIndex * 0x9E3779B97F4A7C15ULL;
+		h ^= h >> 33;
+		h *= 0xFF51AFD7ED558CCDULL;
+		h ^= h >> 33;
+		return h;
+	}
+};
 }
@@ -35,16 +35,18 @@ using std::vector;
 using std::map;
 using std::shared_ptr;
 
-typedef std::unordered_map<size_t, uint16_t> SplicedAlignmentMap;
-
 #include <boost/exception/all.hpp>
 
 #include "bam/bam_master.hpp"
 #include "bam/bam_alignment.hpp"
 #include "bam/bam_reader.hpp"
 #include "bam/genome_mapper.hpp"
+#include "bam/read_name_counter.hpp"
 using namespace portcullis::bam;
 
+// Counts of each spliced alignment's read name, keyed by BamAlignment::deriveNameCode
+typedef portcullis::bam::ReadNameCounter SplicedAlignmentMap;
+
 #include "ml/markov_model.hpp"
 using portcullis::ml::KmerMarkovModel;
 using portcullis::ml::PosMarkovModel;
@@ -131,56 +133,59 @@ struct SplicingScores {
 	double splicingSignal = 0.0;
 };
 
-struct AlignmentInfo {
-	BamAlignmentPtr ba;
-	size_t nameCode;
-	uint32_t totalUpstreamMatches; // Total number of upstream matches in this junction window
-	uint32_t totalDownstreamMatches; // Total number of downstream matches in this junction window
-	uint32_t totalUpstreamMismatches;
-	uint32_t totalDownstreamMismatches;
-	uint32_t upstreamMatches; // Distance to first upstream mismatch
-	uint32_t downstreamMatches; // Distance to first downstream mismatch
+/**
+ * A fixed size summary of a spliced alignment supporting a junction, holding
+ * only what is needed to calculate the junction metrics.  This is created as
+ * the alignment is added to the junction, so the alignment itself doesn't need
+ * to be kept.
+ */
+struct AlignmentSummary {
+	int32_t start;
+	int32_t end;
+	uint64_t nameCode; // Fingerprint of the read name (see BamAlignment::deriveNameCode)
+	uint32_t nbMismatches; // Total number of mismatches in the anchors
 	uint32_t minMatch; // Distance to first mismatch (minimum of either upstream or downstream)
-	uint32_t maxMatch; // Distance to first mismatch (maximum of either upstream or downstream)
-	uint32_t nbMismatches; // Total number of mismatches in this junction window
 	uint32_t mmes; // Minimal Match on Either Side of exon junction
+	uint16_t upstreamJunctions; // Number of other junctions in the alignment before this one
+	uint16_t downstreamJunctions; // Number of other junctions in the alignment after this one
+	Strand strand;
+	uint8_t mapQuality;
+	uint8_t properPairs; // Orientations in which the alignment is properly paired, one bit per orientation
+	bool bamProperPair; // Properly paired according to the BAM flag
 
-	AlignmentInfo(BamAlignmentPtr _ba) {
-		// Copy alignment
-		ba = _ba;
-		// Calculate a hash of the alignment name
-		nameCode = std::hash<std::string>()(ba->deriveName());
-		totalUpstreamMatches = 0;
-		totalDownstreamMatches = 0;
-		totalUpstreamMismatches = 0;
-		totalDownstreamMismatches = 0;
-		upstreamMatches = 0;
-		downstreamMatches = 0;
-		minMatch = 0;
-		maxMatch = 0;
-		nbMismatches = 0;
-		mmes = 0;
-	}
-
-	~AlignmentInfo() {
-		ba.reset();
-	}
+	/**
+	 * Summarises the alignment, apart from the anchor mismatch stats
+	 * @param al The alignment
+	 * @param i The intron of the junction the alignment supports
+	 */
+	AlignmentSummary(const BamAlignment& al, const Intron& i);
 
-	void calcMatchStats(const Intron& i, const uint32_t leftStart, const uint32_t rightEnd, const string& ancLeft, const string& ancRight);
+	/**
+	 * Compares the anchors of the alignment either side of the intron with the
+	 * genome to find the mismatch stats
+	 * @param al The alignment this summarises
+	 * @param i The intron of the junction the alignment supports
+	 * @param genome Bases from the alignment's target sequence
+	 * @param anchorStart Start of the left anchor, after any previous intron in
+	 * the alignment
+	 * @param anchorEnd End of the right anchor (inclusive), before any following
+	 * intron in the alignment
+	 */
+	void calcMatchStats(const BamAlignment& al, const Intron& i, GenomeBuffer& genome,
+						const int32_t anchorStart, const int32_t anchorEnd);
 
-	uint32_t getNbMatchesFromStart(const string& query, const string& anchor);
-	uint32_t getNbMatchesFromEnd(const string& query, const string& anchor);
+	bool isProperPair(const Orientation orientation) const {
+		return (properPairs >> (uint8_t)orientation) & 1;
+	}
 };
 
-typedef shared_ptr<AlignmentInfo> AlignmentInfoPtr;
-
 class Junction {
 private:
 
 	// **** Properties that describe where the junction is ****
 	shared_ptr<Intron> intron;
-	vector<shared_ptr<AlignmentInfo>> alignments;
-	vector<size_t> alignmentCodes;
+	vector<AlignmentSummary> alignments;
+	vector<uint64_t> alignmentCodes;
 
 
 	// **** Junction metrics ****
@@ -289,10 +294,6 @@ public:
 
 	void clearAlignments();
 
-	const BamAlignment& getFirstAlignment() const {
-		return *(alignments[0]->ba);
-	}
-
 	const Intron& getLocation() const {
 		return *intron;
 	}
@@ -457,6 +458,14 @@ public:
 		return this->nbAlRaw;
 	}
 
+	/**
+	 * Fingerprints of the names of the spliced alignments supporting this
+	 * junction, as used for the multiple mapping score
+	 */
+	const vector<uint64_t>& getAlignmentCodes() const {
+		return this->alignmentCodes;
+	}
+
 	/**
 	 * The number of distinct alignments supporting this junction
 	 * @return
@@ -950,7 +959,23 @@ public:
 	 * Add an alignment to this junction and update any associated properties
 	 * @param al
 	 */
-	void addJunctionAlignment(const BamAlignment& al);
+	void addJunctionAlignment(const BamAlignment& al) {
+		addJunctionAlignment(al, nullptr, al.getStart(), al.getEnd());
+	}
+
+	/**
+	 * Add an alignment to this junction and update any associated properties.
+	 * Only a summary of the alignment is kept.  If a genome buffer is given, the
+	 * alignment's anchors are also compared with the genome, which is needed for
+	 * the mismatch metrics calculated in processJunctionWindow.
+	 * @param al
+	 * @param genome Bases from the junction's target sequence, or nullptr
+	 * @param anchorStart Start of this alignment's left anchor, after any
+	 * previous intron in the alignment
+	 * @param anchorEnd End of this alignment's right anchor (inclusive), before
+	 * any following intron in the alignment
+	 */
+	void addJunctionAlignment(const BamAlignment& al, GenomeBuffer* genome, const int32_t anchorStart, const int32_t anchorEnd);
 
 	/**
 	 * Sets the canonical status of this junction based on the dinucleotides at the donor and acceptor
@@ -988,12 +1013,37 @@ public:
 	 */
 	void determineStrandFromReads();
 
+	/**
+	 * Adds the windows of genomic sequence used by processJunctionWindow to a batch
+	 * @param windows Batch of windows on this junction's target sequence
+	 * @return Id of the first window added
+	 */
+	size_t addJunctionWindows(GenomeWindows& windows) const;
+
 	/**
 	 * Extracts genomic content around this junction and updates any associated properties
 	 * @param genomeMapper
 	 */
 	void processJunctionWindow(const GenomeMapper& genomeMapper);
 
+	/**
+	 * As above, but takes the genomic content from a batch of windows that has
+	 * already been fetched
+	 * @param windows Batch holding this junction's windows
+	 * @param first Id of the first window, as returned by addJunctionWindows
+	 */
+	void processJunctionWindow(const GenomeWindows& windows, const size_t first);
+
+	/**
+	 * Updates the properties that depend only on the genomic content around this
+	 * junction, and not on its alignments.  Together with calcMismatchStats this
+	 * does the same as processJunctionWindow, so the alignments can be released
+	 * before the windows are fetched.
+	 * @param windows Batch holding this junction's windows
+	 * @param first Id of the first window, as returned by addJunctionWindows
+	 */
+	void processJunctionSequence(const GenomeWindows& windows, const size_t first);
+
 	/**
 	 * Process non-spliced alignments within a certain region upstream and downstream of the junction
 	 * @param reader
@@ -1074,13 +1124,28 @@ public:
 	/**
 	 * Calculates metric 18.  Multiple mapping score
 	 */
-	void calcMultipleMappingScore(SplicedAlignmentMap& map);
+	void calcMultipleMappingScore(const SplicedAlignmentMap& map);
 
 
 	double calcCoverage(int32_t a, int32_t b, const vector<uint32_t>& coverageLevels);
 
 	double calcCoverage(const vector<uint32_t>& coverageLevels);
 
+	/**
+	 * Calculates the coverage score from coverage levels around the donor and
+	 * acceptor sites only, rather than across the whole target sequence.
+	 * Coverage levels use the same coordinates as the dense version.
+	 * @param donorLevels Coverage levels from donorOffset onwards
+	 * @param donorOffset Coordinate of the first donor level
+	 * @param acceptorLevels Coverage levels from acceptorOffset onwards
+	 * @param acceptorOffset Coordinate of the first acceptor level
+	 * @param nbLevels Number of coverage levels in the dense version, i.e.
+	 * the length of the target sequence
+	 * @return The coverage score
+	 */
+	double calcCoverage(const vector<uint32_t>& donorLevels, int32_t donorOffset,
+						const vector<uint32_t>& acceptorLevels, int32_t acceptorOffset, int32_t nbLevels);
+
 	/**
 	 * Calculates a score for this intron size based on how this intron size fits
 	 * into an expected distribution specified by the length at the threhsold percentile
@@ -1102,10 +1167,37 @@ public:
 	 */
 	double calcCodingPotential(GenomeMapper& gmap, KmerMarkovModel& exon, KmerMarkovModel& intron);
 
+	/**
+	 * Adds the windows of genomic sequence used by calcCodingPotential to a batch
+	 * @param windows Batch of windows on this junction's target sequence
+	 * @return Id of the first window added
+	 */
+	size_t addCodingWindows(GenomeWindows& windows) const;
+
+	/**
+	 * As above, but takes the genomic content from a batch of windows that has
+	 * already been fetched
+	 * @param windows Batch holding this junction's windows
+	 * @param first Id of the first window, as returned by addCodingWindows
+	 */
+	double calcCodingPotential(const GenomeWindows& windows, const size_t first, KmerMarkovModel& exon, KmerMarkovModel& intron);
+
 	SplicingScores calcSplicingScores(GenomeMapper& gmap, KmerMarkovModel& donorT, KmerMarkovModel& donorF,
 									  KmerMarkovModel& acceptorT, KmerMarkovModel& acceptorF,
 									  PosMarkovModel& donorP, PosMarkovModel& acceptorP);
 
+	/**
+	 * Adds the windows of genomic sequence used by calcSplicingScores to a batch
+	 * @param windows Batch of windows on this junction's target sequence
+	 * @return Id of the first window added
+	 */
+	size_t addSplicingWindows(GenomeWindows& windows) const;
+
+	SplicingScores calcSplicingScores(const GenomeWindows& windows, const size_t first,
+									  KmerMarkovModel& donorT, KmerMarkovModel& donorF,
+									  KmerMarkovModel& acceptorT, KmerMarkovModel& acceptorF,
+									  PosMarkovModel& donorP, PosMarkovModel& acceptorP);
+
 
 	/**
 	 * Calculate the log deviation for the junction anchor depth count at a given location
@@ -0,0 +1,86 @@
+//  ********************************************************************
+//  This file is part of Portcullis.
+//
+//  Portcullis is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  Portcullis is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with Portcullis.  If not, see <http://www.gnu.org/licenses/>.
+//  *******************************************************************
+
+#pragma once
+
+#include <vector>
+using std::vector;
+
+#include <portcullis/intron.hpp>
+#include <portcullis/junction.hpp>
+using portcullis::IntronKey;
+using portcullis::JunctionPtr;
+
+namespace portcullis {
+
+/**
+ * Maps intron keys to junctions using open addressing with linear probing.
+ * Keys and junctions are held in two flat arrays, so a lookup hashes the key
+ * and scans neighbouring slots, without allocating or following any pointers
+ * until the junction is found.  Junctions can't be removed, only replaced.
+ */
+class JunctionMap {
+private:
+
+	// A slot is empty if its junction is null
+	vector<IntronKey> keys;
+	vector<JunctionPtr> junctions;
+	size_t nbJunctions;
+	size_t mask;
+
+	void grow();
+
+	// Returns the slot holding this key, or the empty slot where it would go
+	size_t findSlot(const IntronKey& key) const {
+		size_t i = (size_t)key.hash() & mask;
+		while (junctions[i] && keys[i] != key) {
+			i = (i + 1) & mask;
+		}
+		return i;
+	}
+
+public:
+
+	JunctionMap();
+
+	/**
+	 * @return The junction with this key, or nullptr if there isn't one
+	 */
+	JunctionPtr find(const IntronKey& key) const {
+		return nbJunctions == 0 ? nullptr : junctions[findSlot(key)];
+	}
+
+	/**
+	 * Adds the junction under this key, replacing any junction already there
+	 */
+	void insert(const IntronKey& key, JunctionPtr junction);
+
+	size_t size() const {
+		return nbJunctions;
+	}
+
+	bool empty() const {
+		return nbJunctions == 0;
+	}
+
+	/**
+	 * Removes all junctions and frees the table
+	 */
+	void clear();
+};
+
+}
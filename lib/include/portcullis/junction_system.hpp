@@ -17,6 +17,7 @@
 
 #pragma once
 
+#include <algorithm>
 #include <fstream>
 #include <vector>
 #include <memory>
@@ -28,18 +29,23 @@ using std::shared_ptr;
 #include <boost/timer/timer.hpp>
 using boost::timer::auto_cpu_timer;
 
+#include <portcullis/arena.hpp>
 #include <portcullis/intron.hpp>
 #include <portcullis/junction.hpp>
+#include <portcullis/junction_map.hpp>
+#include <portcullis/junction_table.hpp>
 #include <portcullis/seq_utils.hpp>
+using portcullis::Arena;
+using portcullis::ArenaAllocator;
+using portcullis::ArenaPtr;
 using portcullis::Intron;
-using portcullis::IntronHasher;
+using portcullis::IntronKey;
 using portcullis::Junction;
+using portcullis::JunctionMap;
 using portcullis::JunctionPtr;
+using portcullis::JunctionTable;
 using portcullis::SeqUtils;
 
-typedef std::unordered_map<Intron, JunctionPtr, IntronHasher> DistinctJunctions;
-typedef std::unordered_map<Intron, JunctionPtr, IntronHasher>::iterator JunctionMapIterator;
-typedef std::pair<const Intron, JunctionPtr> JunctionMapType;
 typedef std::vector<JunctionPtr> JunctionList;
 typedef std::shared_ptr<JunctionList> JunctionListPtr;
 
@@ -47,7 +53,7 @@ namespace portcullis {
 
 class JunctionSystem {
 private:
-	DistinctJunctions distinctJunctions;
+	JunctionMap distinctJunctions;
 	JunctionList junctionList;
 
 	int32_t minQueryLength;
@@ -56,9 +62,14 @@ private:
 
 	shared_ptr<vector<RefSeqPtr>> refs;
 
-	size_t createJunctionGroup(size_t index, vector<JunctionPtr>& group);
+	// Number of times an alignment has been recorded against a junction
+	uint64_t nbJunctionAlignments;
+
+	// Where new junctions found in alignments are allocated, or nullptr to
+	// allocate each one separately
+	ArenaPtr arena;
 
-	void findJunctions(const int32_t refId, JunctionList& subset);
+	size_t createJunctionGroup(size_t index, vector<JunctionPtr>& group);
 
 
 public:
@@ -77,6 +88,15 @@ public:
 
 	const JunctionList& getJunctions() const;
 
+	/**
+	 * Copies the location and metrics of every junction in this system into a
+	 * column oriented table, with rows in the same order as getJunctions().
+	 * @return The table
+	 */
+	JunctionTable createTable() const {
+		return JunctionTable(junctionList);
+	}
+
 	size_t size();
 
 	double getMeanQueryLength() const {
@@ -109,6 +129,26 @@ public:
 		this->refs = refs;
 	}
 
+	/**
+	 * Allocates the junctions found in alignments, along with their introns,
+	 * from the given arena.  The arena is kept alive until all of these are
+	 * freed.  Must be called before any junctions are added.
+	 * @param arena The arena, or nullptr to allocate each object separately
+	 */
+	void setArena(ArenaPtr arena);
+
+	ArenaPtr getArena() const {
+		return arena;
+	}
+
+	/**
+	 * @return The number of times an alignment has been recorded against a
+	 * junction by addJunctions, including alignments since cleared
+	 */
+	uint64_t getNbJunctionAlignments() const {
+		return nbJunctionAlignments;
+	}
+
 
 	bool addJunction(JunctionPtr j);
 
@@ -119,6 +159,16 @@ public:
 	 */
 	void append(JunctionSystem& other);
 
+	/**
+	 * Moves all the junctions in the other junction system onto the end of this
+	 * one, leaving the other empty.  The moved junctions are numbered after
+	 * those already here, so concatenating sorted junction systems that cover
+	 * consecutive regions produces a sorted and indexed junction system
+	 * without any further passes.  Junctions must not be in both systems.
+	 * @param other The other junction system, which is emptied
+	 */
+	void concatenate(JunctionSystem& other);
+
 	/**
 	 * Adds any new junctions found from the given alignment to the set managed
 	 * by this class
@@ -129,21 +179,101 @@ public:
 		return addJunctions(al, 0, al.getPosition());
 	}
 
-	bool addJunctions(const BamAlignment& al, const size_t startOp, const int32_t offset);
+	/**
+	 * Same as addJunctions, except that only junctions whose intron starts
+	 * within the half-open region [regionStart, regionEnd) are recorded.  This
+	 * allows a target sequence to be split into several windows that are
+	 * processed independently: every junction belongs to exactly one window,
+	 * and every alignment supporting that junction overlaps that window.
+	 * @param al The alignment to search for junctions
+	 * @param regionStart First position (0-based) of the region
+	 * @param regionEnd Position after the last position of the region
+	 * @return Whether a junction was found in this alignment or not (regardless
+	 * of whether it was recorded)
+	 */
+	bool addJunctionsInRegion(const BamAlignment& al, const int32_t regionStart, const int32_t regionEnd) {
+		return addJunctions(al, 0, al.getPosition(), regionStart, regionEnd, nullptr);
+	}
+
+	/**
+	 * Same as addJunctionsInRegion, but also compares the anchors of each
+	 * recorded alignment with the genome, as needed for the mismatch metrics.
+	 * @param al The alignment to search for junctions
+	 * @param regionStart First position (0-based) of the region
+	 * @param regionEnd Position after the last position of the region
+	 * @param genome Bases from the alignment's target sequence
+	 * @return Whether a junction was found in this alignment or not (regardless
+	 * of whether it was recorded)
+	 */
+	bool addJunctionsInRegion(const BamAlignment& al, const int32_t regionStart, const int32_t regionEnd, GenomeBuffer* genome) {
+		return addJunctions(al, 0, al.getPosition(), regionStart, regionEnd, genome);
+	}
+
+	bool addJunctions(const BamAlignment& al, const size_t startOp, const int32_t offset) {
+		return addJunctions(al, startOp, offset, INT32_MIN, INT32_MAX, nullptr);
+	}
+
+	bool addJunctions(const BamAlignment& al, const size_t startOp, const int32_t offset, const int32_t regionStart, const int32_t regionEnd, GenomeBuffer* genome);
 
 	void findFlankingAlignments(const path& alignmentsFile) {
 		findFlankingAlignments(alignmentsFile, false);
 	}
 
-	void findFlankingAlignments(const path& alignmentsFile, bool verbose);
+	void findFlankingAlignments(const path& alignmentsFile, bool verbose) {
+		findFlankingAlignments(alignmentsFile, verbose, 1);
+	}
+
+	/**
+	 * Counts the unspliced alignments flanking each junction in a single pass
+	 * over the given coordinate sorted BAM
+	 * @param alignmentsFile BAM containing unspliced alignments
+	 * @param verbose Whether to print extra information
+	 * @param ioThreads Number of threads to use for decompressing the BAM
+	 */
+	void findFlankingAlignments(const path& alignmentsFile, bool verbose, uint16_t ioThreads);
+
+	void calcCoverage(const path& alignmentsFile, Strandedness strandSpecific) {
+		calcCoverage(alignmentsFile, strandSpecific, 1);
+	}
+
+	/**
+	 * Calculates the coverage score for each junction from the depth of the
+	 * unspliced alignments either side of the junction.  Depth is only recorded
+	 * in the windows around each junction, so memory use depends on the number
+	 * of junctions rather than the length of the target sequences.  Depth is
+	 * uncapped, unlike the 8000 alignment limit of the htslib pileup.
+	 * @param alignmentsFile Coordinate sorted BAM containing unspliced alignments
+	 * @param strandSpecific Strandedness of the library
+	 * @param ioThreads Number of threads to use for decompressing the BAM
+	 */
+	void calcCoverage(const path& alignmentsFile, Strandedness strandSpecific, uint16_t ioThreads);
+
+	/**
+	 * Counts the unspliced alignments flanking each junction and calculates
+	 * their coverage scores, for junctions on a single target sequence.  Makes
+	 * a single pass over the alignments on that target, so it's safe to call
+	 * from several threads at once as long as each has its own reader and its
+	 * own junctions.
+	 * @param reader Reader over a coordinate sorted and indexed BAM containing
+	 * unspliced alignments
+	 * @param refId Index of the target sequence
+	 * @param junctions The junctions on this target sequence
+	 */
+	static void calcTargetFlankingAndCoverage(BamReader& reader, const int32_t refId, const JunctionList& junctions);
 
-	void calcCoverage(const path& alignmentsFile, Strandedness strandSpecific);
+	/**
+	 * Buckets the junctions by target sequence index in a single pass
+	 * @param nbTargets Number of target sequences
+	 * @param targetJunctions Cleared and filled with a list of junctions for
+	 * each target sequence
+	 */
+	void groupJunctionsByTarget(const int32_t nbTargets, vector<JunctionList>& targetJunctions) const;
 
-	void calcMultipleMappingStats(SplicedAlignmentMap& map) {
+	void calcMultipleMappingStats(const SplicedAlignmentMap& map) {
 		calcMultipleMappingStats(map, false);
 	}
 
-	void calcMultipleMappingStats(SplicedAlignmentMap& map, bool verbose);
+	void calcMultipleMappingStats(const SplicedAlignmentMap& map, bool verbose);
 
 	void calcJunctionStats() {
 		calcJunctionStats(false);
@@ -153,6 +283,20 @@ public:
 
 	void sort();
 
+	/**
+	 * Sorts the junctions using several threads.  Each thread sorts a slice of
+	 * the junctions, then neighbouring slices are merged in parallel.
+	 * @param threads Number of threads to use
+	 */
+	void sort(const uint16_t threads);
+
+	/**
+	 * @return Whether the junctions are in the order produced by sort
+	 */
+	bool isSorted() const {
+		return std::is_sorted(junctionList.begin(), junctionList.end(), JunctionComparator());
+	}
+
 	void index();
 
 	void saveAll(const path& outputPrefix, const string& source);
@@ -186,7 +330,16 @@ public:
 		return this->junctionList[index];
 	}
 
-	JunctionPtr getJunction(Intron& intron) const;
+	JunctionPtr getJunction(const Intron& intron) const {
+		return distinctJunctions.find(IntronKey(intron));
+	}
+
+	/**
+	 * @return The junction with this key, or nullptr if there isn't one
+	 */
+	JunctionPtr getJunction(const IntronKey& key) const {
+		return distinctJunctions.find(key);
+	}
 
 };
 }
@@ -0,0 +1,176 @@
+//  ********************************************************************
+//  This file is part of Portcullis.
+//
+//  Portcullis is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  Portcullis is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with Portcullis.  If not, see <http://www.gnu.org/licenses/>.
+//  *******************************************************************
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+using std::string;
+using std::unordered_map;
+using std::vector;
+
+#include <portcullis/junction.hpp>
+using portcullis::CanonicalSS;
+using portcullis::Junction;
+using portcullis::JunctionList;
+
+namespace portcullis {
+
+/**
+ * A snapshot of the location and metrics of a list of junctions, stored column
+ * by column rather than junction by junction.  Row i describes the i'th junction
+ * in the list the table was built from.  Passes that look at the same few
+ * metrics for every junction, such as rule based filtering, can scan these
+ * columns instead of visiting each Junction object in turn.
+ *
+ * Reference names are interned, so each row holds only an index into the list
+ * of names.  Every numeric property that can be looked up by name on a Junction
+ * (see Junction::getValueFromName) is held as a column of doubles, and each of
+ * the junction anchor depth positions is held in its own column.  A table can
+ * also be built with just the numeric columns a pass needs.
+ *
+ * The table is not updated if the junctions change after it is built.
+ */
+class JunctionTable {
+private:
+
+	vector<string> refNames;
+	unordered_map<string, uint32_t> refIndices;
+
+	vector<uint32_t> refIds;
+	vector<int32_t> starts;
+	vector<int32_t> ends;
+	vector<int32_t> leftAncStarts;
+	vector<int32_t> rightAncEnds;
+	vector<Strand> consensusStrands;
+	vector<CanonicalSS> spliceSiteTypes;
+
+	unordered_map<string, vector<double>> numericColumns;
+	vector<vector<uint32_t>> jadColumns;
+
+	uint32_t internRefName(const string& name);
+
+	void addLocations(const JunctionList& junctions);
+
+	void addNumericColumn(const string& name, const JunctionList& junctions);
+
+	void addJunctionAnchorDepthColumns(const JunctionList& junctions);
+
+public:
+
+	/**
+	 * Creates an empty table
+	 */
+	JunctionTable() : JunctionTable(JunctionList()) {
+	}
+
+	/**
+	 * Creates a table describing the given junctions, in the same order
+	 * @param junctions The junctions to describe
+	 */
+	JunctionTable(const JunctionList& junctions);
+
+	/**
+	 * Creates a table describing the given junctions, in the same order, with
+	 * only the named numeric columns and no junction anchor depth columns
+	 * @param junctions The junctions to describe
+	 * @param numericNames Names of the numeric properties to hold, as used by
+	 * Junction::getValueFromName
+	 * @throws JunctionException if a property isn't numeric
+	 */
+	JunctionTable(const JunctionList& junctions, const vector<string>& numericNames);
+
+	/**
+	 * @return The number of rows (junctions) in this table
+	 */
+	size_t size() const {
+		return starts.size();
+	}
+
+	/**
+	 * @return The distinct reference names, in the order they were first seen
+	 */
+	const vector<string>& getRefNames() const {
+		return refNames;
+	}
+
+	/**
+	 * @return For each row, the index of its reference name in getRefNames()
+	 */
+	const vector<uint32_t>& getRefIds() const {
+		return refIds;
+	}
+
+	const string& getRefName(const size_t row) const {
+		return refNames[refIds[row]];
+	}
+
+	const vector<int32_t>& getStarts() const {
+		return starts;
+	}
+
+	const vector<int32_t>& getEnds() const {
+		return ends;
+	}
+
+	const vector<int32_t>& getLeftAncStarts() const {
+		return leftAncStarts;
+	}
+
+	const vector<int32_t>& getRightAncEnds() const {
+		return rightAncEnds;
+	}
+
+	const vector<Strand>& getConsensusStrands() const {
+		return consensusStrands;
+	}
+
+	const vector<CanonicalSS>& getSpliceSiteTypes() const {
+		return spliceSiteTypes;
+	}
+
+	/**
+	 * Returns the column holding a numeric junction property for every row
+	 * @param name Name of the property, as used by Junction::getValueFromName
+	 * @return The column
+	 * @throws JunctionException if the property isn't numeric
+	 */
+	const vector<double>& getNumericColumn(const string& name) const;
+
+	/**
+	 * Returns a string junction property for a single row
+	 * @param name Name of the property, as used by Junction::getStringFromName
+	 * @param row The row
+	 * @return The value of the property
+	 * @throws JunctionException if the property isn't a string
+	 */
+	string getStringValue(const string& name, const size_t row) const;
+
+	/**
+	 * Returns the column holding the junction anchor depth at the given
+	 * position for every row
+	 * @param index Position, from 0 to Junction::JAD_NAMES.size() - 1
+	 * @return The column
+	 * @throws JunctionException if the table wasn't built with all columns, or
+	 * the position is out of range
+	 */
+	const vector<uint32_t>& getJunctionAnchorDepthColumn(const size_t index) const;
+};
+
+}
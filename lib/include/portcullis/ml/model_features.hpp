@@ -30,6 +30,7 @@ using boost::filesystem::path;
 #include <portcullis/ml/markov_model.hpp>
 #include <portcullis/junction.hpp>
 using portcullis::bam::GenomeMapper;
+using portcullis::bam::GenomeWindows;
 using portcullis::ml::MarkovModel;
 using portcullis::Junction;
 using portcullis::JunctionPtr;
@@ -68,7 +69,14 @@ class ModelFeatures {
 private:
 	size_t fi;
 protected:
-	void setRow(Data* d, size_t row, JunctionPtr j, bool labelled);
+	void setRow(Data* d, size_t row, JunctionPtr j, bool labelled,
+				const GenomeWindows& windows, size_t splicingWindow, size_t codingWindow);
+
+	/**
+	 * Sets consecutive rows from a list of junctions, fetching the genomic
+	 * sequence for each run of junctions on the same target in one batch
+	 */
+	void setRows(Data* d, size_t row, const JunctionList& x, bool labelled);
 
 public:
 	uint32_t L95;
@@ -60,9 +60,11 @@ namespace phx = boost::phoenix;
 #include <portcullis/intron.hpp>
 #include <portcullis/junction.hpp>
 #include <portcullis/junction_system.hpp>
+#include <portcullis/junction_table.hpp>
 using portcullis::Intron;
 using portcullis::Junction;
 using portcullis::JunctionSystem;
+using portcullis::JunctionTable;
 
 namespace portcullis {
 
@@ -159,47 +161,84 @@ string opToString(const Operator op);
 
 bool isNumericOp(Operator op);
 
-struct eval : boost::static_visitor<bool> {
-	eval(const NumericFilterMap& _numericmap, const SetFilterMap& _stringmap, const JunctionPtr _junc, JuncResultMap* _juncMap);
+/**
+ * A parsed rule expression, compiled against a junction table so it can be
+ * evaluated for every row without looking anything up by name.  The column,
+ * operator and threshold of each leaf, such as "M2-nb_reads.1", are resolved
+ * once when the rule is built.  The filters and the table are referenced
+ * rather than copied, so must outlive this.
+ */
+class CompiledRule {
+private:
 
-	//
-	bool operator()(const var& v) const;
+	enum class NodeType {
+		CONSTANT,
+		NUMERIC,
+		STRING,
+		NOT,
+		AND,
+		OR
+	};
+
+	struct Node {
+		NodeType type;
+		bool value;     // Constants only
+		size_t leaf;    // Index of the leaf for numeric and string tests
+		size_t oper1;   // Index of the operand nodes for operators
+		size_t oper2;
+	};
+
+	struct Leaf {
+		Operator op;
+		double threshold;
+		const vector<double>* column;
+		string property;
+		const unordered_set<string>* set;
+		string failure; // Recorded against a junction that fails this test
+	};
+
+	struct Compiler;
+	friend struct Compiler;
+
+	const JunctionTable& table;
+	vector<Node> nodes;
+	vector<Leaf> leaves;
+	size_t root;
+
+	bool evaluate(const size_t node, const size_t row, vector<string>& failures) const;
 
-	bool operator()(const binop<op_and>& b) const {
-		bool op1Res = recurse(b.oper1);
-		bool op2Res = recurse(b.oper2);
-		return op1Res && op2Res;
-	}
+public:
 
-	bool operator()(const binop<op_or>& b) const {
-		bool op1Res = recurse(b.oper1);
-		bool op2Res = recurse(b.oper2);
-		return op1Res || op2Res;
-	}
+	/**
+	 * @param expression The parsed expression
+	 * @param numericmap Operator and threshold of each numeric test in the expression
+	 * @param stringmap Operator and set of values of each string test in the expression
+	 * @param table Junctions to evaluate the rule for.  This must hold the
+	 * numeric columns named by getNumericProperties.
+	 * @throws RuleParserException if the expression uses an unrecognised test
+	 */
+	CompiledRule(const expr& expression, const NumericFilterMap& numericmap, const SetFilterMap& stringmap,
+				 const JunctionTable& table);
 
-	bool operator()(const unop<op_not>& u) const {
-		return !recurse(u.oper1);
+	/**
+	 * Evaluates the rule for a single junction
+	 * @param row The junction's row in the table
+	 * @param failures Descriptions of the tests the junction failed are added to this
+	 * @return Whether the junction passed the rule
+	 */
+	bool evaluate(const size_t row, vector<string>& failures) const {
+		return evaluate(root, row, failures);
 	}
 
-	double getNumericFromJunc(const var& fullname) const;
-
-	string getStringFromJunc(const var& fullname) const;
-
-	bool evalNumberLeaf(Operator op, double threshold, double value) const;
-
-	bool evalSetLeaf(Operator op, unordered_set<string>& set, string value) const;
-
-private:
+	/**
+	 * @return The names of the numeric junction properties that the filters
+	 * test, as used by Junction::getValueFromName
+	 */
+	static vector<string> getNumericProperties(const NumericFilterMap& numericmap);
 
-	NumericFilterMap numericmap;
-	SetFilterMap stringmap;
-	JunctionPtr junc;
-	JuncResultMap* juncMap;
+	static bool evalNumberLeaf(Operator op, double threshold, double value);
 
-	template<typename T>
-	bool recurse(T const& v) const {
-		return boost::apply_visitor(*this, v);
-	}
+	static bool evalSetLeaf(Operator op, const unordered_set<string>& set, const string& value);
 };
 
 template <typename It, typename Skipper = qi::space_type>
@@ -228,15 +267,11 @@ qi::rule<It, expr(), Skipper> not_, and_, or_, simple, expr_;
 class RuleFilter {
 protected:
 	/**
-	 * This function evaluates the truth status of a row parameter given the configuration present in the JSON file.
-	 * @param op Operation to be considered
-	 * @param threshold Threshold
-	 * @param param Value
-	 * @return True if parameter passes operation and threshold, false otherwise
+	 * Parses a rule expression, such that it can be evaluated for many junctions
+	 * @param expression The expression from the JSON file
+	 * @return The parsed expression
 	 */
-	static bool parse(const string& expression, JunctionPtr junc,
-					  NumericFilterMap& numericFilters, SetFilterMap& stringFilters,
-					  JuncResultMap* results);
+	static expr parse(const string& expression);
 
 public:
 
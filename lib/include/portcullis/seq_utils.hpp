@@ -17,6 +17,7 @@
 
 #pragma once
 
+#include <cstdint>
 #include <string>
 using std::string;
 
@@ -41,6 +42,15 @@ typedef boost::error_info<struct SeqUtilsError, string> SeqUtilsErrorInfo;
 struct SeqUtilsException: virtual boost::exception, virtual std::exception { };
 
 
+/**
+ * Instruction sets the sequence kernels in SeqUtils can use
+ */
+enum class SimdLevel {
+	SCALAR,
+	SSSE3,
+	AVX2
+};
+
 class SeqUtils {
 
 public:
@@ -49,29 +59,37 @@ public:
 		return c == 'A' || c == 'T' || c == 'G' || c == 'C';
 	}
 
+	/**
+	 * Upper cases a sequence and replaces anything that isn't A, T, G or C with
+	 * N, in place
+	 * @param seq Start of the sequence
+	 * @param length Length of the sequence
+	 */
+	static void makeClean(char* seq, const size_t length);
+
 	static string makeClean(const string& s) {
-		string sequp = boost::to_upper_copy(s);
-		for (size_t i = 0; i < sequp.size(); i++) {
-			sequp[i] = dnaNt(sequp[i]) ? sequp[i] : 'N';
-		}
-		return sequp;
+		string clean(s);
+		makeClean(&clean[0], clean.size());
+		return clean;
 	}
 
+	/**
+	 * Counts the positions at which two sequences of the same length differ,
+	 * ignoring case
+	 * @param s1 Start of the first sequence
+	 * @param s2 Start of the second sequence
+	 * @param length Length of both sequences
+	 * @return The hamming distance
+	 */
+	static uint32_t hammingDistance(const char* s1, const char* s2, const size_t length);
+
 	static uint32_t hammingDistance(const string& s1, const string& s2) {
 		if (s1.size() != s2.size())
 			BOOST_THROW_EXCEPTION(SeqUtilsException() << SeqUtilsErrorInfo(string(
 									  "Can't find hamming distance of strings that are not the same length.  ") +
 								  "s1: " + lexical_cast<string>(s1.size()) + "\"" + s1 + "\"; " +
 								  "s2: " + lexical_cast<string>(s2.size()) + "\"" + s2 + "\""));
-		string s1u = boost::to_upper_copy(s1);
-		string s2u = boost::to_upper_copy(s2);
-		uint32_t sum = 0;
-		for (size_t i = 0; i < s1u.size(); i++) {
-			if (s1u[i] != s2u[i]) {
-				sum++;
-			}
-		}
-		return sum;
+		return hammingDistance(s1.data(), s2.data(), s1.size());
 	}
 
 	/**
@@ -83,21 +101,42 @@ public:
 		return string(sequence.rbegin(), sequence.rend());
 	}
 
+	/**
+	 * Reverse complements a sequence in place.  Bases are complemented as in
+	 * REVCOMP_LOOKUP, and lower case bases stay lower case.
+	 * @param seq Start of the sequence
+	 * @param length Length of the sequence
+	 */
+	static void reverseComplement(char* seq, const size_t length);
+
+	static void reverseComplementInPlace(string& sequence) {
+		reverseComplement(&sequence[0], sequence.size());
+	}
+
 	/**
 	 * Returns a reverse complement of the provided sequence
 	 * @param sequence
 	 * @return
 	 */
 	static string reverseComplement(string sequence) {
-		// do complement, in-place
-		size_t seqLength = sequence.length();
-		for ( size_t i = 0; i < seqLength; ++i )
-			sequence.replace(i, 1, 1, REVCOMP_LOOKUP[(int)sequence.at(i) - 65]);
-		// reverse it
-		return reverseSeq(sequence);
+		reverseComplementInPlace(sequence);
+		return sequence;
 	}
-};
 
+	/**
+	 * @return The instruction set the sequence kernels use.  This is the best
+	 * one the CPU supports, unless lowered with setSimdLevel.
+	 */
+	static SimdLevel getSimdLevel();
+
+	/**
+	 * Changes the instruction set the sequence kernels use, for example to
+	 * compare them with the scalar versions.  A level the CPU doesn't support
+	 * is lowered to the best one it does.  Not thread safe.
+	 * @param level The instruction set to use
+	 */
+	static void setSimdLevel(const SimdLevel level);
+};
 
 }
 
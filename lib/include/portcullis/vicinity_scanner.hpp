@@ -0,0 +1,166 @@
+//  ********************************************************************
+//  This file is part of Portcullis.
+//
+//  Portcullis is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  Portcullis is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with Portcullis.  If not, see <http://www.gnu.org/licenses/>.
+//  *******************************************************************
+
+#pragma once
+
+#include <deque>
+#include <vector>
+using std::deque;
+using std::vector;
+
+#include <portcullis/bam/bam_alignment.hpp>
+using portcullis::bam::BamAlignment;
+
+#include <portcullis/junction.hpp>
+using portcullis::JunctionPtr;
+
+namespace portcullis {
+
+/**
+ * Calculates the junction metrics that depend on the unspliced alignments
+ * around each junction, i.e. the number of upstream and downstream flanking
+ * alignments and the coverage score, from a single coordinate sorted stream of
+ * alignments on one target sequence.  This gives the same results as
+ * Junction::processJunctionVicinity and JunctionSystem::calcCoverage on the
+ * unspliced BAM, but without having to split the BAM or revisit any part of it.
+ *
+ * Junctions should be added as soon as they are discovered and unspliced mapped
+ * alignments as they are read.  The metrics for a junction are set once the
+ * stream has moved past everything that could affect them.  Unspliced
+ * alignments are buffered only for as long as a pending junction may need them.
+ *
+ * The stream is assumed to contain all alignments overlapping the target
+ * sequence from streamStart onwards.  Junctions that need alignments ending
+ * before this position are completed via the backfill methods.
+ */
+class VicinityScanner {
+private:
+
+	// An aligned block (M, = or X cigar ops) as [start, end) on the reference
+	struct Block {
+		int32_t start;
+		int32_t end;
+	};
+
+	struct Alignment {
+		int32_t start;
+		int32_t end;        // Inclusive, as BamAlignment::getEnd
+		uint32_t nbBlocks;
+	};
+
+	struct Pending {
+		JunctionPtr junction;
+		int32_t bound = 0;  // Upper bound when last checked
+		uint32_t nbUpstream = 0;
+		uint32_t nbDownstream = 0;
+		vector<uint32_t> donorLevels;
+		vector<uint32_t> acceptorLevels;
+	};
+
+	int32_t refLength;
+	int32_t streamStart;
+	int32_t lastPrune;
+	bool backfilling;
+
+	deque<Alignment> alignments;
+	deque<Block> blocks;
+
+	// Min-heap of junctions waiting for alignments, by upper bound
+	vector<Pending> pending;
+	vector<Pending> incomplete;
+
+	static bool laterBound(const Pending& a, const Pending& b);
+
+	// Leftmost position of an unspliced alignment that may affect the junction
+	static int32_t lowerBound(const Junction& j);
+
+	// Rightmost start position of an unspliced alignment that may affect the junction
+	static int32_t upperBound(const Junction& j);
+
+	void scan(Pending& p) const;
+
+	void complete(Pending& p);
+
+	void finalise(const int32_t pos);
+
+	void prune(const int32_t pos);
+
+public:
+
+	/**
+	 * Number of bases either side of a splice site used to calculate coverage
+	 */
+	static const int32_t COVERAGE_WINDOW = 2 * 10;
+
+	/**
+	 * @param _refLength Length of the target sequence
+	 * @param _streamStart Position from which the stream contains all
+	 * overlapping alignments
+	 */
+	VicinityScanner(const int32_t _refLength, const int32_t _streamStart);
+
+	/**
+	 * Adds a newly discovered junction.  Its anchors may still be extended by
+	 * alignments read later on.
+	 */
+	void addJunction(JunctionPtr junction);
+
+	/**
+	 * Moves the stream on to the given position, completing any junctions
+	 * which can no longer be affected by alignments from here onwards
+	 * @param pos Start position of the alignment just read, whether or not it
+	 * is unspliced
+	 */
+	void advance(const int32_t pos);
+
+	/**
+	 * Adds an unspliced mapped alignment.  Must be called in coordinate order.
+	 */
+	void addAlignment(const BamAlignment& al);
+
+	/**
+	 * Completes all pending junctions.  Call once the stream has been
+	 * exhausted.
+	 */
+	void finish();
+
+	/**
+	 * Number of junctions that are still waiting for alignments
+	 */
+	size_t getNbPending() const {
+		return pending.size();
+	}
+
+	/**
+	 * Leftmost position required by a junction waiting for alignments before
+	 * the start of the stream, or streamStart if none.  Only valid after finish.
+	 */
+	int32_t getBackfillStart() const;
+
+	/**
+	 * Adds an alignment which is not in the stream, i.e. it ends before
+	 * streamStart.  Must be called in coordinate order after finish.
+	 */
+	void addBackfillAlignment(const BamAlignment& al);
+
+	/**
+	 * Completes any junctions that were waiting for backfill alignments
+	 */
+	void finishBackfill();
+};
+
+}
@@ -0,0 +1,36 @@
+//  ********************************************************************
+//  This file is part of Portcullis.
+//
+//  Portcullis is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  Portcullis is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with Portcullis.  If not, see <http://www.gnu.org/licenses/>.
+//  *******************************************************************
+
+
+#include <algorithm>
+using std::max;
+
+#include <portcullis/arena.hpp>
+
+portcullis::Arena::Arena(const size_t blockSize) :
+	blockSize(blockSize), next(nullptr), remaining(0), nbBytes(0) {
+}
+
+void* portcullis::Arena::allocateFromNewBlock(const size_t bytes, const size_t alignment) {
+	// Objects bigger than a block get a block to themselves.  Memory from new[]
+	// is aligned for any fundamental type.
+	const size_t size = max(blockSize, bytes + alignment);
+	blocks.emplace_back(new char[size]);
+	next = blocks.back().get();
+	remaining = size;
+	return allocate(bytes, alignment);
+}
@@ -15,6 +15,8 @@
 //  along with Portcullis.  If not, see <http://www.gnu.org/licenses/>.
 //  *******************************************************************
 
+#include <algorithm>
+#include <cstring>
 #include <iostream>
 #include <memory>
 #include <sstream>
@@ -28,6 +30,12 @@ using std::string;
 using std::vector;
 using std::stringstream;
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 #include <boost/exception/all.hpp>
 #include <boost/filesystem/path.hpp>
 #include <boost/lexical_cast.hpp>
@@ -68,38 +76,56 @@ vector<CigarOp> portcullis::bam::CigarOp::createFullCigarFromString(const string
 	return c;
 }
 
+uint32_t portcullis::bam::CigarOp::pack() const {
+	const char* code = strchr(BAM_CIGAR_STR, type);
+	if (type == '\0' || code == nullptr) {
+		BOOST_THROW_EXCEPTION(BamException() << BamErrorInfo(string(
+								  "Unrecognised cigar op: ") + type));
+	}
+	return bam_cigar_gen(length, (uint32_t)(code - BAM_CIGAR_STR));
+}
+
 void portcullis::bam::BamAlignment::init() {
 	alFlag = b->core.flag;
 	position = b->core.pos;
 	refId = b->core.tid;
 	mateId = b->core.mtid;
 	matePos = b->core.mpos;
-	uint32_t* c = bam_get_cigar(b);
-	alignedLength = 0;
-	// Record the cigar in an easy to access format and calculate the aligned length
-	// along the way
-	cigar.clear();
-	for (uint32_t i = 0; i < b->core.n_cigar; i++) {
-		CigarOp op(bam_cigar_opchr(c[i]), bam_cigar_oplen(c[i]));
-		cigar.push_back(op);
-		if (CigarOp::opConsumesReference(op.type)) {
-			alignedLength += op.length;
-		}
+	editedCigar.clear();
+	cigarEdited = false;
+	alignedLengthKnown = false;
+	strandDecoded = false;
+}
+
+void portcullis::bam::BamAlignment::editCigar() {
+	if (!cigarEdited) {
+		// Edits don't change the aligned length, so make sure it is known
+		getEnd();
+		const uint32_t* c = bam_get_cigar(b);
+		editedCigar.assign(c, c + b->core.n_cigar);
+		cigarEdited = true;
 	}
-	// Determine actual read strand
-	// Try deriving from XS tag first if it's present.  If not then try to
-	// work it all out from the protocol suggested and the reverse strand
-	// flag.
-	Strand s = getXSStrand();
-	if (s != Strand::UNKNOWN) {
-		strand = s;
+}
+
+void portcullis::bam::BamAlignment::setCigar(const vector<CigarOp>& cig) {
+	editCigar();
+	editedCigar.clear();
+	for (const auto & op : cig) {
+		editedCigar.push_back(op.pack());
 	}
-	else {
-		strand = calcStrand();
+}
+
+vector<CigarOp> portcullis::bam::BamAlignment::getCigar() const {
+	const CigarView cigar = getCigarView();
+	vector<CigarOp> ops;
+	ops.reserve(cigar.size());
+	for (uint32_t i = 0; i < cigar.size(); i++) {
+		ops.push_back(cigar.at(i));
 	}
+	return ops;
 }
 
-portcullis::bam::Strand portcullis::bam::BamAlignment::calcStrand() {
+portcullis::bam::Strand portcullis::bam::BamAlignment::calcStrand() const {
 	Strand strand = Strand::UNKNOWN;
 	if (strandedness == Strandedness::FIRSTSTRAND) {
 		if (orientation == Orientation::FR) {
@@ -168,6 +194,9 @@ portcullis::bam::BamAlignment::BamAlignment() {
 	mateId = -1;
 	strandedness = Strandedness::UNKNOWN;
 	orientation = Orientation::UNKNOWN;
+	cigarEdited = false;
+	alignedLengthKnown = true;
+	strandDecoded = false;
 }
 
 /**
@@ -247,6 +276,33 @@ string portcullis::bam::BamAlignment::deriveName() const {
 			   qName;
 }
 
+static inline uint64_t mixNameCode(uint64_t h) {
+	// Finaliser from splitmix64
+	h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	h = (h ^ (h >> 27)) * 0x94D049BB133111EBULL;
+	return h ^ (h >> 31);
+}
+
+uint64_t portcullis::bam::BamAlignment::deriveNameCode() const {
+	const char* qName = bam_get_qname(b);
+	const size_t len = strlen(qName);
+	// Same mate suffixes as deriveName
+	const uint64_t mate = isPaired() ? (isFirstMate() ? 1 : isSecondMate() ? 2 : 3) : 0;
+	uint64_t h = mixNameCode(len ^ (mate << 56));
+	size_t i = 0;
+	for (; i + 8 <= len; i += 8) {
+		uint64_t w;
+		memcpy(&w, qName + i, 8);
+		h = mixNameCode(h ^ w);
+	}
+	if (i < len) {
+		uint64_t w = 0;
+		memcpy(&w, qName + i, len - i);
+		h = mixNameCode(h ^ w);
+	}
+	return h;
+}
+
 string portcullis::bam::BamAlignment::getQuerySeq() const {
 	stringstream ss;
 	for (int32_t i = 0; i < b->core.l_qseq; ++i) {
@@ -260,10 +316,12 @@ string portcullis::bam::BamAlignment::getQuerySeqAfterClipping() const {
 }
 
 string portcullis::bam::BamAlignment::getQuerySeqAfterClipping(const string& seq) const {
+	const CigarView cigar = getCigarView();
+	const uint32_t last = cigar.size() - 1;
 	int32_t start = getStart();
 	int32_t end = getEnd();
-	int32_t clippedStart = cigar.front().type == BAM_CIGAR_SOFTCLIP_CHAR ? start + cigar.front().length : start;
-	int32_t clippedEnd = cigar.back().type == BAM_CIGAR_SOFTCLIP_CHAR ? end - cigar.back().length : end;
+	int32_t clippedStart = cigar.op(0) == BAM_CSOFT_CLIP ? start + cigar.length(0) : start;
+	int32_t clippedEnd = cigar.op(last) == BAM_CSOFT_CLIP ? end - cigar.length(last) : end;
 	int32_t deltaStart = clippedStart - start;
 	int32_t deltaEnd = end - clippedEnd;
 	return seq.substr(deltaStart, seq.size() - deltaStart - deltaEnd + 1);
@@ -300,25 +358,6 @@ bool portcullis::bam::BamAlignment::calcIfProperPair(Orientation orientation) co
 	}
 }
 
-bool portcullis::bam::BamAlignment::isSplicedRead() const {
-	for (const auto & op : cigar) {
-		if (op.type == BAM_CIGAR_REFSKIP_CHAR) {
-			return true;
-		}
-	}
-	return false;
-}
-
-uint32_t portcullis::bam::BamAlignment::getNbJunctionsInRead() const {
-	int32_t nbJunctions = 0;
-	for (const auto & op : cigar) {
-		if (op.type == BAM_CIGAR_REFSKIP_CHAR) {
-			nbJunctions++;
-		}
-	}
-	return nbJunctions;
-}
-
 uint32_t portcullis::bam::BamAlignment::calcNbAlignedBases(int32_t start, int32_t end, bool includeSoftClips) const {
 	if (start > getEnd() || end < position) {
 		string align = this->toString();
@@ -328,12 +367,14 @@ uint32_t portcullis::bam::BamAlignment::calcNbAlignedBases(int32_t start, int32_
 	}
 	int32_t count = 0;
 	int32_t pos = position;
-	for (const auto & op : cigar) {
+	const CigarView cigar = getCigarView();
+	for (uint32_t k = 0; k < cigar.size(); k++) {
+		const CigarOp op = cigar.at(k);
 		if (pos > end) {
 			break;
 		}
 		// Include softclips in this calculation
-		if (CigarOp::opConsumesReference(op.type) || (includeSoftClips && op.type == BAM_CIGAR_SOFTCLIP_CHAR)) {
+		if (cigar.consumesReference(k) || (includeSoftClips && op.type == BAM_CIGAR_SOFTCLIP_CHAR)) {
 			if (pos >= start) {
 				count += op.length;
 			}
@@ -355,9 +396,11 @@ string portcullis::bam::BamAlignment::getPaddedQuerySeq(const string& query_seq,
 	int32_t rPos = position;
 	string query = include_soft_clips ? query_seq : this->getQuerySeqAfterClipping(query_seq);
 	stringstream ss;
-	for (const auto & op : cigar) {
-		bool consumesRef = CigarOp::opConsumesReference(op.type);
-		bool consumesQuery = CigarOp::opConsumesQuery(op.type) && (include_soft_clips || op.type != BAM_CIGAR_SOFTCLIP_CHAR);
+	const CigarView cigar = getCigarView();
+	for (uint32_t k = 0; k < cigar.size(); k++) {
+		const CigarOp op = cigar.at(k);
+		bool consumesRef = cigar.consumesReference(k);
+		bool consumesQuery = cigar.consumesQuery(k) && (include_soft_clips || op.type != BAM_CIGAR_SOFTCLIP_CHAR);
 		// Skips any cigar ops before start position
 		if (rPos < start) {
 			if (consumesRef) rPos += op.length;
@@ -429,9 +472,11 @@ string portcullis::bam::BamAlignment::getPaddedGenomeSeq(const string& genomeSeq
 								  "Query end position was beyond genomic region end position.  Query end: ") + lexical_cast<string>(q_end) + "; Genomic end: " + lexical_cast<string>(end)));
 	}
 	stringstream ss;
-	for (const auto & op : cigar) {
-		bool consumesRef = CigarOp::opConsumesReference(op.type);
-		bool consumesQuery = CigarOp::opConsumesQuery(op.type) && (include_soft_clips || op.type != BAM_CIGAR_SOFTCLIP_CHAR);
+	const CigarView cigar = getCigarView();
+	for (uint32_t k = 0; k < cigar.size(); k++) {
+		const CigarOp op = cigar.at(k);
+		bool consumesRef = cigar.consumesReference(k);
+		bool consumesQuery = cigar.consumesQuery(k) && (include_soft_clips || op.type != BAM_CIGAR_SOFTCLIP_CHAR);
 		// Skips any cigar ops before start position
 		if (rPos < q_start) {
 			if (consumesRef) rPos += op.length;
@@ -470,13 +515,140 @@ string portcullis::bam::BamAlignment::getPaddedGenomeSeq(const string& genomeSeq
 	return ss.str();
 }
 
+/**
+ * Adds a block of compared positions to the match stats
+ * @param stats Stats to update
+ * @param mismatches Bit i is set if position i in the block is a mismatch
+ * @param width Number of positions in the block, up to 64
+ */
+static void addBlock(portcullis::bam::MatchStats& stats, const uint64_t mismatches, const uint32_t width) {
+	stats.nbPositions += width;
+	if (mismatches == 0) {
+		if (stats.nbMismatches == 0) {
+			stats.nbMatchesFromStart += width;
+		}
+		stats.nbMatchesFromEnd += width;
+		return;
+	}
+	if (stats.nbMismatches == 0) {
+		stats.nbMatchesFromStart += __builtin_ctzll(mismatches);
+	}
+	stats.nbMismatches += __builtin_popcountll(mismatches);
+	stats.nbMatchesFromEnd = width - 1 - (63 - __builtin_clzll(mismatches));
+}
+
+static void addMismatches(portcullis::bam::MatchStats& stats, const uint32_t n) {
+	if (n > 0) {
+		stats.nbPositions += n;
+		stats.nbMismatches += n;
+		stats.nbMatchesFromEnd = 0;
+	}
+}
+
+/**
+ * Compares n bases of a packed BAM read sequence, starting at base qPos, with n
+ * reference bases held as nt16 codes.  The read packs two bases per byte, so
+ * the bases are unpacked a register at a time and compared with byte compares.
+ */
+static void compareBases(const uint8_t* query, const uint32_t qPos, const uint8_t* ref, const uint32_t n, portcullis::bam::MatchStats& stats) {
+	uint32_t i = 0;
+	// Get to a byte boundary in the read first
+	if ((qPos & 1) && n > 0) {
+		addBlock(stats, bam_seqi(query, qPos) != ref[0] ? 1 : 0, 1);
+		i = 1;
+	}
+	const uint8_t* q = query + ((qPos + i) >> 1);
+#if defined(__AVX2__)
+	const __m128i lowNibbles32 = _mm_set1_epi8(0x0F);
+	for (; i + 32 <= n; i += 32, q += 16) {
+		const __m128i packed = _mm_loadu_si128((const __m128i*)q);
+		const __m128i hi = _mm_and_si128(_mm_srli_epi16(packed, 4), lowNibbles32);
+		const __m128i lo = _mm_and_si128(packed, lowNibbles32);
+		const __m256i bases = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_unpacklo_epi8(hi, lo)), _mm_unpackhi_epi8(hi, lo), 1);
+		const __m256i eq = _mm256_cmpeq_epi8(bases, _mm256_loadu_si256((const __m256i*)(ref + i)));
+		addBlock(stats, ~(uint32_t)_mm256_movemask_epi8(eq), 32);
+	}
+#endif
+#if defined(__SSE2__)
+	const __m128i lowNibbles = _mm_set1_epi8(0x0F);
+	for (; i + 16 <= n; i += 16, q += 8) {
+		const __m128i packed = _mm_loadl_epi64((const __m128i*)q);
+		const __m128i hi = _mm_and_si128(_mm_srli_epi16(packed, 4), lowNibbles);
+		const __m128i lo = _mm_and_si128(packed, lowNibbles);
+		const __m128i eq = _mm_cmpeq_epi8(_mm_unpacklo_epi8(hi, lo), _mm_loadu_si128((const __m128i*)(ref + i)));
+		addBlock(stats, ~(uint32_t)_mm_movemask_epi8(eq) & 0xFFFF, 16);
+	}
+#endif
+	// Whatever is left, up to 64 bases at a time
+	while (i < n) {
+		const uint32_t width = std::min<uint32_t>(n - i, 64);
+		uint64_t mismatches = 0;
+		for (uint32_t j = 0; j < width; j++) {
+			if (bam_seqi(query, qPos + i + j) != ref[i + j]) {
+				mismatches |= (uint64_t)1 << j;
+			}
+		}
+		addBlock(stats, mismatches, width);
+		i += width;
+	}
+}
+
+portcullis::bam::MatchStats portcullis::bam::BamAlignment::compareWithReference(const uint8_t* ref, const int32_t refStart, const size_t refLength, const int32_t start, const int32_t end) const {
+	if (start > getEnd() || end < position)
+		BOOST_THROW_EXCEPTION(BamException() << BamErrorInfo(string(
+								  "Found an alignment that does not have a presence in the requested region")));
+	MatchStats stats;
+	const uint8_t* query = bam_get_seq(b);
+	const CigarView cigar = getCigarView();
+	int32_t rPos = position;
+	int32_t qPos = 0;
+	for (uint32_t k = 0; k < cigar.size(); k++) {
+		const int op = cigar.op(k);
+		const int32_t len = cigar.length(k);
+		const bool consumesRef = cigar.consumesReference(k);
+		const bool consumesQuery = cigar.consumesQuery(k);
+		// Skips soft clips and any cigar ops before the start position
+		if (rPos < start || op == BAM_CSOFT_CLIP) {
+			if (consumesRef) rPos += len;
+			if (consumesQuery) qPos += len;
+			continue;
+		}
+		// Stop once we get to the end of the region, and make sure we don't end on a refskip that exceeds our limit
+		if ((rPos > end && op != BAM_CINS) || (op == BAM_CREF_SKIP && rPos + len > end)) break;
+		// Don't compare anything that runs off the end cap
+		const int32_t n = consumesRef && rPos + len > end ? end - rPos + 1 : len;
+		if (consumesQuery && consumesRef) {
+			if (qPos + n > b->core.l_qseq || rPos < refStart || rPos - refStart + n > (int64_t)refLength) {
+				BOOST_THROW_EXCEPTION(BamException() << BamErrorInfo(string(
+										  "Can't compare cigar op with the reference.")
+									  + "\nLimits: " + lexical_cast<string>(start) + "," + lexical_cast<string>(end)
+									  + "\nReference region: " + lexical_cast<string>(refStart) + "," + lexical_cast<string>(refStart + (int64_t)refLength - 1)
+									  + "\nCigar: " + getCigarAsString()
+									  + "\nCurrent op: " + cigar.at(k).toString()
+									  + "\nCurrent position in query: " + lexical_cast<string>(qPos)
+									  + "\nCurrent position in reference: " + lexical_cast<string>(rPos)));
+			}
+			compareBases(query, qPos, ref + (rPos - refStart), n, stats);
+		}
+		else if (consumesQuery || consumesRef) {
+			// Inserted and deleted bases are padded on the other side, so never match
+			addMismatches(stats, n);
+		}
+		if (consumesRef) rPos += len;
+		if (consumesQuery) qPos += len;
+	}
+	return stats;
+}
+
 string portcullis::bam::BamAlignment::toString() const {
 	return toString(false);
 }
 
 string portcullis::bam::BamAlignment::toString(bool afterClipping) const {
-	uint32_t start = afterClipping && cigar.front().type == BAM_CIGAR_SOFTCLIP_CHAR ? position + cigar.front().length : position;
-	uint32_t end = afterClipping && cigar.back().type == BAM_CIGAR_SOFTCLIP_CHAR ? getEnd() - cigar.back().length : getEnd();
+	const CigarView cigar = getCigarView();
+	const uint32_t last = cigar.size() - 1;
+	uint32_t start = afterClipping && cigar.op(0) == BAM_CSOFT_CLIP ? position + cigar.length(0) : position;
+	uint32_t end = afterClipping && cigar.op(last) == BAM_CSOFT_CLIP ? getEnd() - cigar.length(last) : getEnd();
 	stringstream ss;
 	ss << refId << "(" << start << "-" << end << ")" << (this->isReverseStrand() ? "-" : "+");
 	return ss.str();
@@ -50,10 +50,13 @@ using portcullis::bam::BamAlignmentPtr;
 
 // ****** BamReader methods *********
 
-portcullis::bam::BamReader::BamReader(const path& _bamFile) {
+portcullis::bam::BamReader::BamReader(const path& _bamFile) : BamReader(_bamFile, 1) {
+}
+
+portcullis::bam::BamReader::BamReader(const path& _bamFile, const uint16_t _threads) {
 	bamFile = _bamFile;
+	threads = _threads;
 	header = nullptr;
-	index = nullptr;
 	iter = nullptr;
 	c = nullptr;
 }
@@ -65,13 +68,8 @@ portcullis::bam::BamReader::~BamReader() {
 	if (c != nullptr) {
 		bam_destroy1(c);
 	}
-	if (index != nullptr) {
-		hts_idx_destroy(index);
-	}
 	if (iter != nullptr) {
-		free(iter->off);
-		free(iter->bins.a);
-		free(iter);
+		hts_itr_destroy(iter);
 	}
 }
 
@@ -84,17 +82,35 @@ void portcullis::bam::BamReader::open() {
 	}
 	// Load header
 	header = bam_hdr_read(fp);
-	// Load the index
-	index = bam_index_load(bamFile.c_str());
+	// Load the index, if we haven't been given one already
+	if (index == nullptr) {
+		index = loadIndex(bamFile);
+	}
 	// Initialise an empty bam alignment
 	c = bam_init1();
 	b.setRaw(c);
+	// Start decompressing the alignments in the background if requested.  Only
+	// applies to real BGZF files on little endian machines, otherwise we fall
+	// back to htslib.
+	if (threads > 1 && fp->is_compressed == 1 && !fp->is_gzip && !ed_is_big()) {
+		pipeline = unique_ptr<ParallelBgzfReader>(new ParallelBgzfReader(bamFile, threads));
+		pipeline->open(bgzf_tell(fp));
+	}
 }
 
 void portcullis::bam::BamReader::close() {
+	if (pipeline != nullptr) {
+		pipeline->close();
+		pipeline.reset();
+	}
 	bgzf_close(fp);
 }
 
+portcullis::bam::BamIndexPtr portcullis::bam::BamReader::loadIndex(const path& bamFile) {
+	hts_idx_t* idx = bam_index_load(bamFile.c_str());
+	return idx == nullptr ? BamIndexPtr() : BamIndexPtr(idx, hts_idx_destroy);
+}
+
 
 /**
  * Creates a list of the reference target sequences stored in this BAM
@@ -132,7 +148,7 @@ shared_ptr<RefSeqPtrIndexMap> portcullis::bam::BamReader::createRefMap(const Ref
 }
 
 bool portcullis::bam::BamReader::next() {
-	bool res = bam_iter_read(fp, iter, c) >= 0;
+	bool res = (iter == nullptr && pipeline != nullptr ? pipeline->readBam(c) : bam_iter_read(fp, iter, c)) >= 0;
 	b.setRaw(c);
 	return res;
 }
@@ -142,9 +158,21 @@ const BamAlignment& portcullis::bam::BamReader::current() const {
 }
 
 void portcullis::bam::BamReader::setRegion(const int32_t seqIndex, const int32_t start, const int32_t end) {
-	iter = sam_itr_queryi(index, seqIndex, start, end);
+	// Free up the iterator from any previous query before replacing it
+	if (iter != nullptr) {
+		hts_itr_destroy(iter);
+	}
+	iter = sam_itr_queryi(index.get(), seqIndex, start, end);
 }
 
+int64_t portcullis::bam::BamReader::getNbMappedAlignments(const int32_t seqIndex) const {
+	if (index == nullptr || seqIndex < 0 || seqIndex >= header->n_targets) {
+		return -1;
+	}
+	uint64_t mapped = 0;
+	uint64_t unmapped = 0;
+	return hts_idx_get_stat(index.get(), seqIndex, &mapped, &unmapped) == 0 ? (int64_t)mapped : -1;
+}
 
 bool portcullis::bam::BamReader::isCoordSortedBam() {
 	string headerText = header->text;
@@ -0,0 +1,476 @@
+//  ********************************************************************
+//  This file is part of Portcullis.
+//
+//  Portcullis is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  Portcullis is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with Portcullis.  If not, see <http://www.gnu.org/licenses/>.
+//  *******************************************************************
+
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <queue>
+#include <set>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+using std::cerr;
+using std::endl;
+using std::exception_ptr;
+using std::greater;
+using std::max;
+using std::pair;
+using std::priority_queue;
+using std::set;
+using std::string;
+using std::stringstream;
+using std::thread;
+using std::unique_ptr;
+using std::vector;
+
+#include <boost/algorithm/string.hpp>
+#include <boost/filesystem.hpp>
+namespace bfs = boost::filesystem;
+
+#include <htslib/bgzf.h>
+#include <htslib/sam.h>
+
+#include <portcullis/bam/bam_reader.hpp>
+#include <portcullis/bam/bam_writer.hpp>
+using portcullis::bam::BamReader;
+using portcullis::bam::BamWriter;
+
+#include <portcullis/bam/bam_sorter.hpp>
+
+static const size_t DEFAULT_MEMORY_LIMIT = (size_t)1 << 30;
+
+// Stops each buffer from being so small that every record becomes a run
+static const size_t MIN_BUFFER_SIZE = (size_t)1 << 16;
+
+// Size of the fixed length part of a record, including the block size
+static const size_t RECORD_PREFIX_SIZE = 36;
+
+/**
+ * Returns the value of a field, such as ID, in a tab separated header line, or
+ * an empty string if there isn't one
+ */
+static string headerField(const string& line, const string& tag) {
+	vector<string> fields;
+	boost::split(fields, line, boost::is_any_of("\t"));
+	for (const auto & f : fields) {
+		if (f.compare(0, tag.size() + 1, tag + ":") == 0) {
+			return f.substr(tag.size() + 1);
+		}
+	}
+	return string("");
+}
+
+/**
+ * Appends a record to the buffer in BAM's on-disk layout, with its targets
+ * mapped to those of the output
+ */
+static void appendRecord(vector<uint8_t>& records, const bam1_t* b, const vector<int32_t>& targetMap, int32_t& tid) {
+	const bam1_core_t& c = b->core;
+	tid = c.tid < 0 ? -1 : targetMap[c.tid];
+	const int32_t mtid = c.mtid < 0 ? -1 : targetMap[c.mtid];
+	const uint32_t blockLength = b->l_data + 32;
+	uint32_t x[9];
+	x[0] = blockLength;
+	x[1] = tid;
+	x[2] = c.pos;
+	x[3] = (uint32_t)c.bin << 16 | c.qual << 8 | c.l_qname;
+	x[4] = (uint32_t)c.flag << 16 | c.n_cigar;
+	x[5] = c.l_qseq;
+	x[6] = mtid;
+	x[7] = c.mpos;
+	x[8] = c.isize;
+	const size_t offset = records.size();
+	records.resize(offset + RECORD_PREFIX_SIZE + b->l_data);
+	memcpy(&records[offset], x, RECORD_PREFIX_SIZE);
+	memcpy(&records[offset + RECORD_PREFIX_SIZE], b->data, b->l_data);
+}
+
+static uint32_t recordSize(const uint8_t* record) {
+	uint32_t blockLength;
+	memcpy(&blockLength, record, sizeof(uint32_t));
+	return blockLength + sizeof(uint32_t);
+}
+
+/**
+ * Stable LSD radix sort on the keys, a byte at a time.  Bytes that are the same
+ * for every key, such as the high bytes of the target index, are skipped.
+ */
+template<typename T>
+static void radixSort(vector<T>& entries) {
+	if (entries.size() < 2) {
+		return;
+	}
+	size_t counts[8][256];
+	memset(counts, 0, sizeof(counts));
+	for (const auto & e : entries) {
+		for (size_t d = 0; d < 8; d++) {
+			counts[d][(e.key >> (d * 8)) & 0xFF]++;
+		}
+	}
+	vector<T> sorted(entries.size());
+	for (size_t d = 0; d < 8; d++) {
+		const size_t shift = d * 8;
+		if (counts[d][(entries[0].key >> shift) & 0xFF] == entries.size()) {
+			continue;
+		}
+		size_t offsets[256];
+		size_t total = 0;
+		for (size_t i = 0; i < 256; i++) {
+			offsets[i] = total;
+			total += counts[d][i];
+		}
+		for (const auto & e : entries) {
+			sorted[offsets[(e.key >> shift) & 0xFF]++] = e;
+		}
+		std::swap(entries, sorted);
+	}
+}
+
+portcullis::bam::BamSorter::BamSorter(const vector<path>& inputs, const path& output) :
+	inputs(inputs), output(output), threads(1), memoryLimit(DEFAULT_MEMORY_LIMIT), trustSorted(true),
+	indexing(false), useCsi(false), header(nullptr), nbRecords(0), nbRuns(0) {
+	tempDir = output.has_parent_path() ? output.parent_path() : path(".");
+}
+
+portcullis::bam::BamSorter::~BamSorter() {
+	removeRuns();
+	if (header != nullptr) {
+		bam_hdr_destroy(header);
+	}
+}
+
+void portcullis::bam::BamSorter::removeRuns() {
+	for (const auto & run : runs) {
+		bfs::remove(run);
+	}
+	runs.clear();
+}
+
+void portcullis::bam::BamSorter::readHeaders() {
+	if (inputs.empty()) {
+		BOOST_THROW_EXCEPTION(BamException() << BamErrorInfo(string(
+								  "No BAM files to sort")));
+	}
+	if (header != nullptr) {
+		bam_hdr_destroy(header);
+		header = nullptr;
+	}
+	targetMaps.clear();
+	presorted.clear();
+	vector<string> lines;
+	set<string> ids;
+	for (const auto & input : inputs) {
+		BGZF* fp = bgzf_open(input.c_str(), "r");
+		bam_hdr_t* h = fp != nullptr ? bam_hdr_read(fp) : nullptr;
+		if (h == nullptr) {
+			if (fp != nullptr) {
+				bgzf_close(fp);
+			}
+			BOOST_THROW_EXCEPTION(BamException() << BamErrorInfo(string(
+									  "Could not read header from BAM file: ") + input.string()));
+		}
+		string text(h->text, strnlen(h->text, h->l_text));
+		vector<string> inputLines;
+		boost::split(inputLines, text, boost::is_any_of("\n"));
+		bool identical = true;
+		vector<int32_t> targetMap(h->n_targets);
+		if (header == nullptr) {
+			header = bam_hdr_dup(h);
+			for (int32_t i = 0; i < h->n_targets; i++) {
+				targetMap[i] = i;
+			}
+			for (const auto & line : inputLines) {
+				if (!line.empty()) {
+					lines.push_back(line);
+					if (boost::starts_with(line, "@RG\t") || boost::starts_with(line, "@PG\t")) {
+						ids.insert(line.substr(0, 3) + headerField(line, "ID"));
+					}
+				}
+			}
+		}
+		else {
+			// Match targets to the first header by name
+			for (int32_t i = 0; i < h->n_targets; i++) {
+				const int32_t tid = bam_name2id(header, h->target_name[i]);
+				if (tid < 0 || header->target_len[tid] != h->target_len[i]) {
+					const string name = h->target_name[i];
+					bam_hdr_destroy(h);
+					bgzf_close(fp);
+					BOOST_THROW_EXCEPTION(BamException() << BamErrorInfo(string(
+											  "Target sequence ") + name + " in " + input.string() +
+										  " doesn't match any target in " + inputs[0].string()));
+				}
+				targetMap[i] = tid;
+				identical = identical && tid == i;
+			}
+			identical = identical && h->n_targets == header->n_targets;
+			// Keep read groups and programs that aren't already in the header
+			for (const auto & line : inputLines) {
+				if (boost::starts_with(line, "@RG\t") || boost::starts_with(line, "@PG\t")) {
+					const string id = line.substr(0, 3) + headerField(line, "ID");
+					if (ids.insert(id).second) {
+						lines.push_back(line);
+					}
+				}
+			}
+		}
+		presorted.push_back(trustSorted && identical && text.find("SO:coordinate") != string::npos);
+		targetMaps.push_back(targetMap);
+		bam_hdr_destroy(h);
+		bgzf_close(fp);
+	}
+	// Mark the output as sorted
+	if (!lines.empty() && boost::starts_with(lines[0], "@HD")) {
+		vector<string> fields;
+		boost::split(fields, lines[0], boost::is_any_of("\t"));
+		lines[0].clear();
+		for (const auto & f : fields) {
+			if (!boost::starts_with(f, "SO:")) {
+				lines[0] += f + "\t";
+			}
+		}
+		lines[0] += "SO:coordinate";
+	}
+	else {
+		lines.insert(lines.begin(), "@HD\tVN:1.4\tSO:coordinate");
+	}
+	const string text = boost::join(lines, "\n") + "\n";
+	free(header->text);
+	header->l_text = text.size();
+	header->text = (char*)malloc(text.size() + 1);
+	memcpy(header->text, text.c_str(), text.size() + 1);
+}
+
+void portcullis::bam::BamSorter::spill(vector<uint8_t>& records, vector<Entry>& entries, const path& run) const {
+	radixSort(entries);
+	// Runs are only read back once, so favour speed over size
+	BGZF* fp = bgzf_open(run.c_str(), "w1");
+	if (fp == nullptr) {
+		BOOST_THROW_EXCEPTION(BamException() << BamErrorInfo(string(
+								  "Could not open temporary file for sorting BAM: ") + run.string()));
+	}
+	if (threads > 1) {
+		bgzf_mt(fp, threads, 256);
+	}
+	bool ok = bam_hdr_write(fp, header) == 0;
+	for (size_t i = 0; ok && i < entries.size(); i++) {
+		const uint8_t* record = &records[entries[i].offset];
+		ok = bgzf_write(fp, record, recordSize(record)) >= 0;
+	}
+	if (bgzf_close(fp) < 0 || !ok) {
+		BOOST_THROW_EXCEPTION(BamException() << BamErrorInfo(string(
+								  "Could not write temporary file for sorting BAM: ") + run.string()));
+	}
+	records.clear();
+	entries.clear();
+}
+
+path portcullis::bam::BamSorter::merge(const vector<path>& sortedInputs, const vector<uint8_t>& records, vector<Entry>& entries) {
+	radixSort(entries);
+	// The sorted inputs, then the runs in the order they were written, then
+	// the records in memory.  Ties go to the earliest source.
+	vector<path> sources(sortedInputs);
+	sources.insert(sources.end(), runs.begin(), runs.end());
+	nbRuns = sources.size() + (entries.empty() ? 0 : 1);
+	vector<unique_ptr<BamReader>> readers;
+	for (const auto & s : sources) {
+		readers.push_back(unique_ptr<BamReader>(new BamReader(s)));
+		readers.back()->open();
+	}
+	const size_t memorySource = readers.size();
+	size_t nextEntry = 0;
+	typedef pair<uint64_t, size_t> Head;
+	priority_queue<Head, vector<Head>, greater<Head>> heads;
+	auto advance = [&](const size_t source) {
+		if (source == memorySource) {
+			if (nextEntry < entries.size()) {
+				heads.push(Head(entries[nextEntry].key, source));
+			}
+		}
+		else if (readers[source]->next()) {
+			const bam1_core_t& c = readers[source]->current().getRaw()->core;
+			heads.push(Head(sortKey(c.tid, c.pos, c.flag & BAM_FREVERSE), source));
+		}
+	};
+	for (size_t i = 0; i <= memorySource; i++) {
+		advance(i);
+	}
+	// Write to a temporary name, so a failed sort doesn't leave a partial output
+	const path tmpOutput = path(output.string() + ".tmp");
+	BamWriter writer(tmpOutput);
+	writer.setThreads(threads);
+	if (indexing) {
+		writer.enableIndexing(useCsi);
+	}
+	writer.open(header);
+	bool ok = true;
+	vector<uint64_t> lastKeys(memorySource, 0);
+	string unsorted;
+	nbRecords = 0;
+	// Errors while writing, such as from indexing, are rethrown once the
+	// partial output has been removed
+	exception_ptr writeError;
+	try {
+		while (ok && !heads.empty()) {
+			const Head head = heads.top();
+			heads.pop();
+			if (head.second == memorySource) {
+				ok = writer.writeRecord(&records[entries[nextEntry++].offset]) >= 0;
+			}
+			else {
+				if (head.first < lastKeys[head.second]) {
+					unsorted = sources[head.second].string();
+					break;
+				}
+				lastKeys[head.second] = head.first;
+				ok = writer.write(readers[head.second]->current().getRaw()) >= 0;
+			}
+			nbRecords++;
+			advance(head.second);
+		}
+	}
+	catch (...) {
+		writeError = std::current_exception();
+		ok = false;
+	}
+	for (auto & r : readers) {
+		r->close();
+	}
+	try {
+		writer.close();
+	}
+	catch (...) {
+		ok = false;
+	}
+	if (!ok || !unsorted.empty()) {
+		bfs::remove(tmpOutput);
+		if (indexing) {
+			bfs::remove(writer.getIndexFile());
+		}
+		if (writeError) {
+			std::rethrow_exception(writeError);
+		}
+		if (!unsorted.empty()) {
+			return path(unsorted);
+		}
+		BOOST_THROW_EXCEPTION(BamException() << BamErrorInfo(string(
+								  "Could not write output BAM file: ") + tmpOutput.string()));
+	}
+	bfs::rename(tmpOutput, output);
+	if (indexing) {
+		bfs::rename(writer.getIndexFile(), getIndexFile());
+	}
+	return path();
+}
+
+void portcullis::bam::BamSorter::sort() {
+	readHeaders();
+	// An input marked as sorted that isn't is only noticed while merging.  It
+	// is then sorted like any other input, and the merge is done again.
+	path unsorted = sortAndMerge();
+	while (!unsorted.empty()) {
+		cerr << "Warning: BAM file is marked as coordinate sorted but isn't, sorting it: " << unsorted << endl;
+		for (size_t i = 0; i < inputs.size(); i++) {
+			if (inputs[i] == unsorted) {
+				presorted[i] = false;
+			}
+		}
+		unsorted = sortAndMerge();
+	}
+}
+
+path portcullis::bam::BamSorter::sortAndMerge() {
+	removeRuns();
+	const size_t bufferLimit = max(memoryLimit / 2, MIN_BUFFER_SIZE);
+	// One buffer is filled while the other is sorted and written to disk
+	vector<uint8_t> records[2];
+	vector<Entry> entries[2];
+	size_t current = 0;
+	records[current].reserve(bufferLimit);
+	thread spiller;
+	exception_ptr spillError;
+	auto waitForSpill = [&]() {
+		if (spiller.joinable()) {
+			spiller.join();
+		}
+		if (spillError) {
+			std::rethrow_exception(spillError);
+		}
+	};
+	vector<path> sortedInputs;
+	try {
+		for (size_t i = 0; i < inputs.size(); i++) {
+			if (presorted[i]) {
+				sortedInputs.push_back(inputs[i]);
+				continue;
+			}
+			BamReader reader(inputs[i], threads);
+			reader.open();
+			while (reader.next()) {
+				Entry e;
+				int32_t tid;
+				const bam1_t* b = reader.current().getRaw();
+				e.offset = records[current].size();
+				appendRecord(records[current], b, targetMaps[i], tid);
+				e.key = sortKey(tid, b->core.pos, b->core.flag & BAM_FREVERSE);
+				entries[current].push_back(e);
+				if (records[current].size() + entries[current].size() * sizeof(Entry) >= bufferLimit) {
+					// The other buffer must be written before it can be refilled
+					waitForSpill();
+					runs.push_back(tempDir / bfs::unique_path("portcullis_sort_%%%%-%%%%-%%%%-%%%%.bam"));
+					vector<uint8_t>& r = records[current];
+					vector<Entry>& en = entries[current];
+					const path run = runs.back();
+					spiller = thread([this, &r, &en, run, &spillError]() {
+						try {
+							spill(r, en, run);
+						}
+						catch (...) {
+							spillError = std::current_exception();
+						}
+					});
+					current = 1 - current;
+					records[current].reserve(bufferLimit);
+				}
+			}
+			reader.close();
+		}
+		waitForSpill();
+	}
+	catch (...) {
+		if (spiller.joinable()) {
+			spiller.join();
+		}
+		removeRuns();
+		throw;
+	}
+	path unsorted;
+	try {
+		unsorted = merge(sortedInputs, records[current], entries[current]);
+	}
+	catch (...) {
+		removeRuns();
+		throw;
+	}
+	removeRuns();
+	return unsorted;
+}
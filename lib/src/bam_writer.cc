@@ -15,15 +15,19 @@
 //  along with Portcullis.  If not, see <http://www.gnu.org/licenses/>.
 //  *******************************************************************
 
+#include <algorithm>
+#include <cstring>
 #include <memory>
 #include <sstream>
 #include <string>
+#include <thread>
 #include <vector>
 using std::make_shared;
 using std::shared_ptr;
 using std::string;
 using std::vector;
 using std::stringstream;
+using std::thread;
 
 #include <boost/exception/all.hpp>
 #include <boost/filesystem/path.hpp>
@@ -36,12 +40,25 @@ using boost::lexical_cast;
 #include <htslib/faidx.h>
 #include <htslib/sam.h>
 #include <htslib/bgzf.h>
+#include <htslib/hts.h>
 
 #include <portcullis/bam/bam_alignment.hpp>
 using portcullis::bam::BamAlignment;
 
 #include <portcullis/bam/bam_writer.hpp>
 
+// Size of the fixed length part of a record, including the block size
+static const size_t RECORD_PREFIX_SIZE = 36;
+
+// The number of blocks each thread compresses per batch when indexing
+static const size_t BLOCKS_PER_THREAD = 16;
+
+portcullis::bam::BamWriter::~BamWriter() {
+	if (idx != nullptr) {
+		hts_idx_destroy(idx);
+	}
+}
+
 void portcullis::bam::BamWriter::open(bam_hdr_t* header) {
 	// split
 	fp = bgzf_open(bamFile.c_str(), "w");
@@ -49,17 +66,198 @@ void portcullis::bam::BamWriter::open(bam_hdr_t* header) {
 		BOOST_THROW_EXCEPTION(BamException() << BamErrorInfo(string(
 								  "Could not open output BAM file: ") + bamFile.string()));
 	}
-	if (bam_hdr_write(fp, header) != 0) {
+	// When indexing the writer compresses the records itself
+	if (threads > 1 && !indexing) {
+		bgzf_mt(fp, threads, 256);
+	}
+	if (bam_hdr_write(fp, header) != 0 || (indexing && bgzf_flush(fp) != 0)) {
 		BOOST_THROW_EXCEPTION(BamException() << BamErrorInfo(string(
 								  "Could not write header into: ") + bamFile.string()));
 	}
+	if (indexing) {
+		// Same index parameters as samtools index
+		int minShift = 14;
+		int nbLevels = 5;
+		if (useCsi) {
+			int64_t maxLength = 0;
+			for (int32_t i = 0; i < header->n_targets; i++) {
+				maxLength = std::max<int64_t>(maxLength, header->target_len[i]);
+			}
+			maxLength += 256;
+			nbLevels = 0;
+			for (int64_t s = 1 << minShift; maxLength > s; s <<= 3) {
+				nbLevels++;
+			}
+		}
+		nbBlocks = 0;
+		address = bgzf_tell(fp) >> 16;
+		block.reserve(BGZF_BLOCK_SIZE);
+		idx = hts_idx_init(header->n_targets, useCsi ? HTS_FMT_CSI : HTS_FMT_BAI, address << 16, minShift, nbLevels);
+	}
 }
 
 int portcullis::bam::BamWriter::write(const BamAlignment& ba) {
-	return bam_write1(fp, ba.getRaw());
+	return write(ba.getRaw());
+}
+
+int portcullis::bam::BamWriter::write(const bam1_t* b) {
+	if (!indexing) {
+		return bam_write1(fp, b);
+	}
+	const bam1_core_t& c = b->core;
+	uint32_t x[9];
+	x[0] = b->l_data + 32;
+	x[1] = c.tid;
+	x[2] = c.pos;
+	x[3] = (uint32_t)c.bin << 16 | c.qual << 8 | c.l_qname;
+	x[4] = (uint32_t)c.flag << 16 | c.n_cigar;
+	x[5] = c.l_qseq;
+	x[6] = c.mtid;
+	x[7] = c.mpos;
+	x[8] = c.isize;
+	return append((const uint8_t*)x, b->data, b->l_data, c.tid, c.pos, bam_endpos(b), !(c.flag & BAM_FUNMAP));
+}
+
+int portcullis::bam::BamWriter::writeRecord(const uint8_t* record) {
+	uint32_t x[9];
+	memcpy(x, record, RECORD_PREFIX_SIZE);
+	if (!indexing) {
+		return bgzf_write(fp, record, x[0] + sizeof(uint32_t));
+	}
+	// Work out the end position in the same way as bam_endpos
+	const int32_t tid = x[1];
+	const int32_t pos = x[2];
+	const uint16_t flag = x[4] >> 16;
+	const uint32_t nbCigarOps = x[4] & 0xffff;
+	int32_t end = pos + 1;
+	if (!(flag & BAM_FUNMAP) && nbCigarOps > 0) {
+		const uint8_t* cigar = record + RECORD_PREFIX_SIZE + (x[3] & 0xff);
+		end = pos;
+		for (uint32_t i = 0; i < nbCigarOps; i++) {
+			uint32_t op;
+			memcpy(&op, cigar + i * sizeof(uint32_t), sizeof(uint32_t));
+			if (bam_cigar_type(bam_cigar_op(op)) & 2) {
+				end += bam_cigar_oplen(op);
+			}
+		}
+	}
+	return append(record, record + RECORD_PREFIX_SIZE, x[0] - 32, tid, pos, end, !(flag & BAM_FUNMAP));
+}
+
+int portcullis::bam::BamWriter::append(const uint8_t* prefix, const uint8_t* data, const size_t length,
+									   const int32_t tid, const int32_t beg, const int32_t end, const bool mapped) {
+	const size_t size = RECORD_PREFIX_SIZE + length;
+	// Start a new block if the record doesn't fit in this one, as bam_write1
+	// does, so that most records can be read without crossing blocks
+	if (!block.empty() && block.size() + size > BGZF_BLOCK_SIZE) {
+		cutBlock();
+	}
+	appendBytes(prefix, RECORD_PREFIX_SIZE);
+	appendBytes(data, length);
+	IndexEntry e;
+	e.tid = tid;
+	e.beg = beg;
+	e.end = end;
+	e.mapped = mapped;
+	e.block = nbBlocks + fullBlocks.size();
+	e.offset = block.size();
+	entries.push_back(e);
+	if (fullBlocks.size() >= BLOCKS_PER_THREAD * std::max<uint16_t>(threads, 1)) {
+		return flushBlocks() ? 0 : -1;
+	}
+	return 0;
+}
+
+void portcullis::bam::BamWriter::appendBytes(const uint8_t* data, size_t length) {
+	while (length > 0) {
+		const size_t n = std::min<size_t>(length, BGZF_BLOCK_SIZE - block.size());
+		block.insert(block.end(), data, data + n);
+		data += n;
+		length -= n;
+		if (block.size() == BGZF_BLOCK_SIZE) {
+			cutBlock();
+		}
+	}
+}
+
+void portcullis::bam::BamWriter::cutBlock() {
+	fullBlocks.push_back(vector<uint8_t>());
+	std::swap(fullBlocks.back(), block);
+	block.reserve(BGZF_BLOCK_SIZE);
+}
+
+bool portcullis::bam::BamWriter::flushBlocks() {
+	// Compress the full blocks, with each thread taking every nth block
+	vector<vector<uint8_t>> compressed(fullBlocks.size(), vector<uint8_t>(BGZF_MAX_BLOCK_SIZE));
+	vector<size_t> sizes(fullBlocks.size(), 0);
+	const size_t nbThreads = std::min<size_t>(std::max<uint16_t>(threads, 1), fullBlocks.size());
+	auto compress = [&](const size_t first) {
+		for (size_t i = first; i < fullBlocks.size(); i += nbThreads) {
+			size_t n = BGZF_MAX_BLOCK_SIZE;
+			if (bgzf_compress(&compressed[i][0], &n, &fullBlocks[i][0], fullBlocks[i].size(), fp->compress_level) == 0) {
+				sizes[i] = n;
+			}
+		}
+	};
+	vector<thread> workers;
+	for (size_t t = 1; t < nbThreads; t++) {
+		workers.push_back(thread(compress, t));
+	}
+	if (nbThreads > 0) {
+		compress(0);
+	}
+	for (auto & w : workers) {
+		w.join();
+	}
+	// Write the blocks in order, noting where each one starts
+	vector<uint64_t> addresses(fullBlocks.size() + 1);
+	bool ok = true;
+	for (size_t i = 0; i < fullBlocks.size(); i++) {
+		addresses[i] = address;
+		ok = ok && sizes[i] > 0 && bgzf_raw_write(fp, &compressed[i][0], sizes[i]) == (ssize_t)sizes[i];
+		address += sizes[i];
+	}
+	addresses[fullBlocks.size()] = address;
+	// Every record now ends either in a block just written, or at a known
+	// offset in the block being filled
+	for (const auto & e : entries) {
+		const uint64_t offset = addresses[e.block - nbBlocks] << 16 | e.offset;
+		if (hts_idx_push(idx, e.tid, e.beg, e.end, offset, e.mapped) < 0) {
+			BOOST_THROW_EXCEPTION(BamException() << BamErrorInfo(string(
+									  "Could not index BAM file as its records are not sorted: ") + bamFile.string()));
+		}
+	}
+	nbBlocks += fullBlocks.size();
+	fullBlocks.clear();
+	entries.clear();
+	return ok;
 }
 
 void portcullis::bam::BamWriter::close() {
+	if (fp == nullptr) {
+		return;
+	}
+	if (indexing) {
+		if (!block.empty()) {
+			cutBlock();
+		}
+		bool ok = flushBlocks();
+		hts_idx_finish(idx, address << 16);
+		ok = bgzf_close(fp) == 0 && ok;
+		fp = nullptr;
+		if (!ok) {
+			BOOST_THROW_EXCEPTION(BamException() << BamErrorInfo(string(
+									  "Could not write output BAM file: ") + bamFile.string()));
+		}
+		const int fmt = useCsi ? HTS_FMT_CSI : HTS_FMT_BAI;
+		if (hts_idx_save_as(idx, bamFile.c_str(), indexFile.c_str(), fmt) != 0) {
+			BOOST_THROW_EXCEPTION(BamException() << BamErrorInfo(string(
+									  "Could not write BAM index: ") + indexFile.string()));
+		}
+		hts_idx_destroy(idx);
+		idx = nullptr;
+		return;
+	}
 	bgzf_close(fp);
+	fp = nullptr;
 }
-
@@ -0,0 +1,290 @@
+//  ********************************************************************
+//  This file is part of Portcullis.
+//
+//  Portcullis is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  Portcullis is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with Portcullis.  If not, see <http://www.gnu.org/licenses/>.
+//  *******************************************************************
+
+#include <string.h>
+#include <zlib.h>
+#include <algorithm>
+#include <mutex>
+#include <string>
+#include <vector>
+using std::min;
+using std::string;
+using std::unique_lock;
+using std::vector;
+
+#include <boost/exception/all.hpp>
+#include <boost/filesystem/path.hpp>
+using boost::filesystem::path;
+
+#include <htslib/bgzf.h>
+#include <htslib/sam.h>
+
+#include <portcullis/bam/bam_master.hpp>
+#include <portcullis/bam/bgzf_reader.hpp>
+
+// BGZF block layout, see the SAM specification
+const int32_t BGZF_HEADER_LENGTH = 18;
+const int32_t BGZF_FOOTER_LENGTH = 8;
+
+static inline uint32_t unpackUInt32(const uint8_t* buffer) {
+	return buffer[0] | (buffer[1] << 8) | (buffer[2] << 16) | ((uint32_t)buffer[3] << 24);
+}
+
+portcullis::bam::ParallelBgzfReader::ParallelBgzfReader(const path& _file, const uint16_t _threads) :
+	file(_file), threads(std::max<uint16_t>(_threads, 1)) {
+	fp = nullptr;
+	nbRead = 0;
+	nbConsumed = 0;
+	eof = false;
+	failed = false;
+	stopping = false;
+	current = nullptr;
+	currentOffset = 0;
+}
+
+portcullis::bam::ParallelBgzfReader::~ParallelBgzfReader() {
+	close();
+}
+
+void portcullis::bam::ParallelBgzfReader::open(const int64_t virtualOffset) {
+	fp = fopen(file.c_str(), "rb");
+	if (fp == nullptr) {
+		BOOST_THROW_EXCEPTION(BamException() << BamErrorInfo(string(
+								  "Could not open BGZF file: ") + file.string()));
+	}
+	if (fseeko(fp, virtualOffset >> 16, SEEK_SET) != 0) {
+		BOOST_THROW_EXCEPTION(BamException() << BamErrorInfo(string(
+								  "Could not seek in BGZF file: ") + file.string()));
+	}
+	// Allow a few blocks per thread to be queued up ahead of the consumer
+	blocks = vector<Block>(threads * 4 + 2);
+	for (auto & b : blocks) {
+		b.compressed.resize(BGZF_MAX_BLOCK_SIZE);
+		b.uncompressed.resize(BGZF_MAX_BLOCK_SIZE);
+	}
+	nbRead = 0;
+	nbConsumed = 0;
+	eof = false;
+	failed = false;
+	stopping = false;
+	current = nullptr;
+	// Position in first block to start from
+	currentOffset = virtualOffset & 0xFFFF;
+	readerThread = thread(&ParallelBgzfReader::readBlocks, this);
+	for (uint16_t i = 0; i < threads; i++) {
+		inflaterThreads.emplace_back(thread(&ParallelBgzfReader::inflateBlocks, this));
+	}
+}
+
+void portcullis::bam::ParallelBgzfReader::stop() {
+	{
+		unique_lock<mutex> lock(blockMutex);
+		stopping = true;
+	}
+	blockRead.notify_all();
+	blockFreed.notify_all();
+	blockInflated.notify_all();
+	if (readerThread.joinable()) {
+		readerThread.join();
+	}
+	for (auto & t : inflaterThreads) {
+		t.join();
+	}
+	inflaterThreads.clear();
+}
+
+void portcullis::bam::ParallelBgzfReader::close() {
+	stop();
+	if (fp != nullptr) {
+		fclose(fp);
+		fp = nullptr;
+	}
+}
+
+void portcullis::bam::ParallelBgzfReader::readBlocks() {
+	while (true) {
+		Block* b = nullptr;
+		{
+			unique_lock<mutex> lock(blockMutex);
+			blockFreed.wait(lock, [this] {
+				return nbRead - nbConsumed < blocks.size() || stopping;
+			});
+			if (stopping) {
+				return;
+			}
+			b = &blocks[nbRead % blocks.size()];
+		}
+		// We own this block until it is handed over to the inflaters
+		uint8_t* header = b->compressed.data();
+		size_t count = fread(header, 1, BGZF_HEADER_LENGTH, fp);
+		string error;
+		if (count == 0) {
+			unique_lock<mutex> lock(blockMutex);
+			eof = true;
+			blockInflated.notify_all();
+			return;
+		}
+		else if (count != (size_t)BGZF_HEADER_LENGTH || header[0] != 31 || header[1] != 139 || header[2] != 8 ||
+				 (header[3] & 4) == 0 || header[12] != 'B' || header[13] != 'C') {
+			error = "Invalid BGZF block header";
+		}
+		else {
+			b->compressedLength = (header[16] | (header[17] << 8)) + 1;
+			const int32_t remaining = b->compressedLength - BGZF_HEADER_LENGTH;
+			if (remaining < BGZF_FOOTER_LENGTH || fread(header + BGZF_HEADER_LENGTH, 1, remaining, fp) != (size_t)remaining) {
+				error = "Truncated BGZF block";
+			}
+		}
+		unique_lock<mutex> lock(blockMutex);
+		if (!error.empty()) {
+			failed = true;
+			errorMessage = error;
+			blockInflated.notify_all();
+			return;
+		}
+		b->state = BlockState::READ;
+		toInflate.push_back(nbRead++);
+		blockRead.notify_one();
+	}
+}
+
+void portcullis::bam::ParallelBgzfReader::inflateBlocks() {
+	while (true) {
+		uint64_t seq = 0;
+		{
+			unique_lock<mutex> lock(blockMutex);
+			blockRead.wait(lock, [this] {
+				return !toInflate.empty() || stopping;
+			});
+			if (stopping) {
+				return;
+			}
+			seq = toInflate.front();
+			toInflate.pop_front();
+		}
+		Block& b = blocks[seq % blocks.size()];
+		z_stream zs;
+		memset(&zs, 0, sizeof(zs));
+		zs.next_in = (Bytef*)b.compressed.data() + BGZF_HEADER_LENGTH;
+		zs.avail_in = b.compressedLength - BGZF_HEADER_LENGTH - BGZF_FOOTER_LENGTH;
+		zs.next_out = (Bytef*)b.uncompressed.data();
+		zs.avail_out = BGZF_MAX_BLOCK_SIZE;
+		bool ok = inflateInit2(&zs, -15) == Z_OK;
+		if (ok) {
+			ok = inflate(&zs, Z_FINISH) == Z_STREAM_END;
+			ok = inflateEnd(&zs) == Z_OK && ok;
+		}
+		// Check the uncompressed size recorded in the footer
+		ok = ok && zs.total_out == unpackUInt32(b.compressed.data() + b.compressedLength - 4);
+		{
+			unique_lock<mutex> lock(blockMutex);
+			b.length = zs.total_out;
+			b.state = ok ? BlockState::INFLATED : BlockState::FAILED;
+		}
+		blockInflated.notify_all();
+	}
+}
+
+bool portcullis::bam::ParallelBgzfReader::nextBlock() {
+	unique_lock<mutex> lock(blockMutex);
+	if (current != nullptr) {
+		// Release the block we've finished with
+		current->state = BlockState::FREE;
+		current = nullptr;
+		currentOffset = 0;
+		nbConsumed++;
+		blockFreed.notify_one();
+	}
+	Block& b = blocks[nbConsumed % blocks.size()];
+	blockInflated.wait(lock, [this, &b] {
+		return b.state == BlockState::INFLATED || b.state == BlockState::FAILED ||
+			   (eof && nbConsumed == nbRead) || failed || stopping;
+	});
+	if (b.state == BlockState::INFLATED) {
+		current = &b;
+		return true;
+	}
+	else if (b.state == BlockState::FAILED || failed) {
+		BOOST_THROW_EXCEPTION(BamException() << BamErrorInfo(string(
+								  "Error decompressing ") + file.string() + ": " +
+							  (errorMessage.empty() ? string("could not inflate BGZF block") : errorMessage)));
+	}
+	return false;
+}
+
+ssize_t portcullis::bam::ParallelBgzfReader::read(void* data, const size_t len) {
+	uint8_t* out = (uint8_t*)data;
+	size_t copied = 0;
+	while (copied < len) {
+		if (current == nullptr || currentOffset >= current->length) {
+			// Before the first block is fetched currentOffset holds the
+			// position within that block to start from
+			if (!nextBlock()) {
+				break;
+			}
+			continue;
+		}
+		const size_t n = min(len - copied, (size_t)(current->length - currentOffset));
+		memcpy(out + copied, current->uncompressed.data() + currentOffset, n);
+		currentOffset += n;
+		copied += n;
+	}
+	return copied;
+}
+
+int portcullis::bam::ParallelBgzfReader::readBam(bam1_t* b) {
+	bam1_core_t *c = &b->core;
+	int32_t block_len;
+	uint32_t x[8];
+	ssize_t ret = read(&block_len, 4);
+	if (ret != 4) {
+		return ret == 0 ? -1 : -2;
+	}
+	if (read(x, 32) != 32) {
+		return -3;
+	}
+	c->tid = x[0];
+	c->pos = x[1];
+	c->bin = x[2] >> 16;
+	c->qual = x[2] >> 8 & 0xff;
+	c->l_qname = x[2] & 0xff;
+	c->flag = x[3] >> 16;
+	c->n_cigar = x[3] & 0xffff;
+	c->l_qseq = x[4];
+	c->mtid = x[5];
+	c->mpos = x[6];
+	c->isize = x[7];
+	b->l_data = block_len - 32;
+	if (b->l_data < 0 || c->l_qseq < 0 || c->l_qname < 1) {
+		return -4;
+	}
+	if ((char *)bam_get_aux(b) - (char *)b->data > b->l_data) {
+		return -4;
+	}
+	if (b->m_data < b->l_data) {
+		b->m_data = b->l_data;
+		kroundup32(b->m_data);
+		b->data = (uint8_t*)realloc(b->data, b->m_data);
+		if (!b->data) {
+			return -4;
+		}
+	}
+	if (read(b->data, b->l_data) != b->l_data) {
+		return -4;
+	}
+	return 4 + block_len;
+}
@@ -15,11 +15,13 @@
 //  along with Portcullis.  If not, see <http://www.gnu.org/licenses/>.
 //  *******************************************************************
 
+#include <algorithm>
 #include <memory>
 #include <sstream>
 #include <string>
 #include <vector>
 using std::make_shared;
+using std::min;
 using std::shared_ptr;
 using std::string;
 using std::vector;
@@ -33,6 +35,10 @@ using boost::filesystem::exists;
 using boost::filesystem::path;
 using boost::lexical_cast;
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include <htslib/faidx.h>
 #include <htslib/sam.h>
 
@@ -49,7 +55,7 @@ using portcullis::bam::BamReader;
 
 int portcullis::bam::DepthParser::read_bam(void *data, bam1_t *b) {
 	aux_t *aux = (aux_t*)data; // data in fact is a pointer to an auxiliary structure
-	int ret = aux->iter ? BamReader::bam_iter_read(aux->fp, aux->iter, b) : bam_read1(aux->fp, b);
+	int ret = aux->iter ? BamReader::bam_iter_read(aux->fp, aux->iter, b) : aux->pipeline ? aux->pipeline->readBam(b) : bam_read1(aux->fp, b);
 	if (!(b->core.flag & BAM_FUNMAP)) {
 		if ((int)b->core.qual < aux->min_mapQ) b->core.flag |= BAM_FUNMAP;
 		else if (aux->min_len && bam_cigar2qlen(b->core.n_cigar, bam_get_cigar(b)) < aux->min_len) b->core.flag |= BAM_FUNMAP;
@@ -63,7 +69,7 @@ int portcullis::bam::DepthParser::read_bam_skip_gapped(void *data, bam1_t *b) {
 	bool skip = false;
 	do {
 		skip = false;
-		ret = aux->iter ? BamReader::bam_iter_read(aux->fp, aux->iter, b) : bam_read1(aux->fp, b);
+		ret = aux->iter ? BamReader::bam_iter_read(aux->fp, aux->iter, b) : aux->pipeline ? aux->pipeline->readBam(b) : bam_read1(aux->fp, b);
 		uint32_t *cigar = bam_get_cigar(b);
 		for (int k = 0; k < b->core.n_cigar; ++k) {
 			int cop = cigar[k] & BAM_CIGAR_MASK; // operation
@@ -77,29 +83,59 @@ int portcullis::bam::DepthParser::read_bam_skip_gapped(void *data, bam1_t *b) {
 			else if (aux->min_len && bam_cigar2qlen(b->core.n_cigar, cigar) < aux->min_len) b->core.flag |= BAM_FUNMAP;
 		}
 	}
-	while (skip);
+	while (skip && ret >= 0);
 	return ret;
 }
 
 
 portcullis::bam::DepthParser::DepthParser(path _bamFile, uint8_t _strandSpecific, bool _allowGappedAlignments) :
-	bamFile(_bamFile), strandSpecific(_strandSpecific), allowGappedAlignments(_allowGappedAlignments) {
+	DepthParser(_bamFile, _strandSpecific, _allowGappedAlignments, 1) {
+}
+
+portcullis::bam::DepthParser::DepthParser(path _bamFile, uint8_t _strandSpecific, bool _allowGappedAlignments, uint16_t _ioThreads) :
+	DepthParser(_bamFile, _strandSpecific, _allowGappedAlignments, _ioThreads, false) {
+}
+
+portcullis::bam::DepthParser::DepthParser(path _bamFile, uint8_t _strandSpecific, bool _allowGappedAlignments, uint16_t _ioThreads, bool _usePileup) :
+	bamFile(_bamFile), strandSpecific(_strandSpecific), allowGappedAlignments(_allowGappedAlignments), usePileup(_usePileup) {
 	data = (aux_t**)calloc(1, sizeof(aux_t**));
 	data[0] = (aux_t*)calloc(1, sizeof(aux_t));
 	data[0]->fp = bgzf_open(bamFile.c_str(), "r");
 	data[0]->min_mapQ = 0;
 	data[0]->min_len  = 0;
 	header = bam_hdr_read(data[0]->fp);
-	mplp = allowGappedAlignments ?
-		   bam_mplp_init(1, read_bam, (void**)data) :
-		   bam_mplp_init(1, read_bam_skip_gapped, (void**)data);
+	BGZF* fp = data[0]->fp;
+	if (_ioThreads > 1 && fp->is_compressed == 1 && !fp->is_gzip && !ed_is_big()) {
+		data[0]->pipeline = new ParallelBgzfReader(bamFile, _ioThreads);
+		data[0]->pipeline->open(bgzf_tell(fp));
+	}
+	mplp = nullptr;
+	b = nullptr;
+	if (usePileup) {
+		mplp = allowGappedAlignments ?
+			   bam_mplp_init(1, read_bam, (void**)data) :
+			   bam_mplp_init(1, read_bam_skip_gapped, (void**)data);
+	}
+	else {
+		b = bam_init1();
+	}
 	res = 0;
+	batchRef = -1;
 	start = true;
+	pending = false;
 }
 
 portcullis::bam::DepthParser::~DepthParser() {
-	bam_mplp_destroy(mplp);
+	if (mplp != nullptr) {
+		bam_mplp_destroy(mplp);
+	}
+	if (b != nullptr) {
+		bam_destroy1(b);
+	}
 	bam_hdr_destroy(header);
+	if (data[0]->pipeline) {
+		delete data[0]->pipeline;
+	}
 	bgzf_close(data[0]->fp);
 	if (data[0]->iter) {
 		bam_itr_destroy(data[0]->iter);
@@ -107,9 +143,104 @@ portcullis::bam::DepthParser::~DepthParser() {
 	free(data);
 }
 
+/**
+ * In place inclusive prefix sum, starting from carry.  Returns the last sum.
+ * Unsigned arithmetic wraps, so the -1 events in the difference array are fine.
+ */
+static uint32_t prefixSum(uint32_t* d, const size_t n, uint32_t carry) {
+	size_t i = 0;
+#ifdef __SSE2__
+	__m128i c = _mm_set1_epi32(carry);
+	for (; i + 4 <= n; i += 4) {
+		__m128i x = _mm_loadu_si128((const __m128i*)(d + i));
+		x = _mm_add_epi32(x, _mm_slli_si128(x, 4));
+		x = _mm_add_epi32(x, _mm_slli_si128(x, 8));
+		x = _mm_add_epi32(x, c);
+		_mm_storeu_si128((__m128i*)(d + i), x);
+		c = _mm_shuffle_epi32(x, _MM_SHUFFLE(3, 3, 3, 3));
+	}
+	carry = (uint32_t)_mm_cvtsi128_si32(c);
+#endif
+	for (; i < n; i++) {
+		carry += d[i];
+		d[i] = carry;
+	}
+	return carry;
+}
 
+bool portcullis::bam::DepthParser::readNext() {
+	// Use the same filters as the pileup engine.  These flag alignments that
+	// should be ignored as unmapped.
+	while ((allowGappedAlignments ? read_bam(data[0], b) : read_bam_skip_gapped(data[0], b)) >= 0) {
+		if (!(b->core.flag & BAM_FUNMAP) && b->core.tid >= 0) {
+			return true;
+		}
+	}
+	return false;
+}
 
 bool portcullis::bam::DepthParser::loadNextBatch(vector<uint32_t>& depths) {
+	return usePileup ? loadNextPileupBatch(depths) : loadNextDifferenceBatch(depths);
+}
+
+bool portcullis::bam::DepthParser::loadNextDifferenceBatch(vector<uint32_t>& depths) {
+	// Positions more than this far behind the stream are summed while that
+	// part of the difference array is still in cache
+	const int32_t SCAN_WINDOW = 1 << 16;
+	if (!pending && (!start || !readNext())) {
+		return false;
+	}
+	start = false;
+	// Target sequences without any aligned bases don't get a batch, as with
+	// the pileup engine
+	bool covered = false;
+	do {
+		pending = false;
+		batchRef = b->core.tid;
+		const int32_t len = header->target_len[batchRef];
+		// Extra levels so that the end events of the last block have somewhere to go
+		depths.assign(len + 2, 0);
+		uint32_t* d = depths.data();
+		int32_t scanned = 0;
+		uint32_t carry = 0;
+		do {
+			if (b->core.tid != batchRef) {
+				pending = true;
+				break;
+			}
+			// No event from here on lands before pos + 1, so everything
+			// before there is final
+			const int32_t pos = b->core.pos;
+			const int32_t settled = min(pos + 1, len + 1);
+			if (settled - scanned > SCAN_WINDOW) {
+				carry = prefixSum(d + scanned, settled - scanned, carry);
+				scanned = settled;
+			}
+			const uint32_t* cigar = bam_get_cigar(b);
+			int32_t refPos = pos;
+			for (uint32_t k = 0; k < b->core.n_cigar; k++) {
+				const int32_t opLen = bam_cigar_oplen(cigar[k]);
+				const int type = bam_cigar_type(bam_cigar_op(cigar[k]));
+				if (type == 3 && opLen > 0) {
+					// M, = or X.  Level i is the depth at position i - 1.
+					d[min(refPos + 1, len + 1)]++;
+					d[min(refPos + opLen + 1, len + 1)]--;
+					covered = true;
+				}
+				if (type & 2) {
+					refPos += opLen;
+				}
+			}
+		}
+		while (readNext());
+		prefixSum(d + scanned, depths.size() - scanned, carry);
+		depths.resize(len);
+	}
+	while (!covered && pending);
+	return covered;
+}
+
+bool portcullis::bam::DepthParser::loadNextPileupBatch(vector<uint32_t>& depths) {
 	if (res == 0 && !start) {
 		return false;
 	}
@@ -136,8 +267,10 @@ bool portcullis::bam::DepthParser::loadNextBatch(vector<uint32_t>& depths) {
 			return false;
 		}
 	}
-	// Create the vector
-	depths.resize(header->target_len[last.ref], 0);
+	// Create the vector.  Note that "last" moves on to the next target
+	// sequence when we reach the end of this one
+	batchRef = last.ref;
+	depths.resize(header->target_len[batchRef], 0);
 	// Use the details from the last run
 	depths[last.pos] = last.depth;
 	while ((res = bam_mplp_auto(mplp, &tid, &pos, &n_plp, plp)) > 0) {
@@ -15,10 +15,24 @@
 //  along with Portcullis.  If not, see <http://www.gnu.org/licenses/>.
 //  *******************************************************************
 
+#include <ctype.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iostream>
 #include <memory>
 #include <sstream>
 #include <string>
 #include <vector>
+using std::cerr;
+using std::min;
+using std::endl;
+using std::ifstream;
+using std::ofstream;
 using std::make_shared;
 using std::shared_ptr;
 using std::string;
@@ -33,11 +47,230 @@ using boost::filesystem::exists;
 using boost::filesystem::path;
 using boost::lexical_cast;
 
+#include <htslib/bgzf.h>
 #include <htslib/faidx.h>
 #include <htslib/sam.h>
 
 #include <portcullis/bam/genome_mapper.hpp>
 
+// ******** Fasta index ********
+
+portcullis::bam::FastaIndex::FastaIndex(const path& fastaIndexFile) {
+	ifstream in(fastaIndexFile.c_str());
+	if (!in.good()) {
+		BOOST_THROW_EXCEPTION(BamException() << BamErrorInfo(string(
+								  "Could not open genome index file: ") + fastaIndexFile.string()));
+	}
+	string line;
+	while (std::getline(in, line)) {
+		if (line.empty()) {
+			continue;
+		}
+		stringstream ss(line);
+		string name;
+		Entry e;
+		if (!(ss >> name >> e.length >> e.offset >> e.lineBases >> e.lineWidth)) {
+			BOOST_THROW_EXCEPTION(BamException() << BamErrorInfo(string(
+									  "Could not parse line in genome index file: ") + fastaIndexFile.string() + ": " + line));
+		}
+		// Mimic samtools, which ignores duplicate sequence names
+		if (entries.find(name) == entries.end()) {
+			e.id = names.size();
+			entries[name] = e;
+			names.push_back(name);
+		}
+	}
+}
+
+// ******** Packed genome ********
+
+// Identifies a packed genome file, and the version of its layout
+static const char PACKED_GENOME_MAGIC[8] = {'P', 'C', 'L', 'S', 'P', 'K', 'G', '3'};
+
+// The header holds the magic, the number of sequences, and the size and
+// modification time of the fasta file the genome was packed from
+static const uint64_t PACKED_GENOME_HEADER_SIZE = sizeof(PACKED_GENOME_MAGIC) + 3 * sizeof(uint64_t);
+
+// Number of bases read from the fasta file at once when packing
+static const int64_t PACK_CHUNK_SIZE = 1 << 20;
+
+static uint64_t align8(const uint64_t n) {
+	return (n + 7) & ~(uint64_t)7;
+}
+
+// Records the size and modification time of a fasta file, so a packed genome
+// can tell when the fasta has been changed since it was packed
+static void fastaStamp(const path& fastaFile, uint64_t& size, uint64_t& mtime) {
+	size = boost::filesystem::file_size(fastaFile);
+	mtime = (uint64_t)boost::filesystem::last_write_time(fastaFile);
+}
+
+string portcullis::bam::PackedSeqView::toString() const {
+	string seq(length, 'N');
+	for (int64_t i = 0; i < length; i++) {
+		seq[i] = (*this)[i];
+	}
+	return seq;
+}
+
+portcullis::bam::PackedGenome::PackedGenome(const path& _packedFile, const FastaIndex& index, const path& fastaFile) :
+	packedFile(_packedFile), data(nullptr), dataSize(0), entries(nullptr), nbSeqs(0) {
+	const int fd = open(packedFile.c_str(), O_RDONLY);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st) != 0) {
+		if (fd >= 0) {
+			close(fd);
+		}
+		BOOST_THROW_EXCEPTION(BamException() << BamErrorInfo(string(
+								  "Could not open packed genome file: ") + packedFile.string()));
+	}
+	dataSize = st.st_size;
+	void* m = dataSize > 0 ? mmap(nullptr, dataSize, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+	// The mapping stays valid after the file is closed
+	close(fd);
+	if (m == MAP_FAILED) {
+		BOOST_THROW_EXCEPTION(BamException() << BamErrorInfo(string(
+								  "Could not memory map packed genome file: ") + packedFile.string()));
+	}
+	data = (const uint8_t*)m;
+	// Make sure the file is complete and describes the sequences in the index
+	string error;
+	const uint64_t headerSize = PACKED_GENOME_HEADER_SIZE;
+	if (dataSize < headerSize || memcmp(data, PACKED_GENOME_MAGIC, sizeof(PACKED_GENOME_MAGIC)) != 0) {
+		error = "not a packed genome file";
+	}
+	else {
+		const uint64_t* header = (const uint64_t*)(data + sizeof(PACKED_GENOME_MAGIC));
+		nbSeqs = header[0];
+		entries = (const Entry*)(data + headerSize);
+		uint64_t fastaSize = 0;
+		uint64_t fastaMtime = 0;
+		fastaStamp(fastaFile, fastaSize, fastaMtime);
+		if (header[1] != fastaSize || header[2] != fastaMtime) {
+			error = "fasta file has changed since it was packed";
+		}
+		else if (nbSeqs != index.size() || dataSize < headerSize + nbSeqs * sizeof(Entry)) {
+			error = "wrong number of sequences";
+		}
+		for (uint64_t i = 0; i < nbSeqs && error.empty(); i++) {
+			const Entry& e = entries[i];
+			if ((int64_t)e.length != index.find(index.getName(i))->length) {
+				error = "wrong length for sequence " + index.getName(i);
+			}
+			else if (e.softMaskOffset + (e.length + 63) / 64 * sizeof(uint64_t) > dataSize ||
+					 e.exceptionsOffset + e.nbExceptions * sizeof(uint64_t) > dataSize) {
+				error = "file is truncated";
+			}
+		}
+	}
+	if (!error.empty()) {
+		munmap((void*)data, dataSize);
+		BOOST_THROW_EXCEPTION(BamException() << BamErrorInfo(string(
+								  "Packed genome file does not match the genome: ") + packedFile.string() + ": " + error));
+	}
+}
+
+portcullis::bam::PackedGenome::~PackedGenome() {
+	munmap((void*)data, dataSize);
+}
+
+void portcullis::bam::PackedGenome::build(const GenomeMapper& genome, const path& packedFile) {
+	const FastaIndexPtr index = genome.getFastaIndex();
+	// Lay out the file: the header and sequence table, then the bases and the
+	// two bitmaps for each sequence, each starting on an 8 byte boundary.  The
+	// exceptions for every sequence go at the end, once they are known.
+	vector<Entry> table(index->size());
+	uint64_t offset = PACKED_GENOME_HEADER_SIZE + table.size() * sizeof(Entry);
+	for (size_t i = 0; i < table.size(); i++) {
+		Entry& e = table[i];
+		e.length = index->find(index->getName(i))->length;
+		e.basesOffset = offset;
+		offset += align8((e.length + 3) / 4);
+		e.nMaskOffset = offset;
+		offset += (e.length + 63) / 64 * sizeof(uint64_t);
+		e.softMaskOffset = offset;
+		offset += (e.length + 63) / 64 * sizeof(uint64_t);
+	}
+	// Write to a temporary file first, so a partly written file is never used
+	const path tempFile = path(packedFile.string() + ".tmp");
+	ofstream out(tempFile.c_str(), std::ios::binary);
+	if (!out.good()) {
+		BOOST_THROW_EXCEPTION(BamException() << BamErrorInfo(string(
+								  "Could not open file for writing packed genome: ") + tempFile.string()));
+	}
+	// Stamp the fasta before reading it, so a change made while packing is
+	// caught when the packed genome is next loaded
+	uint64_t header[3] = {table.size(), 0, 0};
+	fastaStamp(genome.getGenomeFile(), header[1], header[2]);
+	out.write(PACKED_GENOME_MAGIC, sizeof(PACKED_GENOME_MAGIC));
+	out.write((const char*)header, sizeof(header));
+	out.write((const char*)table.data(), table.size() * sizeof(Entry));
+	vector<uint64_t> exceptions;
+	for (size_t i = 0; i < table.size(); i++) {
+		Entry& e = table[i];
+		const string& name = index->getName(i);
+		const size_t firstException = exceptions.size();
+		vector<uint8_t> bases(e.nMaskOffset - e.basesOffset, 0);
+		vector<uint64_t> nMask((e.length + 63) / 64, 0);
+		vector<uint64_t> softMask((e.length + 63) / 64, 0);
+		for (int64_t chunk = 0; chunk < (int64_t)e.length; chunk += PACK_CHUNK_SIZE) {
+			const int64_t chunkEnd = min<int64_t>(chunk + PACK_CHUNK_SIZE, e.length) - 1;
+			int len = -1;
+			const string seq = genome.fetchBases(name.c_str(), chunk, chunkEnd, &len);
+			if (len != chunkEnd - chunk + 1) {
+				BOOST_THROW_EXCEPTION(BamException() << BamErrorInfo(string(
+										  "Could not fetch region from genome while packing: ") + name + ":" +
+									  lexical_cast<string>(chunk) + "-" + lexical_cast<string>(chunkEnd)));
+			}
+			for (int64_t j = 0; j < len; j++) {
+				const int64_t pos = chunk + j;
+				const char c = seq[j];
+				if (islower(c)) {
+					softMask[pos >> 6] |= (uint64_t)1 << (pos & 63);
+				}
+				uint8_t code = 0;
+				switch (toupper(c)) {
+				case 'A':
+					code = 0;
+					break;
+				case 'C':
+					code = 1;
+					break;
+				case 'G':
+					code = 2;
+					break;
+				case 'T':
+					code = 3;
+					break;
+				case 'N':
+					nMask[pos >> 6] |= (uint64_t)1 << (pos & 63);
+					break;
+				default:
+					// Keep anything else, such as an IUPAC ambiguity code, exactly
+					nMask[pos >> 6] |= (uint64_t)1 << (pos & 63);
+					exceptions.push_back((uint64_t)pos << 8 | (uint8_t)toupper(c));
+				}
+				bases[pos >> 2] |= code << ((pos & 3) << 1);
+			}
+		}
+		out.write((const char*)bases.data(), bases.size());
+		out.write((const char*)nMask.data(), nMask.size() * sizeof(uint64_t));
+		out.write((const char*)softMask.data(), softMask.size() * sizeof(uint64_t));
+		e.exceptionsOffset = offset + firstException * sizeof(uint64_t);
+		e.nbExceptions = exceptions.size() - firstException;
+	}
+	out.write((const char*)exceptions.data(), exceptions.size() * sizeof(uint64_t));
+	// Now the exceptions are placed, fill in the sequence table properly
+	out.seekp(PACKED_GENOME_HEADER_SIZE);
+	out.write((const char*)table.data(), table.size() * sizeof(Entry));
+	out.close();
+	if (!out) {
+		BOOST_THROW_EXCEPTION(BamException() << BamErrorInfo(string(
+								  "Could not write packed genome: ") + tempFile.string()));
+	}
+	boost::filesystem::rename(tempFile, packedFile);
+}
+
 // ******** Genome mapper ********
 
 /**
@@ -47,12 +280,12 @@ using boost::lexical_cast;
  */
 portcullis::bam::GenomeMapper::GenomeMapper(path _genomeFile) :
 	genomeFile(_genomeFile) {
-	fastaIndex = nullptr;
+	fastaFile = nullptr;
 }
 
 portcullis::bam::GenomeMapper::~GenomeMapper() {
-	if (fastaIndex != nullptr) {
-		fai_destroy(fastaIndex);
+	if (fastaFile != nullptr) {
+		bgzf_close(fastaFile);
 	}
 }
 
@@ -83,7 +316,44 @@ void portcullis::bam::GenomeMapper::loadFastaIndex() {
 		BOOST_THROW_EXCEPTION(BamException() << BamErrorInfo(string(
 								  "Genome index file does not exist: ") + fastaIndexFile.string()));
 	}
-	fastaIndex = fai_load(genomeFile.c_str());
+	FastaIndexPtr index = make_shared<FastaIndex>(fastaIndexFile);
+	PackedGenomePtr packed = nullptr;
+	if (exists(getPackedGenomeFile())) {
+		// An out of date packed genome isn't fatal, the fasta file can still be used
+		try {
+			packed = make_shared<PackedGenome>(getPackedGenomeFile(), *index, genomeFile);
+		}
+		catch (BamException& ex) {
+			cerr << "Warning: not using packed genome: " << *boost::get_error_info<BamErrorInfo>(ex) << endl;
+		}
+	}
+	loadFastaIndex(index, packed);
+}
+
+void portcullis::bam::GenomeMapper::loadFastaIndex(FastaIndexPtr index, PackedGenomePtr packed) {
+	fastaIndex = index;
+	packedGenome = packed;
+	openGenome();
+}
+
+void portcullis::bam::GenomeMapper::buildPackedGenome() {
+	PackedGenome::build(*this, getPackedGenomeFile());
+}
+
+void portcullis::bam::GenomeMapper::openGenome() {
+	if (fastaFile != nullptr) {
+		bgzf_close(fastaFile);
+	}
+	fastaFile = bgzf_open(genomeFile.c_str(), "rb");
+	if (fastaFile == nullptr) {
+		BOOST_THROW_EXCEPTION(BamException() << BamErrorInfo(string(
+								  "Could not open genome file: ") + genomeFile.string()));
+	}
+	// Compressed genomes need the bgzip index in order to seek
+	if (fastaFile->is_compressed == 1 && bgzf_index_load(fastaFile, genomeFile.c_str(), ".gzi") < 0) {
+		BOOST_THROW_EXCEPTION(BamException() << BamErrorInfo(string(
+								  "Could not load bgzip index for genome file: ") + genomeFile.string()));
+	}
 }
 
 
@@ -94,11 +364,66 @@ void portcullis::bam::GenomeMapper::loadFastaIndex() {
 * @return      The sequence as a string; empty string if no seq found
 */
 string portcullis::bam::GenomeMapper::fetchBases(const char* reg, int* len) const {
-	char* cseq = fai_fetch(fastaIndex, reg, len);
-	string strseq = cseq == NULL ? string("") : string(cseq);
-	if (cseq != NULL)
-		free(cseq);
-	return strseq;
+	// Parse the region string in the same way as samtools: the sequence name
+	// is everything before the last colon, providing what's after it looks like
+	// a 1-based position range.  Otherwise the whole string is the name.
+	string region;
+	for (const char* c = reg; *c != '\0'; c++) {
+		if (!isspace(*c)) {
+			region.push_back(*c);
+		}
+	}
+	string name = region;
+	string range;
+	size_t colon = region.rfind(':');
+	if (colon != string::npos) {
+		size_t nbHyphens = 0;
+		bool valid = true;
+		for (size_t i = colon + 1; i < region.size(); i++) {
+			if (region[i] == '-') {
+				nbHyphens++;
+			}
+			else if (!isdigit(region[i]) && region[i] != ',') {
+				valid = false;
+			}
+		}
+		if (valid && nbHyphens <= 1 && fastaIndex->find(region.substr(0, colon)) != nullptr) {
+			name = region.substr(0, colon);
+			for (size_t i = colon + 1; i < region.size(); i++) {
+				if (region[i] != ',') {
+					range.push_back(region[i]);
+				}
+			}
+		}
+	}
+	const FastaIndex::Entry* e = fastaIndex->find(name);
+	if (e == nullptr) {
+		cerr << "[fai_fetch] Warning - Reference " << reg << " not found in FASTA file, returning empty sequence" << endl;
+		*len = -2;
+		return string("");
+	}
+	int64_t beg = 0;
+	int64_t end = e->length;
+	if (!range.empty()) {
+		size_t hyphen = range.find('-');
+		beg = atol(range.substr(0, hyphen).c_str());
+		if (hyphen != string::npos) {
+			end = atol(range.substr(hyphen + 1).c_str());
+		}
+		if (beg > 0) {
+			--beg;
+		}
+	}
+	beg = min(beg, e->length);
+	end = min(end, e->length);
+	if (beg > end) {
+		beg = end;
+	}
+	if (beg == end) {
+		*len = 0;
+		return string("");
+	}
+	return fetchBases(name.c_str(), beg, end - 1, len);
 }
 
 /**
@@ -110,9 +435,176 @@ string portcullis::bam::GenomeMapper::fetchBases(const char* reg, int* len) cons
  * @return      The sequence as a string; empty string if no seq found
  */
 string portcullis::bam::GenomeMapper::fetchBases(const char* name, int start, int end, int* len) const {
-	char* cseq = faidx_fetch_seq(fastaIndex, name, start, end, len);
-	string strseq = cseq == NULL ? string("") : string(cseq);
-	if (cseq != NULL)
-		free(cseq);
-	return strseq;
-}
\ No newline at end of file
+	const FastaIndex::Entry* e = fastaIndex->find(name);
+	if (e == nullptr) {
+		*len = -2;
+		cerr << "[fai_fetch_seq] The sequence \"" << name << "\" not found" << endl;
+		return string("");
+	}
+	// Clip the requested region to the sequence bounds in the same way as samtools
+	int64_t beg = start;
+	int64_t last = end;
+	if (last < beg) beg = last;
+	if (beg < 0) beg = 0;
+	else if (e->length <= beg) beg = e->length - 1;
+	if (last < 0) last = 0;
+	else if (e->length <= last) last = e->length - 1;
+	if (packedGenome != nullptr) {
+		const string seq = packedGenome->getSeq(e->id, beg, last).toString();
+		*len = seq.size();
+		return seq;
+	}
+	// Read the block of the file covering the region, then strip out the newlines
+	const int64_t begOffset = e->offset + beg / e->lineBases * e->lineWidth + beg % e->lineBases;
+	const int64_t endOffset = e->offset + last / e->lineBases * e->lineWidth + last % e->lineBases;
+	if (bgzf_useek(fastaFile, begOffset, SEEK_SET) < 0) {
+		*len = -1;
+		cerr << "[fai_fetch_seq] Error: fai_fetch failed. (Seeking in a compressed, .gzi unindexed, file?)" << endl;
+		return string("");
+	}
+	string block(endOffset - begOffset + 1, '\0');
+	ssize_t nbRead = bgzf_read(fastaFile, &block[0], block.size());
+	string seq;
+	seq.reserve(last - beg + 1);
+	for (ssize_t i = 0; i < nbRead; i++) {
+		if (isgraph(block[i])) {
+			seq.push_back(block[i]);
+		}
+	}
+	*len = seq.size();
+	return seq;
+}
+
+bool portcullis::bam::GenomeMapper::fetchView(const string& name, const int64_t start, const int64_t end, PackedSeqView& view) const {
+	const FastaIndex::Entry* e = packedGenome != nullptr ? fastaIndex->find(name) : nullptr;
+	if (e == nullptr || start < 0 || end < start || end >= e->length) {
+		return false;
+	}
+	view = packedGenome->getSeq(e->id, start, end);
+	return true;
+}
+
+// ******** Genome buffer ********
+
+portcullis::bam::GenomeBuffer::GenomeBuffer(const GenomeMapper& genome, const string& name, const int32_t chunkSize) :
+	genome(genome), name(name), chunkSize(chunkSize), start(0) {
+	const FastaIndex::Entry* e = genome.getFastaIndex() != nullptr ? genome.getFastaIndex()->find(name) : nullptr;
+	if (e == nullptr) {
+		BOOST_THROW_EXCEPTION(BamException() << BamErrorInfo(string(
+								  "Could not find sequence in genome: ") + name));
+	}
+	length = e->length;
+}
+
+bool portcullis::bam::GenomeBuffer::fetch(const int32_t regionStart, const int32_t regionEnd) {
+	if (regionStart < 0 || regionEnd < regionStart || regionEnd >= length) {
+		return false;
+	}
+	if (!seq.empty() && regionStart >= start && regionEnd <= getEnd()) {
+		return true;
+	}
+	const int32_t fetchEnd = (int32_t)std::min<int64_t>(length - 1, std::max<int64_t>(regionEnd, (int64_t)regionStart + chunkSize - 1));
+	start = regionStart;
+	// Decode straight from the packed genome if there is one
+	PackedSeqView view;
+	if (genome.fetchView(name, regionStart, fetchEnd, view)) {
+		seq.resize(view.size());
+		codes.resize(view.size());
+		for (int64_t i = 0; i < view.size(); i++) {
+			seq[i] = view.upper(i);
+			codes[i] = view.nt16(i);
+		}
+		return true;
+	}
+	int len = -1;
+	seq = genome.fetchBases(name.c_str(), regionStart, fetchEnd, &len);
+	if (len != fetchEnd - regionStart + 1) {
+		BOOST_THROW_EXCEPTION(BamException() << BamErrorInfo(string(
+								  "Could not fetch region from genome: ") + name + ":" + lexical_cast<string>(regionStart) +
+							  "-" + lexical_cast<string>(fetchEnd)));
+	}
+	// Removes any lowercase bases representing repeats
+	std::transform(seq.begin(), seq.end(), seq.begin(), ::toupper);
+	codes.resize(seq.size());
+	for (size_t i = 0; i < seq.size(); i++) {
+		codes[i] = seq_nt16_table[(uint8_t)seq[i]];
+	}
+	return true;
+}
+
+portcullis::bam::GenomeWindows::GenomeWindows(const GenomeMapper& genome, const string& name, const int32_t maxGap) :
+	genome(genome), name(name), maxGap(maxGap) {
+	const FastaIndex::Entry* e = genome.getFastaIndex() != nullptr ? genome.getFastaIndex()->find(name) : nullptr;
+	length = e != nullptr ? e->length : -1;
+}
+
+size_t portcullis::bam::GenomeWindows::add(const int32_t start, const int32_t end) {
+	// Clip the window to the sequence bounds in the same way as fetchBases
+	Window w;
+	w.start = start;
+	w.end = end;
+	if (w.end < w.start) w.start = w.end;
+	if (w.start < 0) w.start = 0;
+	else if (length <= w.start) w.start = length - 1;
+	if (w.end < 0) w.end = 0;
+	else if (length <= w.end) w.end = length - 1;
+	w.block = 0;
+	w.len = -1;
+	windows.push_back(w);
+	return windows.size() - 1;
+}
+
+void portcullis::bam::GenomeWindows::fetch() {
+	blocks.clear();
+	blockStarts.clear();
+	if (length < 0) {
+		cerr << "[fai_fetch_seq] The sequence \"" << name << "\" not found" << endl;
+		for (auto & w : windows) {
+			w.len = -2;
+		}
+		return;
+	}
+	// Visit the windows in order of position, merging them into blocks
+	vector<size_t> order(windows.size());
+	for (size_t i = 0; i < order.size(); i++) {
+		order[i] = i;
+	}
+	std::sort(order.begin(), order.end(), [this](const size_t a, const size_t b) {
+		return windows[a].start < windows[b].start;
+	});
+	size_t first = 0;
+	while (first < order.size()) {
+		const int64_t blockStart = windows[order[first]].start;
+		int64_t blockEnd = windows[order[first]].end;
+		size_t last = first + 1;
+		while (last < order.size() && windows[order[last]].start <= blockEnd + maxGap) {
+			blockEnd = std::max(blockEnd, windows[order[last]].end);
+			last++;
+		}
+		int len = -1;
+		blocks.push_back(genome.fetchBases(name.c_str(), blockStart, blockEnd, &len));
+		blockStarts.push_back(blockStart);
+		for (size_t i = first; i < last; i++) {
+			Window& w = windows[order[i]];
+			w.block = blocks.size() - 1;
+			// Only a short read of the block leaves a window with fewer bases
+			w.len = len < 0 ? len : (int)std::max<int64_t>(0, std::min<int64_t>(w.end, blockStart + len - 1) - w.start + 1);
+		}
+		first = last;
+	}
+}
+
+string portcullis::bam::GenomeWindows::get(const size_t id, int* len) const {
+	const Window& w = windows[id];
+	*len = w.len;
+	if (w.len <= 0) {
+		return string("");
+	}
+	return blocks[w.block].substr(w.start - blockStarts[w.block], w.len);
+}
+
+void portcullis::bam::GenomeWindows::clear() {
+	windows.clear();
+	blocks.clear();
+	blockStarts.clear();
+}
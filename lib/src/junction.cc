@@ -32,8 +32,6 @@ using std::size_t;
 using std::vector;
 using std::shared_ptr;
 
-typedef std::unordered_map<size_t, uint16_t> SplicedAlignmentMap;
-
 #include <boost/algorithm/string.hpp>
 #include <boost/exception/all.hpp>
 #include <boost/lexical_cast.hpp>
@@ -41,8 +39,10 @@ using boost::lexical_cast;
 
 #include <portcullis/bam/bam_alignment.hpp>
 #include <portcullis/bam/genome_mapper.hpp>
-using portcullis::bam::CigarOp;
+using portcullis::bam::CigarView;
 using portcullis::bam::GenomeMapper;
+using portcullis::bam::GenomeWindows;
+using portcullis::bam::MatchStats;
 using portcullis::bam::Strand;
 
 #include <portcullis/junction.hpp>
@@ -115,75 +115,70 @@ const vector<string> portcullis::Junction::STRAND_NAMES = {
 	"consensus-strand"
 };
 
-void portcullis::AlignmentInfo::calcMatchStats(const Intron& i, const uint32_t leftStart, const uint32_t rightEnd, const string& ancLeft, const string& ancRight) {
+portcullis::AlignmentSummary::AlignmentSummary(const BamAlignment& al, const Intron& i) {
+	start = al.getStart();
+	end = al.getEnd();
+	nameCode = al.deriveNameCode();
+	nbMismatches = 0;
+	minMatch = 0;
+	mmes = 0;
+	upstreamJunctions = 0;
+	downstreamJunctions = 0;
+	int32_t pos = start;
+	const CigarView cigar = al.getCigarView();
+	for (uint32_t k = 0; k < cigar.size(); k++) {
+		if (cigar.consumesReference(k)) {
+			pos += cigar.length(k);
+		}
+		if (cigar.op(k) == BAM_CREF_SKIP) {
+			if (pos < i.start) {
+				upstreamJunctions++;
+			}
+			else if (pos > i.end + 1) {
+				downstreamJunctions++;
+			}
+		}
+	}
+	strand = al.getStrand();
+	mapQuality = (uint8_t)al.getMapQuality();
+	properPairs = 0;
+	for (Orientation o : {Orientation::FR, Orientation::RF, Orientation::FF, Orientation::RR}) {
+		if (al.calcIfProperPair(o)) {
+			properPairs |= 1 << (uint8_t)o;
+		}
+	}
+	bamProperPair = al.isProperPair();
+}
+
+void portcullis::AlignmentSummary::calcMatchStats(const BamAlignment& al, const Intron& i, GenomeBuffer& genome,
+		const int32_t anchorStart, const int32_t anchorEnd) {
+	// The anchors stop at any other introns in the alignment, so their skipped
+	// bases aren't counted as mismatches
+	uint32_t leftStart = anchorStart;
 	uint32_t leftEnd = i.start - 1;
 	uint32_t rightStart = i.end + 1;
-	uint32_t qLeftStart = leftStart;
-	uint32_t qLeftEnd = leftEnd;
-	uint32_t qRightStart = rightStart;
-	uint32_t qRightEnd = rightEnd;
-	string qAnchorLeft = ba->getPaddedQuerySeq(leftStart, leftEnd, qLeftStart, qLeftEnd, false);
-	string qAnchorRight = ba->getPaddedQuerySeq(rightStart, rightEnd, qRightStart, qRightEnd, false);
-	string gAnchorLeft = ba->getPaddedGenomeSeq(ancLeft, leftStart, leftEnd, qLeftStart, qLeftEnd, false);
-	string gAnchorRight = ba->getPaddedGenomeSeq(ancRight, rightStart, rightEnd, qRightStart, qRightEnd, false);
-	if (qAnchorLeft.size() != gAnchorLeft.size() || qAnchorLeft.empty()) {
+	uint32_t rightEnd = min<int32_t>(anchorEnd, i.ref.length - 1);
+	if (!genome.fetch(leftStart, rightEnd)) {
 		BOOST_THROW_EXCEPTION(JunctionException() << JunctionErrorInfo(string(
-								  "Left anchor region for query and genome are not the same size.")
-							  + "\nIntron: " + i.toString()
-							  + "\nJunction anchor limits: " + lexical_cast<string>(leftStart) + "," + lexical_cast<string>(rightEnd)
-							  + "\nGenomic sequence: " + ancLeft
-							  + "\nAlignment coords (before soft clipping): " + ba->toString(false)
-							  + "\nAlignment coords (after soft clipping): " + ba->toString(true)
-							  + "\nRead name: " + ba->deriveName()
-							  + "\nRead seq (before soft clipping): " + ba->getQuerySeq() + " (" + lexical_cast<string>(ba->getQuerySeq().size()) + ")"
-							  + "\nRead seq (after soft clipping): " + ba->getQuerySeqAfterClipping() + " (" + lexical_cast<string>(ba->getQuerySeqAfterClipping().size()) + ")"
-							  + "\nCigar: " + ba->getCigarAsString()
-							  + "\nLeft Anchor query seq:  \n" + qAnchorLeft + " (" + lexical_cast<string>(qAnchorLeft.size()) + ")"
-							  + "\nLeft Anchor genome seq: \n" + gAnchorLeft + " (" + lexical_cast<string>(gAnchorLeft.size()) + ")"));
+								  "Can't find anchor regions for alignment: ") + al.toString(false)
+							  + "\nIntron: " + i.toString()));
 	}
-	if (qAnchorRight.size() != gAnchorRight.size() || qAnchorRight.empty()) {
+	const vector<uint8_t>& ref = genome.getCodes();
+	const MatchStats left = al.compareWithReference(ref.data(), genome.getStart(), ref.size(), leftStart, leftEnd);
+	const MatchStats right = al.compareWithReference(ref.data(), genome.getStart(), ref.size(), rightStart, rightEnd);
+	if (left.nbPositions == 0 || right.nbPositions == 0) {
 		BOOST_THROW_EXCEPTION(JunctionException() << JunctionErrorInfo(string(
-								  "Right Anchor region for query and genome are not the same size.")
+								  "Alignment has no bases in the ") + (left.nbPositions == 0 ? "left" : "right") + " anchor region."
 							  + "\nIntron: " + i.toString()
 							  + "\nJunction anchor limits: " + lexical_cast<string>(leftStart) + "," + lexical_cast<string>(rightEnd)
-							  + "\nGenomic sequence: " + ancRight
-							  + "\nAlignment coords (before soft clipping): " + ba->toString(false)
-							  + "\nAlignment coords (after soft clipping): " + ba->toString(true)
-							  + "\nRead name: " + ba->deriveName()
-							  + "\nRead seq (before soft clipping): " + ba->getQuerySeq() + " (" + lexical_cast<string>(ba->getQuerySeq().size()) + ")"
-							  + "\nRead seq (after soft clipping): " + ba->getQuerySeqAfterClipping() + " (" + lexical_cast<string>(ba->getQuerySeqAfterClipping().size()) + ")"
-							  + "\nCigar: " + ba->getCigarAsString()
-							  + "\nRight Anchor query seq:  \n" + qAnchorRight + " (" + lexical_cast<string>(qAnchorRight.size()) + ")"
-							  + "\nRight Anchor genome seq: \n" + gAnchorRight + " (" + lexical_cast<string>(gAnchorRight.size()) + ")"));
+							  + "\nAlignment coords (before soft clipping): " + al.toString(false)
+							  + "\nAlignment coords (after soft clipping): " + al.toString(true)
+							  + "\nRead name: " + al.deriveName()
+							  + "\nCigar: " + al.getCigarAsString()));
 	}
-	totalUpstreamMismatches = SeqUtils::hammingDistance(qAnchorLeft, gAnchorLeft);
-	totalDownstreamMismatches = SeqUtils::hammingDistance(qAnchorRight, gAnchorRight);
-	totalUpstreamMatches = qAnchorLeft.size() - totalUpstreamMismatches;
-	totalDownstreamMatches = qAnchorRight.size() - totalDownstreamMismatches;
-	nbMismatches = totalUpstreamMismatches + totalDownstreamMismatches;
-	upstreamMatches = getNbMatchesFromEnd(qAnchorLeft, gAnchorLeft);
-	downstreamMatches = getNbMatchesFromStart(qAnchorRight, gAnchorRight);
-	minMatch = min(upstreamMatches, downstreamMatches);
-	maxMatch = max(upstreamMatches, downstreamMatches);
-	mmes = min(totalUpstreamMatches, totalDownstreamMatches);
-}
-
-uint32_t portcullis::AlignmentInfo::getNbMatchesFromStart(const string& query, const string& anchor) {
-	for (size_t i = 0; i < query.size(); i++) {
-		if (query[i] != anchor[i]) {
-			return i;
-		}
-	}
-	return query.size();
-}
-
-uint32_t portcullis::AlignmentInfo::getNbMatchesFromEnd(const string& query, const string& anchor) {
-	for (size_t i = query.size() - 1; i >= 0; i--) {
-		if (query[i] != anchor[i]) {
-			return query.size() - i - 1;
-		}
-	}
-	return query.size();
+	nbMismatches = left.nbMismatches + right.nbMismatches;
+	minMatch = min(left.nbMatchesFromEnd, right.nbMatchesFromStart);
+	mmes = min(left.getNbMatches(), right.getNbMatches());
 }
 
 /**
@@ -274,10 +269,7 @@ portcullis::Junction::Junction(shared_ptr<Intron> _location, int32_t _leftAncSta
 	multipleMappingScore = 0.0;
 	nbUpstreamFlankingAlignments = 0;
 	nbDownstreamFlankingAlignments = 0;
-	junctionAnchorDepth.clear();
-	for (size_t i = 0; i < JAD_NAMES.size(); i++) {
-		junctionAnchorDepth.push_back(0);
-	}
+	junctionAnchorDepth.assign(JAD_NAMES.size(), 0);
 	alignments.clear();
 	alignmentCodes.clear();
 	trimmedCoverage.clear();
@@ -332,9 +324,9 @@ portcullis::Junction::Junction(const Junction& j, bool withAlignments) {
 	nbUpstreamFlankingAlignments = j.nbUpstreamFlankingAlignments;
 	nbDownstreamFlankingAlignments = j.nbDownstreamFlankingAlignments;
 	if (withAlignments) {
-		for (size_t i = 0; i < j.alignments.size(); i++) {
-			this->alignments.push_back(make_shared<AlignmentInfo>(j.alignments[i]->ba));
-			this->alignmentCodes.push_back(j.alignments[i]->nameCode);
+		alignments = j.alignments;
+		for (const auto & a : j.alignments) {
+			alignmentCodes.push_back(a.nameCode);
 		}
 	}
 	trimmedCoverage.clear();
@@ -345,10 +337,7 @@ portcullis::Junction::Junction(const Junction& j, bool withAlignments) {
 	for (auto & x : j.trimmedLogDevCov) {
 		trimmedLogDevCov.push_back(x);
 	}
-	junctionAnchorDepth.clear();
-	for (size_t i = 0; i < JAD_NAMES.size(); i++) {
-		junctionAnchorDepth.push_back(j.getJunctionAnchorDepth(i));
-	}
+	junctionAnchorDepth.assign(j.junctionAnchorDepth.begin(), j.junctionAnchorDepth.begin() + JAD_NAMES.size());
 }
 
 // **** Destructor ****
@@ -360,13 +349,16 @@ portcullis::Junction::~Junction() {
 
 void portcullis::Junction::clearAlignments() {
 	alignments.clear();
+	alignments.shrink_to_fit();
 }
 
-void portcullis::Junction::addJunctionAlignment(const BamAlignment& al) {
-	// Make sure we take a proper copy of this alignment for safe storage
-	AlignmentInfoPtr aip = make_shared<AlignmentInfo>(make_shared<BamAlignment>(al));
-	this->alignments.push_back(aip);
-	this->alignmentCodes.push_back(aip->nameCode);
+void portcullis::Junction::addJunctionAlignment(const BamAlignment& al, GenomeBuffer* genome, const int32_t anchorStart, const int32_t anchorEnd) {
+	AlignmentSummary summary(al, *intron);
+	if (genome != nullptr) {
+		summary.calcMatchStats(al, *intron, *genome, anchorStart, anchorEnd);
+	}
+	this->alignments.push_back(summary);
+	this->alignmentCodes.push_back(summary.nameCode);
 	this->nbAlRaw = this->alignments.size();
 	if (al.getNbJunctionsInRead() > 1) {
 		this->nbAlMultiplySpliced++;
@@ -405,7 +397,7 @@ void portcullis::Junction::determineStrandFromReads() {
 	uint32_t nb_neg = 0;
 	uint32_t nb_unk = 0;
 	for (const auto & a : alignments) {
-		switch (a->ba->getStrand()) {
+		switch (a.strand) {
 		case Strand::POSITIVE:
 			nb_pos++;
 			break;
@@ -430,15 +422,42 @@ void portcullis::Junction::determineStrandFromReads() {
 	}
 }
 
+size_t portcullis::Junction::addJunctionWindows(GenomeWindows& windows) const {
+	if (intron == nullptr)
+		BOOST_THROW_EXCEPTION(JunctionException() << JunctionErrorInfo(string(
+								  "Can't find genomic sequence for this junction as no intron is defined")));
+	// Donor and acceptor sites, anchors, then the 10bp at either end of the intron
+	const size_t first = windows.add(intron->start, intron->start + 1);
+	windows.add(intron->end - 1, intron->end);
+	windows.add(leftAncStart, intron->start - 1);
+	windows.add(intron->end + 1, rightAncEnd);
+	windows.add(intron->start, intron->start + 9);
+	windows.add(intron->end - 9, intron->end);
+	return first;
+}
+
 void portcullis::Junction::processJunctionWindow(const GenomeMapper& genomeMapper) {
 	if (intron == nullptr)
 		BOOST_THROW_EXCEPTION(JunctionException() << JunctionErrorInfo(string(
 								  "Can't find genomic sequence for this junction as no intron is defined")));
+	GenomeWindows windows(genomeMapper, intron->ref.name);
+	const size_t first = addJunctionWindows(windows);
+	windows.fetch();
+	processJunctionWindow(windows, first);
+}
+
+void portcullis::Junction::processJunctionWindow(const GenomeWindows& windows, const size_t first) {
+	processJunctionSequence(windows, first);
+	// The match stats for each alignment were calculated as it was added
+	this->calcMismatchStats();
+}
+
+void portcullis::Junction::processJunctionSequence(const GenomeWindows& windows, const size_t first) {
 	// Process the predicted donor / acceptor regions and update junction
 	int donorLen = -1;
 	int acceptorLen = -1;
-	string donor = genomeMapper.fetchBases(intron->ref.name.c_str(), intron->start, intron->start + 1, &donorLen);
-	string acceptor = genomeMapper.fetchBases(intron->ref.name.c_str(), intron->end - 1, intron->end, &acceptorLen);
+	string donor = windows.get(first, &donorLen);
+	string acceptor = windows.get(first + 1, &acceptorLen);
 	if (donorLen == -1)
 		BOOST_THROW_EXCEPTION(JunctionException() << JunctionErrorInfo(string(
 								  "Can't find donor site (left side splice site) region for junction: ") + this->intron->toString()));
@@ -463,10 +482,10 @@ void portcullis::Junction::processJunctionWindow(const GenomeMapper& genomeMappe
 	int leftIntLen = -1;
 	int rightAncLen = -1;
 	int rightIntLen = -1;
-	string leftAnc = genomeMapper.fetchBases(intron->ref.name.c_str(), leftAncStart, intron->start - 1, &leftAncLen);
-	string rightAnc = genomeMapper.fetchBases(intron->ref.name.c_str(), intron->end + 1, rightAncEnd, &rightAncLen);
-	string leftInt = genomeMapper.fetchBases(intron->ref.name.c_str(), intron->start, intron->start + 9, &leftIntLen);
-	string rightInt = genomeMapper.fetchBases(intron->ref.name.c_str(), intron->end - 9, intron->end, &rightIntLen);
+	string leftAnc = windows.get(first + 2, &leftAncLen);
+	string rightAnc = windows.get(first + 3, &rightAncLen);
+	string leftInt = windows.get(first + 4, &leftIntLen);
+	string rightInt = windows.get(first + 5, &rightIntLen);
 	if (leftAncLen == -1)
 		BOOST_THROW_EXCEPTION(JunctionException() << JunctionErrorInfo(string(
 								  "Can't find left anchor region for junction: ") + this->intron->toString()));
@@ -511,12 +530,6 @@ void portcullis::Junction::processJunctionWindow(const GenomeMapper& genomeMappe
 	string leftAnchor10 = leftAncLen < 10 ? leftAnc : leftAnc.substr(leftAncLen - 10, 10);
 	string rightAnchor10 = rightAncLen < 10 ? rightAnc : rightAnc.substr(0, 10);
 	this->calcHammingScores(leftAnchor10, leftInt, rightInt, rightAnchor10);
-	// Update match statistics for each alignment
-	for (const auto & a : alignments) {
-		a->calcMatchStats(*getIntron(), this->getLeftAncStart(), this->getRightAncEnd(), leftAnc, rightAnc);
-	}
-	// MaxMMES can now use info in alignments
-	this->calcMismatchStats();
 }
 
 void portcullis::Junction::processJunctionVicinity(BamReader& reader, int32_t refLength, int32_t meanQueryLength, int32_t maxQueryLength) {
@@ -589,7 +602,7 @@ void portcullis::Junction::calcMetrics(Orientation orientation) {
 double portcullis::Junction::calcEntropy() {
 	vector<int32_t> junctionPositions;
 	for (const auto & a : alignments) {
-		junctionPositions.push_back(a->ba->getStart());
+		junctionPositions.push_back(a.start);
 	}
 	// Should already be sorted but let's be sure.  This is critical to the rest
 	// of the algorithm.  It's possible after soft clips are removed that the reads
@@ -632,27 +645,26 @@ void portcullis::Junction::calcAlignmentStats(Orientation orientation) {
 	const bool properPairedCheck = doProperPairCheck(orientation);
 	//cout << junctionAlignments.size() << endl;
 	for (const auto & a : alignments) {
-		BamAlignmentPtr ba = a->ba;
-		const int32_t start = ba->getStart();
-		const int32_t end = ba->getEnd();
+		const int32_t start = a.start;
+		const int32_t end = a.end;
 		if (start != lastStart || end != lastEnd) {
 			nbAlDistinct++;
 			lastStart = start;
 			lastEnd = end;
 		}
 		bool reliable = true;
-		if (ba->getMapQuality() >= MAP_QUALITY_THRESHOLD) {
+		if (a.mapQuality >= MAP_QUALITY_THRESHOLD) {
 			nbAlUniquelyMapped++;
 		}
 		else {
 			reliable = false;
 		}
 		// Get properly paired BAM flag regardless
-		if (ba->isProperPair()) {
+		if (a.bamProperPair) {
 			nbAlBamProperlyPaired++;
 		}
 		if (properPairedCheck) {
-			bool pp = ba->calcIfProperPair(orientation);
+			bool pp = a.isProperPair(orientation);
 			if (pp) {
 				nbAlPortcullisProperlyPaired++;
 			}
@@ -663,22 +675,8 @@ void portcullis::Junction::calcAlignmentStats(Orientation orientation) {
 		if (reliable) {
 			nbAlReliable++;
 		}
-		uint32_t upjuncs = 0;
-		uint32_t downjuncs = 0;
-		int32_t pos = start;
-		for (CigarOp op : ba->getCigar()) {
-			if (CigarOp::opConsumesReference(op.type)) {
-				pos += op.length;
-			}
-			if (op.type == BAM_CIGAR_REFSKIP_CHAR) {
-				if (pos < intron->start) {
-					upjuncs++;
-				}
-				else if (pos > intron->end + 1) {
-					downjuncs++;
-				}
-			}
-		}
+		const uint32_t upjuncs = a.upstreamJunctions;
+		const uint32_t downjuncs = a.downstreamJunctions;
 		nbUpstreamJunctions = max(nbUpstreamJunctions, upjuncs);
 		nbDownstreamJunctions = max(nbDownstreamJunctions, downjuncs);
 	}
@@ -735,15 +733,15 @@ void portcullis::Junction::calcMismatchStats() {
 	uint32_t firstMismatch = 100000000;
 	for (const auto & a : alignments) {
 		// Update maxMMES for this alignment
-		maxMMES = max(maxMMES, a->mmes);
+		maxMMES = max(maxMMES, a.mmes);
 		// Update total number of mismatches in this junction
-		nbMismatches += a->nbMismatches;
+		nbMismatches += a.nbMismatches;
 		// Keep a record of the first mismatch detected
-		if (a->minMatch > 0) {
-			firstMismatch = min(firstMismatch, a->minMatch);
+		if (a.minMatch > 0) {
+			firstMismatch = min(firstMismatch, a.minMatch);
 		}
 		// Update junction overhang vector
-		for (uint16_t i = 0; i < JAD_NAMES.size() && i < a->minMatch; i++) {
+		for (uint16_t i = 0; i < JAD_NAMES.size() && i < a.minMatch; i++) {
 			junctionAnchorDepth[i]++;
 		}
 	}
@@ -755,7 +753,7 @@ void portcullis::Junction::calcMismatchStats() {
 	if (nbMismatches > 0 && firstMismatch < 20) {
 		bool found = false;
 		for (const auto & a : alignments) {
-			if (a->minMatch > firstMismatch) {
+			if (a.minMatch > firstMismatch) {
 				found = true;
 				break;
 			}
@@ -769,28 +767,37 @@ void portcullis::Junction::calcMismatchStats() {
 /**
  * Calculates metric 18.  Multiple mapping score
  */
-void portcullis::Junction::calcMultipleMappingScore(SplicedAlignmentMap& map) {
+void portcullis::Junction::calcMultipleMappingScore(const SplicedAlignmentMap& map) {
 	size_t N = alignmentCodes.size();
 	uint32_t M = 0;
 	for (const auto & a : alignmentCodes) {
-		M += map[a]; // Number of multiple splitting patterns
+		M += map.count(a); // Number of multiple splitting patterns
 	}
 	this->multipleMappingScore = (double) N / (double) M;
 }
 
-double portcullis::Junction::calcCoverage(int32_t a, int32_t b, const vector<uint32_t>& coverageLevels) {
+static double calcWindowCoverage(int32_t a, int32_t b, const vector<uint32_t>& coverageLevels, int32_t offset, int32_t nbLevels) {
 	double multiplier = 1.0 / (b - a);
 	uint32_t readCount = 0;
 	for (int32_t i = a; i <= b; i++) {
 		// Don't do anything stupid!
-		if (i >= 0 && i < coverageLevels.size()) {
-			readCount += coverageLevels[i];
+		if (i >= 0 && i < nbLevels && i >= offset && i - offset < (int32_t)coverageLevels.size()) {
+			readCount += coverageLevels[i - offset];
 		}
 	}
 	return multiplier * (double) readCount;
 }
 
+double portcullis::Junction::calcCoverage(int32_t a, int32_t b, const vector<uint32_t>& coverageLevels) {
+	return calcWindowCoverage(a, b, coverageLevels, 0, coverageLevels.size());
+}
+
 double portcullis::Junction::calcCoverage(const vector<uint32_t>& coverageLevels) {
+	return calcCoverage(coverageLevels, 0, coverageLevels, 0, coverageLevels.size());
+}
+
+double portcullis::Junction::calcCoverage(const vector<uint32_t>& donorLevels, int32_t donorOffset,
+		const vector<uint32_t>& acceptorLevels, int32_t acceptorOffset, int32_t nbLevels) {
 	const uint32_t REGION_LENGTH = 10;
 	int32_t donorStart = intron->start - 2 * REGION_LENGTH;
 	int32_t donorMid = intron->start - REGION_LENGTH;
@@ -799,11 +806,11 @@ double portcullis::Junction::calcCoverage(const vector<uint32_t>& coverageLevels
 	int32_t acceptorMid = intron->end + REGION_LENGTH;
 	int32_t acceptorEnd = intron->end + 2 * REGION_LENGTH;
 	double donorCoverage =
-		calcCoverage(donorStart, donorMid - 1, coverageLevels) -
-		calcCoverage(donorMid, donorEnd, coverageLevels);
+		calcWindowCoverage(donorStart, donorMid - 1, donorLevels, donorOffset, nbLevels) -
+		calcWindowCoverage(donorMid, donorEnd, donorLevels, donorOffset, nbLevels);
 	double acceptorCoverage =
-		calcCoverage(acceptorMid, acceptorEnd, coverageLevels) -
-		calcCoverage(acceptorStart, acceptorMid - 1, coverageLevels);
+		calcWindowCoverage(acceptorMid, acceptorEnd, acceptorLevels, acceptorOffset, nbLevels) -
+		calcWindowCoverage(acceptorStart, acceptorMid - 1, acceptorLevels, acceptorOffset, nbLevels);
 	coverage = donorCoverage + acceptorCoverage;
 	return coverage;
 }
@@ -1169,25 +1176,40 @@ shared_ptr<portcullis::Junction> portcullis::Junction::parse(const string& line)
 	return j;
 }
 
+size_t portcullis::Junction::addCodingWindows(GenomeWindows& windows) const {
+	// Exon and intron either side of both splice sites
+	const size_t first = windows.add(this->intron->start - 82, this->intron->start - 2);
+	windows.add(this->intron->start, this->intron->start + 80);
+	windows.add(this->intron->end - 80, this->intron->end);
+	windows.add(this->intron->end + 1, this->intron->end + 81);
+	return first;
+}
+
 double portcullis::Junction::calcCodingPotential(GenomeMapper& gmap, KmerMarkovModel& exon, KmerMarkovModel& intron) {
+	GenomeWindows windows(gmap, this->intron->ref.name);
+	const size_t first = addCodingWindows(windows);
+	windows.fetch();
+	return calcCodingPotential(windows, first, exon, intron);
+}
+
+double portcullis::Junction::calcCodingPotential(const GenomeWindows& windows, const size_t first, KmerMarkovModel& exon, KmerMarkovModel& intron) {
 	int len = 0;
-	const char* ref = this->intron->ref.name.c_str();
 	const bool neg = getConsensusStrand() == Strand::NEGATIVE;
-	string left_exon = gmap.fetchBases(ref, this->intron->start - 82, this->intron->start - 2, &len);
+	string left_exon = windows.get(first, &len);
 	if (neg) {
-		left_exon = SeqUtils::reverseComplement(left_exon);
+		SeqUtils::reverseComplementInPlace(left_exon);
 	}
-	string left_intron = gmap.fetchBases(ref, this->intron->start, this->intron->start + 80, &len);
+	string left_intron = windows.get(first + 1, &len);
 	if (neg) {
-		left_intron = SeqUtils::reverseComplement(left_intron);
+		SeqUtils::reverseComplementInPlace(left_intron);
 	}
-	string right_intron = gmap.fetchBases(ref, this->intron->end - 80, this->intron->end, &len);
+	string right_intron = windows.get(first + 2, &len);
 	if (neg) {
-		right_intron = SeqUtils::reverseComplement(right_intron);
+		SeqUtils::reverseComplementInPlace(right_intron);
 	}
-	string right_exon = gmap.fetchBases(ref, this->intron->end + 1, this->intron->end + 81, &len);
+	string right_exon = windows.get(first + 3, &len);
 	if (neg) {
-		right_exon = SeqUtils::reverseComplement(right_exon);
+		SeqUtils::reverseComplementInPlace(right_exon);
 	}
 	/*
 	cout << "Left exon   : " << this->consensusStrand << " : " << left_exon << endl;
@@ -1202,19 +1224,35 @@ double portcullis::Junction::calcCodingPotential(GenomeMapper& gmap, KmerMarkovM
 	return this->codingPotential;
 }
 
+size_t portcullis::Junction::addSplicingWindows(GenomeWindows& windows) const {
+	// Splice signal around the left and right splice sites
+	const size_t first = windows.add(intron->start - 3, intron->start + 20);
+	windows.add(intron->end - 20, intron->end + 2);
+	return first;
+}
+
 portcullis::SplicingScores portcullis::Junction::calcSplicingScores(GenomeMapper& gmap, KmerMarkovModel& donorT, KmerMarkovModel& donorF,
 		KmerMarkovModel& acceptorT, KmerMarkovModel& acceptorF,
 		PosMarkovModel& donorP, PosMarkovModel& acceptorP) {
+	GenomeWindows windows(gmap, intron->ref.name);
+	const size_t first = addSplicingWindows(windows);
+	windows.fetch();
+	return calcSplicingScores(windows, first, donorT, donorF, acceptorT, acceptorF, donorP, acceptorP);
+}
+
+portcullis::SplicingScores portcullis::Junction::calcSplicingScores(const GenomeWindows& windows, const size_t first,
+		KmerMarkovModel& donorT, KmerMarkovModel& donorF,
+		KmerMarkovModel& acceptorT, KmerMarkovModel& acceptorF,
+		PosMarkovModel& donorP, PosMarkovModel& acceptorP) {
 	int len = 0;
-	const char* ref = this->intron->ref.name.c_str();
 	const bool neg = getConsensusStrand() == Strand::NEGATIVE;
-	string left = gmap.fetchBases(ref, intron->start - 3, intron->start + 20, &len);
+	string left = windows.get(first, &len);
 	if (neg) {
-		left = SeqUtils::reverseComplement(left);
+		SeqUtils::reverseComplementInPlace(left);
 	}
-	string right = gmap.fetchBases(ref, intron->end - 20, intron->end + 2, &len);
+	string right = windows.get(first + 1, &len);
 	if (neg) {
-		right = SeqUtils::reverseComplement(right);
+		SeqUtils::reverseComplementInPlace(right);
 	}
 	string donorseq = neg ? right : left;
 	string acceptorseq = neg ? left : right;
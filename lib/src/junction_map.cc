@@ -0,0 +1,65 @@
+//  ********************************************************************
+//  This file is part of Portcullis.
+//
+//  Portcullis is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  Portcullis is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with Portcullis.  If not, see <http://www.gnu.org/licenses/>.
+//  *******************************************************************
+
+#include <algorithm>
+#include <vector>
+using std::vector;
+
+#include <portcullis/junction_map.hpp>
+
+static const size_t INITIAL_CAPACITY = 64;
+
+portcullis::JunctionMap::JunctionMap() : nbJunctions(0), mask(0) {
+}
+
+void portcullis::JunctionMap::insert(const IntronKey& key, JunctionPtr junction) {
+	// Keep the table no more than 70% full
+	if ((nbJunctions + 1) * 10 > keys.size() * 7) {
+		grow();
+	}
+	const size_t i = findSlot(key);
+	if (!junctions[i]) {
+		keys[i] = key;
+		nbJunctions++;
+	}
+	junctions[i] = junction;
+}
+
+void portcullis::JunctionMap::grow() {
+	const size_t capacity = std::max(keys.size() * 2, INITIAL_CAPACITY);
+	vector<IntronKey> oldKeys(capacity);
+	vector<JunctionPtr> oldJunctions(capacity);
+	std::swap(keys, oldKeys);
+	std::swap(junctions, oldJunctions);
+	mask = capacity - 1;
+	for (size_t i = 0; i < oldKeys.size(); i++) {
+		if (oldJunctions[i]) {
+			const size_t j = findSlot(oldKeys[i]);
+			keys[j] = oldKeys[i];
+			junctions[j] = std::move(oldJunctions[i]);
+		}
+	}
+}
+
+void portcullis::JunctionMap::clear() {
+	keys.clear();
+	keys.shrink_to_fit();
+	junctions.clear();
+	junctions.shrink_to_fit();
+	nbJunctions = 0;
+	mask = 0;
+}
@@ -15,9 +15,13 @@
 //  along with Portcullis.  If not, see <http://www.gnu.org/licenses/>.
 //  *******************************************************************
 
+#include <algorithm>
 #include <fstream>
+#include <functional>
 #include <iostream>
 #include <memory>
+#include <queue>
+#include <thread>
 #include <unordered_map>
 #include <unordered_set>
 #include <vector>
@@ -26,6 +30,8 @@ using std::endl;
 using std::ifstream;
 using std::ofstream;
 using std::shared_ptr;
+using std::thread;
+using std::unique_ptr;
 using std::unordered_set;
 
 #include <boost/lexical_cast.hpp>
@@ -34,20 +40,26 @@ using std::unordered_set;
 using boost::lexical_cast;
 using boost::timer::auto_cpu_timer;
 
-#include <portcullis/bam/depth_parser.hpp>
-using portcullis::bam::DepthParser;
+#include <portcullis/bam/bam_reader.hpp>
+#include <portcullis/bam/sparse_depth.hpp>
+using portcullis::bam::BamReader;
+using portcullis::bam::CigarView;
+using portcullis::bam::SparseDepth;
 
 #include <portcullis/intron.hpp>
 #include <portcullis/junction.hpp>
 #include <portcullis/seq_utils.hpp>
 using portcullis::Intron;
-using portcullis::IntronHasher;
+using portcullis::IntronKey;
 using portcullis::Junction;
 using portcullis::JunctionPtr;
 using portcullis::SeqUtils;
 
 #include <portcullis/junction_system.hpp>
 
+// Smallest number of junctions worth sorting in a separate thread
+static const size_t MIN_PARALLEL_SORT_SLICE = 10000;
+
 size_t portcullis::JunctionSystem::createJunctionGroup(size_t index, vector<JunctionPtr>& group) {
 	JunctionPtr junc = junctionList[index];
 	group.push_back(junc);
@@ -65,16 +77,19 @@ size_t portcullis::JunctionSystem::createJunctionGroup(size_t index, vector<Junc
 	return foundMore ? index : junctionList.size() - 1;
 }
 
-void portcullis::JunctionSystem::findJunctions(const int32_t refId, JunctionList& subset) {
-	subset.clear();
+void portcullis::JunctionSystem::groupJunctionsByTarget(const int32_t nbTargets, vector<JunctionList>& targetJunctions) const {
+	targetJunctions.clear();
+	targetJunctions.resize(nbTargets);
 	for (JunctionPtr j : junctionList) {
-		if (j->getIntron()->ref.index == refId) {
-			subset.push_back(j);
+		const int32_t refId = j->getIntron()->ref.index;
+		if (refId >= 0 && refId < nbTargets) {
+			targetJunctions[refId].push_back(j);
 		}
 	}
 }
 
 portcullis::JunctionSystem::JunctionSystem() {
+	nbJunctionAlignments = 0;
 	minQueryLength = 0;
 	meanQueryLength = 0.0;
 	maxQueryLength = 0;
@@ -116,10 +131,19 @@ void portcullis::JunctionSystem::setQueryLengthStats(int32_t min, double mean, i
 	this->maxQueryLength = max;
 }
 
+void portcullis::JunctionSystem::setArena(ArenaPtr arena) {
+	if (!junctionList.empty()) {
+		BOOST_THROW_EXCEPTION(JunctionException() << JunctionErrorInfo(string(
+								  "Can't set the arena for a junction system that already holds junctions")));
+	}
+	this->arena = arena;
+}
+
 bool portcullis::JunctionSystem::addJunction(JunctionPtr j) {
 	j->clearAlignments();
-	distinctJunctions[*(j->getIntron())] = j;
+	distinctJunctions.insert(IntronKey(*(j->getIntron())), j);
 	junctionList.push_back(j);
+	return true;
 }
 
 /**
@@ -133,30 +157,41 @@ void portcullis::JunctionSystem::append(JunctionSystem& other) {
 	}
 }
 
-bool portcullis::JunctionSystem::addJunctions(const BamAlignment& al, const size_t startOp, const int32_t offset) {
+void portcullis::JunctionSystem::concatenate(JunctionSystem& other) {
+	junctionList.reserve(junctionList.size() + other.junctionList.size());
+	for (auto & j : other.junctionList) {
+		j->setId(junctionList.size());
+		distinctJunctions.insert(IntronKey(*(j->getIntron())), j);
+		junctionList.push_back(std::move(j));
+	}
+	other.junctionList.clear();
+	other.distinctJunctions.clear();
+}
+
+bool portcullis::JunctionSystem::addJunctions(const BamAlignment& al, const size_t startOp, const int32_t offset, const int32_t regionStart, const int32_t regionEnd, GenomeBuffer* genome) {
 	bool foundJunction = false;
-	const size_t nbOps = al.getNbCigarOps();
+	const CigarView cigar = al.getCigarView();
+	const size_t nbOps = cigar.size();
 	const int32_t refId = al.getReferenceId();
 	int32_t lStart = offset;
 	int32_t lEndExc = lStart; // End of left anchor exclusive (i.e. +1)
 	int32_t rStart = lStart;
 	int32_t rEndExc = lStart; // End of right anchor exclusive (i.e. +1)
 	for (size_t i = startOp; i < nbOps; i++) {
-		CigarOp op = al.getCigarOpAt(i);
-		if (op.type == BAM_CIGAR_REFSKIP_CHAR) {
+		if (cigar.op(i) == BAM_CREF_SKIP) {
 			foundJunction = true;
 			const int32_t refLength = refs->at(refId)->length;
-			rStart = lEndExc + op.length;
+			rStart = lEndExc + cigar.length(i);
 			rEndExc = rStart;
 			// Establish end position of right anchor in genomic coordinates
 			size_t j = i + 1;
 			while (j < nbOps
 					&& rEndExc <= refLength
-					&& al.getCigarOpAt(j).type != BAM_CIGAR_REFSKIP_CHAR) {
-				CigarOp rOp = al.getCigarOpAt(j++);
-				if (CigarOp::opConsumesReference(rOp.type)) {
-					rEndExc += rOp.length;
+					&& cigar.op(j) != BAM_CREF_SKIP) {
+				if (cigar.consumesReference(j)) {
+					rEndExc += cigar.length(j);
 				}
+				j++;
 			}
 			// Do some sanity checking... make sure there are not any strange N cigar ops that
 			// drift over the edge of a reference sequence... seems like this can actually
@@ -168,78 +203,290 @@ bool portcullis::JunctionSystem::addJunctions(const BamAlignment& al, const size
 			if (rEndExc - 1 >= refLength) {
 				rEndExc = refLength;
 			}
-			// Create the intron
-			shared_ptr<Intron> location = make_shared<Intron>(
-											  RefSeq(refId, refs->at(refId)->name, refLength),
-											  lEndExc,
-											  rStart - 1);
-			// We should now have the complete junction location information
-			JunctionMapIterator it = distinctJunctions.find(*location);
-			// If we couldn't find this location in the hashmap, add a new
-			// location / junction pair.  If we've seen this location before
-			// then add this alignment to the existing junction
-			if (it == distinctJunctions.end()) {
-				JunctionPtr junction = make_shared<Junction>(location, lStart, rEndExc - 1);
-				junction->addJunctionAlignment(al);
-				distinctJunctions[*location] = junction;
-				junctionList.push_back(junction);
-			}
-			else {
-				JunctionPtr junction = it->second;
-				junction->addJunctionAlignment(al);
-				junction->extendAnchors(lStart, rEndExc - 1);
+			// Only record junctions that start in the requested region
+			if (lEndExc >= regionStart && lEndExc < regionEnd) {
+				// We should now have the complete junction location information
+				const IntronKey key(refId, lEndExc, rStart - 1);
+				JunctionPtr junction = distinctJunctions.find(key);
+				// If we couldn't find this location in the hashmap, add a new
+				// location / junction pair.  If we've seen this location before
+				// then add this alignment to the existing junction.  The
+				// target name is only copied for new junctions.
+				if (!junction) {
+					shared_ptr<Intron> intron = std::allocate_shared<Intron>(ArenaAllocator<Intron>(arena),
+													RefSeq(refId, refs->at(refId)->name, refLength), lEndExc, rStart - 1);
+					junction = std::allocate_shared<Junction>(ArenaAllocator<Junction>(arena), intron, lStart, rEndExc - 1);
+					junction->addJunctionAlignment(al, genome, lStart, rEndExc - 1);
+					distinctJunctions.insert(key, junction);
+					junctionList.push_back(junction);
+				}
+				else {
+					junction->addJunctionAlignment(al, genome, lStart, rEndExc - 1);
+					junction->extendAnchors(lStart, rEndExc - 1);
+				}
+				nbJunctionAlignments++;
 			}
 			// Check if we have fully processed the cigar or not.  If not, then
 			// that means that this cigar contains additional junctions, so
 			// process those using recursion
 			if (j < nbOps) {
-				addJunctions(al, i + 1, rStart);
+				addJunctions(al, i + 1, rStart, regionStart, regionEnd, genome);
 				break;
 			}
 		}
-		else if (CigarOp::opConsumesReference(op.type)) {
-			lEndExc += op.length;
+		else if (cigar.consumesReference(i)) {
+			lEndExc += cigar.length(i);
 		}
 		// Ignore any other op types not already covered
 	}
 	return foundJunction;
 }
 
-void portcullis::JunctionSystem::findFlankingAlignments(const path& alignmentsFile, bool verbose) {
+/**
+ * Counts the flanking alignments for all junctions on one target sequence in a
+ * single pass over the coordinate sorted unspliced alignments.
+ *
+ * For a junction, an upstream flanking alignment starts before the intron and
+ * ends within or after the left anchor, and a downstream flanking alignment
+ * starts after the intron and within the right anchor.  Both can be expressed
+ * in terms of the number of alignments starting before a position and the
+ * number ending before a position.  So rather than query the alignments around
+ * each junction, we sort these positions up front and record the running totals
+ * as the alignments stream past.  Only the ends of alignments that overlap the
+ * current position are held in memory.
+ */
+class FlankingSweep {
+private:
+
+	struct Checkpoint {
+		int32_t pos;
+		uint32_t junction;
+		bool upstream;      // Which count to update
+		bool ends;          // Use number of alignments ending before pos rather than starting
+		int8_t sign;
+	};
+
+	JunctionList junctions;
+	vector<Checkpoint> checkpoints;
+	size_t next;
+
+	// Number of alignments starting and ending before the current position
+	uint64_t nbStarted;
+	uint64_t nbEnded;
+
+	// Ends of alignments that have started but may not have ended yet
+	std::priority_queue<int32_t, vector<int32_t>, std::greater<int32_t>> ends;
+
+	vector<int64_t> upstream;
+	vector<int64_t> downstream;
+
+	void resolve(const int32_t pos) {
+		while (next < checkpoints.size() && checkpoints[next].pos <= pos) {
+			const Checkpoint& cp = checkpoints[next++];
+			if (cp.ends) {
+				while (!ends.empty() && ends.top() < cp.pos) {
+					ends.pop();
+					nbEnded++;
+				}
+			}
+			const int64_t count = cp.sign * (int64_t)(cp.ends ? nbEnded : nbStarted);
+			if (cp.upstream) {
+				upstream[cp.junction] += count;
+			}
+			else {
+				downstream[cp.junction] += count;
+			}
+		}
+	}
+
+public:
+
+	FlankingSweep(const JunctionList& _junctions) : junctions(_junctions) {
+		next = 0;
+		nbStarted = 0;
+		nbEnded = 0;
+		upstream.resize(junctions.size(), 0);
+		downstream.resize(junctions.size(), 0);
+		checkpoints.reserve(junctions.size() * 4);
+		for (uint32_t i = 0; i < junctions.size(); i++) {
+			const Junction& j = *junctions[i];
+			const int32_t intronStart = j.getIntron()->start;
+			const int32_t intronEnd = j.getIntron()->end;
+			// Upstream: start < intron start and end >= left anchor start.  Any
+			// alignment ending before the left anchor also starts before the intron.
+			checkpoints.push_back(Checkpoint{intronStart, i, true, false, 1});
+			checkpoints.push_back(Checkpoint{j.getLeftAncStart(), i, true, true, -1});
+			// Downstream: intron end < start <= right anchor end
+			checkpoints.push_back(Checkpoint{j.getRightAncEnd() + 1, i, false, false, 1});
+			checkpoints.push_back(Checkpoint{intronEnd + 1, i, false, false, -1});
+		}
+		std::sort(checkpoints.begin(), checkpoints.end(), [](const Checkpoint & a, const Checkpoint & b) {
+			return a.pos < b.pos;
+		});
+	}
+
+	/**
+	 * Adds the next alignment on this target sequence, in coordinate order
+	 */
+	void add(const BamAlignment& al) {
+		const int32_t start = al.getStart();
+		resolve(start);
+		// Every checkpoint still to come is after this start, so alignments
+		// that ended before it can be counted now rather than kept in the heap
+		while (!ends.empty() && ends.top() < start) {
+			ends.pop();
+			nbEnded++;
+		}
+		nbStarted++;
+		ends.push(al.getEnd());
+	}
+
+	/**
+	 * Resolves all remaining checkpoints and sets the counts on the junctions
+	 */
+	void finish() {
+		resolve(INT32_MAX);
+		for (size_t i = 0; i < junctions.size(); i++) {
+			junctions[i]->setNbUpstreamFlankingAlignments(upstream[i]);
+			junctions[i]->setNbDownstreamFlankingAlignments(downstream[i]);
+		}
+	}
+};
+
+void portcullis::JunctionSystem::findFlankingAlignments(const path& alignmentsFile, bool verbose, uint16_t ioThreads) {
 	auto_cpu_timer timer(1, " done. Wall time taken: %ws\n");
-	// Maybe try to multi-thread this part
-	BamReader reader(alignmentsFile);
+	BamReader reader(alignmentsFile, ioThreads);
 	// Open the file
 	reader.open();
-	// Read the alignments around every junction and set appropriate metrics
-	size_t count = 0;
-	//cout << endl;
-	for (JunctionPtr j : junctionList) {
-		j->processJunctionVicinity(
-			reader,
-			j->getIntron()->ref.length,
-			meanQueryLength,
-			maxQueryLength);
-		//cout << count++ << endl;
+	// Group the junctions by target sequence
+	const int32_t nbTargets = reader.getHeader()->n_targets;
+	vector<JunctionList> targetJunctions;
+	groupJunctionsByTarget(nbTargets, targetJunctions);
+	// Stream through all the alignments once, sweeping over the junctions on
+	// each target sequence in turn
+	vector<bool> swept(nbTargets, false);
+	unique_ptr<FlankingSweep> sweep;
+	int32_t currentRef = -1;
+	while (reader.next()) {
+		const BamAlignment& al = reader.current();
+		const int32_t refId = al.getReferenceId();
+		if (refId != currentRef) {
+			if (sweep != nullptr) {
+				sweep->finish();
+				sweep.reset();
+			}
+			currentRef = refId;
+			if (refId >= 0 && refId < nbTargets && !targetJunctions[refId].empty()) {
+				sweep = unique_ptr<FlankingSweep>(new FlankingSweep(targetJunctions[refId]));
+				swept[refId] = true;
+			}
+		}
+		if (sweep != nullptr) {
+			sweep->add(al);
+		}
+	}
+	if (sweep != nullptr) {
+		sweep->finish();
+	}
+	// Junctions on target sequences without any unspliced alignments
+	for (int32_t i = 0; i < nbTargets; i++) {
+		if (!swept[i] && !targetJunctions[i].empty()) {
+			FlankingSweep(targetJunctions[i]).finish();
+		}
 	}
 	reader.close();
 }
 
-void portcullis::JunctionSystem::calcCoverage(const path& alignmentsFile, Strandedness strandSpecific) {
+// Only record depth in the windows either side of each junction that
+// Junction::calcCoverage uses.  Coverage level i in those windows holds the depth
+// at 0-based position i - 1, as produced by DepthParser.
+static const int32_t COVERAGE_WINDOW = 20;
+
+static unique_ptr<SparseDepth> createCoverageDepth(const JunctionList& junctions) {
+	unique_ptr<SparseDepth> depth(new SparseDepth());
+	for (JunctionPtr j : junctions) {
+		depth->addWindow(j->getIntron()->start - COVERAGE_WINDOW - 1, j->getIntron()->start);
+		depth->addWindow(j->getIntron()->end - 1, j->getIntron()->end + COVERAGE_WINDOW);
+	}
+	depth->index();
+	return depth;
+}
+
+static void setCoverage(const JunctionList& junctions, const SparseDepth& depth, const int32_t refLength) {
+	vector<uint32_t> donorLevels(COVERAGE_WINDOW + 1);
+	vector<uint32_t> acceptorLevels(COVERAGE_WINDOW + 1);
+	for (JunctionPtr j : junctions) {
+		const int32_t donorOffset = j->getIntron()->start - COVERAGE_WINDOW;
+		const int32_t acceptorOffset = j->getIntron()->end;
+		for (int32_t i = 0; i <= COVERAGE_WINDOW; i++) {
+			donorLevels[i] = depth.getDepth(donorOffset + i - 1);
+			acceptorLevels[i] = depth.getDepth(acceptorOffset + i - 1);
+		}
+		j->calcCoverage(donorLevels, donorOffset, acceptorLevels, acceptorOffset, refLength);
+	}
+}
+
+void portcullis::JunctionSystem::calcCoverage(const path& alignmentsFile, Strandedness strandSpecific, uint16_t ioThreads) {
 	auto_cpu_timer timer(1, " done. Wall time taken: %ws\n");
-	DepthParser dp(alignmentsFile, static_cast<uint8_t> (strandSpecific), false);
-	vector<uint32_t> batch;
-	size_t i = 0;
-	while (dp.loadNextBatch(batch)) {
-		JunctionList subset;
-		findJunctions(dp.getCurrentRefIndex(), subset);
-		for (JunctionPtr j : subset) {
-			j->calcCoverage(batch);
+	BamReader reader(alignmentsFile, ioThreads);
+	reader.open();
+	const bam_hdr_t* header = reader.getHeader();
+	vector<JunctionList> targetJunctions;
+	groupJunctionsByTarget(header->n_targets, targetJunctions);
+	vector<bool> done(header->n_targets, false);
+	unique_ptr<SparseDepth> depth;
+	int32_t currentRef = -1;
+	while (reader.next()) {
+		const BamAlignment& al = reader.current();
+		const int32_t refId = al.getReferenceId();
+		if (refId != currentRef) {
+			if (depth != nullptr) {
+				setCoverage(targetJunctions[currentRef], *depth, header->target_len[currentRef]);
+				depth.reset();
+			}
+			currentRef = refId;
+			if (refId >= 0 && refId < header->n_targets && !targetJunctions[refId].empty()) {
+				depth = createCoverageDepth(targetJunctions[refId]);
+				done[refId] = true;
+			}
+		}
+		// Gapped alignments don't contribute to coverage
+		if (depth != nullptr && !al.isSplicedRead()) {
+			depth->addAlignment(al);
 		}
 	}
+	if (depth != nullptr) {
+		setCoverage(targetJunctions[currentRef], *depth, header->target_len[currentRef]);
+	}
+	// Junctions on target sequences without any alignments
+	for (int32_t i = 0; i < header->n_targets; i++) {
+		if (!done[i] && !targetJunctions[i].empty()) {
+			setCoverage(targetJunctions[i], *createCoverageDepth(targetJunctions[i]), header->target_len[i]);
+		}
+	}
+	reader.close();
 }
 
-void portcullis::JunctionSystem::calcMultipleMappingStats(SplicedAlignmentMap& map, bool verbose) {
+void portcullis::JunctionSystem::calcTargetFlankingAndCoverage(BamReader& reader, const int32_t refId, const JunctionList& junctions) {
+	if (junctions.empty()) {
+		return;
+	}
+	const int32_t refLength = reader.getHeader()->target_len[refId];
+	FlankingSweep sweep(junctions);
+	unique_ptr<SparseDepth> depth = createCoverageDepth(junctions);
+	reader.setRegion(refId, 0, refLength);
+	while (reader.next()) {
+		const BamAlignment& al = reader.current();
+		sweep.add(al);
+		if (!al.isSplicedRead()) {
+			depth->addAlignment(al);
+		}
+	}
+	sweep.finish();
+	setCoverage(junctions, *depth, refLength);
+}
+
+void portcullis::JunctionSystem::calcMultipleMappingStats(const SplicedAlignmentMap& map, bool verbose) {
 	for (JunctionPtr j : junctionList) {
 		j->calcMultipleMappingScore(map);
 	}
@@ -321,6 +568,41 @@ void portcullis::JunctionSystem::sort() {
 	std::sort(junctionList.begin(), junctionList.end(), JunctionComparator());
 }
 
+void portcullis::JunctionSystem::sort(const uint16_t threads) {
+	const size_t n = junctionList.size();
+	const size_t nbSlices = std::max<size_t>(1, std::min<size_t>(threads, n / MIN_PARALLEL_SORT_SLICE));
+	if (nbSlices == 1) {
+		sort();
+		return;
+	}
+	vector<JunctionList::iterator> bounds;
+	for (size_t i = 0; i <= nbSlices; i++) {
+		bounds.push_back(junctionList.begin() + (n * i) / nbSlices);
+	}
+	vector<thread> workers;
+	for (size_t i = 0; i < nbSlices; i++) {
+		workers.emplace_back([&bounds, i]() {
+			std::sort(bounds[i], bounds[i + 1], JunctionComparator());
+		});
+	}
+	for (auto & w : workers) {
+		w.join();
+	}
+	// Merge pairs of neighbouring slices, doubling the slice width each round
+	for (size_t width = 1; width < nbSlices; width *= 2) {
+		workers.clear();
+		for (size_t i = 0; i + width < nbSlices; i += 2 * width) {
+			const size_t last = std::min(i + 2 * width, nbSlices);
+			workers.emplace_back([&bounds, i, width, last]() {
+				std::inplace_merge(bounds[i], bounds[i + width], bounds[last], JunctionComparator());
+			});
+		}
+		for (auto & w : workers) {
+			w.join();
+		}
+	}
+}
+
 void portcullis::JunctionSystem::index() {
 	for (size_t i = 0; i < this->size(); i++) {
 		junctionList[i]->setId(i);
@@ -429,21 +711,12 @@ void portcullis::JunctionSystem::load(const path& junctionTabFile, const bool si
 			shared_ptr<Junction> j = Junction::parse(line);
 			junctionList.push_back(j);
 			if (!simple) {
-				distinctJunctions[*(j->getIntron())] = j;
+				distinctJunctions.insert(IntronKey(*(j->getIntron())), j);
 			}
 		}
 	}
 	ifs.close();
 }
 
-JunctionPtr portcullis::JunctionSystem::getJunction(Intron& intron) const {
-	try {
-		return this->distinctJunctions.at(intron);
-	}
-	catch (std::out_of_range ex) {
-		return nullptr;
-	}
-}
-
 string portcullis::JunctionSystem::version = "";
 
@@ -0,0 +1,150 @@
+//  ********************************************************************
+//  This file is part of Portcullis.
+//
+//  Portcullis is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  Portcullis is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with Portcullis.  If not, see <http://www.gnu.org/licenses/>.
+//  *******************************************************************
+
+#include <string>
+#include <vector>
+using std::string;
+using std::vector;
+
+#include <portcullis/junction.hpp>
+using portcullis::Junction;
+using portcullis::JunctionException;
+using portcullis::JunctionErrorInfo;
+
+#include <portcullis/junction_table.hpp>
+
+portcullis::JunctionTable::JunctionTable(const JunctionList& junctions) {
+	addLocations(junctions);
+	// Fill one column at a time, so each pass only calls a single getter
+	for (const auto & kv : JunctionUint32FunctionMap) {
+		addNumericColumn(kv.first, junctions);
+	}
+	for (const auto & kv : JunctionDoubleFunctionMap) {
+		addNumericColumn(kv.first, junctions);
+	}
+	for (const auto & kv : JunctionBoolFunctionMap) {
+		addNumericColumn(kv.first, junctions);
+	}
+	addJunctionAnchorDepthColumns(junctions);
+}
+
+portcullis::JunctionTable::JunctionTable(const JunctionList& junctions, const vector<string>& numericNames) {
+	addLocations(junctions);
+	for (const auto & name : numericNames) {
+		if (numericColumns.count(name) == 0) {
+			addNumericColumn(name, junctions);
+		}
+	}
+}
+
+void portcullis::JunctionTable::addLocations(const JunctionList& junctions) {
+	const size_t n = junctions.size();
+	refIds.reserve(n);
+	starts.reserve(n);
+	ends.reserve(n);
+	leftAncStarts.reserve(n);
+	rightAncEnds.reserve(n);
+	consensusStrands.reserve(n);
+	spliceSiteTypes.reserve(n);
+	for (const auto & j : junctions) {
+		const auto intron = j->getIntron();
+		refIds.push_back(internRefName(intron->ref.name));
+		starts.push_back(intron->start);
+		ends.push_back(intron->end);
+		leftAncStarts.push_back(j->getLeftAncStart());
+		rightAncEnds.push_back(j->getRightAncEnd());
+		consensusStrands.push_back(j->getConsensusStrand());
+		spliceSiteTypes.push_back(j->getSpliceSiteType());
+	}
+}
+
+uint32_t portcullis::JunctionTable::internRefName(const string& name) {
+	auto it = refIndices.find(name);
+	if (it != refIndices.end()) {
+		return it->second;
+	}
+	const uint32_t index = (uint32_t)refNames.size();
+	refNames.push_back(name);
+	refIndices[name] = index;
+	return index;
+}
+
+void portcullis::JunctionTable::addNumericColumn(const string& name, const JunctionList& junctions) {
+	vector<double> col;
+	col.reserve(junctions.size());
+	auto uif = JunctionUint32FunctionMap.find(name);
+	auto df = JunctionDoubleFunctionMap.find(name);
+	auto bf = JunctionBoolFunctionMap.find(name);
+	if (uif != JunctionUint32FunctionMap.end()) {
+		for (const auto & j : junctions) {
+			col.push_back((double)((*j).*(uif->second))());
+		}
+	}
+	else if (df != JunctionDoubleFunctionMap.end()) {
+		for (const auto & j : junctions) {
+			col.push_back(((*j).*(df->second))());
+		}
+	}
+	else if (bf != JunctionBoolFunctionMap.end()) {
+		for (const auto & j : junctions) {
+			col.push_back((double)((*j).*(bf->second))());
+		}
+	}
+	else {
+		BOOST_THROW_EXCEPTION(JunctionException() << JunctionErrorInfo(string(
+								  "Unrecognised junction property: ") + name));
+	}
+	numericColumns[name] = std::move(col);
+}
+
+void portcullis::JunctionTable::addJunctionAnchorDepthColumns(const JunctionList& junctions) {
+	jadColumns.resize(Junction::JAD_NAMES.size());
+	for (size_t i = 0; i < jadColumns.size(); i++) {
+		jadColumns[i].reserve(junctions.size());
+		for (const auto & j : junctions) {
+			jadColumns[i].push_back(j->getJunctionAnchorDepth(i));
+		}
+	}
+}
+
+const vector<double>& portcullis::JunctionTable::getNumericColumn(const string& name) const {
+	auto it = numericColumns.find(name);
+	if (it == numericColumns.end()) {
+		BOOST_THROW_EXCEPTION(JunctionException() << JunctionErrorInfo(string(
+								  "Unrecognised junction property: ") + name));
+	}
+	return it->second;
+}
+
+const vector<uint32_t>& portcullis::JunctionTable::getJunctionAnchorDepthColumn(const size_t index) const {
+	if (index >= jadColumns.size()) {
+		BOOST_THROW_EXCEPTION(JunctionException() << JunctionErrorInfo(string(
+								  "Junction anchor depth column not available: ") + std::to_string(index)));
+	}
+	return jadColumns[index];
+}
+
+string portcullis::JunctionTable::getStringValue(const string& name, const size_t row) const {
+	if (name == "refname") {
+		return getRefName(row);
+	}
+	else if (name == "ss_type") {
+		return string() + cssToChar(spliceSiteTypes[row]);
+	}
+	BOOST_THROW_EXCEPTION(JunctionException() << JunctionErrorInfo(string(
+							  "Unrecognised junction property: ") + name));
+}
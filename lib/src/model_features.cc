@@ -74,37 +74,88 @@ uint32_t portcullis::ml::ModelFeatures::calcIntronThreshold(const JunctionList&
 	return L95;
 }
 
-void portcullis::ml::ModelFeatures::trainCodingPotentialModel(const JunctionList& in) {
-	vector<string> exons;
-	vector<string> introns;
-	for (auto & j : in) {
-		int len = 0;
-		string left_exon = gmap.fetchBases(j->getIntron()->ref.name.c_str(), j->getIntron()->start - 202, j->getIntron()->start - 2, &len);
-		if (j->getConsensusStrand() == Strand::NEGATIVE) {
-			left_exon = SeqUtils::reverseComplement(left_exon);
+/**
+ * Returns the end of the run of junctions, starting at the given index, that
+ * are all on the same target sequence, so that their windows of genomic
+ * sequence can be fetched as one batch
+ */
+static size_t findRefRunEnd(const JunctionList& juncs, const size_t first) {
+	const string& ref = juncs[first]->getIntron()->ref.name;
+	size_t last = first + 1;
+	while (last < juncs.size() && juncs[last]->getIntron()->ref.name == ref) {
+		last++;
+	}
+	return last;
+}
+
+/**
+ * Collects the donor and acceptor splice signals of each junction, in the
+ * order of the list
+ */
+static void collectSpliceSignals(const GenomeMapper& gmap, const JunctionList& juncs, vector<string>& donors, vector<string>& acceptors) {
+	for (size_t first = 0; first < juncs.size();) {
+		const size_t last = findRefRunEnd(juncs, first);
+		GenomeWindows windows(gmap, juncs[first]->getIntron()->ref.name);
+		for (size_t i = first; i < last; i++) {
+			juncs[i]->addSplicingWindows(windows);
 		}
-		exons.push_back(left_exon);
-		/*string left_intron = gmap.fetchBases(j->getIntron()->ref.name.c_str(), j->getIntron()->start, j->getIntron()->start+80, &len);
-		if (j->getConsensusStrand() == Strand::NEGATIVE) {
-		    left_intron = SeqUtils::reverseComplement(left_intron);
+		windows.fetch();
+		for (size_t i = first; i < last; i++) {
+			const JunctionPtr& j = juncs[i];
+			const size_t w = (i - first) * 2;
+			int len = 0;
+			string left = windows.get(w, &len);
+			string right = windows.get(w + 1, &len);
+			if (j->getConsensusStrand() == Strand::NEGATIVE) {
+				SeqUtils::reverseComplementInPlace(left);
+				SeqUtils::reverseComplementInPlace(right);
+				donors.push_back(right);
+				acceptors.push_back(left);
+			}
+			else {
+				donors.push_back(left);
+				acceptors.push_back(right);
+			}
 		}
-		introns.push_back(left_intron);
+		first = last;
+	}
+}
 
-		string right_intron = gmap.fetchBases(j->getIntron()->ref.name.c_str(), j->getIntron()->end-80, j->getIntron()->end, &len);
-		if (j->getConsensusStrand() == Strand::NEGATIVE) {
-		    right_intron = SeqUtils::reverseComplement(right_intron);
-		}
-		introns.push_back(right_intron);*/
-		string intron = gmap.fetchBases(j->getIntron()->ref.name.c_str(), j->getIntron()->start, j->getIntron()->end, &len);
-		if (j->getConsensusStrand() == Strand::NEGATIVE) {
-			intron = SeqUtils::reverseComplement(intron);
+void portcullis::ml::ModelFeatures::trainCodingPotentialModel(const JunctionList& in) {
+	vector<string> exons;
+	vector<string> introns;
+	for (size_t first = 0; first < in.size();) {
+		const size_t last = findRefRunEnd(in, first);
+		// Left exon, whole intron and right exon of each junction
+		GenomeWindows windows(gmap, in[first]->getIntron()->ref.name);
+		for (size_t i = first; i < last; i++) {
+			const Intron& intron = *in[i]->getIntron();
+			windows.add(intron.start - 202, intron.start - 2);
+			windows.add(intron.start, intron.end);
+			windows.add(intron.end + 1, intron.end + 201);
 		}
-		introns.push_back(intron);
-		string right_exon = gmap.fetchBases(j->getIntron()->ref.name.c_str(), j->getIntron()->end + 1, j->getIntron()->end + 201, &len);
-		if (j->getConsensusStrand() == Strand::NEGATIVE) {
-			right_exon = SeqUtils::reverseComplement(right_exon);
+		windows.fetch();
+		for (size_t i = first; i < last; i++) {
+			const bool neg = in[i]->getConsensusStrand() == Strand::NEGATIVE;
+			const size_t w = (i - first) * 3;
+			int len = 0;
+			string left_exon = windows.get(w, &len);
+			if (neg) {
+				SeqUtils::reverseComplementInPlace(left_exon);
+			}
+			exons.push_back(left_exon);
+			string intron = windows.get(w + 1, &len);
+			if (neg) {
+				SeqUtils::reverseComplementInPlace(intron);
+			}
+			introns.push_back(intron);
+			string right_exon = windows.get(w + 2, &len);
+			if (neg) {
+				SeqUtils::reverseComplementInPlace(right_exon);
+			}
+			exons.push_back(right_exon);
 		}
-		exons.push_back(right_exon);
+		first = last;
 	}
 	exonModel.train(exons, 5);
 	intronModel.train(introns, 5);
@@ -113,56 +164,44 @@ void portcullis::ml::ModelFeatures::trainCodingPotentialModel(const JunctionList
 void portcullis::ml::ModelFeatures::trainSplicingModels(const JunctionList& pass, const JunctionList& fail) {
 	vector<string> donors;
 	vector<string> acceptors;
-	for (auto & j : pass) {
-		int len = 0;
-		string left = gmap.fetchBases(j->getIntron()->ref.name.c_str(), j->getIntron()->start - 3, j->getIntron()->start + 20, &len);
-		if (j->getConsensusStrand() == Strand::NEGATIVE) {
-			left = SeqUtils::reverseComplement(left);
-		}
-		string right = gmap.fetchBases(j->getIntron()->ref.name.c_str(), j->getIntron()->end - 20, j->getIntron()->end + 2, &len);
-		if (j->getConsensusStrand() == Strand::NEGATIVE) {
-			right = SeqUtils::reverseComplement(right);
-		}
-		if (j->getConsensusStrand() == Strand::NEGATIVE) {
-			donors.push_back(right);
-			acceptors.push_back(left);
-		}
-		else {
-			donors.push_back(left);
-			acceptors.push_back(right);
-		}
-	}
+	collectSpliceSignals(gmap, pass, donors, acceptors);
 	donorPWModel.train(donors, 1);
 	acceptorPWModel.train(acceptors, 1);
 	donorTModel.train(donors, 5);
 	acceptorTModel.train(acceptors, 5);
 	donors.clear();
 	acceptors.clear();
-	for (auto & j : fail) {
-		int len = 0;
-		string left = gmap.fetchBases(j->getIntron()->ref.name.c_str(), j->getIntron()->start - 3, j->getIntron()->start + 20, &len);
-		if (j->getConsensusStrand() == Strand::NEGATIVE) {
-			left = SeqUtils::reverseComplement(left);
-		}
-		string right = gmap.fetchBases(j->getIntron()->ref.name.c_str(), j->getIntron()->end - 20, j->getIntron()->end + 2, &len);
-		if (j->getConsensusStrand() == Strand::NEGATIVE) {
-			right = SeqUtils::reverseComplement(right);
-		}
-		if (j->getConsensusStrand() == Strand::NEGATIVE) {
-			donors.push_back(right);
-			acceptors.push_back(left);
+	collectSpliceSignals(gmap, fail, donors, acceptors);
+	donorFModel.train(donors, 5);
+	acceptorFModel.train(acceptors, 5);
+}
+
+void portcullis::ml::ModelFeatures::setRows(Data* d, size_t row, const JunctionList& x, bool labelled) {
+	const bool coding = features[11].active && !isCodingPotentialModelEmpty();
+	vector<size_t> splicingWindows;
+	vector<size_t> codingWindows;
+	for (size_t first = 0; first < x.size();) {
+		const size_t last = findRefRunEnd(x, first);
+		GenomeWindows windows(gmap, x[first]->getIntron()->ref.name);
+		splicingWindows.clear();
+		codingWindows.clear();
+		for (size_t i = first; i < last; i++) {
+			splicingWindows.push_back(x[i]->addSplicingWindows(windows));
+			if (coding) {
+				codingWindows.push_back(x[i]->addCodingWindows(windows));
+			}
 		}
-		else {
-			donors.push_back(left);
-			acceptors.push_back(right);
+		windows.fetch();
+		for (size_t i = first; i < last; i++) {
+			setRow(d, row++, x[i], labelled, windows, splicingWindows[i - first], coding ? codingWindows[i - first] : 0);
 		}
+		first = last;
 	}
-	donorFModel.train(donors, 5);
-	acceptorFModel.train(acceptors, 5);
 }
 
-void portcullis::ml::ModelFeatures::setRow(Data* d, size_t row, JunctionPtr j, bool labelled) {
-	SplicingScores ss = j->calcSplicingScores(gmap, donorTModel, donorFModel, acceptorTModel, acceptorFModel,
+void portcullis::ml::ModelFeatures::setRow(Data* d, size_t row, JunctionPtr j, bool labelled,
+		const GenomeWindows& windows, size_t splicingWindow, size_t codingWindow) {
+	SplicingScores ss = j->calcSplicingScores(windows, splicingWindow, donorTModel, donorFModel, acceptorTModel, acceptorFModel,
 						donorPWModel, acceptorPWModel);
 	bool error = false;
 	d->set(0, row, j->isGenuine(), error);
@@ -198,7 +237,7 @@ void portcullis::ml::ModelFeatures::setRow(Data* d, size_t row, JunctionPtr j, b
 		d->set(i++, row, std::min(j->getHammingDistance5p(), j->getHammingDistance3p()), error);
 	}
 	if (features[11].active) {
-		d->set(i++, row, isCodingPotentialModelEmpty() ? 0.0 : j->calcCodingPotential(gmap, exonModel, intronModel), error);
+		d->set(i++, row, isCodingPotentialModelEmpty() ? 0.0 : j->calcCodingPotential(windows, codingWindow, exonModel, intronModel), error);
 	}
 	if (features[12].active) {
 		d->set(i++, row, isPWModelEmpty() ? 0.0 : ss.positionWeighting, error);
@@ -223,11 +262,7 @@ Data* portcullis::ml::ModelFeatures::juncs2FeatureVectors(const JunctionList& x)
 	}
 	// Convert junction list info to double*
 	Data* d = new DataDouble(headers, x.size(), headers.size());
-	uint32_t row = 0;
-	for (const auto & j : x) {
-		setRow(d, row, j, true);
-		row++;
-	}
+	setRows(d, 0, x, true);
 	return d;
 }
 
@@ -240,15 +275,8 @@ Data* portcullis::ml::ModelFeatures::juncs2FeatureVectors(const JunctionList& xl
 	}
 	// Convert junction list info to double*
 	Data* d = new DataDouble(headers, xl.size() + xu.size(), headers.size());
-	uint32_t row = 0;
-	for (const auto & j : xl) {
-		setRow(d, row, j, true);
-		row++;
-	}
-	for (const auto & j : xu) {
-		setRow(d, row, j, false);
-		row++;
-	}
+	setRows(d, 0, xl, true);
+	setRows(d, xl.size(), xu, false);
 	return d;
 }
 
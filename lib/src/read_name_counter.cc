@@ -0,0 +1,225 @@
+//  ********************************************************************
+//  This file is part of Portcullis.
+//
+//  Portcullis is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  Portcullis is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with Portcullis.  If not, see <http://www.gnu.org/licenses/>.
+//  *******************************************************************
+
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <utility>
+#include <vector>
+using std::ifstream;
+using std::min;
+using std::ofstream;
+using std::pair;
+using std::vector;
+
+#include <boost/filesystem.hpp>
+namespace bfs = boost::filesystem;
+
+#include <portcullis/bam/read_name_counter.hpp>
+
+// The table isn't allocated until something is added, as there may be many
+// counters that stay empty
+static const size_t INITIAL_CAPACITY = 64;
+static const size_t BYTES_PER_SLOT = sizeof(uint64_t) + sizeof(uint16_t);
+
+portcullis::bam::ReadNameCounter::ReadNameCounter() : ReadNameCounter(0, path()) {
+}
+
+portcullis::bam::ReadNameCounter::ReadNameCounter(const size_t memoryLimit, const path& tempDir) :
+	nbKeys(0), mask(0),
+	memoryLimit(memoryLimit), tempDir(tempDir) {
+}
+
+portcullis::bam::ReadNameCounter::ReadNameCounter(ReadNameCounter&& other) :
+	keys(std::move(other.keys)), counts(std::move(other.counts)), nbKeys(other.nbKeys), mask(other.mask),
+	memoryLimit(other.memoryLimit), tempDir(other.tempDir), runs(std::move(other.runs)) {
+	other.runs.clear();
+	other.keys.clear();
+	other.counts.clear();
+	other.nbKeys = 0;
+	other.mask = 0;
+}
+
+portcullis::bam::ReadNameCounter& portcullis::bam::ReadNameCounter::operator=(ReadNameCounter&& other) {
+	if (this != &other) {
+		clear();
+		std::swap(keys, other.keys);
+		std::swap(counts, other.counts);
+		std::swap(nbKeys, other.nbKeys);
+		std::swap(mask, other.mask);
+		std::swap(runs, other.runs);
+		memoryLimit = other.memoryLimit;
+		tempDir = other.tempDir;
+	}
+	return *this;
+}
+
+portcullis::bam::ReadNameCounter::~ReadNameCounter() {
+	for (const auto & run : runs) {
+		bfs::remove(run);
+	}
+}
+
+void portcullis::bam::ReadNameCounter::insert(const uint64_t key, const uint32_t count) {
+	const uint64_t k = normalise(key);
+	size_t i = slot(k) & mask;
+	while (keys[i] != 0 && keys[i] != k) {
+		i = (i + 1) & mask;
+	}
+	if (keys[i] == 0) {
+		keys[i] = k;
+		nbKeys++;
+	}
+	counts[i] = (uint16_t)min<uint32_t>(counts[i] + count, UINT16_MAX);
+}
+
+void portcullis::bam::ReadNameCounter::grow() {
+	const size_t capacity = std::max(keys.size() * 2, INITIAL_CAPACITY);
+	if (!keys.empty() && memoryLimit > 0 && capacity * BYTES_PER_SLOT > memoryLimit && !tempDir.empty()) {
+		spill();
+		return;
+	}
+	vector<uint64_t> oldKeys;
+	vector<uint16_t> oldCounts;
+	std::swap(keys, oldKeys);
+	std::swap(counts, oldCounts);
+	keys.assign(capacity, 0);
+	counts.assign(capacity, 0);
+	mask = capacity - 1;
+	nbKeys = 0;
+	for (size_t i = 0; i < oldKeys.size(); i++) {
+		if (oldKeys[i] != 0) {
+			insert(oldKeys[i], oldCounts[i]);
+		}
+	}
+}
+
+void portcullis::bam::ReadNameCounter::spill() {
+	vector<pair<uint64_t, uint16_t>> entries;
+	entries.reserve(nbKeys);
+	for (size_t i = 0; i < keys.size(); i++) {
+		if (keys[i] != 0) {
+			entries.push_back(std::make_pair(keys[i], counts[i]));
+		}
+	}
+	std::sort(entries.begin(), entries.end());
+	const path run = tempDir / bfs::unique_path("portcullis_names_%%%%-%%%%-%%%%-%%%%.tmp");
+	ofstream out(run.c_str(), std::ios::binary);
+	if (!out.good()) {
+		BOOST_THROW_EXCEPTION(ReadNameCounterException() << ReadNameCounterErrorInfo(string(
+								  "Could not open file for writing read names: ") + run.string()));
+	}
+	for (const auto & e : entries) {
+		out.write((const char*)&e.first, sizeof(uint64_t));
+		out.write((const char*)&e.second, sizeof(uint16_t));
+	}
+	out.close();
+	runs.push_back(run);
+	std::fill(keys.begin(), keys.end(), 0);
+	std::fill(counts.begin(), counts.end(), 0);
+	nbKeys = 0;
+}
+
+void portcullis::bam::ReadNameCounter::merge(ReadNameCounter& other) {
+	for (size_t i = 0; i < other.keys.size(); i++) {
+		if (other.keys[i] != 0) {
+			add(other.keys[i], other.counts[i]);
+		}
+	}
+	runs.insert(runs.end(), other.runs.begin(), other.runs.end());
+	other.runs.clear();
+	other.clear();
+}
+
+uint16_t portcullis::bam::ReadNameCounter::count(const uint64_t key) const {
+	if (keys.empty()) {
+		return 0;
+	}
+	const uint64_t k = normalise(key);
+	size_t i = slot(k) & mask;
+	while (keys[i] != 0) {
+		if (keys[i] == k) {
+			return counts[i];
+		}
+		i = (i + 1) & mask;
+	}
+	return 0;
+}
+
+void portcullis::bam::ReadNameCounter::resolve(vector<uint64_t> queries) {
+	if (runs.empty()) {
+		return;
+	}
+	for (auto & q : queries) {
+		q = normalise(q);
+	}
+	std::sort(queries.begin(), queries.end());
+	queries.erase(std::unique(queries.begin(), queries.end()), queries.end());
+	vector<uint32_t> totals(queries.size(), 0);
+	for (size_t i = 0; i < queries.size(); i++) {
+		totals[i] = count(queries[i]);
+	}
+	// Each run is sorted, so merge it with the sorted queries
+	for (const auto & run : runs) {
+		ifstream in(run.c_str(), std::ios::binary);
+		if (!in.good()) {
+			BOOST_THROW_EXCEPTION(ReadNameCounterException() << ReadNameCounterErrorInfo(string(
+									  "Could not open file for reading read names: ") + run.string()));
+		}
+		size_t q = 0;
+		uint64_t key;
+		uint16_t c;
+		while (q < queries.size() && in.read((char*)&key, sizeof(uint64_t)) && in.read((char*)&c, sizeof(uint16_t))) {
+			while (q < queries.size() && queries[q] < key) {
+				q++;
+			}
+			if (q < queries.size() && queries[q] == key) {
+				totals[q] += c;
+			}
+		}
+		in.close();
+		bfs::remove(run);
+	}
+	runs.clear();
+	// Keep only the queried counts, in a table big enough to hold them all
+	size_t capacity = INITIAL_CAPACITY;
+	while (queries.size() * 10 > capacity * 7) {
+		capacity *= 2;
+	}
+	keys.assign(capacity, 0);
+	counts.assign(capacity, 0);
+	mask = capacity - 1;
+	nbKeys = 0;
+	for (size_t i = 0; i < queries.size(); i++) {
+		if (totals[i] > 0) {
+			insert(queries[i], totals[i]);
+		}
+	}
+}
+
+void portcullis::bam::ReadNameCounter::clear() {
+	for (const auto & run : runs) {
+		bfs::remove(run);
+	}
+	runs.clear();
+	keys.clear();
+	keys.shrink_to_fit();
+	counts.clear();
+	counts.shrink_to_fit();
+	nbKeys = 0;
+	mask = 0;
+}
@@ -15,6 +15,7 @@
 //  along with Portcullis.  If not, see <http://www.gnu.org/licenses/>.
 //  *******************************************************************
 
+#include <algorithm>
 #include <fstream>
 #include <string>
 #include <iostream>
@@ -58,56 +59,146 @@ namespace phx = boost::phoenix;
 #include <portcullis/rule_parser.hpp>
 #include <boost/algorithm/string/case_conv.hpp>
 
-portcullis::eval::eval(const NumericFilterMap& _numericmap, const SetFilterMap& _stringmap,
-					   const JunctionPtr _junc, JuncResultMap* _juncMap) :
-	boost::static_visitor<bool>() {
-	numericmap = _numericmap;
-	stringmap = _stringmap;
-	junc = _junc;
-	juncMap = _juncMap;
-}
+/**
+ * Adds the nodes for a parsed expression to a compiled rule, returning the
+ * index of the node at the top of the expression
+ */
+struct portcullis::CompiledRule::Compiler : boost::static_visitor<size_t> {
 
-bool portcullis::eval::operator()(const var& v) const {
-	if (v == "T" || v == "t" || v == "true" || v == "True")
-		return true;
-	else if (v == "F" || v == "f" || v == "false" || v == "False")
-		return false;
-	else {
+	CompiledRule& rule;
+	const NumericFilterMap& numericmap;
+	const SetFilterMap& stringmap;
+
+	Compiler(CompiledRule& _rule, const NumericFilterMap& _numericmap, const SetFilterMap& _stringmap) :
+		rule(_rule), numericmap(_numericmap), stringmap(_stringmap) {
+	}
+
+	size_t add(const NodeType type, const size_t oper1, const size_t oper2) const {
+		Node n;
+		n.type = type;
+		n.value = false;
+		n.leaf = 0;
+		n.oper1 = oper1;
+		n.oper2 = oper2;
+		rule.nodes.push_back(n);
+		return rule.nodes.size() - 1;
+	}
+
+	size_t operator()(const var& v) const {
+		if (v == "T" || v == "t" || v == "true" || v == "True" ||
+				v == "F" || v == "f" || v == "false" || v == "False") {
+			const size_t node = add(NodeType::CONSTANT, 0, 0);
+			rule.nodes[node].value = v == "T" || v == "t" || v == "true" || v == "True";
+			return node;
+		}
 		string fullname = v;
 		size_t pos = fullname.find(".");
 		string name = pos == string::npos ? fullname : fullname.substr(0, pos);
 		string lname = boost::to_lower_copy(name);
-		// If it starts with an M then assume we are looking at a metric
-		if (Junction::isNumericType(lname)) {
-			Operator op = numericmap.at(v).first;
-			double threshold = numericmap.at(v).second;
-			double value = junc->getValueFromName(lname);
-			bool res = evalNumberLeaf(op, threshold, value);
-			if (!res) {
-				juncMap->at(*(junc->getIntron())).push_back(v + " " + opToString(op) + " " + lexical_cast<string>(threshold));
-			}
-			return res;
+		Leaf leaf;
+		leaf.threshold = 0.0;
+		leaf.column = nullptr;
+		leaf.set = nullptr;
+		NodeType type;
+		if (Junction::isNumericType(lname) && numericmap.count(v) > 0) {
+			type = NodeType::NUMERIC;
+			leaf.op = numericmap.at(v).first;
+			leaf.threshold = numericmap.at(v).second;
+			leaf.column = &rule.table.getNumericColumn(lname);
+			leaf.failure = v + " " + opToString(leaf.op) + " " + lexical_cast<string>(leaf.threshold);
 		}
-		else if (Junction::isStringType(lname) > 0) {
-			Operator op = stringmap.at(v).first;
-			unordered_set<string> set = stringmap.at(v).second;
-			string setstring = boost::algorithm::join(set, ", ");
-			string value = junc->getStringFromName(lname);
-			bool res = evalSetLeaf(op, set, value);
-			if (!res) {
-				juncMap->at(*(junc->getIntron())).push_back(v + " " + opToString(op) + " " + setstring);
-			}
-			return res;
+		else if (Junction::isStringType(lname) && stringmap.count(v) > 0) {
+			type = NodeType::STRING;
+			leaf.op = stringmap.at(v).first;
+			leaf.set = &stringmap.at(v).second;
+			leaf.property = lname;
+			leaf.failure = v + " " + opToString(leaf.op) + " " + boost::algorithm::join(*leaf.set, ", ");
 		}
 		else {
 			BOOST_THROW_EXCEPTION(RuleParserException() << RuleParserErrorInfo(string(
 									  "Unrecognised param: ") + v));
 		}
+		rule.leaves.push_back(leaf);
+		const size_t node = add(type, 0, 0);
+		rule.nodes[node].leaf = rule.leaves.size() - 1;
+		return node;
 	}
-	return boost::lexical_cast<bool>(v);
+
+	size_t operator()(const binop<op_and>& b) const {
+		const size_t oper1 = boost::apply_visitor(*this, b.oper1);
+		const size_t oper2 = boost::apply_visitor(*this, b.oper2);
+		return add(NodeType::AND, oper1, oper2);
+	}
+
+	size_t operator()(const binop<op_or>& b) const {
+		const size_t oper1 = boost::apply_visitor(*this, b.oper1);
+		const size_t oper2 = boost::apply_visitor(*this, b.oper2);
+		return add(NodeType::OR, oper1, oper2);
+	}
+
+	size_t operator()(const unop<op_not>& u) const {
+		return add(NodeType::NOT, boost::apply_visitor(*this, u.oper1), 0);
+	}
+};
+
+portcullis::CompiledRule::CompiledRule(const expr& expression, const NumericFilterMap& numericmap, const SetFilterMap& stringmap,
+									   const JunctionTable& _table) : table(_table) {
+	root = boost::apply_visitor(Compiler(*this, numericmap, stringmap), expression);
 }
 
-bool portcullis::eval::evalNumberLeaf(Operator op, double threshold, double value) const {
+vector<string> portcullis::CompiledRule::getNumericProperties(const NumericFilterMap& numericmap) {
+	vector<string> names;
+	for (const auto & kv : numericmap) {
+		size_t pos = kv.first.find(".");
+		string lname = boost::to_lower_copy(pos == string::npos ? kv.first : kv.first.substr(0, pos));
+		if (Junction::isNumericType(lname) && std::find(names.begin(), names.end(), lname) == names.end()) {
+			names.push_back(lname);
+		}
+	}
+	return names;
+}
+
+bool portcullis::CompiledRule::evaluate(const size_t node, const size_t row, vector<string>& failures) const {
+	const Node& n = nodes[node];
+	switch (n.type) {
+	case NodeType::CONSTANT:
+		return n.value;
+	case NodeType::NUMERIC: {
+		const Leaf& leaf = leaves[n.leaf];
+		bool res = evalNumberLeaf(leaf.op, leaf.threshold, (*leaf.column)[row]);
+		if (!res) {
+			failures.push_back(leaf.failure);
+		}
+		return res;
+	}
+	case NodeType::STRING: {
+		const Leaf& leaf = leaves[n.leaf];
+		bool res = evalSetLeaf(leaf.op, *leaf.set, table.getStringValue(leaf.property, row));
+		if (!res) {
+			failures.push_back(leaf.failure);
+		}
+		return res;
+	}
+	case NodeType::NOT:
+		return !evaluate(n.oper1, row, failures);
+	case NodeType::AND: {
+		// Evaluate both sides, so every failed test is recorded
+		bool op1Res = evaluate(n.oper1, row, failures);
+		bool op2Res = evaluate(n.oper2, row, failures);
+		return op1Res && op2Res;
+	}
+	case NodeType::OR: {
+		bool op1Res = evaluate(n.oper1, row, failures);
+		bool op2Res = evaluate(n.oper2, row, failures);
+		return op1Res || op2Res;
+	}
+	default:
+		BOOST_THROW_EXCEPTION(RuleParserException() << RuleParserErrorInfo(string(
+								  "Unrecognised rule node")));
+	}
+}
+
+bool portcullis::CompiledRule::evalNumberLeaf(Operator op, double threshold, double value) {
 	switch (op) {
 	case Operator::EQ:
 		return value == threshold;
@@ -125,7 +216,7 @@ bool portcullis::eval::evalNumberLeaf(Operator op, double threshold, double valu
 	}
 }
 
-bool portcullis::eval::evalSetLeaf(Operator op, unordered_set<string>& set, string value) const {
+bool portcullis::CompiledRule::evalSetLeaf(Operator op, const unordered_set<string>& set, const string& value) {
 	switch (op) {
 	case Operator::IN:
 		return set.find(value) != set.end();
@@ -137,16 +228,7 @@ bool portcullis::eval::evalSetLeaf(Operator op, unordered_set<string>& set, stri
 	}
 }
 
-/**
- * This function evaluates the truth status of a row parameter given the configuration present in the JSON file.
- * @param op Operation to be considered
- * @param threshold Threshold
- * @param param Value
- * @return True if parameter passes operation and threshold, false otherwise
- */
-bool portcullis::RuleFilter::parse(const string& expression, JunctionPtr junc,
-								   NumericFilterMap& numericFilters, SetFilterMap& stringFilters,
-								   JuncResultMap* results) {
+portcullis::expr portcullis::RuleFilter::parse(const string& expression) {
 	typedef std::string::const_iterator it;
 	it f(expression.begin()), l(expression.end());
 	parser<it> p;
@@ -156,8 +238,7 @@ bool portcullis::RuleFilter::parse(const string& expression, JunctionPtr junc,
 		BOOST_THROW_EXCEPTION(RuleParserException() << RuleParserErrorInfo(string(
 								  "Invalid expression: ") + expression));
 	}
-	// Evaluate results
-	return boost::apply_visitor(eval(numericFilters, stringFilters, junc, results), result);
+	return result;
 }
 
 map<string, int> portcullis::RuleFilter::filter(const path& ruleFile, const JunctionList& all, JunctionList& pass, JunctionList& fail, const string& prefix, JuncResultMap& resultMap) {
@@ -187,17 +268,22 @@ map<string, int> portcullis::RuleFilter::filter(const path& ruleFile, const Junc
 			stringFilters[name] = pair<Operator, unordered_set < string >> (op, set);
 		}
 	}
-	const string expression = pt.get_child("expression").data();
+	const expr expression = RuleFilter::parse(pt.get_child("expression").data());
+	// Rules only look at a few metrics, so only build columns for those, and
+	// resolve each test to its column before visiting the junctions
+	const JunctionTable table(all, CompiledRule::getNumericProperties(numericFilters));
+	const CompiledRule rule(expression, numericFilters, stringFilters, table);
 	map<string, int> filterCounts;
-	for (auto & junc : all) {
-		junctionResultMap[*(junc->getIntron())] = vector<string>();
-		if (RuleFilter::parse(expression, junc, numericFilters, stringFilters, &junctionResultMap)) {
+	for (size_t i = 0; i < all.size(); i++) {
+		const JunctionPtr& junc = all[i];
+		vector<string>& failed = junctionResultMap[*(junc->getIntron())];
+		failed.clear();
+		if (rule.evaluate(i, failed)) {
 			pass.push_back(junc);
 		}
 		else {
 			fail.push_back(junc);
-			vector<string> failed = junctionResultMap[*(junc->getIntron())];
-			for (string s : failed) {
+			for (const string& s : failed) {
 				filterCounts[s]++;
 			}
 		}
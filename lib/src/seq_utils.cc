@@ -0,0 +1,332 @@
+//  ********************************************************************
+//  This file is part of Portcullis.
+//
+//  Portcullis is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  Portcullis is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with Portcullis.  If not, see <http://www.gnu.org/licenses/>.
+//  *******************************************************************
+
+#include <algorithm>
+#include <cstdint>
+#include <cstddef>
+
+// The SIMD kernels are compiled for their own instruction sets and only used
+// if the CPU running them supports it
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define SEQ_UTILS_X86_SIMD
+#include <immintrin.h>
+#endif
+
+#include <portcullis/seq_utils.hpp>
+using portcullis::SeqUtils;
+using portcullis::SimdLevel;
+
+// Complement of each character, following REVCOMP_LOOKUP for upper case letters
+// and keeping the case of lower case ones.  Anything that isn't a letter is
+// left as it is.
+static const uint8_t COMPLEMENT[256] = {
+	0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,
+	16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31,
+	32, '!', '"', '#', '$', '%', '&', 39, '(', ')', '*', '+', ',', '-', '.', '/',
+	'0', '1', '2', '3', '4', '5', '6', '7', '8', '9', ':', ';', '<', '=', '>', '?',
+	'@', 'T', 0, 'G', 'H', 0, 0, 'C', 'D', 0, 0, 0, 0, 'K', 'N', 0,
+	0, 0, 'Y', 'W', 'A', 'A', 'B', 'S', 'X', 'R', 0, '[', 92, ']', '^', '_',
+	'`', 't', 0, 'g', 'h', 0, 0, 'c', 'd', 0, 0, 0, 0, 'k', 'n', 0,
+	0, 0, 'y', 'w', 'a', 'a', 'b', 's', 'x', 'r', 0, '{', '|', '}', '~', 127,
+	128, 129, 130, 131, 132, 133, 134, 135, 136, 137, 138, 139, 140, 141, 142, 143,
+	144, 145, 146, 147, 148, 149, 150, 151, 152, 153, 154, 155, 156, 157, 158, 159,
+	160, 161, 162, 163, 164, 165, 166, 167, 168, 169, 170, 171, 172, 173, 174, 175,
+	176, 177, 178, 179, 180, 181, 182, 183, 184, 185, 186, 187, 188, 189, 190, 191,
+	192, 193, 194, 195, 196, 197, 198, 199, 200, 201, 202, 203, 204, 205, 206, 207,
+	208, 209, 210, 211, 212, 213, 214, 215, 216, 217, 218, 219, 220, 221, 222, 223,
+	224, 225, 226, 227, 228, 229, 230, 231, 232, 233, 234, 235, 236, 237, 238, 239,
+	240, 241, 242, 243, 244, 245, 246, 247, 248, 249, 250, 251, 252, 253, 254, 255
+};
+
+static inline char complement(const char c) {
+	return (char)COMPLEMENT[(uint8_t)c];
+}
+
+static inline char toUpper(const char c) {
+	return c >= 'a' && c <= 'z' ? c - ('a' - 'A') : c;
+}
+
+
+// ******** Scalar kernels ********
+
+static void makeCleanScalar(char* seq, const size_t length) {
+	for (size_t i = 0; i < length; i++) {
+		const char c = toUpper(seq[i]);
+		seq[i] = SeqUtils::dnaNt(c) ? c : 'N';
+	}
+}
+
+static uint32_t hammingDistanceScalar(const char* s1, const char* s2, const size_t length) {
+	uint32_t sum = 0;
+	for (size_t i = 0; i < length; i++) {
+		if (toUpper(s1[i]) != toUpper(s2[i])) {
+			sum++;
+		}
+	}
+	return sum;
+}
+
+/**
+ * Swaps and complements the first n characters from the front of the sequence
+ * with the n characters at the back, i.e. the outer part of a reverse complement
+ */
+static void swapComplement(char* front, char* back, const size_t n) {
+	for (size_t k = 0; k < n; k++) {
+		const char c = complement(front[k]);
+		front[k] = complement(back[-1 - (ptrdiff_t)k]);
+		back[-1 - (ptrdiff_t)k] = c;
+	}
+}
+
+static void reverseComplementScalar(char* seq, const size_t length) {
+	swapComplement(seq, seq + length, length / 2);
+	if (length % 2 == 1) {
+		seq[length / 2] = complement(seq[length / 2]);
+	}
+}
+
+
+#ifdef SEQ_UTILS_X86_SIMD
+
+// ******** SSSE3 kernels ********
+
+__attribute__((target("ssse3")))
+static inline __m128i toUpper16(const __m128i c) {
+	const __m128i lower = _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8('a' - 1)), _mm_cmplt_epi8(c, _mm_set1_epi8('z' + 1)));
+	return _mm_sub_epi8(c, _mm_and_si128(lower, _mm_set1_epi8('a' - 'A')));
+}
+
+__attribute__((target("ssse3")))
+static void makeCleanSsse3(char* seq, const size_t length) {
+	size_t i = 0;
+	for (; i + 16 <= length; i += 16) {
+		const __m128i c = toUpper16(_mm_loadu_si128((const __m128i*)(seq + i)));
+		const __m128i nt = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(c, _mm_set1_epi8('A')), _mm_cmpeq_epi8(c, _mm_set1_epi8('C'))),
+										_mm_or_si128(_mm_cmpeq_epi8(c, _mm_set1_epi8('G')), _mm_cmpeq_epi8(c, _mm_set1_epi8('T'))));
+		const __m128i clean = _mm_or_si128(_mm_and_si128(nt, c), _mm_andnot_si128(nt, _mm_set1_epi8('N')));
+		_mm_storeu_si128((__m128i*)(seq + i), clean);
+	}
+	makeCleanScalar(seq + i, length - i);
+}
+
+__attribute__((target("ssse3")))
+static uint32_t hammingDistanceSsse3(const char* s1, const char* s2, const size_t length) {
+	uint32_t sum = 0;
+	size_t i = 0;
+	for (; i + 16 <= length; i += 16) {
+		const __m128i eq = _mm_cmpeq_epi8(toUpper16(_mm_loadu_si128((const __m128i*)(s1 + i))),
+										  toUpper16(_mm_loadu_si128((const __m128i*)(s2 + i))));
+		sum += 16 - __builtin_popcount(_mm_movemask_epi8(eq));
+	}
+	return sum + hammingDistanceScalar(s1 + i, s2 + i, length - i);
+}
+
+/**
+ * Reverse complements 16 characters, if they are all A, C, G, T or N in either
+ * case.  The complement is looked up from the low 4 bits of each character,
+ * which are distinct for these bases, and then the case bit is put back.
+ * @return False if there is any other character in the block
+ */
+__attribute__((target("ssse3")))
+static inline bool reverseComplement16(const __m128i c, __m128i& rc) {
+	const __m128i folded = _mm_or_si128(c, _mm_set1_epi8(0x20));
+	const __m128i valid = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(folded, _mm_set1_epi8('a')), _mm_cmpeq_epi8(folded, _mm_set1_epi8('c'))),
+									   _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(folded, _mm_set1_epi8('g')), _mm_cmpeq_epi8(folded, _mm_set1_epi8('t'))),
+											   _mm_cmpeq_epi8(folded, _mm_set1_epi8('n'))));
+	if (_mm_movemask_epi8(valid) != 0xFFFF) {
+		return false;
+	}
+	const __m128i table = _mm_setr_epi8(0, 'T', 0, 'G', 'A', 0, 0, 'C', 0, 0, 0, 0, 0, 0, 'N', 0);
+	const __m128i comp = _mm_or_si128(_mm_shuffle_epi8(table, _mm_and_si128(c, _mm_set1_epi8(0x0F))), _mm_and_si128(c, _mm_set1_epi8(0x20)));
+	rc = _mm_shuffle_epi8(comp, _mm_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0));
+	return true;
+}
+
+__attribute__((target("ssse3")))
+static void reverseComplementSsse3(char* seq, const size_t length) {
+	// Swap blocks from the front and back, working inwards
+	char* front = seq;
+	char* back = seq + length;
+	while (back - front >= 32) {
+		__m128i f, b;
+		if (reverseComplement16(_mm_loadu_si128((const __m128i*)front), f) &&
+				reverseComplement16(_mm_loadu_si128((const __m128i*)(back - 16)), b)) {
+			_mm_storeu_si128((__m128i*)front, b);
+			_mm_storeu_si128((__m128i*)(back - 16), f);
+		}
+		else {
+			swapComplement(front, back, 16);
+		}
+		front += 16;
+		back -= 16;
+	}
+	reverseComplementScalar(front, back - front);
+}
+
+
+// ******** AVX2 kernels ********
+
+__attribute__((target("avx2")))
+static inline __m256i toUpper32(const __m256i c) {
+	const __m256i lower = _mm256_and_si256(_mm256_cmpgt_epi8(c, _mm256_set1_epi8('a' - 1)), _mm256_cmpgt_epi8(_mm256_set1_epi8('z' + 1), c));
+	return _mm256_sub_epi8(c, _mm256_and_si256(lower, _mm256_set1_epi8('a' - 'A')));
+}
+
+__attribute__((target("avx2")))
+static void makeCleanAvx2(char* seq, const size_t length) {
+	size_t i = 0;
+	for (; i + 32 <= length; i += 32) {
+		const __m256i c = toUpper32(_mm256_loadu_si256((const __m256i*)(seq + i)));
+		const __m256i nt = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(c, _mm256_set1_epi8('A')), _mm256_cmpeq_epi8(c, _mm256_set1_epi8('C'))),
+										   _mm256_or_si256(_mm256_cmpeq_epi8(c, _mm256_set1_epi8('G')), _mm256_cmpeq_epi8(c, _mm256_set1_epi8('T'))));
+		_mm256_storeu_si256((__m256i*)(seq + i), _mm256_blendv_epi8(_mm256_set1_epi8('N'), c, nt));
+	}
+	// Clear the upper halves of the registers, to avoid a penalty when the
+	// SSE kernel handles the rest
+	_mm256_zeroupper();
+	makeCleanSsse3(seq + i, length - i);
+}
+
+__attribute__((target("avx2")))
+static uint32_t hammingDistanceAvx2(const char* s1, const char* s2, const size_t length) {
+	uint32_t sum = 0;
+	size_t i = 0;
+	for (; i + 32 <= length; i += 32) {
+		const __m256i eq = _mm256_cmpeq_epi8(toUpper32(_mm256_loadu_si256((const __m256i*)(s1 + i))),
+											 toUpper32(_mm256_loadu_si256((const __m256i*)(s2 + i))));
+		sum += 32 - __builtin_popcount((uint32_t)_mm256_movemask_epi8(eq));
+	}
+	_mm256_zeroupper();
+	return sum + hammingDistanceSsse3(s1 + i, s2 + i, length - i);
+}
+
+/**
+ * As reverseComplement16, for 32 characters.  The byte shuffle only works
+ * within each 128-bit lane, so the lanes are swapped afterwards.
+ */
+__attribute__((target("avx2")))
+static inline bool reverseComplement32(const __m256i c, __m256i& rc) {
+	const __m256i folded = _mm256_or_si256(c, _mm256_set1_epi8(0x20));
+	const __m256i valid = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(folded, _mm256_set1_epi8('a')), _mm256_cmpeq_epi8(folded, _mm256_set1_epi8('c'))),
+										  _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(folded, _mm256_set1_epi8('g')), _mm256_cmpeq_epi8(folded, _mm256_set1_epi8('t'))),
+												  _mm256_cmpeq_epi8(folded, _mm256_set1_epi8('n'))));
+	if ((uint32_t)_mm256_movemask_epi8(valid) != 0xFFFFFFFF) {
+		return false;
+	}
+	const __m256i table = _mm256_setr_epi8(0, 'T', 0, 'G', 'A', 0, 0, 'C', 0, 0, 0, 0, 0, 0, 'N', 0,
+										   0, 'T', 0, 'G', 'A', 0, 0, 'C', 0, 0, 0, 0, 0, 0, 'N', 0);
+	const __m256i comp = _mm256_or_si256(_mm256_shuffle_epi8(table, _mm256_and_si256(c, _mm256_set1_epi8(0x0F))), _mm256_and_si256(c, _mm256_set1_epi8(0x20)));
+	const __m256i reversed = _mm256_shuffle_epi8(comp, _mm256_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0,
+							 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0));
+	rc = _mm256_permute2x128_si256(reversed, reversed, 1);
+	return true;
+}
+
+__attribute__((target("avx2")))
+static void reverseComplementAvx2(char* seq, const size_t length) {
+	char* front = seq;
+	char* back = seq + length;
+	while (back - front >= 64) {
+		__m256i f, b;
+		if (reverseComplement32(_mm256_loadu_si256((const __m256i*)front), f) &&
+				reverseComplement32(_mm256_loadu_si256((const __m256i*)(back - 32)), b)) {
+			_mm256_storeu_si256((__m256i*)front, b);
+			_mm256_storeu_si256((__m256i*)(back - 32), f);
+		}
+		else {
+			swapComplement(front, back, 32);
+		}
+		front += 32;
+		back -= 32;
+	}
+	_mm256_zeroupper();
+	reverseComplementSsse3(front, back - front);
+}
+
+#endif
+
+
+// ******** Dispatch ********
+
+static SimdLevel detectSimdLevel() {
+#ifdef SEQ_UTILS_X86_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		return SimdLevel::AVX2;
+	}
+	if (__builtin_cpu_supports("ssse3")) {
+		return SimdLevel::SSSE3;
+	}
+#endif
+	return SimdLevel::SCALAR;
+}
+
+static SimdLevel& currentSimdLevel() {
+	static SimdLevel level = detectSimdLevel();
+	return level;
+}
+
+SimdLevel portcullis::SeqUtils::getSimdLevel() {
+	return currentSimdLevel();
+}
+
+void portcullis::SeqUtils::setSimdLevel(const SimdLevel level) {
+	currentSimdLevel() = std::min(level, detectSimdLevel());
+}
+
+void portcullis::SeqUtils::makeClean(char* seq, const size_t length) {
+	switch (currentSimdLevel()) {
+#ifdef SEQ_UTILS_X86_SIMD
+	case SimdLevel::AVX2:
+		makeCleanAvx2(seq, length);
+		break;
+	case SimdLevel::SSSE3:
+		makeCleanSsse3(seq, length);
+		break;
+#endif
+	default:
+		makeCleanScalar(seq, length);
+	}
+}
+
+uint32_t portcullis::SeqUtils::hammingDistance(const char* s1, const char* s2, const size_t length) {
+	switch (currentSimdLevel()) {
+#ifdef SEQ_UTILS_X86_SIMD
+	case SimdLevel::AVX2:
+		return hammingDistanceAvx2(s1, s2, length);
+	case SimdLevel::SSSE3:
+		return hammingDistanceSsse3(s1, s2, length);
+#endif
+	default:
+		return hammingDistanceScalar(s1, s2, length);
+	}
+}
+
+void portcullis::SeqUtils::reverseComplement(char* seq, const size_t length) {
+	switch (currentSimdLevel()) {
+#ifdef SEQ_UTILS_X86_SIMD
+	case SimdLevel::AVX2:
+		reverseComplementAvx2(seq, length);
+		break;
+	case SimdLevel::SSSE3:
+		reverseComplementSsse3(seq, length);
+		break;
+#endif
+	default:
+		reverseComplementScalar(seq, length);
+	}
+}
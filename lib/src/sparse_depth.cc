@@ -0,0 +1,95 @@
+//  ********************************************************************
+//  This file is part of Portcullis.
+//
+//  Portcullis is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  Portcullis is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with Portcullis.  If not, see <http://www.gnu.org/licenses/>.
+//  *******************************************************************
+
+#include <algorithm>
+#include <vector>
+using std::max;
+using std::min;
+using std::vector;
+
+#include <portcullis/bam/bam_alignment.hpp>
+using portcullis::bam::BamAlignment;
+using portcullis::bam::CigarView;
+
+#include <portcullis/bam/sparse_depth.hpp>
+
+void portcullis::bam::SparseDepth::addWindow(const int32_t start, const int32_t end) {
+	const int32_t s = max(start, 0);
+	if (s < end) {
+		windows.push_back(Segment{s, end, 0});
+	}
+}
+
+void portcullis::bam::SparseDepth::index() {
+	std::sort(windows.begin(), windows.end(), [](const Segment & a, const Segment & b) {
+		return a.start < b.start;
+	});
+	segments.clear();
+	size_t length = 0;
+	for (const auto & w : windows) {
+		if (!segments.empty() && w.start <= segments.back().end) {
+			Segment& last = segments.back();
+			if (w.end > last.end) {
+				length += w.end - last.end;
+				last.end = w.end;
+			}
+		}
+		else {
+			segments.push_back(Segment{w.start, w.end, length});
+			length += w.end - w.start;
+		}
+	}
+	windows.clear();
+	windows.shrink_to_fit();
+	depths.assign(length, 0);
+}
+
+vector<portcullis::bam::SparseDepth::Segment>::const_iterator portcullis::bam::SparseDepth::findSegment(const int32_t pos) const {
+	return std::upper_bound(segments.begin(), segments.end(), pos, [](const int32_t p, const Segment & s) {
+		return p < s.end;
+	});
+}
+
+void portcullis::bam::SparseDepth::addAlignment(const BamAlignment& al) {
+	if (!al.isMapped() || segments.empty()) {
+		return;
+	}
+	int32_t refPos = al.getStart();
+	const CigarView cigar = al.getCigarView();
+	for (uint32_t i = 0; i < cigar.size(); i++) {
+		const int op = cigar.op(i);
+		if (op == BAM_CMATCH || op == BAM_CEQUAL || op == BAM_CDIFF) {
+			const int32_t blockEnd = refPos + cigar.length(i);
+			for (auto s = findSegment(refPos); s != segments.end() && s->start < blockEnd; ++s) {
+				const int32_t a = max(refPos, s->start);
+				const int32_t b = min(blockEnd, s->end);
+				uint32_t* d = depths.data() + s->offset + (a - s->start);
+				for (int32_t q = a; q < b; q++) {
+					(*d++)++;
+				}
+			}
+		}
+		if (cigar.consumesReference(i)) {
+			refPos += cigar.length(i);
+		}
+	}
+}
+
+uint32_t portcullis::bam::SparseDepth::getDepth(const int32_t pos) const {
+	auto s = findSegment(pos);
+	return s != segments.end() && s->start <= pos ? depths[s->offset + (pos - s->start)] : 0;
+}
@@ -0,0 +1,215 @@
+//  ********************************************************************
+//  This file is part of Portcullis.
+//
+//  Portcullis is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  Portcullis is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with Portcullis.  If not, see <http://www.gnu.org/licenses/>.
+//  *******************************************************************
+
+#include <algorithm>
+#include <utility>
+#include <vector>
+using std::max;
+using std::min;
+using std::vector;
+
+#include <portcullis/bam/bam_alignment.hpp>
+using portcullis::bam::BamAlignment;
+using portcullis::bam::CigarView;
+
+#include <portcullis/junction.hpp>
+using portcullis::Junction;
+using portcullis::JunctionPtr;
+
+#include <portcullis/vicinity_scanner.hpp>
+
+// How far the stream must move on before we try to drop buffered alignments
+const int32_t PRUNE_INTERVAL = 1000;
+
+bool portcullis::VicinityScanner::laterBound(const Pending& a, const Pending& b) {
+	return a.bound > b.bound;
+}
+
+portcullis::VicinityScanner::VicinityScanner(const int32_t _refLength, const int32_t _streamStart) :
+	refLength(_refLength), streamStart(_streamStart) {
+	lastPrune = _streamStart;
+	backfilling = false;
+}
+
+int32_t portcullis::VicinityScanner::lowerBound(const Junction& j) {
+	// Left flanking alignments must end at or after the start of the left
+	// anchor.  Coverage uses 0-based positions from start - 21.
+	return min(j.getLeftAncStart(), j.getIntron()->start - COVERAGE_WINDOW - 1);
+}
+
+int32_t portcullis::VicinityScanner::upperBound(const Junction& j) {
+	// Right flanking alignments start at or before the end of the right
+	// anchor.  Coverage uses 0-based positions up to end + 19.
+	return max(j.getRightAncEnd(), j.getIntron()->end + COVERAGE_WINDOW - 1);
+}
+
+void portcullis::VicinityScanner::addJunction(JunctionPtr junction) {
+	Pending p;
+	p.junction = junction;
+	p.bound = upperBound(*junction);
+	p.donorLevels.resize(COVERAGE_WINDOW + 1, 0);
+	p.acceptorLevels.resize(COVERAGE_WINDOW + 1, 0);
+	pending.push_back(std::move(p));
+	std::push_heap(pending.begin(), pending.end(), laterBound);
+}
+
+void portcullis::VicinityScanner::advance(const int32_t pos) {
+	finalise(pos);
+	prune(pos);
+}
+
+void portcullis::VicinityScanner::addAlignment(const BamAlignment& al) {
+	const int32_t pos = al.getStart();
+	if (!backfilling) {
+		advance(pos);
+	}
+	Alignment a;
+	a.start = pos;
+	a.end = al.getEnd();
+	a.nbBlocks = 0;
+	int32_t refPos = pos;
+	const CigarView cigar = al.getCigarView();
+	for (uint32_t i = 0; i < cigar.size(); i++) {
+		const int op = cigar.op(i);
+		if (op == BAM_CMATCH || op == BAM_CEQUAL || op == BAM_CDIFF) {
+			blocks.push_back(Block{refPos, refPos + (int32_t)cigar.length(i)});
+			a.nbBlocks++;
+		}
+		if (cigar.consumesReference(i)) {
+			refPos += cigar.length(i);
+		}
+	}
+	alignments.push_back(a);
+}
+
+void portcullis::VicinityScanner::scan(Pending& p) const {
+	const Junction& j = *p.junction;
+	const int32_t intronStart = j.getIntron()->start;
+	const int32_t intronEnd = j.getIntron()->end;
+	const int32_t leftAncStart = j.getLeftAncStart();
+	const int32_t rightAncEnd = j.getRightAncEnd();
+	const int32_t last = upperBound(j);
+	// Coverage level i holds the depth at 0-based position i - 1
+	const int32_t donorOffset = intronStart - COVERAGE_WINDOW;
+	const int32_t acceptorOffset = intronEnd;
+	size_t b = 0;
+	for (const auto & a : alignments) {
+		if (a.start > last) {
+			break;
+		}
+		if (a.start < intronStart && a.end >= leftAncStart) {
+			p.nbUpstream++;
+		}
+		if (a.start > intronEnd && a.start <= rightAncEnd) {
+			p.nbDownstream++;
+		}
+		for (size_t k = b; k < b + a.nbBlocks; k++) {
+			const Block& block = blocks[k];
+			for (int32_t q = max(block.start, donorOffset - 1); q < min(block.end, intronStart); q++) {
+				p.donorLevels[q + 1 - donorOffset]++;
+			}
+			for (int32_t q = max(block.start, acceptorOffset - 1); q < min(block.end, intronEnd + COVERAGE_WINDOW); q++) {
+				p.acceptorLevels[q + 1 - acceptorOffset]++;
+			}
+		}
+		b += a.nbBlocks;
+	}
+}
+
+void portcullis::VicinityScanner::complete(Pending& p) {
+	scan(p);
+	if (!backfilling && max(lowerBound(*p.junction), 0) < streamStart) {
+		// Still need alignments from before the start of the stream
+		incomplete.push_back(p);
+		return;
+	}
+	Junction& j = *p.junction;
+	j.setNbUpstreamFlankingAlignments(p.nbUpstream);
+	j.setNbDownstreamFlankingAlignments(p.nbDownstream);
+	j.calcCoverage(p.donorLevels, j.getIntron()->start - COVERAGE_WINDOW,
+				   p.acceptorLevels, j.getIntron()->end, refLength);
+}
+
+void portcullis::VicinityScanner::finalise(const int32_t pos) {
+	// Any junction whose relevant alignments must all start before pos can be
+	// completed.  The bound recorded in the heap may be out of date if the
+	// right anchor was extended after the junction was added, in which case
+	// put it back with the new bound.
+	while (!pending.empty() && pending.front().bound < pos) {
+		std::pop_heap(pending.begin(), pending.end(), laterBound);
+		Pending& p = pending.back();
+		const int32_t bound = upperBound(*p.junction);
+		if (bound < pos) {
+			complete(p);
+			pending.pop_back();
+		}
+		else {
+			p.bound = bound;
+			std::push_heap(pending.begin(), pending.end(), laterBound);
+		}
+	}
+}
+
+void portcullis::VicinityScanner::prune(const int32_t pos) {
+	if (pos - lastPrune < PRUNE_INTERVAL) {
+		return;
+	}
+	lastPrune = pos;
+	// Junctions discovered from now on can't need anything before this point
+	int32_t keepFrom = pos - COVERAGE_WINDOW - 1;
+	for (const auto & p : pending) {
+		keepFrom = min(keepFrom, lowerBound(*p.junction));
+	}
+	while (!alignments.empty() && alignments.front().end < keepFrom) {
+		for (uint32_t k = 0; k < alignments.front().nbBlocks; k++) {
+			blocks.pop_front();
+		}
+		alignments.pop_front();
+	}
+}
+
+void portcullis::VicinityScanner::finish() {
+	for (auto & p : pending) {
+		complete(p);
+	}
+	pending.clear();
+	alignments.clear();
+	blocks.clear();
+}
+
+int32_t portcullis::VicinityScanner::getBackfillStart() const {
+	int32_t start = streamStart;
+	for (const auto & p : incomplete) {
+		start = min(start, lowerBound(*p.junction));
+	}
+	return start;
+}
+
+void portcullis::VicinityScanner::addBackfillAlignment(const BamAlignment& al) {
+	backfilling = true;
+	addAlignment(al);
+}
+
+void portcullis::VicinityScanner::finishBackfill() {
+	backfilling = true;
+	for (auto & p : incomplete) {
+		complete(p);
+	}
+	incomplete.clear();
+	alignments.clear();
+	blocks.clear();
+}
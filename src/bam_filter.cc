@@ -51,6 +51,7 @@ portcullis::BamFilter::BamFilter(const path& _junctionFile, const path& _bamFile
 	//strandSpecific = Strandedness::UNKNOWN;
 	//orientation = Orientation::UNKNOWN;
 	clipMode = ClipMode::HARD;
+	ioThreads = 1;
 	saveMSRs = false;
 	useCsi = false;
 	// Test if provided genome exists
@@ -68,40 +69,33 @@ portcullis::BamFilter::BamFilter(const path& _junctionFile, const path& _bamFile
 /**
  * Checks a given alignment to see if it exists in the given junction system
  * @param al Alignment to check
- * @param refs References
  * @param js The junction system containing good junctions to keep
  * @return Whether or not the alignment contains a junction found in the junction system
  */
-bool portcullis::BamFilter::containsJunctionInSystem(const BamAlignment& al, const RefSeqPtrList& refs, JunctionSystem& js) {
+bool portcullis::BamFilter::containsJunctionInSystem(const BamAlignment& al, JunctionSystem& js) {
 	int32_t refId = al.getReferenceId();
-	string refName = refs[refId]->name;
-	int32_t refLength = refs[refId]->length;
 	int32_t lStart = al.getPosition();
 	int32_t lEnd = lStart;
 	int32_t rStart = lStart;
 	int32_t rEnd = lStart;
-	for (size_t i = 0; i < al.getNbCigarOps(); i++) {
-		CigarOp op = al.getCigarOpAt(i);
-		if (op.type == BAM_CIGAR_REFSKIP_CHAR) {
-			rStart = lEnd + op.length;
-			// Create the intron
-			shared_ptr<Intron> location = make_shared<Intron>(RefSeq(refId, refName, refLength), lEnd, rStart - 1);
-			if (js.getJunction(*location) != nullptr) {
+	const CigarView cigar = al.getCigarView();
+	for (uint32_t i = 0; i < cigar.size(); i++) {
+		if (cigar.op(i) == BAM_CREF_SKIP) {
+			rStart = lEnd + cigar.length(i);
+			if (js.getJunction(IntronKey(refId, lEnd, rStart - 1)) != nullptr) {
 				// Break out of the loop leaving write set to true
 				return true;
 			}
 		}
-		else if (CigarOp::opConsumesReference(op.type)) {
-			lEnd += op.length;
+		else if (cigar.consumesReference(i)) {
+			lEnd += cigar.length(i);
 		}
 	}
 	return false;
 }
 
-BamAlignmentPtr portcullis::BamFilter::clipMSR(const BamAlignment& al, const RefSeqPtrList& refs, JunctionSystem& js, bool& allBad) {
+BamAlignmentPtr portcullis::BamFilter::clipMSR(const BamAlignment& al, JunctionSystem& js, bool& allBad) {
 	int32_t refId = al.getReferenceId();
-	string refName = refs[refId]->name;
-	int32_t refLength = refs[refId]->length;
 	int32_t lStart = al.getPosition();
 	int32_t lEnd = lStart;
 	int32_t rStart = lStart;
@@ -117,9 +111,7 @@ BamAlignmentPtr portcullis::BamFilter::clipMSR(const BamAlignment& al, const Ref
 		CigarOp op = al.getCigarOpAt(i);
 		if (op.type == BAM_CIGAR_REFSKIP_CHAR) {
 			rStart = lEnd + op.length;
-			// Create the intron
-			shared_ptr<Intron> location = make_shared<Intron>(RefSeq(refId, refName, refLength), lEnd, rStart - 1);
-			if (js.getJunction(*location) != nullptr) {
+			if (js.getJunction(IntronKey(refId, lEnd, rStart - 1)) != nullptr) {
 				// Found a good junction, so region from start should be left as is, reset start to after junction
 				ab = false;
 				lastGood = true;
@@ -154,7 +146,7 @@ void portcullis::BamFilter::filter() {
 	// Load junction system
 	JunctionSystem js(junctionFile);
 	cout << " - Found " << js.size() << " junctions" << endl << endl;
-	BamReader reader(bamFile);
+	BamReader reader(bamFile, ioThreads);
 	reader.open();
 	shared_ptr<RefSeqPtrList> refs = reader.createRefList();
 	js.setRefs(refs);
@@ -171,6 +163,7 @@ void portcullis::BamFilter::filter() {
 	}
 	cout << " - Processing alignments from: " << bamFile << endl;
 	BamWriter writer(outputBam);
+	writer.setThreads(ioThreads);
 	writer.open(reader.getHeader());
 	cout << " - Saving filtered alignments to: " << outputBam << endl;
 	BamWriter mod(outputBam.string() + ".mod.bam");
@@ -193,7 +186,7 @@ void portcullis::BamFilter::filter() {
 			// If we are in complete clip mode, or this is a single spliced read, then keep the alignment
 			// if its junction is found in the junctions system, otherwise discard it
 			if (clipMode == ClipMode::COMPLETE || !al.isMultiplySplicedRead()) {
-				if (containsJunctionInSystem(al, *refs, js)) {
+				if (containsJunctionInSystem(al, js)) {
 					writer.write(al);
 					nbReadsOut++;
 				}
@@ -201,7 +194,7 @@ void portcullis::BamFilter::filter() {
 			// Else we are in HARD or SOFT clip mode and this is an MSR
 			else {
 				bool allBad = false;
-				BamAlignmentPtr clipped = clipMSR(al, *refs, js, allBad);
+				BamAlignmentPtr clipped = clipMSR(al, js, allBad);
 				if (!allBad) {
 					writer.write(*clipped);
 					if (saveMSRs) {
@@ -245,6 +238,7 @@ int portcullis::BamFilter::main(int argc, char *argv[]) {
 	//string strandSpecific;
 	//string orientation;
 	string clipMode;
+	uint16_t ioThreads;
 	bool saveMSRs;
 	bool useCsi;
 	bool verbose;
@@ -264,6 +258,8 @@ int portcullis::BamFilter::main(int argc, char *argv[]) {
 	*/
 	("clip_mode,c", po::value<string>(&clipMode)->default_value(clipToString(ClipMode::HARD)),
 	 "How to clip reads associated with bad junctions: \"HARD\" (Hard clip reads at junction boundary - suitable for cufflinks); \"SOFT\" (Soft clip reads at junction boundaries); \"COMPLETE\" (Remove reads associated exclusively with bad junctions, MSRs covering both good and bad junctions are kept)  Default: \"HARD\"")
+	("io_threads", po::value<uint16_t>(&ioThreads)->default_value(1),
+	 "The number of threads to use for decompressing the input BAM and compressing the output BAM.")
 	("save_msrs,m", po::bool_switch(&saveMSRs)->default_value(false),
 	 "Whether or not to output modified MSRs to a separate file.  If true will output to a file with name specified by output with \".msr.bam\" extension")
 	("use_csi,c", po::bool_switch(&useCsi)->default_value(false),
@@ -306,6 +302,7 @@ int portcullis::BamFilter::main(int argc, char *argv[]) {
 	//filter.setStrandSpecific(strandednessFromString(strandSpecific));
 	//filter.setOrientation(orientationFromString(orientation));
 	filter.setClipMode(clipFromString(clipMode));
+	filter.setIoThreads(ioThreads);
 	filter.setSaveMSRs(saveMSRs);
 	filter.setUseCsi(useCsi);
 	filter.setVerbose(verbose);
@@ -89,6 +89,7 @@ private:
 	//Strandedness strandSpecific;
 	//Orientation orientation;
 	ClipMode clipMode;
+	uint16_t ioThreads;
 	bool saveMSRs;
 	bool useCsi;
 	bool verbose;
@@ -106,13 +107,12 @@ protected:
 	/**
 	 * Checks a given alignment to see if it exists in the given junction system
 	 * @param al Alignment to check
-	 * @param refs References
 	 * @param js The junction system containing good junctions to keep
 	 * @return Whether or not the alignment contains a junction found in the junction system
 	 */
-	bool containsJunctionInSystem(const BamAlignment& al, const RefSeqPtrList& refs, JunctionSystem& js);
+	bool containsJunctionInSystem(const BamAlignment& al, JunctionSystem& js);
 
-	BamAlignmentPtr clipMSR(const BamAlignment& al, const RefSeqPtrList& refs, JunctionSystem& js, bool& allBad);
+	BamAlignmentPtr clipMSR(const BamAlignment& al, JunctionSystem& js, bool& allBad);
 
 
 public:
@@ -165,6 +165,14 @@ public:
 		this->clipMode = clipMode;
 	}
 
+	uint16_t getIoThreads() const {
+		return ioThreads;
+	}
+
+	void setIoThreads(uint16_t ioThreads) {
+		this->ioThreads = ioThreads;
+	}
+
 	bool isSaveMSRs() const {
 		return saveMSRs;
 	}
@@ -19,6 +19,8 @@
 #include <fstream>
 #include <iostream>
 #include <iomanip>
+#include <algorithm>
+#include <numeric>
 #include <vector>
 #include <memory>
 #include <mutex>
@@ -37,6 +39,7 @@ using std::unique_lock;
 #include <boost/program_options.hpp>
 #include <boost/timer/timer.hpp>
 using boost::timer::auto_cpu_timer;
+using boost::timer::cpu_timer;
 using boost::lexical_cast;
 using namespace boost::filesystem;
 using boost::filesystem::path;
@@ -53,9 +56,11 @@ using namespace portcullis::bam;
 #include <portcullis/intron.hpp>
 #include <portcullis/junction.hpp>
 #include <portcullis/junction_system.hpp>
+#include <portcullis/vicinity_scanner.hpp>
 using portcullis::Intron;
 using portcullis::Junction;
 using portcullis::JunctionSystem;
+using portcullis::VicinityScanner;
 
 #include "junction_builder.hpp"
 using portcullis::JBThreadPool;
@@ -65,7 +70,12 @@ portcullis::JunctionBuilder::JunctionBuilder(const path& _prepDir, const path& _
 	outputDir = _output.empty() ? path(".") : _output.parent_path();
 	outputPrefix = _output.empty() ? "portcullis" : _output.leaf().string();
 	threads = 1;
+	ioThreads = 1;
+	windowSize = DEFAULT_JUNC_WINDOW_SIZE;
+	nameMemLimit = 0;
 	extra = false;
+	multipass = false;
+	separate = false;
 	useCsi = false;
 	strandSpecific = Strandedness::UNKNOWN;
 	source = "portcullis";
@@ -104,16 +114,18 @@ void portcullis::JunctionBuilder::process() {
 	reader.open();
 	refs = reader.createRefList();
 	refMap = reader.createRefMap(*refs);
+	refMappedCounts.clear();
+	for (size_t i = 0; i < refs->size(); i++) {
+		refMappedCounts.push_back(reader.getNbMappedAlignments(i));
+	}
 	reader.close();
 	junctionSystem.setRefs(refs);
-	if (refs->size() < threads) {
-		cerr << "Warning: User requested " << threads << " threads but there are only " << refs->size() << " target sequences to process.  Setting number of threads to " << refs->size() << "." << endl << endl;
-		threads = refs->size();
-	}
-	// Must separate BAMs if extra metrics are requested
-	if (extra && !separate) {
+	// The multipass engine calculates flanking alignments and coverage from
+	// separated BAMs.  By default they are calculated while finding junctions
+	// instead.  Read names are always counted while finding junctions.
+	if (extra && multipass && !separate) {
 		separate = true;
-		cerr << "Warning: User requested that separated BAMS should not be output but user did request extra metrics to be calculated.  This requires separated BAMs to be produced." << endl << endl;
+		cerr << "Warning: User requested that separated BAMS should not be output but user did request extra metrics to be calculated in multipass mode.  This requires separated BAMs to be produced." << endl << endl;
 	}
 	// Output settings requested
 	cout << "Settings:" << endl
@@ -122,10 +134,17 @@ void portcullis::JunctionBuilder::process() {
 		 << " - BAM Read Orientation: " << orientationToString(orientation) << endl
 		 << " - BAM Indexing mode: " << (useCsi ? "CSI" : "BAI") << endl
 		 << " - Threads: " << threads << endl
+		 << " - IO threads: " << ioThreads << endl
+		 << " - Window size: " << (windowSize > 0 ? lexical_cast<string>(windowSize) : "OFF") << endl
 		 << " - Separate BAMs: " << separate << endl
+		 << " - Extra metrics: " << (extra ? (multipass ? "multipass" : "fused") : "off") << endl
+		 << " - Read name memory limit: " << (nameMemLimit > 0 ? lexical_cast<string>(nameMemLimit) + "MB" : "OFF") << endl
 		 //<< " - Calculate additional metrics: " << extra << endl
 		 << endl;
 	cout << reader.bamDetails() << endl;
+	// Read names are only counted for the extra metrics.  Spill them to the
+	// output directory if they take up too much memory.
+	splicedAlignmentMap = SplicedAlignmentMap((size_t)nameMemLimit << 20, outputDir);
 	// Separate spliced from unspliced reads and save to file if requested
 	if (separate) {
 		separateBams();
@@ -150,7 +169,14 @@ void portcullis::JunctionBuilder::separateBams() {
 	BamWriter unsplicedWriter(unsplicedFile);
 	BamWriter splicedWriter(splicedFile);
 	BamWriter unmappedWriter(unmappedFile);
-	BamReader reader(prepData.getSortedBamFilePath());
+	unsplicedWriter.setThreads(ioThreads);
+	splicedWriter.setThreads(ioThreads);
+	unmappedWriter.setThreads(ioThreads);
+	// The input is sorted, so the spliced and unspliced alignments can be
+	// indexed as they're written
+	unsplicedWriter.enableIndexing(useCsi);
+	splicedWriter.enableIndexing(useCsi);
+	BamReader reader(prepData.getSortedBamFilePath(), ioThreads);
 	reader.open();
 	cout << "Splitting BAM:" << endl;
 	if (threads > 1) {
@@ -169,11 +195,6 @@ void portcullis::JunctionBuilder::separateBams() {
 		if (al.isSplicedRead()) {
 			splicedWriter.write(al);
 			splicedCount++;
-			if (extra) {
-				// Record alignment name in map
-				size_t code = std::hash<string>()(al.deriveName());
-				splicedAlignmentMap[code]++;
-			}
 		}
 		else if (al.isMapped()) {
 			unsplicedWriter.write(al);
@@ -192,41 +213,105 @@ void portcullis::JunctionBuilder::separateBams() {
 	unsplicedWriter.close();
 	splicedWriter.close();
 	unmappedWriter.close();
-	cout << " - Indexing unspliced alignments ... ";
-	cout.flush();
-	// Create BAM index
-	string unsplicedIndexCmd = BamHelper::createIndexBamCmd(unsplicedFile, useCsi);
-	int unsExitCode = system(unsplicedIndexCmd.c_str());
-	cout << "done." << endl;
-	cout << " - Indexing spliced alignments ... ";
-	cout.flush();
-	// Create BAM index
-	string splicedIndexCmd = BamHelper::createIndexBamCmd(splicedFile, useCsi);
-	int sExitCode = system(splicedIndexCmd.c_str());
-	cout << "done." << endl;
+	cout << " - Indexed unspliced alignments at: " << unsplicedWriter.getIndexFile() << endl;
+	cout << " - Indexed spliced alignments at: " << splicedWriter.getIndexFile() << endl;
 }
 
 void portcullis::JunctionBuilder::findJunctions() {
 	auto_cpu_timer timer(1, " = Wall time taken: %ws\n\n");
-	// Add each target sequence as a chunk of work for the thread pool
+	// Split each target sequence into windows, each of which is a chunk of work
+	// for the thread pool.  This means long target sequences can be processed
+	// by several threads at once.
 	results.clear();
-	results.resize(refs->size());
+	for (size_t i = 0; i < refs->size(); i++) {
+		const int64_t length = refs->at(i)->length;
+		const int64_t step = windowSize > 0 ? windowSize : max<int64_t>(length, 1);
+		int64_t start = 0;
+		do {
+			RegionResult res;
+			res.refIndex = refs->at(i)->index;
+			res.name = refs->at(i)->name;
+			res.start = start;
+			res.end = min(length, start + step);
+			res.first = start == 0;
+			res.last = res.end >= length;
+			results.push_back(std::move(res));
+			start += step;
+		}
+		while (start < length);
+	}
+	// Estimate the amount of work in each region, so we can process the largest
+	// regions first.  Use the number of mapped alignments recorded in the BAM
+	// index if available, otherwise fall back to the size of the region.
+	const bool useCounts = std::any_of(refMappedCounts.begin(), refMappedCounts.end(), [](int64_t c) {
+		return c >= 0;
+	});
+	for (auto & res : results) {
+		const int64_t regionLength = res.end - res.start;
+		if (useCounts) {
+			const int64_t refLength = max<int64_t>(refs->at(res.refIndex)->length, 1);
+			const int64_t count = max<int64_t>(refMappedCounts[res.refIndex], 0);
+			res.size = (uint64_t)((double)count * (double)regionLength / (double)refLength);
+		}
+		else {
+			res.size = regionLength;
+		}
+	}
+	vector<size_t> order(results.size());
+	std::iota(order.begin(), order.end(), 0);
+	std::stable_sort(order.begin(), order.end(), [this](size_t a, size_t b) {
+		return results[a].size > results[b].size;
+	});
+	uint16_t nbThreads = threads;
+	if (results.size() < nbThreads) {
+		cerr << "Warning: User requested " << threads << " threads but there are only " << results.size() << " regions to process.  Setting number of threads to " << results.size() << "." << endl << endl;
+		nbThreads = results.size();
+	}
+	// Load the indices once, they are shared by all threads
+	cout << "Loading BAM and genome indices ...";
+	cout.flush();
+	bamIndex = BamReader::loadIndex(prepData.getSortedBamFilePath());
+	if (bamIndex == nullptr) {
+		BOOST_THROW_EXCEPTION(JunctionBuilderException() << JunctionBuilderErrorInfo(string(
+								  "Could not load BAM index for: ") + prepData.getSortedBamFilePath().string()));
+	}
+	GenomeMapper indexLoader(prepData.getGenomeFilePath());
+	indexLoader.loadFastaIndex();
+	fastaIndex = indexLoader.getFastaIndex();
+	packedGenome = indexLoader.getPackedGenome();
+	cout << " done." << endl;
+	// Each thread counts spliced read names in its own table, so there's no
+	// locking.  The threads share the memory limit.
+	splicedAlignmentShards.clear();
+	for (uint16_t i = 0; i < max<uint16_t>(nbThreads, 1); i++) {
+		splicedAlignmentShards.push_back(SplicedAlignmentMap(((size_t)nameMemLimit << 20) / max<uint16_t>(nbThreads, 1), outputDir));
+	}
 	// Create the thread pool and start the threads
-	cout << "Creating " << threads << " threads, each with BAM and genome indicies loaded ...";
+	cout << "Creating " << nbThreads << " threads ...";
 	cout.flush();
-	JBThreadPool pool(this, threads);
+	JBThreadPool pool(this, nbThreads);
 	cout << " done." << endl;
 	cout << "Finding junctions and calculating basic metrics:" << endl;
-	cout << " - Queueing " << refs->size() << " target sequences for processing in the thread pool" << endl;
+	cout << " - Queueing " << results.size() << " regions from " << refs->size() << " target sequences for processing in the thread pool, largest " << (useCounts ? "(by mapped alignments) " : "(by length) ") << "first" << endl;
 	cout << " - Processing: " << endl;
-	for (size_t i = 0; i < refs->size(); i++) {
-		results[i].js.setRefs(refs); // Make sure junction system has reference sequence list available
-		results[i].name = refs->at(i)->name;
-		pool.enqueue(refs->at(i)->index);
+	for (auto & res : results) {
+		res.js.setRefs(refs); // Make sure junction system has reference sequence list available
+	}
+	for (size_t i : order) {
+		pool.enqueue(i, results[i].size);
 	}
 	// Waits for all threads to complete
 	pool.shutDown();
-	cout << " - All threads completed." << endl << " - Combining results from threads." << endl << endl;
+	bamIndex.reset();
+	fastaIndex.reset();
+	packedGenome.reset();
+	cout << " - All threads completed." << endl;
+	reportTaskTimes(nbThreads, order);
+	cout << " - Combining results from threads." << endl << endl;
+	for (auto & shard : splicedAlignmentShards) {
+		splicedAlignmentMap.merge(shard);
+	}
+	splicedAlignmentShards.clear();
 	uint64_t unsplicedCount = 0;
 	uint64_t splicedCount = 0;
 	uint64_t sumQueryLengths = 0;
@@ -236,23 +321,40 @@ void portcullis::JunctionBuilder::findJunctions() {
 		 << std::right << std::setw(12) << "unspliced" << "\t"
 		 << std::right << std::setw(12) << "spliced" << "\t"
 		 << std::right << std::setw(12) << "total" << endl;
+	uint64_t refUnsplicedCount = 0;
+	uint64_t refSplicedCount = 0;
 	for (auto & res : results) {
-		junctionSystem.append(res.js);
+		// Each junction is owned by exactly one window, so no need to check
+		// for duplicates here.  Windows are in target sequence order and each
+		// was sorted by its thread, so this leaves the junctions sorted and
+		// numbered.
+		junctionSystem.concatenate(res.js);
 		unsplicedCount += res.unsplicedCount;
 		splicedCount += res.splicedCount;
 		sumQueryLengths += res.sumQueryLengths;
 		minQueryLength = min(minQueryLength, res.minQueryLength);
 		maxQueryLength = max(maxQueryLength, res.maxQueryLength);
-		cout << std::left << std::setw(12) << res.name << "\t"
-			 << std::right << std::setw(12) << res.unsplicedCount << "\t"
-			 << std::right << std::setw(12) << res.splicedCount << "\t"
-			 << std::right << std::setw(12) << res.splicedCount + res.unsplicedCount << endl;
+		// Report counts per target sequence rather than per window
+		refUnsplicedCount += res.unsplicedCount;
+		refSplicedCount += res.splicedCount;
+		if (res.last) {
+			cout << std::left << std::setw(12) << res.name << "\t"
+				 << std::right << std::setw(12) << refUnsplicedCount << "\t"
+				 << std::right << std::setw(12) << refSplicedCount << "\t"
+				 << std::right << std::setw(12) << refSplicedCount + refUnsplicedCount << endl;
+			refUnsplicedCount = 0;
+			refSplicedCount = 0;
+		}
 	}
-	cout << endl << "Sorting and reindexing merged junctions...";
-	cout.flush();
-	junctionSystem.sort(); // Make sure the output is properly ordered
-	junctionSystem.index(); // Add unique identifiers to each junction
-	cout << " done." << endl << endl;
+	// Only needed if the target sequences aren't listed in index order
+	if (!junctionSystem.isSorted()) {
+		cout << endl << "Sorting and reindexing merged junctions...";
+		cout.flush();
+		junctionSystem.sort(max<uint16_t>(nbThreads, 1)); // Make sure the output is properly ordered
+		junctionSystem.index(); // Add unique identifiers to each junction
+		cout << " done." << endl;
+	}
+	cout << endl;
 	// Calculate some alignment stats
 	uint64_t totalAlignments = splicedCount + unsplicedCount;
 	double meanQueryLength = (double) sumQueryLengths / (double) totalAlignments;
@@ -271,70 +373,261 @@ void portcullis::JunctionBuilder::findJunctions() {
 	}
 }
 
+void portcullis::JunctionBuilder::reportTaskTimes(const uint16_t nbThreads, const vector<size_t>& order) {
+	double totalTime = 0.0;
+	size_t longest = 0;
+	vector<double> workerTimes(nbThreads, 0.0);
+	for (size_t i = 0; i < results.size(); i++) {
+		totalTime += results[i].taskTime;
+		workerTimes[results[i].worker] += results[i].taskTime;
+		if (results[i].taskTime > results[longest].taskTime) {
+			longest = i;
+		}
+	}
+	const auto workerRange = std::minmax_element(workerTimes.begin(), workerTimes.end());
+	cout << " - Task times: total " << totalTime << "s; longest " << results[longest].taskTime
+		 << "s (" << results[longest].regionName() << "); per thread min " << *workerRange.first
+		 << "s, max " << *workerRange.second << "s" << endl;
+	const auto peak = std::max_element(results.begin(), results.end(), [](const RegionResult& a, const RegionResult& b) {
+		return a.peakResidentAlignments < b.peakResidentAlignments;
+	});
+	cout << " - Peak number of alignments held by unfinished junctions: " << peak->peakResidentAlignments
+		 << " (" << peak->regionName() << ")" << endl;
+	if (verbose) {
+		cout << std::left << std::setw(24) << "   Region" << "\t"
+			 << std::right << std::setw(12) << "size" << "\t"
+			 << std::right << std::setw(8) << "thread" << "\t"
+			 << std::right << std::setw(12) << "time (s)" << "\t"
+			 << std::right << std::setw(12) << "peak alns" << endl;
+		for (size_t i : order) {
+			cout << std::left << std::setw(24) << "   " + results[i].regionName() << "\t"
+				 << std::right << std::setw(12) << results[i].size << "\t"
+				 << std::right << std::setw(8) << results[i].worker << "\t"
+				 << std::right << std::setw(12) << results[i].taskTime << "\t"
+				 << std::right << std::setw(12) << results[i].peakResidentAlignments << endl;
+		}
+	}
+}
+
 void portcullis::JunctionBuilder::calcExtraMetrics() {
 	auto_cpu_timer timer(1, " = Wall time taken: %ws\n\n");
 	cout << "Calculating extra junction metrics:" << endl;
-	if (threads > 1) {
-		cerr << " - Note: this part of the pipeline is single threaded." << endl;
+	// Read names from all target sequences have been counted by now.  If some
+	// were spilled to disk, merge them back in, keeping only those we need.
+	if (splicedAlignmentMap.isSpilled()) {
+		cout << " - Merging read name counts spilled to disk ...";
+		cout.flush();
+		vector<uint64_t> codes;
+		for (JunctionPtr j : junctionSystem.getJunctions()) {
+			codes.insert(codes.end(), j->getAlignmentCodes().begin(), j->getAlignmentCodes().end());
+		}
+		splicedAlignmentMap.resolve(codes);
+		cout << " done." << endl;
 	}
-	// Requires BAMs to be separated
-	cout << " - Calculating multiple mapping stats ...";
-	cout.flush();
-	junctionSystem.calcMultipleMappingStats(splicedAlignmentMap);
-	cout << " done" << endl;
-	// Count the number of alignments found in upstream and downstream flanking
-	// regions for each junction
-	cout << " - Analysing unspliced alignments around junctions ...";
-	cout.flush();
-	junctionSystem.findFlankingAlignments(getUnsplicedBamFile());
-	cout << " - Calculating unspliced alignment coverage around junctions ...";
+	// The remaining metrics for each junction only depend on alignments on the
+	// same target sequence, so process each target sequence as a separate task.
+	junctionSystem.groupJunctionsByTarget(refs->size(), targetJunctions);
+	vector<int32_t> order;
+	for (size_t i = 0; i < targetJunctions.size(); i++) {
+		if (!targetJunctions[i].empty()) {
+			order.push_back(i);
+		}
+	}
+	// Estimate the amount of work for each target sequence from the number of
+	// junctions and, if we need to read them, the number of alignments
+	auto taskSize = [this](const int32_t i) {
+		const uint64_t nbJunctions = targetJunctions[i].size();
+		return multipass ? nbJunctions + max<int64_t>(refMappedCounts[i], 0) : nbJunctions;
+	};
+	std::stable_sort(order.begin(), order.end(), [&](int32_t a, int32_t b) {
+		return taskSize(a) > taskSize(b);
+	});
+	if (multipass) {
+		// Requires BAMs to be separated.  Load the index once, it is shared by
+		// all threads.
+		bamIndex = BamReader::loadIndex(getUnsplicedBamFile());
+		if (bamIndex == nullptr) {
+			BOOST_THROW_EXCEPTION(JunctionBuilderException() << JunctionBuilderErrorInfo(string(
+									  "Could not load BAM index for: ") + getUnsplicedBamFile().string()));
+		}
+	}
+	const uint16_t nbThreads = max<uint16_t>(1, min<size_t>(threads, order.size()));
+	cout << " - Calculating multiple mapping stats" << (multipass ? ", flanking alignments and coverage" : "")
+		 << " for junctions on " << order.size() << " target sequences using " << nbThreads << " threads ...";
 	cout.flush();
-	junctionSystem.calcCoverage(getUnsplicedBamFile(), strandSpecific);
+	{
+		JBThreadPool pool(this, nbThreads, JBTaskType::EXTRA_METRICS);
+		for (int32_t i : order) {
+			pool.enqueue(i, taskSize(i));
+		}
+		// Waits for all threads to complete
+		pool.shutDown();
+	}
+	bamIndex.reset();
+	targetJunctions.clear();
+	cout << " done." << endl;
 }
 
-void portcullis::JunctionBuilder::findJuncs(BamReader& reader, GenomeMapper& gmap, int32_t seq) {
+void portcullis::JunctionBuilder::calcExtraMetrics(BamReader* reader, const int32_t refIndex) {
+	const JunctionList& junctions = targetJunctions[refIndex];
+	for (JunctionPtr j : junctions) {
+		j->calcMultipleMappingScore(splicedAlignmentMap);
+	}
+	if (reader != nullptr) {
+		// Count the number of alignments found in upstream and downstream
+		// flanking regions for each junction, and the coverage around them
+		JunctionSystem::calcTargetFlankingAndCoverage(*reader, refIndex, junctions);
+	}
+}
+
+void portcullis::JunctionBuilder::findJuncs(BamReader& reader, GenomeMapper& gmap, SplicedAlignmentMap& splicedNames, int32_t index) {
+	RegionResult& res = results[index];
+	// Junctions found in this window are allocated together, from memory owned
+	// by this thread, and freed together once they are no longer needed
+	res.js.setArena(make_shared<Arena>());
 	uint64_t splicedCount = 0;
 	uint64_t unsplicedCount = 0;
-	int32_t lastCalculatedJunctionIndex = 0;
+	// Junctions still collecting alignments, soonest ending first.  A junction
+	// is complete once the alignments start after its intron, regardless of
+	// any longer introns found before it.
+	JunctionEndQueue pending;
+	size_t nbQueued = 0;
+	uint64_t nbRetiredAlignments = 0;
+	uint64_t peakResidentAlignments = 0;
+	// The metrics from a complete junction's alignments are calculated as soon
+	// as it is retired, so its alignments can be released straight away.  The
+	// metrics from the genome are calculated in batches, so the genomic windows
+	// around a batch of neighbouring junctions are fetched together.
+	vector<size_t> retired;
+	vector<size_t> retiredWindows;
+	GenomeWindows windows(gmap, res.name);
+	auto flushRetired = [&]() {
+		windows.clear();
+		retiredWindows.clear();
+		for (size_t i : retired) {
+			retiredWindows.push_back(res.js.getJunctionAt(i)->addJunctionWindows(windows));
+		}
+		windows.fetch();
+		for (size_t k = 0; k < retired.size(); k++) {
+			res.js.getJunctionAt(retired[k])->processJunctionSequence(windows, retiredWindows[k]);
+		}
+		retired.clear();
+	};
+	auto retire = [&](const size_t i) {
+		JunctionPtr j = res.js.getJunctionAt(i);
+		j->calcMetrics(this->orientation);
+		j->calcMismatchStats();
+		nbRetiredAlignments += j->getNbSplicedAlignments();
+		j->clearAlignments();
+		retired.push_back(i);
+		if (retired.size() >= JUNC_WINDOW_BATCH_SIZE) {
+			flushRetired();
+		}
+	};
 	uint64_t sumQueryLengths = 0;
 	int32_t minQueryLength = INT32_MAX;
 	int32_t maxQueryLength = 0;
-	reader.setRegion(seq, 0, refs->at(seq)->length);
+	// Junctions starting outside the target sequence bounds belong to the
+	// first or last window
+	const int32_t juncStart = res.first ? INT32_MIN : res.start;
+	const int32_t juncEnd = res.last ? INT32_MAX : res.end;
+	// In fused mode the extra metrics are calculated from the same stream of
+	// alignments.  Flanking alignments and coverage may extend past the end of
+	// the window, so keep reading until all junctions in the window are complete.
+	const bool fused = extra && !multipass;
+	const int32_t refLength = refs->at(res.refIndex)->length;
+	unique_ptr<VicinityScanner> scanner(fused ? new VicinityScanner(refLength, res.first ? 0 : res.start) : nullptr);
+	// Bases underneath the spliced alignments, for comparing their anchors with
+	// the genome as they are added to junctions
+	GenomeBuffer genome(gmap, res.name, JUNC_GENOME_BUFFER_SIZE);
+	// This returns all alignments overlapping the window, which includes any
+	// alignment supporting a junction that starts in the window.
+	reader.setRegion(res.refIndex, res.start, fused ? max(refLength, res.end) : res.end);
 	while (reader.next()) {
 		const BamAlignment& al = reader.current();
-		while (results[seq].js.size() > 0 && lastCalculatedJunctionIndex < results[seq].js.size() &&
-				al.getPosition() > results[seq].js.getJunctionAt(lastCalculatedJunctionIndex)->getIntron()->end) {
-			JunctionPtr j = results[seq].js.getJunctionAt(lastCalculatedJunctionIndex);
-			j->calcMetrics(this->orientation);
-			j->processJunctionWindow(gmap);
-			j->clearAlignments();
-			lastCalculatedJunctionIndex++;
+		while (!pending.empty() && al.getPosition() > pending.top().first) {
+			retire(pending.top().second);
+			pending.pop();
+		}
+		if (fused) {
+			scanner->advance(al.getPosition());
+			if (al.getPosition() >= res.end) {
+				// Past the window, so only interested in flanking alignments
+				if (scanner->getNbPending() == 0) {
+					break;
+				}
+				if (al.isMapped() && !al.isSplicedRead()) {
+					scanner->addAlignment(al);
+				}
+				continue;
+			}
+		}
+		// Alignments starting before this window were counted by the previous window
+		const bool owned = res.first || al.getPosition() >= res.start;
+		const size_t nbJunctions = res.js.size();
+		const bool spliced = res.js.addJunctionsInRegion(al, juncStart, juncEnd, &genome);
+		for (; nbQueued < res.js.size(); nbQueued++) {
+			pending.push(std::make_pair(res.js.getJunctionAt(nbQueued)->getIntron()->end, nbQueued));
+		}
+		peakResidentAlignments = max(peakResidentAlignments, res.js.getNbJunctionAlignments() - nbRetiredAlignments);
+		if (fused) {
+			for (size_t i = nbJunctions; i < res.js.size(); i++) {
+				scanner->addJunction(res.js.getJunctionAt(i));
+			}
+			if (!spliced && al.isMapped()) {
+				scanner->addAlignment(al);
+			}
+		}
+		if (extra && spliced && owned) {
+			// Record alignment name for the multiple mapping stats
+			splicedNames.add(al.deriveNameCode());
+		}
+		if (!owned) {
+			continue;
 		}
 		// Calc alignment stats
 		int32_t len = al.getLength();
 		minQueryLength = min(minQueryLength, len);
 		maxQueryLength = max(maxQueryLength, len);
 		sumQueryLengths += len;
-		if (results[seq].js.addJunctions(al)) {
+		if (spliced) {
 			splicedCount++;
 		}
 		else {
 			unsplicedCount++;
 		}
 	}
-	while (results[seq].js.size() > 0 && lastCalculatedJunctionIndex < results[seq].js.size()) {
-		JunctionPtr j = results[seq].js.getJunctionAt(lastCalculatedJunctionIndex);
-		j->calcMetrics(this->orientation);
-		j->processJunctionWindow(gmap);
-		j->clearAlignments();
-		lastCalculatedJunctionIndex++;
+	while (!pending.empty()) {
+		retire(pending.top().second);
+		pending.pop();
+	}
+	flushRetired();
+	// Junctions were found in order of their first alignment, so put them in
+	// order of position ready to be concatenated with the other windows
+	res.js.sort();
+	if (fused) {
+		scanner->finish();
+		// Junctions near the start of the window may also need alignments
+		// ending before the window, which weren't in the stream
+		const int32_t backfillStart = scanner->getBackfillStart();
+		if (backfillStart < res.start) {
+			reader.setRegion(res.refIndex, backfillStart, res.start);
+			while (reader.next()) {
+				const BamAlignment& al = reader.current();
+				if (bam_endpos(al.getRaw()) <= res.start && al.isMapped() && !al.isSplicedRead()) {
+					scanner->addBackfillAlignment(al);
+				}
+			}
+		}
+		scanner->finishBackfill();
 	}
 	// Update result vector
-	results[seq].splicedCount = splicedCount;
-	results[seq].unsplicedCount = unsplicedCount;
-	results[seq].minQueryLength = minQueryLength;
-	results[seq].maxQueryLength = maxQueryLength;
-	results[seq].sumQueryLengths = sumQueryLengths;
+	res.splicedCount = splicedCount;
+	res.unsplicedCount = unsplicedCount;
+	res.minQueryLength = minQueryLength;
+	res.maxQueryLength = maxQueryLength;
+	res.sumQueryLengths = sumQueryLengths;
+	res.peakResidentAlignments = peakResidentAlignments;
 }
 
 int portcullis::JunctionBuilder::main(int argc, char *argv[]) {
@@ -342,7 +635,11 @@ int portcullis::JunctionBuilder::main(int argc, char *argv[]) {
 	string prepDir;
 	string output;
 	uint16_t threads;
+	uint16_t ioThreads;
+	int32_t windowSize;
+	uint32_t nameMemLimit;
 	bool extra;
+	bool multipass;
 	bool separate;
 	string strandSpecific;
 	string orientation;
@@ -359,10 +656,18 @@ int portcullis::JunctionBuilder::main(int argc, char *argv[]) {
 	system_options.add_options()
 	("threads,t", po::value<uint16_t>(&threads)->default_value(1),
 	 "The number of threads to use.  Note that increasing the number of threads will also increase memory requirements.")
+	("io_threads", po::value<uint16_t>(&ioThreads)->default_value(1),
+	 "The number of threads to use for decompressing and compressing BAM files when streaming through them from start to finish.")
+	("window_size", po::value<int32_t>(&windowSize)->default_value(DEFAULT_JUNC_WINDOW_SIZE),
+	 "Target sequences longer than this are split into windows of this many bases, which can be processed by different threads.  This is useful for genomes with a few very long target sequences.  Set to 0 to process each target sequence as a single unit of work.")
+	("name_mem_limit", po::value<uint32_t>(&nameMemLimit)->default_value(0),
+	 "Maximum memory in MB to use for counting read names when calculating the multiple mapping score.  Counts are spilled to temporary files in the output directory beyond this.  Set to 0 for no limit.")
 	("separate", po::bool_switch(&separate)->default_value(false),
 	 "Separate spliced from unspliced reads.")
 	("extra", po::bool_switch(&extra)->default_value(false),
-	 "Calculate additional metrics that take some time to generate.  Automatically activates BAM splitting mode (--separate).")
+	 "Calculate additional metrics that take some time to generate.  These are calculated while finding junctions, unless --multipass is also given.")
+	("multipass", po::bool_switch(&multipass)->default_value(false),
+	 "Calculate the flanking alignment and coverage metrics in separate passes over split BAM files after all junctions have been found, rather than while finding junctions.  This is much slower and is mainly useful for checking results.  Automatically activates BAM splitting mode (--separate).  Read names for the multiple mapping score are always counted while finding junctions.")
 	("orientation", po::value<string>(&orientation)->default_value(orientationToString(Orientation::UNKNOWN)),
 	 "The orientation of the reads that produced the BAM alignments: \"F\" (Single-end forward orientation); \"R\" (single-end reverse orientation); \"FR\" (paired-end, with reads sequenced towards center of fragment -> <-.  This is usual setting for most Illumina paired end sequencing); \"RF\" (paired-end, reads sequenced away from center of fragment <- ->); \"FF\" (paired-end, reads both sequenced in forward orientation); \"RR\" (paired-end, reads both sequenced in reverse orientation); \"UNKNOWN\" (default, portcullis will workaround any calculations requiring orientation information)")
 	("strandedness", po::value<string>(&strandSpecific)->default_value(strandednessToString(Strandedness::UNKNOWN)),
@@ -421,7 +726,11 @@ int portcullis::JunctionBuilder::main(int argc, char *argv[]) {
 	// Do the work ...
 	JunctionBuilder jb(prepDir, output);
 	jb.setThreads(threads);
+	jb.setIoThreads(ioThreads);
+	jb.setWindowSize(windowSize);
+	jb.setNameMemLimit(nameMemLimit);
 	jb.setExtra(extra);
+	jb.setMultipass(multipass);
 	jb.setSeparate(separate);
 	jb.setSource(source);
 	jb.setStrandSpecific(strandednessFromString(strandSpecific));
@@ -437,60 +746,151 @@ int portcullis::JunctionBuilder::main(int argc, char *argv[]) {
 
 // ********* Thread Pool ************
 
-portcullis::JBThreadPool::JBThreadPool(JunctionBuilder* jb, const uint16_t threads) : terminate(false), stopped(false) {
+portcullis::JBThreadPool::JBThreadPool(JunctionBuilder* jb, const uint16_t threads) :
+	JBThreadPool(jb, threads, JBTaskType::FIND_JUNCTIONS) {
+}
+
+portcullis::JBThreadPool::JBThreadPool(JunctionBuilder* jb, const uint16_t threads, const JBTaskType taskType) : pending(0), terminate(false), stopped(false) {
 	junctionBuilder = jb;
+	this->taskType = taskType;
+	for (int i = 0; i < threads; i++) {
+		queues.emplace_back(new WorkQueue());
+	}
 	// Create number of required threads and add them to the thread pool vector.
 	for (int i = 0; i < threads; i++) {
-		// Add the thread onto the thread pool (providing an index so we can get the the correct BAM reader again)
-		threadPool.emplace_back(thread(&portcullis::JBThreadPool::invoke, this));
+		// Add the thread onto the thread pool (providing an index so we can get the correct task queue)
+		threadPool.emplace_back(thread(&portcullis::JBThreadPool::invoke, this, i));
 	}
 }
 
-void portcullis::JBThreadPool::enqueue(const int32_t index) {
+void portcullis::JBThreadPool::enqueue(const int32_t index, const uint64_t size) {
+	// Give the task to the worker with the least amount of queued work.  Each
+	// queue's size is only read while holding that queue's lock.
+	WorkQueue* target = nullptr;
+	uint64_t targetSize = 0;
+	for (auto & q : queues) {
+		unique_lock<mutex> lock(q->queueMutex);
+		if (target == nullptr || q->queuedSize < targetSize) {
+			target = q.get();
+			targetSize = q->queuedSize;
+		}
+	}
 	// Scope based locking.
 	{
-		// Put unique lock on task mutex.
-		unique_lock<mutex> lock(tasksMutex);
-		// Push task into queue.
-		tasks.push(index);
+		// Put unique lock on task mutex, so waiting threads can't miss the
+		// update.  Count the task before publishing it, so a worker can't take
+		// it and decrement the counter first.
+		unique_lock<mutex> tasksLock(tasksMutex);
+		unique_lock<mutex> lock(target->queueMutex);
+		pending++;
+		target->tasks.push_back(Task{index, size});
+		target->queuedSize += size;
 	}
 	// Wake up one thread.
 	condition.notify_one();
 }
 
-void portcullis::JBThreadPool::invoke() {
-	// Create the genome mapper
+bool portcullis::JBThreadPool::nextTask(const uint16_t worker, Task& task) {
+	// Try our own queue first
+	{
+		WorkQueue& own = *queues[worker];
+		unique_lock<mutex> lock(own.queueMutex);
+		if (!own.tasks.empty()) {
+			task = own.tasks.front();
+			own.tasks.pop_front();
+			own.queuedSize -= task.size;
+			pending--;
+			return true;
+		}
+	}
+	// Otherwise steal from the worker with the most queued work.  We take the
+	// largest task from that worker, as starting the largest remaining task
+	// as soon as possible is what minimises the overall run time.
+	while (pending > 0) {
+		WorkQueue* victim = nullptr;
+		uint64_t victimSize = 0;
+		for (auto & q : queues) {
+			unique_lock<mutex> lock(q->queueMutex);
+			if (!q->tasks.empty() && (victim == nullptr || q->queuedSize > victimSize)) {
+				victim = q.get();
+				victimSize = q->queuedSize;
+			}
+		}
+		if (victim == nullptr) {
+			return false;
+		}
+		unique_lock<mutex> lock(victim->queueMutex);
+		if (!victim->tasks.empty()) {
+			task = victim->tasks.front();
+			victim->tasks.pop_front();
+			victim->queuedSize -= task.size;
+			pending--;
+			return true;
+		}
+		// Someone else got there first, try again
+	}
+	return false;
+}
+
+void portcullis::JBThreadPool::invoke(const uint16_t worker) {
+	if (taskType == JBTaskType::EXTRA_METRICS) {
+		// Only need our own reader over the unspliced alignments if flanking
+		// alignments and coverage weren't calculated while finding junctions
+		unique_ptr<BamReader> reader;
+		if (junctionBuilder->isMultipass()) {
+			reader = unique_ptr<BamReader>(new BamReader(junctionBuilder->getUnsplicedBamFile()));
+			reader->setIndex(junctionBuilder->getBamIndex());
+			reader->open();
+		}
+		run(worker, [&](const int32_t index) {
+			junctionBuilder->calcExtraMetrics(reader.get(), index);
+		});
+		// Make sure we close the reader before exiting
+		if (reader != nullptr) {
+			reader->close();
+		}
+		return;
+	}
+	// Create the genome mapper, using the shared fasta index and packed genome but with our own file handle
 	GenomeMapper gmap(junctionBuilder->getPreparedFiles().getGenomeFilePath());
-	// Load the fasta index
-	gmap.loadFastaIndex();
-	// Create a BAM reader for this thread
+	gmap.loadFastaIndex(junctionBuilder->getFastaIndex(), junctionBuilder->getPackedGenome());
+	// Create a BAM reader for this thread, using the shared BAM index
 	BamReader reader(junctionBuilder->getPreparedFiles().getSortedBamFilePath());
-	// Open the BAM file... this will load the index, which might take some time on large BAMs
+	reader.setIndex(junctionBuilder->getBamIndex());
 	reader.open();
-	int32_t id;
+	SplicedAlignmentMap& splicedNames = junctionBuilder->getSplicedAlignmentShard(worker);
+	run(worker, [&](const int32_t index) {
+		cout << "   - " + junctionBuilder->getRegionName(index) + "\n";
+		cout.flush();
+		cpu_timer timer;
+		junctionBuilder->findJuncs(reader, gmap, splicedNames, index);
+		junctionBuilder->recordTaskTime(index, worker, (double)timer.elapsed().wall / 1.0e9);
+	});
+	// Make sure we close the reader before exiting
+	reader.close();
+}
+
+void portcullis::JBThreadPool::run(const uint16_t worker, std::function<void(const int32_t)> execute) {
+	Task task;
 	while (true) {
+		if (nextTask(worker, task)) {
+			// Execute the task.
+			execute(task.index);
+			continue;
+		}
 		// Scope based locking.
 		{
 			// Put unique lock on task mutex.
 			unique_lock<mutex> lock(tasksMutex);
-			// Wait until queue is not empty or termination signal is sent.
+			// Wait until there are tasks queued or termination signal is sent.
 			condition.wait(lock, [this] {
-				return !tasks.empty() || terminate;
+				return pending > 0 || terminate;
 			});
-			// If termination signal received and queue is empty then exit else continue clearing the queue.
-			// Make sure we close the reader before exiting
-			if (terminate && tasks.empty()) {
-				reader.close();
+			// If termination signal received and all queues are empty then exit else continue clearing the queues.
+			if (terminate && pending == 0) {
 				return;
 			}
-			// Get next task in the queue.
-			id = tasks.front();
-			cout << "   - " << junctionBuilder->getRefName(id) << endl;
-			// Remove it from the queue.
-			tasks.pop();
 		}
-		// Execute the task.
-		junctionBuilder->findJuncs(reader, gmap, id);
 	}
 }
 
@@ -509,7 +909,7 @@ void portcullis::JBThreadPool::shutDown() {
 		thread.join();
 	}
 	// Empty workers vector.
-	threadPool.empty();
+	threadPool.clear();
 	// Indicate that the pool has been shut down.
 	stopped = true;
 }
@@ -521,4 +921,3 @@ portcullis::JBThreadPool::~JBThreadPool() {
 		shutDown();
 	}
 }
-
@@ -20,11 +20,14 @@
 #include <fstream>
 #include <iostream>
 #include <vector>
+#include <atomic>
+#include <deque>
 #include <memory>
-#include <queue>
 #include <thread>
 #include <mutex>
+#include <queue>
 #include <condition_variable>
+#include <functional>
 using std::boolalpha;
 using std::string;
 using std::cout;
@@ -32,8 +35,10 @@ using std::cerr;
 using std::endl;
 using std::mutex;
 using std::ofstream;
-using std::queue;
+using std::atomic;
+using std::deque;
 using std::thread;
+using std::unique_ptr;
 using std::condition_variable;
 
 #include <boost/filesystem.hpp>
@@ -48,6 +53,12 @@ using namespace boost::filesystem;
 using boost::filesystem::path;
 namespace po = boost::program_options;
 
+#include <portcullis/bam/bam_reader.hpp>
+#include <portcullis/bam/genome_mapper.hpp>
+using portcullis::bam::BamIndexPtr;
+using portcullis::bam::FastaIndexPtr;
+using portcullis::bam::PackedGenomePtr;
+
 #include <portcullis/intron.hpp>
 #include <portcullis/junction.hpp>
 #include <portcullis/junction_system.hpp>
@@ -65,18 +76,50 @@ namespace portcullis {
 const string DEFAULT_JUNC_OUTPUT = "portcullis_junc/portcullis";
 const string DEFAULT_JUNC_SOURCE = "portcullis";
 const uint16_t DEFAULT_JUNC_THREADS = 1;
+const int32_t DEFAULT_JUNC_WINDOW_SIZE = 10000000;
+
+// Number of bases fetched from the genome at a time when comparing the anchors
+// of spliced alignments with the genome
+const int32_t JUNC_GENOME_BUFFER_SIZE = 1000000;
+
+// Number of complete junctions whose genomic windows are fetched together
+const size_t JUNC_WINDOW_BATCH_SIZE = 256;
+
+// Indices of junctions paired with the end of their intron, smallest end first
+typedef std::pair<int32_t, size_t> JunctionEnd;
+typedef std::priority_queue<JunctionEnd, vector<JunctionEnd>, std::greater<JunctionEnd>> JunctionEndQueue;
 
 typedef boost::error_info<struct JunctionBuilderError, string> JunctionBuilderErrorInfo;
 struct JunctionBuilderException: virtual boost::exception, virtual std::exception { };
 
+/**
+ * A window of a target sequence processed as a single task by the thread pool,
+ * along with the results collected from it.  Alignments are owned by the
+ * window containing their start position and junctions by the window
+ * containing their intron start position, so no alignment or junction is
+ * counted twice when windows are combined.
+ */
 struct RegionResult {
+	int32_t refIndex = -1;
+	int32_t start = 0;      // First position of window (0-based)
+	int32_t end = 0;        // Position after the last position of window
+	bool first = true;      // Whether this is the first window on the target sequence
+	bool last = true;       // Whether this is the last window on the target sequence
+	uint64_t size = 0;      // Estimate of the amount of work required to process this window
+	double taskTime = 0.0;  // Wall time taken to process this window, in seconds
+	uint16_t worker = 0;    // The thread that processed this window
 	uint64_t splicedCount = 0;
 	uint64_t unsplicedCount = 0;
 	uint64_t sumQueryLengths = 0;
 	int32_t minQueryLength = 100000;
 	int32_t maxQueryLength = 0;
+	uint64_t peakResidentAlignments = 0;  // Most alignments held by junctions at once
 	string name;
 	JunctionSystem js;
+
+	string regionName() const {
+		return first && last ? name : name + ":" + std::to_string(start) + "-" + std::to_string(end);
+	}
 };
 
 class JunctionBuilder {
@@ -87,9 +130,13 @@ private:
 	path outputDir;
 	string outputPrefix;
 	uint16_t threads;
+	uint16_t ioThreads;
+	int32_t windowSize;
+	uint32_t nameMemLimit;
 	Strandedness strandSpecific;
 	Orientation orientation;
 	bool extra;
+	bool multipass;
 	bool separate;
 	bool useCsi;
 	bool outputExonGFF;
@@ -101,22 +148,34 @@ private:
 	JunctionSystem junctionSystem;
 	SplicedAlignmentMap splicedAlignmentMap;
 
+	// Spliced read names counted by each thread while finding junctions, merged
+	// into splicedAlignmentMap once all threads have completed
+	vector<SplicedAlignmentMap> splicedAlignmentShards;
+
 	// List of reference sequences (might be shared amongst various objects)
 	shared_ptr<RefSeqPtrList> refs;
 
 	// Map of reference sequence indicies to reference sequences
 	shared_ptr<RefSeqPtrIndexMap> refMap;
 
+	// Number of mapped alignments per reference sequence according to the BAM
+	// index (-1 if not available)
+	vector<int64_t> refMappedCounts;
+
 	// Results from threads
 	vector<RegionResult> results;
 
+	// Indices shared by all threads
+	BamIndexPtr bamIndex;
+	FastaIndexPtr fastaIndex;
+	PackedGenomePtr packedGenome;
 
+	// Junctions grouped by target sequence, for calculating extra metrics
+	vector<JunctionList> targetJunctions;
 
-protected:
 
-	path getUnsplicedBamFile() {
-		return path(outputDir.string() + "/" + outputPrefix + ".unspliced.bam");
-	}
+
+protected:
 
 	path getSplicedBamFile() {
 		return path(outputDir.string() + "/" + outputPrefix + ".spliced.bam");
@@ -136,6 +195,8 @@ protected:
 
 	void calcExtraMetrics();
 
+	void reportTaskTimes(const uint16_t nbThreads, const vector<size_t>& order);
+
 
 public:
 
@@ -146,10 +207,47 @@ public:
 
 	string getRefName(const int32_t seqId) { return refs->at(seqId)->name; }
 
-	void findJuncs(BamReader& reader, GenomeMapper& gmap, const int32_t seq);
+	string getRegionName(const int32_t index) { return results[index].regionName(); }
+
+	/**
+	 * Finds all junctions in the given region and calculates their basic metrics
+	 * @param reader BAM reader for the calling thread
+	 * @param gmap Genome mapper for the calling thread
+	 * @param splicedNames Counts spliced read names for the calling thread
+	 * @param index Index of the region to process
+	 */
+	void findJuncs(BamReader& reader, GenomeMapper& gmap, SplicedAlignmentMap& splicedNames, const int32_t index);
+
+	/**
+	 * Calculates the extra metrics for the junctions on a single target sequence
+	 * @param reader BAM reader over the unspliced alignments for the calling
+	 * thread, or nullptr if flanking alignments and coverage have already been
+	 * calculated
+	 * @param refIndex Index of the target sequence to process
+	 */
+	void calcExtraMetrics(BamReader* reader, const int32_t refIndex);
+
+	/**
+	 * Records how long a thread took to process the given region
+	 */
+	void recordTaskTime(const int32_t index, const uint16_t worker, const double seconds) {
+		results[index].worker = worker;
+		results[index].taskTime = seconds;
+	}
 
 	PreparedFiles& getPreparedFiles() { return prepData; }
 
+	path getUnsplicedBamFile() {
+		return path(outputDir.string() + "/" + outputPrefix + ".unspliced.bam");
+	}
+
+	BamIndexPtr getBamIndex() const { return bamIndex; }
+
+	FastaIndexPtr getFastaIndex() const { return fastaIndex; }
+	PackedGenomePtr getPackedGenome() const { return packedGenome; }
+
+	SplicedAlignmentMap& getSplicedAlignmentShard(const uint16_t worker) { return splicedAlignmentShards[worker]; }
+
 	bool isExtra() const {
 		return extra;
 	}
@@ -166,6 +264,34 @@ public:
 		this->threads = threads;
 	}
 
+	uint16_t getIoThreads() const {
+		return ioThreads;
+	}
+
+	void setIoThreads(uint16_t ioThreads) {
+		this->ioThreads = ioThreads;
+	}
+
+	int32_t getWindowSize() const {
+		return windowSize;
+	}
+
+	void setWindowSize(int32_t windowSize) {
+		this->windowSize = windowSize;
+	}
+
+	uint32_t getNameMemLimit() const {
+		return nameMemLimit;
+	}
+
+	/**
+	 * Maximum memory in MB for counting read names for the multiple mapping
+	 * score, before spilling to disk.  0 means no limit.
+	 */
+	void setNameMemLimit(uint32_t nameMemLimit) {
+		this->nameMemLimit = nameMemLimit;
+	}
+
 	bool isVerbose() const {
 		return verbose;
 	}
@@ -174,6 +300,19 @@ public:
 		this->verbose = verbose;
 	}
 
+	bool isMultipass() const {
+		return multipass;
+	}
+
+	/**
+	 * Whether to calculate the extra metrics by making separate passes over
+	 * split BAM files once all junctions have been found, rather than while
+	 * finding junctions
+	 */
+	void setMultipass(bool multipass) {
+		this->multipass = multipass;
+	}
+
 	bool isSeparate() const {
 		return separate;
 	}
@@ -258,33 +397,69 @@ public:
 	static int main(int argc, char *argv[]);
 };
 
+/**
+ * The kind of work done by each task in the thread pool
+ */
+enum class JBTaskType {
+	FIND_JUNCTIONS,     // Find junctions in a region of a target sequence
+	EXTRA_METRICS       // Calculate extra metrics for junctions on a target sequence
+};
+
+/**
+ * Thread pool for processing regions.  Each worker has its own queue of tasks.
+ * Tasks are assigned to the worker with the least amount of queued work, and
+ * each worker processes its own queue largest task first.  When a worker's
+ * own queue is empty it steals the largest task queued by the worker with the
+ * most queued work, so no thread sits idle while there is still work waiting.
+ * For best results enqueue tasks in decreasing order of size.
+ */
 class JBThreadPool {
 public:
 
 	// Constructor.
 	JBThreadPool(JunctionBuilder* jb, const uint16_t threads);
 
+	// Constructor for a specific kind of task.
+	JBThreadPool(JunctionBuilder* jb, const uint16_t threads, const JBTaskType taskType);
+
 	// Destructor.
 	~JBThreadPool();
 
-	// Adds task to a task queue.
-	void enqueue(const int32_t index);
+	// Adds task, with an estimate of its size, to a worker's task queue.
+	void enqueue(const int32_t index, const uint64_t size);
 
 	// Shut down the pool.
 	void shutDown();
 
 private:
 
+	struct Task {
+		int32_t index;
+		uint64_t size;
+	};
+
+	struct WorkQueue {
+		deque<Task> tasks;
+		uint64_t queuedSize = 0;
+		mutex queueMutex;
+	};
+
 	// JunctionBuider
 	JunctionBuilder* junctionBuilder;
 
+	// What each task does
+	JBTaskType taskType;
+
 	// Thread pool storage.
 	vector<thread> threadPool;
 
-	// Queue to keep track of incoming tasks and task index.
-	queue<int32_t> tasks;
+	// One task queue per thread.
+	vector<unique_ptr<WorkQueue>> queues;
 
-	// Task queue mutex.
+	// Number of tasks in all queues.
+	atomic<size_t> pending;
+
+	// Mutex used by idle threads waiting for new tasks.
 	mutex tasksMutex;
 
 	// Condition variable.
@@ -296,9 +471,16 @@ private:
 	// Indicates that pool has been terminated.
 	bool stopped;
 
+	// Takes the next task from the worker's own queue, or failing that steals
+	// one from another worker.  Returns false if there are no tasks queued.
+	bool nextTask(const uint16_t worker, Task& task);
+
 	// Function that will be invoked by our threads.
-	void invoke();
+	void invoke(const uint16_t worker);
+
+	// Runs tasks for the given worker until the pool is shut down.  Runs each
+	// task with the given function.
+	void run(const uint16_t worker, std::function<void(const int32_t)> execute);
 };
 
 }
-
@@ -65,7 +65,6 @@ using portcullis::ml::SemiSupervisedForest;
 using portcullis::PortcullisFS;
 using portcullis::Intron;
 using portcullis::IntronHasher;
-using portcullis::eval;
 
 #include "junction_filter.hpp"
 #include "prepare.hpp"
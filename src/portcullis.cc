@@ -145,11 +145,13 @@ int mainFull(int argc, char *argv[]) {
 	string strandSpecific;
 	string orientation;
 	uint16_t threads;
+	uint16_t ioThreads;
 	bool separate;
     bool extra;
     bool copy;
 	bool force;
 	bool useCsi;
+	uint32_t sortMemLimit;
 	bool properPairedCheck;
 	bool saveBad;
 	bool exongff;
@@ -168,6 +170,8 @@ int mainFull(int argc, char *argv[]) {
 	system_options.add_options()
 	("threads,t", po::value<uint16_t>(&threads)->default_value(1),
 	 "The number of threads to use.  Note that increasing the number of threads will also increase memory requirements.  Default: 1")
+	("io_threads", po::value<uint16_t>(&ioThreads)->default_value(1),
+	 "The number of threads to use for decompressing and compressing BAM files when streaming through them from start to finish.  Default: 1")
 	("verbose,v", po::bool_switch(&verbose)->default_value(false),
 	 "Print extra information")
 	("help", po::bool_switch(&help)->default_value(false), "Produce help message")
@@ -193,6 +197,8 @@ int mainFull(int argc, char *argv[]) {
 	 "Whether to copy files from input data to prepared data where possible, otherwise will use symlinks.  Will require more time and disk space to prepare input but is potentially more robust.")
 	("use_csi", po::bool_switch(&useCsi)->default_value(false),
 	 "Whether to use CSI indexing rather than BAI indexing.  CSI has the advantage that it supports very long target sequences (probably not an issue unless you are working on huge genomes).  BAI has the advantage that it is more widely supported (useful for viewing in genome browsers).")
+	("sort_mem_limit", po::value<uint32_t>(&sortMemLimit)->default_value(portcullis::DEFAULT_PREP_SORT_MEM_LIMIT),
+	 "Maximum memory in MB to use for holding alignments when sorting and merging BAM files.  Sorted runs are written to temporary files in the prep directory beyond this.")
 	;
     
     po::options_description analysis_options("Analysis options", w.ws_col, (unsigned)((double)w.ws_col / 1.5));
@@ -285,6 +291,7 @@ int mainFull(int argc, char *argv[]) {
 	prep.setUseLinks(!copy);
 	prep.setUseCsi(useCsi);
 	prep.setThreads(threads);
+	prep.setSortMemLimit(sortMemLimit);
 	prep.setVerbose(verbose);
 	// Prep the input to produce a usable indexed and sorted bam plus, indexed
 	// genome and queryable coverage information
@@ -298,6 +305,7 @@ int mainFull(int argc, char *argv[]) {
 	// Identify junctions and calculate metrics
 	JunctionBuilder jb(prepDir, juncOut);
 	jb.setThreads(threads);
+	jb.setIoThreads(ioThreads);
 	jb.setExtra(false);     // Run in fast mode
 	jb.setSeparate(false);  // Run in fast mode
 	jb.setStrandSpecific(strandednessFromString(strandSpecific));
@@ -340,6 +348,7 @@ int mainFull(int argc, char *argv[]) {
 		BamFilter bamFilter(filtJuncTab.string(), bamFile.string(), filteredBam.string());
 		//bamFilter.setStrandSpecific(strandednessFromString(strandSpecific));
 		//bamFilter.setOrientation(orientationFromString(orientation));
+		bamFilter.setIoThreads(ioThreads);
 		bamFilter.setUseCsi(useCsi);
 		bamFilter.setVerbose(verbose);
 		bamFilter.filter();
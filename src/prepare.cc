@@ -47,7 +47,10 @@ namespace bfs = boost::filesystem;
 using bfs::path;
 namespace po = boost::program_options;
 
+#include <htslib/sam.h>
+
 #include <portcullis/bam/bam_master.hpp>
+#include <portcullis/bam/bam_sorter.hpp>
 #include <portcullis/bam/genome_mapper.hpp>
 #include <portcullis/portcullis_fs.hpp>
 using portcullis::PortcullisFS;
@@ -82,6 +85,7 @@ void portcullis::PreparedFiles::clean() {
 	bfs::remove(getBamIndexFilePath(true));
 	bfs::remove(getGenomeFilePath());
 	bfs::remove(getGenomeIndexFilePath());
+	bfs::remove(getPackedGenomeFilePath());
 	bfs::remove(getBcfFilePath());
 	bfs::remove(getBcfIndexFilePath());
 }
@@ -93,6 +97,7 @@ portcullis::Prepare::Prepare(const path& _outputPrefix) {
 	useLinks = true;
 	useCsi = false;
 	threads = 1;
+	sortMemLimit = DEFAULT_PREP_SORT_MEM_LIMIT;
 	verbose = false;
 }
 
@@ -145,6 +150,28 @@ bool portcullis::Prepare::genomeIndex() {
 	return bfs::exists(indexFile);
 }
 
+bool portcullis::Prepare::genomePack() {
+	const path genomeFile = output->getGenomeFilePath();
+	const path packedFile = output->getPackedGenomeFilePath();
+	GenomeMapper gmap(genomeFile);
+	// Loading the index only picks up the packed genome if it's still valid for
+	// the fasta file, otherwise it's out of date and gets rebuilt
+	gmap.loadFastaIndex();
+	if (gmap.getPackedGenome() != nullptr) {
+		cout << "Packed genome detected: " << packedFile << endl;
+	}
+	else {
+		auto_cpu_timer timer(1, " - Genome Pack - Wall time taken: %ws\n\n");
+		cout << "Packing genome " << genomeFile << " ... ";
+		cout.flush();
+		// Encode the genome at 2 bits per base, so later stages can map it into memory
+		gmap.buildPackedGenome();
+		cout << "done." << endl
+			 << "Packed genome file created at: " << packedFile << endl;
+	}
+	return bfs::exists(packedFile);
+}
+
 
 /**
  * Merge together a set of BAM files, use the output prefix to construct a
@@ -161,35 +188,22 @@ bool portcullis::Prepare::bamMerge(vector<path> bamFiles) {
 	else {
 		auto_cpu_timer timer(1, " - BAM Merge - Wall time taken: %ws\n\n");
 		cout << "Found " << bamFiles.size() << " BAM files." << endl;
-		vector<path> mergeIn;
-		// Sort the individual inputs if necessary
-		uint16_t inCount = 1;
-		for (auto & f : bamFiles) {
-			path tempSorted = path(output->getPrepDir());
-			tempSorted /= "temp" + lexical_cast<string>(inCount++) + ".bam";
-			// Sort the data (if required, will auto-detect if necessary)
-			if (!bamSort(f, tempSorted)) {
-				BOOST_THROW_EXCEPTION(PrepareException() << PrepareErrorInfo(string(
-										  "Could not sort: ") + output->getUnsortedBamFilePath().string()));
-			}
-			mergeIn.push_back(tempSorted);
-		}
-		string mergeCmd = BamHelper::createMergeBamCmd(mergeIn, mergedBam, threads);
-		cout << "Merging BAM using command \"" << mergeCmd << "\" ... ";
+		// Sort and merge all the inputs in one pass, indexing the output as it's written
+		cout << "Sorting and merging BAM files ... ";
 		cout.flush();
-		int exitCode = system(mergeCmd.c_str());
-		if (exitCode != 0 || !bfs::exists(mergedBam)) {
+		BamSorter sorter(bamFiles, mergedBam);
+		sorter.setThreads(threads);
+		sorter.setMemoryLimit((size_t)sortMemLimit << 20);
+		sorter.enableIndexing(useCsi);
+		sorter.sort();
+		if (!bfs::exists(mergedBam)) {
 			BOOST_THROW_EXCEPTION(PrepareException() << PrepareErrorInfo(string(
 									  "Failed to successfully merge: ") + mergedBam.string()));
 		}
 		cout << "done." << endl
-			 << "Merged BAM file created at: " << mergedBam << endl;
-		cout << "Deleteing temporary unmerged files ...";
-		cout.flush();
-		for (auto & f : mergeIn) {
-			bfs::remove(f);
-		}
-		cout << "done." << endl;
+			 << "Merged " << sorter.getNbRecords() << " alignments from " << sorter.getNbRuns() << " sorted runs" << endl
+			 << "Merged BAM file created at: " << mergedBam << endl
+			 << "BAM index created at: " << sorter.getIndexFile() << endl;
 	}
 	// Return true if the merged BAM exists now, which is should do
 	return bfs::exists(mergedBam) || bfs::symbolic_link_exists(mergedBam);
@@ -216,20 +230,21 @@ bool portcullis::Prepare::bamSort(const path& input, const path& output) {
 		else {
 			auto_cpu_timer timer(1, " - BAM Sort - Wall time taken: %ws\n\n");
 			// Sort the BAM file by coordinate
-			string sortCmd = BamHelper::createSortBamCmd(unsortedBam, sortedBam, false, threads, "1G");
-			cout << "Sorting BAM using command \"" << sortCmd << "\" ... ";
+			cout << "Sorting BAM " << unsortedBam << " ... ";
 			cout.flush();
-			int exitCode = system(sortCmd.c_str());
-			path badNameMergeFile = path(sortedBam.string() + ".bam");
-			if (bfs::exists(badNameMergeFile) || bfs::symbolic_link_exists(badNameMergeFile)) {
-				boost::filesystem::rename(badNameMergeFile, sortedBam);
-			}
-			if (exitCode != 0 || !bfs::exists(sortedBam) || !BamHelper::isCoordSortedBam(sortedBam)) {
+			BamSorter sorter(vector<path>(1, unsortedBam), sortedBam);
+			sorter.setThreads(threads);
+			sorter.setMemoryLimit((size_t)sortMemLimit << 20);
+			sorter.setTrustSorted(false);
+			sorter.enableIndexing(useCsi);
+			sorter.sort();
+			if (!bfs::exists(sortedBam) || !BamHelper::isCoordSortedBam(sortedBam)) {
 				BOOST_THROW_EXCEPTION(PrepareException() << PrepareErrorInfo(string(
 										  "Failed to successfully sort: ") + unsortedBam.string()));
 			}
 			cout << "done." << endl
-				 << "Sorted BAM file created at: " << sortedBam << endl;
+				 << "Sorted BAM file created at: " << sortedBam << endl
+				 << "BAM index created at: " << sorter.getIndexFile() << endl;
 		}
 	}
 	// Return true if the sorted BAM exists now, which is should do
@@ -244,12 +259,12 @@ bool portcullis::Prepare::bamIndex(const bool copied) {
 		if (verbose) cout << "Prepped indexed BAM detected: " << indexedFile << endl;
 	}
 	else if (!indexedBamExists) {
+		// Sorted and merged BAMs are indexed as they're written, so this is only
+		// needed for pre-sorted inputs without an index, which we index in process
 		auto_cpu_timer timer(1, " - BAM Index - Wall time taken: %ws\n\n");
-		// Create BAM index
-		string indexCmd = BamHelper::createIndexBamCmd(sortedBam, useCsi);
-		cout << "Indexing BAM using command \"" << indexCmd << "\" ... ";
+		cout << "Indexing BAM " << sortedBam << " ... ";
 		cout.flush();
-		int exitCode = system(indexCmd.c_str());
+		int exitCode = sam_index_build2(sortedBam.c_str(), indexedFile.c_str(), useCsi ? 14 : 0);
 		if (exitCode != 0 || !exists(output->getBamIndexFilePath(useCsi))) {
 			BOOST_THROW_EXCEPTION(PrepareException() << PrepareErrorInfo(string(
 									  "Failed to successfully index: ") + sortedBam.string()));
@@ -267,7 +282,8 @@ void portcullis::Prepare::prepare(vector<path> bamFiles, const path& originalGen
 			 << " - Force prep (cleans output directory): " << boolalpha << force << endl
 			 << " - Use symbolic links instead of copy where possible: " << boolalpha << useLinks << endl
 			 << " - Indexing type: " << (useCsi ? "CSI" : "BAI") << endl
-			 << " - Threads (for sorting BAM): " << threads << endl << endl;
+			 << " - Threads (for sorting BAM): " << threads << endl
+			 << " - Memory limit (for sorting BAM): " << sortMemLimit << "MB" << endl << endl;
 	}
 	if (force) {
 		cout << "Cleaning output dir: " << output->getPrepDir() << " ... ";
@@ -292,6 +308,10 @@ void portcullis::Prepare::prepare(vector<path> bamFiles, const path& originalGen
 		BOOST_THROW_EXCEPTION(PrepareException() << PrepareErrorInfo(string(
 								  "User requested ") + (useCsi ? "CSI" : "BAI") + " indexing mode, however, genome file contains sequences too long to properly index using this method.  To continue, restart using the --use_csi option."));
 	}
+	if (!genomePack()) {
+		BOOST_THROW_EXCEPTION(PrepareException() << PrepareErrorInfo(string(
+								  "Could not create packed genome")));
+	}
 	const bool doMerge = bamFiles.size() > 1;
 	if (bamFiles.empty()) {
 		BOOST_THROW_EXCEPTION(PrepareException() << PrepareErrorInfo(string(
@@ -376,6 +396,7 @@ int portcullis::Prepare::main(int argc, char *argv[]) {
 	bool copy;
 	bool useCsi;
 	uint16_t threads;
+	uint32_t sortMemLimit;
 	bool verbose;
 	bool help;
 	struct winsize w;
@@ -393,6 +414,8 @@ int portcullis::Prepare::main(int argc, char *argv[]) {
 	 "Whether to use CSI indexing rather than BAI indexing.  CSI has the advantage that it supports very long target sequences (probably not an issue unless you are working on huge genomes).  BAI has the advantage that it is more widely supported (useful for viewing in genome browsers).")
 	("threads,t", po::value<uint16_t>(&threads)->default_value(DEFAULT_PREP_THREADS),
 	 (string("The number of threads to used to sort the BAM file (if required).  Default: ") + lexical_cast<string>(DEFAULT_PREP_THREADS)).c_str())
+	("sort_mem_limit", po::value<uint32_t>(&sortMemLimit)->default_value(DEFAULT_PREP_SORT_MEM_LIMIT),
+	 "Maximum memory in MB to use for holding alignments when sorting and merging BAM files.  Sorted runs are written to temporary files in the output directory beyond this.")
 	("verbose,v", po::bool_switch(&verbose)->default_value(false),
 	 "Print extra information")
 	("help", po::bool_switch(&help)->default_value(false), "Produce help message")
@@ -451,6 +474,7 @@ int portcullis::Prepare::main(int argc, char *argv[]) {
 	prep.setUseLinks(!copy);
 	prep.setUseCsi(useCsi);
 	prep.setThreads(threads);
+	prep.setSortMemLimit(sortMemLimit);
 	prep.setVerbose(verbose);
 	// Prep the input to produce a usable indexed and sorted bam plus, indexed
 	// genome and queryable coverage information
@@ -58,6 +58,7 @@ struct PrepareException: virtual boost::exception, virtual std::exception { };
 
 const string DEFAULT_PREP_OUTPUT_DIR = "portcullis_prep";
 const uint16_t DEFAULT_PREP_THREADS = 1;
+const uint32_t DEFAULT_PREP_SORT_MEM_LIMIT = 1024;
 
 const string PORTCULLIS = "portcullis";
 
@@ -139,6 +140,10 @@ public:
 		return path(getGenomeFilePath().string() + FASTA_INDEX_EXTENSION);
 	}
 
+	path getPackedGenomeFilePath() const {
+		return path(getGenomeFilePath().string() + PACKED_GENOME_EXTENSION);
+	}
+
 	bool valid(bool useCsi) const;
 
 	void clean();
@@ -153,6 +158,7 @@ private:
 	bool force;
 	bool useLinks;
 	uint16_t threads;
+	uint32_t sortMemLimit;
 	bool useCsi;
 	bool verbose;
 
@@ -185,6 +191,19 @@ public:
 		this->threads = threads;
 	}
 
+	uint32_t getSortMemLimit() const {
+		return sortMemLimit;
+	}
+
+	/**
+	 * Sets the memory used for holding alignments when sorting and merging BAM
+	 * files, beyond which sorted runs are written to the output directory
+	 * @param sortMemLimit Limit in MB
+	 */
+	void setSortMemLimit(uint32_t sortMemLimit) {
+		this->sortMemLimit = sortMemLimit;
+	}
+
 	bool isUseCsi() const {
 		return useCsi;
 	}
@@ -220,6 +239,8 @@ protected:
 
 	bool genomeIndex();
 
+	bool genomePack();
+
 
 	/**
 	 * Merge together a set of BAM files, use the output prefix to construct a
@@ -17,9 +17,12 @@
 
 #include <gtest/gtest.h>
 
+#include <algorithm>
 #include <iostream>
 #include <fstream>
+#include <random>
 #include <string>
+#include <vector>
 using std::cout;
 using std::endl;
 using std::stringstream;
@@ -34,8 +37,12 @@ using bfs::path;
 #include <portcullis/bam/bam_master.hpp>
 #include <portcullis/bam/bam_alignment.hpp>
 #include <portcullis/bam/bam_reader.hpp>
+#include <portcullis/bam/bam_sorter.hpp>
+#include <portcullis/bam/bam_writer.hpp>
 #include <portcullis/bam/depth_parser.hpp>
 #include <portcullis/bam/genome_mapper.hpp>
+#include <portcullis/bam/read_name_counter.hpp>
+#include <portcullis/bam/sparse_depth.hpp>
 using namespace portcullis::bam;
 
         
@@ -76,6 +83,276 @@ TEST(bam, merge) {
     EXPECT_EQ(cmd, correct);
 }
 
+// Sort key and name of every record in a BAM, in file order
+static vector<std::pair<uint64_t, string>> readSortKeys(const path& bamFile) {
+    vector<std::pair<uint64_t, string>> keys;
+    BamReader reader(bamFile);
+    reader.open();
+    while (reader.next()) {
+        const BamAlignment& al = reader.current();
+        const bam1_core_t& c = al.getRaw()->core;
+        keys.push_back(std::make_pair(BamSorter::sortKey(c.tid, c.pos, c.flag & BAM_FREVERSE), al.deriveName()));
+    }
+    reader.close();
+    return keys;
+}
+
+static size_t countRegion(const path& bamFile, BamIndexPtr index, int32_t tid, int32_t start, int32_t end) {
+    BamReader reader(bamFile);
+    reader.setIndex(index);
+    reader.open();
+    reader.setRegion(tid, start, end);
+    size_t count = 0;
+    while (reader.next()) {
+        count++;
+    }
+    reader.close();
+    return count;
+}
+
+TEST(bam, sorter) {
+    
+    bfs::create_directories("temp");
+    path shuffled("temp/shuffled.bam");
+    path sorted("temp/shuffled.sorted.bam");
+    
+    // Shuffle a sorted BAM, leaving its header claiming it's sorted
+    BamReader reader(RESOURCESDIR "/clipped3.bam");
+    reader.open();
+    vector<bam1_t*> records;
+    while (reader.next()) {
+        records.push_back(bam_dup1(reader.current().getRaw()));
+    }
+    std::mt19937 rng(42);
+    std::shuffle(records.begin(), records.end(), rng);
+    const int32_t length = reader.getHeader()->target_len[0];
+    BGZF* fp = bgzf_open(shuffled.c_str(), "w");
+    bam_hdr_write(fp, reader.getHeader());
+    for (auto b : records) {
+        bam_write1(fp, b);
+        bam_destroy1(b);
+    }
+    bgzf_close(fp);
+    reader.close();
+    
+    // A small memory limit forces the records out to several runs
+    BamSorter sorter(vector<path>(1, shuffled), sorted);
+    sorter.setThreads(2);
+    sorter.setMemoryLimit(1 << 17);
+    sorter.setTrustSorted(false);
+    sorter.enableIndexing(false);
+    sorter.sort();
+    EXPECT_EQ(sorter.getNbRecords(), records.size());
+    EXPECT_GT(sorter.getNbRuns(), 2);
+    EXPECT_TRUE(BamHelper::isCoordSortedBam(sorted));
+    EXPECT_TRUE(bfs::exists(sorter.getIndexFile()));
+    BamIndexPtr index = BamReader::loadIndex(sorted);
+    ASSERT_TRUE(index != nullptr);
+    EXPECT_EQ(countRegion(sorted, index, 0, 0, length), records.size());
+    
+    auto expected = readSortKeys(RESOURCESDIR "/clipped3.bam");
+    auto actual = readSortKeys(sorted);
+    ASSERT_EQ(actual.size(), expected.size());
+    for (size_t i = 1; i < actual.size(); i++) {
+        EXPECT_LE(actual[i - 1].first, actual[i].first);
+    }
+    std::sort(expected.begin(), expected.end());
+    std::sort(actual.begin(), actual.end());
+    EXPECT_TRUE(actual == expected);
+    
+    // Everything fits in memory
+    BamSorter inMemory(vector<path>(1, shuffled), sorted);
+    inMemory.setTrustSorted(false);
+    inMemory.sort();
+    EXPECT_EQ(inMemory.getNbRuns(), 1);
+    auto actual2 = readSortKeys(sorted);
+    std::sort(actual2.begin(), actual2.end());
+    EXPECT_TRUE(actual2 == expected);
+    
+    // Temporary runs are cleaned up
+    size_t nbFiles = 0;
+    for (bfs::directory_iterator it("temp"); it != bfs::directory_iterator(); ++it) {
+        if (it->path().filename().string().find("portcullis_sort_") == 0) {
+            nbFiles++;
+        }
+    }
+    EXPECT_EQ(nbFiles, 0);
+    
+    bfs::remove(shuffled);
+    bfs::remove(sorted);
+    bfs::remove(sorter.getIndexFile());
+}
+
+TEST(bam, sorter_merge) {
+    
+    bfs::create_directories("temp");
+    path merged("temp/merged.bam");
+    vector<path> bamFiles;
+    bamFiles.push_back(RESOURCESDIR "/bam1.bam");
+    bamFiles.push_back(RESOURCESDIR "/bam2.bam");
+    
+    // These claim to be sorted, but aren't, so they get sorted anyway
+    BamSorter trusting(bamFiles, merged);
+    trusting.sort();
+    EXPECT_EQ(trusting.getNbRecords(), 200);
+    auto trustedKeys = readSortKeys(merged);
+    ASSERT_EQ(trustedKeys.size(), 200);
+    for (size_t i = 1; i < trustedKeys.size(); i++) {
+        EXPECT_LE(trustedKeys[i - 1].first, trustedKeys[i].first);
+    }
+    EXPECT_FALSE(bfs::exists(merged.string() + ".tmp"));
+    
+    BamSorter sorter(bamFiles, merged);
+    sorter.setTrustSorted(false);
+    sorter.sort();
+    EXPECT_EQ(sorter.getNbRecords(), 200);
+    auto keys = readSortKeys(merged);
+    ASSERT_EQ(keys.size(), 200);
+    for (size_t i = 1; i < keys.size(); i++) {
+        EXPECT_LE(keys[i - 1].first, keys[i].first);
+    }
+    
+    // Sorted inputs are merged as they are, without being read into memory
+    path merged2("temp/merged2.bam");
+    vector<path> sortedFiles;
+    sortedFiles.push_back(merged);
+    sortedFiles.push_back(RESOURCESDIR "/sorted.bam");
+    BamSorter withSorted(sortedFiles, merged2);
+    withSorted.sort();
+    EXPECT_EQ(withSorted.getNbRecords(), 300);
+    EXPECT_EQ(withSorted.getNbRuns(), 2);
+    keys = readSortKeys(merged2);
+    for (size_t i = 1; i < keys.size(); i++) {
+        EXPECT_LE(keys[i - 1].first, keys[i].first);
+    }
+    
+    // Inputs must share target sequences
+    sortedFiles.push_back(RESOURCESDIR "/clipped3.bam");
+    BamSorter mismatched(sortedFiles, merged2);
+    EXPECT_THROW(mismatched.sort(), BamException);
+    
+    bfs::remove(merged);
+    bfs::remove(merged2);
+}
+
+TEST(bam, sorter_write_error) {
+    
+    bfs::create_directories("temp");
+    path sam("temp/bad_position.sam");
+    path input("temp/bad_position.bam");
+    path output("temp/bad_position.sorted.bam");
+    
+    // A mapped record at a negative position sorts after the second target's
+    // records, which the index can't take.  Enough unmapped records follow it
+    // that the index fails while records are still being written.
+    std::ofstream out(sam.c_str());
+    out << "@SQ\tSN:seq1\tLN:1000" << endl << "@SQ\tSN:seq2\tLN:1000" << endl
+        << "good\t0\tseq1\t100\t60\t4M\t*\t0\t0\tACGT\t*" << endl
+        << "bad\t0\tseq1\t100\t60\t4M\t*\t0\t0\tACGT\t*" << endl
+        << "other\t0\tseq2\t100\t60\t4M\t*\t0\t0\tACGT\t*" << endl;
+    const string longSeq(1000, 'A');
+    for (int i = 0; i < 3000; i++) {
+        out << "unmapped" << i << "\t4\t*\t0\t0\t*\t*\t0\t0\t" << longSeq << "\t*" << endl;
+    }
+    out.close();
+    samFile* in = sam_open(sam.c_str(), "r");
+    ASSERT_TRUE(in != nullptr);
+    bam_hdr_t* header = sam_hdr_read(in);
+    BGZF* fp = bgzf_open(input.c_str(), "w");
+    bam_hdr_write(fp, header);
+    bam1_t* b = bam_init1();
+    while (sam_read1(in, header, b) >= 0) {
+        if (string(bam_get_qname(b)) == "bad") {
+            b->core.pos = -5;
+        }
+        bam_write1(fp, b);
+    }
+    bam_destroy1(b);
+    bgzf_close(fp);
+    bam_hdr_destroy(header);
+    sam_close(in);
+    
+    // The partial output and index are removed
+    BamSorter sorter(vector<path>(1, input), output);
+    sorter.setTrustSorted(false);
+    sorter.enableIndexing(false);
+    EXPECT_THROW(sorter.sort(), BamException);
+    EXPECT_FALSE(bfs::exists(output));
+    EXPECT_FALSE(bfs::exists(output.string() + ".tmp"));
+    EXPECT_FALSE(bfs::exists(output.string() + ".tmp.bai"));
+    
+    bfs::remove(sam);
+    bfs::remove(input);
+}
+
+TEST(bam, writer_index) {
+    
+    bfs::create_directories("temp");
+    path indexed("temp/indexed.bam");
+    
+    BamReader reader(RESOURCESDIR "/clipped3.bam");
+    reader.open();
+    vector<bam1_t*> records;
+    while (reader.next()) {
+        records.push_back(bam_dup1(reader.current().getRaw()));
+    }
+    const int32_t length = reader.getHeader()->target_len[0];
+    
+    for (int useCsi = 0; useCsi < 2; useCsi++) {
+        // Write each record several times, so the output spans many batches of blocks
+        BamWriter writer(indexed);
+        writer.setThreads(2);
+        writer.enableIndexing(useCsi, path("temp/indexed.bam.own"));
+        writer.open(reader.getHeader());
+        for (auto b : records) {
+            for (int i = 0; i < 4; i++) {
+                EXPECT_EQ(writer.write(b), 0);
+            }
+        }
+        writer.close();
+        
+        // Compare against the index htslib builds from the finished file
+        ASSERT_EQ(sam_index_build2(indexed.c_str(), "temp/indexed.bam.ref", useCsi ? 14 : 0), 0);
+        BamIndexPtr own(hts_idx_load2(indexed.c_str(), "temp/indexed.bam.own"), hts_idx_destroy);
+        BamIndexPtr ref(hts_idx_load2(indexed.c_str(), "temp/indexed.bam.ref"), hts_idx_destroy);
+        ASSERT_TRUE(own != nullptr);
+        ASSERT_TRUE(ref != nullptr);
+        uint64_t ownMapped, ownUnmapped, refMapped, refUnmapped;
+        EXPECT_EQ(hts_idx_get_stat(own.get(), 0, &ownMapped, &ownUnmapped), 0);
+        EXPECT_EQ(hts_idx_get_stat(ref.get(), 0, &refMapped, &refUnmapped), 0);
+        EXPECT_EQ(ownMapped, refMapped);
+        EXPECT_EQ(ownUnmapped, refUnmapped);
+        
+        EXPECT_EQ(countRegion(indexed, own, 0, 0, length), records.size() * 4);
+        for (int32_t start = 0; start < length; start += length / 50) {
+            EXPECT_EQ(countRegion(indexed, own, 0, start, start + 5000), countRegion(indexed, ref, 0, start, start + 5000));
+        }
+    }
+    reader.close();
+    
+    // Can't index records that aren't sorted
+    BamReader unsorted(RESOURCESDIR "/unsorted.bam");
+    unsorted.open();
+    EXPECT_THROW({
+        BamWriter writer(indexed);
+        writer.enableIndexing(false);
+        writer.open(unsorted.getHeader());
+        while (unsorted.next()) {
+            writer.write(unsorted.current());
+        }
+        writer.close();
+    }, BamException);
+    unsorted.close();
+    
+    for (auto b : records) {
+        bam_destroy1(b);
+    }
+    bfs::remove(indexed);
+    bfs::remove("temp/indexed.bam.bai");
+    bfs::remove("temp/indexed.bam.own");
+    bfs::remove("temp/indexed.bam.ref");
+}
+
 TEST(bam, is_sorted1) {
     
     string unsortedBam = RESOURCESDIR "/unsorted.bam";
@@ -94,6 +371,35 @@ TEST(bam, is_sorted2) {
     EXPECT_EQ(sorted, true);    
 }
 
+TEST(bam, parallel_decompression) {
+    
+    string bamFile = RESOURCESDIR "/clipped3.bam";
+    
+    BamReader serial(bamFile);
+    serial.open();
+    BamReader parallel(bamFile, 4);
+    parallel.open();
+    
+    uint32_t count = 0;
+    bool ok = true;
+    while (serial.next()) {
+        EXPECT_TRUE(parallel.next());
+        const BamAlignment& s = serial.current();
+        const BamAlignment& p = parallel.current();
+        ok = ok && s.deriveName() == p.deriveName() && 
+                s.getPosition() == p.getPosition() &&
+                s.getCigarAsString() == p.getCigarAsString() &&
+                s.getQuerySeq() == p.getQuerySeq();
+        count++;
+    }
+    EXPECT_FALSE(parallel.next());
+    serial.close();
+    parallel.close();
+    
+    EXPECT_TRUE(ok);
+    EXPECT_GT(count, 0);
+}
+
 
 TEST(bam, depth_test_1) {
     
@@ -142,6 +448,138 @@ TEST(bam, depth_test_1) {
     EXPECT_LE(count2, count1);
 }
 
+// Checks the difference array engine gives the same depths as the pileup
+TEST(bam, depth_engines) {
+    
+    const vector<string> bamFiles = { RESOURCESDIR "/sorted.bam", RESOURCESDIR "/clipped3.bam" };
+    for(const string& bamFile : bamFiles) {
+        for(bool gapped : { true, false }) {
+            
+            DepthParser pileup(bamFile, 0, gapped, 1, true);
+            vector<vector<uint32_t>> expected;
+            vector<int32_t> expectedRefs;
+            vector<uint32_t> batch;
+            while(pileup.loadNextBatch(batch)) {
+                expected.push_back(batch);
+                expectedRefs.push_back(pileup.getCurrentRefIndex());
+            }
+            
+            DepthParser difference(bamFile, 0, gapped, 1, false);
+            size_t i = 0;
+            bool same = true;
+            while(difference.loadNextBatch(batch)) {
+                EXPECT_LT(i, expected.size());
+                if (i < expected.size()) {
+                    same = same && batch == expected[i] && difference.getCurrentRefIndex() == expectedRefs[i];
+                }
+                i++;
+            }
+            
+            EXPECT_EQ(i, expected.size());
+            EXPECT_TRUE(same);
+        }
+    }
+}
+
+TEST(bam, sparse_depth) {
+    
+    // Dense depths from the pileup, as used by the old coverage calculation
+    DepthParser dp(RESOURCESDIR "/clipped3.bam", 0, false);
+    vector<vector<uint32_t>> dense;
+    vector<uint32_t> batch;
+    while(dp.loadNextBatch(batch)) {
+        const int32_t refId = dp.getCurrentRefIndex();
+        if (refId >= (int32_t)dense.size()) {
+            dense.resize(refId + 1);
+        }
+        dense[refId] = batch;
+    }
+    
+    // Windows every 500bp on each target with coverage
+    BamReader reader(RESOURCESDIR "/clipped3.bam");
+    reader.open();
+    vector<SparseDepth> sparse(dense.size());
+    for(size_t r = 0; r < dense.size(); r++) {
+        for(int32_t p = 0; p < (int32_t)dense[r].size(); p += 500) {
+            sparse[r].addWindow(p, p + 50);
+        }
+        sparse[r].index();
+    }
+    while(reader.next()) {
+        const BamAlignment& al = reader.current();
+        const int32_t refId = al.getReferenceId();
+        if (refId >= 0 && refId < (int32_t)sparse.size() && !al.isSplicedRead()) {
+            sparse[refId].addAlignment(al);
+        }
+    }
+    reader.close();
+    
+    // Coverage level i holds the depth at 0-based position i - 1
+    uint32_t mismatches = 0;
+    uint64_t total = 0;
+    for(size_t r = 0; r < dense.size(); r++) {
+        for(int32_t p = 1; p < (int32_t)dense[r].size(); p++) {
+            const uint32_t expected = (p - 1) % 500 < 50 ? dense[r][p] : 0;
+            if (sparse[r].getDepth(p - 1) != expected) {
+                mismatches++;
+            }
+            total += expected;
+        }
+    }
+    
+    EXPECT_EQ(mismatches, 0);
+    EXPECT_GT(total, 0);
+}
+
+TEST(bam, read_name_counter) {
+    
+    // Compare against counting the derived names directly
+    BamReader reader(RESOURCESDIR "/clipped3.bam");
+    reader.open();
+    std::map<string, uint32_t> names;
+    std::map<string, uint64_t> codes;
+    ReadNameCounter counter;
+    while(reader.next()) {
+        const BamAlignment& al = reader.current();
+        names[al.deriveName()]++;
+        codes[al.deriveName()] = al.deriveNameCode();
+        counter.add(al.deriveNameCode());
+    }
+    reader.close();
+    
+    EXPECT_EQ(counter.size(), names.size());
+    bool same = true;
+    for(const auto& n : names) {
+        same = same && counter.count(codes[n.first]) == n.second;
+    }
+    EXPECT_TRUE(same);
+    EXPECT_EQ(counter.count(0), 0);
+    
+    // Counts saturate rather than wrap
+    ReadNameCounter saturated;
+    saturated.add(42, 65000);
+    saturated.add(42, 1000);
+    EXPECT_EQ(saturated.count(42), 65535);
+    
+    // Spill to disk with a tiny memory limit, then look up some of the counts
+    bfs::create_directories("temp");
+    ReadNameCounter spilled(1000, "temp");
+    for(uint64_t i = 1; i <= 10000; i++) {
+        spilled.add(i * 7919, i % 3 + 1);
+        if (i % 2 == 0) {
+            spilled.add(i * 7919);
+        }
+    }
+    EXPECT_TRUE(spilled.isSpilled());
+    vector<uint64_t> queries = { 7919, 2 * 7919, 5000 * 7919, 10001 * 7919 };
+    spilled.resolve(queries);
+    EXPECT_FALSE(spilled.isSpilled());
+    EXPECT_EQ(spilled.count(7919), 2);
+    EXPECT_EQ(spilled.count(2 * 7919), 4);
+    EXPECT_EQ(spilled.count(5000 * 7919), 4);
+    EXPECT_EQ(spilled.count(10001 * 7919), 0);
+}
+
 TEST(bam, genome_mapper_ecoli) {
     
     // Create a new faidx
@@ -189,6 +627,443 @@ TEST(bam, genome_mapper_ecoli) {
     bfs::remove(faidxFile);
 }
 
+TEST(bam, genome_mapper_shared_index) {
+    
+    bfs::create_directories("temp");
+    path in(RESOURCESDIR "/spombe.III.fa");
+    path out("temp/spombe.III.fa");
+    
+    std::ifstream  src(in.c_str(), std::ios::binary);
+    std::ofstream  dst(out.c_str(), std::ios::binary);
+
+    dst << src.rdbuf();
+    dst.close();
+    
+    GenomeMapper gmap1(out);
+    gmap1.buildFastaIndex();
+    gmap1.loadFastaIndex();
+    
+    // Second mapper shares the index loaded by the first
+    GenomeMapper gmap2(out);
+    gmap2.loadFastaIndex(gmap1.getFastaIndex());
+    EXPECT_EQ(gmap1.getFastaIndex(), gmap2.getFastaIndex());
+    EXPECT_EQ(gmap2.getNbSeqs(), 1);
+    
+    int len = -1;
+    string fullSeq = gmap2.fetchBases("III", &len);
+    EXPECT_EQ(len, 2452883);
+    
+    // Region spanning a line break
+    string partialSeq1 = gmap1.fetchBases("III", 55, 64, &len);
+    EXPECT_EQ(partialSeq1, "cgcaattaag");
+    EXPECT_EQ(len, 10);
+    
+    string partialSeq2 = gmap2.fetchBases("III:56-65", &len);
+    EXPECT_EQ(partialSeq2, "cgcaattaag");
+    EXPECT_EQ(len, 10);
+    
+    // Regions are clipped to the sequence bounds
+    string partialSeq3 = gmap2.fetchBases("III", -5, 9, &len);
+    EXPECT_EQ(partialSeq3, "Gatcagccaa");
+    
+    string missing = gmap2.fetchBases("IV", 0, 9, &len);
+    EXPECT_EQ(missing, "");
+    EXPECT_EQ(len, -2);
+    
+    bfs::remove(gmap1.getFastaIndexFile());
+}
+
+TEST(bam, genome_buffer) {
+    
+    bfs::create_directories("temp");
+    path in(RESOURCESDIR "/spombe.III.fa");
+    path out("temp/spombe.III.buffer.fa");
+    
+    std::ifstream  src(in.c_str(), std::ios::binary);
+    std::ofstream  dst(out.c_str(), std::ios::binary);
+
+    dst << src.rdbuf();
+    dst.close();
+    
+    GenomeMapper gmap(out);
+    gmap.buildFastaIndex();
+    gmap.loadFastaIndex();
+    
+    int len = -1;
+    string fullSeq = gmap.fetchBases("III", &len);
+    boost::to_upper(fullSeq);
+    
+    // Regions moving along the sequence, some spanning the end of a chunk
+    GenomeBuffer buffer(gmap, "III", 1000);
+    int32_t regions[][2] = {{0, 9}, {55, 64}, {990, 1010}, {1005, 1200}, {5000, 9000}, {2452800, 2452882}};
+    for (auto & r : regions) {
+        EXPECT_TRUE(buffer.fetch(r[0], r[1]));
+        EXPECT_LE(buffer.getStart(), r[0]);
+        EXPECT_GE(buffer.getEnd(), r[1]);
+        EXPECT_EQ(buffer.getSeq().substr(r[0] - buffer.getStart(), r[1] - r[0] + 1), fullSeq.substr(r[0], r[1] - r[0] + 1));
+    }
+    
+    // Regions off the end of the sequence
+    EXPECT_FALSE(buffer.fetch(2452800, 2452883));
+    EXPECT_FALSE(buffer.fetch(-1, 10));
+    
+    EXPECT_THROW(GenomeBuffer(gmap, "IV", 1000), BamException);
+    
+    bfs::remove(gmap.getFastaIndexFile());
+    bfs::remove(out);
+}
+
+TEST(bam, genome_windows) {
+    
+    bfs::create_directories("temp");
+    path in(RESOURCESDIR "/spombe.III.fa");
+    path out("temp/spombe.III.windows.fa");
+    
+    std::ifstream  src(in.c_str(), std::ios::binary);
+    std::ofstream  dst(out.c_str(), std::ios::binary);
+
+    dst << src.rdbuf();
+    dst.close();
+    
+    GenomeMapper gmap(out);
+    gmap.buildFastaIndex();
+    gmap.loadFastaIndex();
+    
+    // Windows out of order, overlapping, clipped at either end and far apart
+    int32_t regions[][2] = {{1000, 1001}, {990, 999}, {55, 64}, {-5, 9}, {1000, 1009},
+                            {500000, 500080}, {2452800, 2452890}, {20, 10}};
+    GenomeWindows windows(gmap, "III", 4096);
+    for (auto & r : regions) {
+        windows.add(r[0], r[1]);
+    }
+    EXPECT_EQ(windows.size(), 8);
+    windows.fetch();
+    EXPECT_EQ(windows.getNbBlocks(), 3);
+    for (size_t i = 0; i < windows.size(); i++) {
+        int len1 = -1;
+        int len2 = -1;
+        string expected = gmap.fetchBases("III", regions[i][0], regions[i][1], &len1);
+        EXPECT_EQ(windows.get(i, &len2), expected);
+        EXPECT_EQ(len2, len1);
+    }
+    
+    // Sequences missing from the genome behave as they do with fetchBases
+    GenomeWindows missing(gmap, "IV");
+    missing.add(0, 9);
+    missing.fetch();
+    int len = -1;
+    EXPECT_EQ(missing.get(0, &len), "");
+    EXPECT_EQ(len, -2);
+    
+    bfs::remove(gmap.getFastaIndexFile());
+    bfs::remove(out);
+}
+
+TEST(bam, packed_genome) {
+    
+    bfs::create_directories("temp");
+    path in(RESOURCESDIR "/spombe.III.fa");
+    path out("temp/spombe.III.packed.fa");
+    
+    std::ifstream  src(in.c_str(), std::ios::binary);
+    std::ofstream  dst(out.c_str(), std::ios::binary);
+
+    dst << src.rdbuf();
+    dst.close();
+    
+    GenomeMapper plain(out);
+    plain.buildFastaIndex();
+    plain.loadFastaIndex();
+    plain.buildPackedGenome();
+    EXPECT_TRUE(bfs::exists(plain.getPackedGenomeFile()));
+    EXPECT_EQ(plain.getPackedGenome(), nullptr);
+    
+    // Loading the index picks up the packed genome
+    GenomeMapper packed(out);
+    packed.loadFastaIndex();
+    ASSERT_NE(packed.getPackedGenome(), nullptr);
+    EXPECT_EQ(packed.getPackedGenome()->size(), 1);
+    
+    int len1 = -1;
+    int len2 = -1;
+    int32_t regions[][2] = {{0, 9}, {55, 64}, {-5, 9}, {1000, 5000}, {2452800, 2452890}};
+    for (auto & r : regions) {
+        string s1 = plain.fetchBases("III", r[0], r[1], &len1);
+        string s2 = packed.fetchBases("III", r[0], r[1], &len2);
+        EXPECT_EQ(s1, s2);
+        EXPECT_EQ(len1, len2);
+    }
+    EXPECT_EQ(packed.fetchBases("III", &len2), plain.fetchBases("III", &len1));
+    EXPECT_EQ(len2, 2452883);
+    
+    PackedSeqView view;
+    EXPECT_TRUE(packed.fetchView("III", 55, 64, view));
+    EXPECT_EQ(view.size(), 10);
+    EXPECT_EQ(view.toString(), "cgcaattaag");
+    EXPECT_EQ(view.upper(0), 'C');
+    EXPECT_TRUE(view.isSoftMasked(0));
+    EXPECT_EQ(view.nt16(0), seq_nt16_table['C']);
+    EXPECT_FALSE(packed.fetchView("III", 2452880, 2452883, view));
+    EXPECT_FALSE(packed.fetchView("IV", 0, 9, view));
+    EXPECT_FALSE(plain.fetchView("III", 55, 64, view));
+    
+    bfs::remove(plain.getPackedGenomeFile());
+    bfs::remove(plain.getFastaIndexFile());
+    bfs::remove(out);
+}
+
+TEST(bam, packed_genome_stale) {
+    
+    bfs::create_directories("temp");
+    path in(RESOURCESDIR "/spombe.III.fa");
+    path out("temp/spombe.III.stale.fa");
+    
+    std::ifstream  src(in.c_str(), std::ios::binary);
+    std::ofstream  dst(out.c_str(), std::ios::binary);
+
+    dst << src.rdbuf();
+    dst.close();
+    
+    GenomeMapper gmap(out);
+    gmap.buildFastaIndex();
+    gmap.loadFastaIndex();
+    gmap.buildPackedGenome();
+    int len = -1;
+    EXPECT_EQ(gmap.fetchBases("III", 55, 64, &len), "cgcaattaag");
+    
+    // Change a base without changing any sequence lengths, so the fasta index
+    // still matches but the packed genome doesn't
+    std::fstream edit(out.c_str(), std::ios::binary | std::ios::in | std::ios::out);
+    string header;
+    std::getline(edit, header);
+    edit.seekp(header.size() + 1 + 55);
+    edit.put('t');
+    edit.close();
+    bfs::last_write_time(out, bfs::last_write_time(out) + 10);
+    
+    // The stale packed genome is ignored, and bases come from the fasta file
+    GenomeMapper stale(out);
+    stale.loadFastaIndex();
+    EXPECT_EQ(stale.getPackedGenome(), nullptr);
+    EXPECT_EQ(stale.fetchBases("III", 55, 64, &len), "tgcaattaag");
+    
+    // Rebuilding picks up the change
+    stale.buildPackedGenome();
+    GenomeMapper rebuilt(out);
+    rebuilt.loadFastaIndex();
+    ASSERT_NE(rebuilt.getPackedGenome(), nullptr);
+    EXPECT_EQ(rebuilt.fetchBases("III", 55, 64, &len), "tgcaattaag");
+    
+    bfs::remove(gmap.getPackedGenomeFile());
+    bfs::remove(gmap.getFastaIndexFile());
+    bfs::remove(out);
+}
+
+TEST(bam, packed_genome_ambiguous) {
+    
+    bfs::create_directories("temp");
+    path out("temp/ambiguous.fa");
+    
+    std::ofstream dst(out.c_str());
+    dst << ">seq1" << endl << "ACGTNNacgtnn" << endl << "RYacGT" << endl
+        << ">seq2" << endl << "nkMw" << endl;
+    dst.close();
+    
+    GenomeMapper gmap(out);
+    gmap.buildFastaIndex();
+    gmap.loadFastaIndex();
+    gmap.buildPackedGenome();
+    
+    GenomeMapper packed(out);
+    packed.loadFastaIndex();
+    ASSERT_NE(packed.getPackedGenome(), nullptr);
+    EXPECT_EQ(packed.getPackedGenome()->size(), 2);
+    
+    // Ambiguity codes are read back exactly as they are in the fasta file
+    int len = -1;
+    EXPECT_EQ(packed.fetchBases("seq1", &len), "ACGTNNacgtnnRYacGT");
+    EXPECT_EQ(len, 18);
+    EXPECT_EQ(packed.fetchBases("seq1", 10, 13, &len), "nnRY");
+    EXPECT_EQ(packed.fetchBases("seq2", &len), "nkMw");
+    
+    // With or without the packed genome, the same bases are fetched
+    int len2 = -1;
+    for (const string name : {"seq1", "seq2"}) {
+        EXPECT_EQ(packed.fetchBases(name.c_str(), &len), gmap.fetchBases(name.c_str(), &len2));
+        EXPECT_EQ(len, len2);
+        GenomeBuffer packedBuffer(packed, name, 4);
+        GenomeBuffer plainBuffer(gmap, name, 4);
+        ASSERT_TRUE(packedBuffer.fetch(0, len - 1));
+        ASSERT_TRUE(plainBuffer.fetch(0, len - 1));
+        EXPECT_EQ(packedBuffer.getSeq(), plainBuffer.getSeq());
+        EXPECT_EQ(packedBuffer.getCodes(), plainBuffer.getCodes());
+    }
+    
+    PackedSeqView view;
+    EXPECT_TRUE(packed.fetchView("seq1", 3, 6, view));
+    EXPECT_EQ(view.nt16(0), seq_nt16_table['T']);
+    EXPECT_TRUE(view.isN(1));
+    EXPECT_EQ(view.nt16(1), 15);
+    EXPECT_EQ(view[3], 'a');
+    EXPECT_TRUE(packed.fetchView("seq1", 12, 13, view));
+    EXPECT_TRUE(view.isN(0));
+    EXPECT_EQ(view.upper(0), 'R');
+    EXPECT_EQ(view.nt16(1), seq_nt16_table['Y']);
+    
+    bfs::remove(gmap.getPackedGenomeFile());
+    bfs::remove(gmap.getFastaIndexFile());
+    bfs::remove(out);
+}
+
+TEST(bam, lazy_decoding) {
+
+    BamReader reader(RESOURCESDIR "/clipped3.bam");
+    reader.open();
+    uint32_t nbSpliced = 0;
+    uint32_t nbRecords = 0;
+    while (reader.next()) {
+        const BamAlignment& al = reader.current();
+        // From the raw cigar first, then from the decoded cigar
+        const bool spliced = al.isSplicedRead();
+        const uint32_t nbJuncs = al.getNbJunctionsInRead();
+        const vector<CigarOp>& cigar = al.getCigar();
+        EXPECT_EQ(cigar.size(), al.getRaw()->core.n_cigar);
+        EXPECT_EQ(al.isSplicedRead(), spliced);
+        EXPECT_EQ(al.getNbJunctionsInRead(), nbJuncs);
+        EXPECT_EQ(al.getEnd() + 1, bam_endpos(al.getRaw()));
+        if (spliced) {
+            nbSpliced++;
+        }
+        nbRecords++;
+    }
+    reader.close();
+    EXPECT_EQ(nbSpliced, 135);
+    EXPECT_GT(nbRecords, nbSpliced);
+
+    // A cigar set by hand is used rather than the raw cigar
+    BamAlignment ba;
+    EXPECT_FALSE(ba.isSplicedRead());
+    vector<CigarOp> cigar = CigarOp::createFullCigarFromString("10M100N10M200N5M");
+    ba.setCigar(cigar);
+    EXPECT_TRUE(ba.isSplicedRead());
+    EXPECT_EQ(ba.getNbJunctionsInRead(), 2);
+}
+
+TEST(bam, cigar_view) {
+
+    BamReader reader(RESOURCESDIR "/clipped3.bam");
+    reader.open();
+    while (reader.next()) {
+        const BamAlignment& al = reader.current();
+        const CigarView view = al.getCigarView();
+        const vector<CigarOp> cigar = al.getCigar();
+        ASSERT_EQ(view.size(), cigar.size());
+        for (uint32_t i = 0; i < view.size(); i++) {
+            EXPECT_EQ(view.opChar(i), cigar[i].type);
+            EXPECT_EQ(view.length(i), cigar[i].length);
+            EXPECT_EQ(view.consumesQuery(i), CigarOp::opConsumesQuery(cigar[i].type));
+            EXPECT_EQ(view.consumesReference(i), CigarOp::opConsumesReference(cigar[i].type));
+            EXPECT_EQ(view.at(i).pack(), bam_get_cigar(al.getRaw())[i]);
+        }
+        EXPECT_EQ(view.calcReferenceLength(), bam_cigar2rlen(view.size(), bam_get_cigar(al.getRaw())));
+    }
+    reader.close();
+
+    // Editing an op changes the view but not the aligned length
+    BamAlignment ba;
+    ba.setCigar(CigarOp::createFullCigarFromString("10M100N10M"));
+    ba.setPosition(0);
+    ba.setAlignedLength(120);
+    ba.setCigarOpAt(1, CigarOp(BAM_CIGAR_DEL_CHAR, 100));
+    EXPECT_EQ(ba.getCigarAsString(), "10M100D10M");
+    EXPECT_FALSE(ba.isSplicedRead());
+    EXPECT_EQ(ba.getEnd(), 119);
+}
+
+// Finds the match stats the slow way, by comparing the padded sequences
+MatchStats paddedMatchStats(const BamAlignment& al, const string& ref, int32_t refStart, int32_t start, int32_t end) {
+    uint32_t qStart = start;
+    uint32_t qEnd = end;
+    string query = al.getPaddedQuerySeq(start, end, qStart, qEnd, false);
+    string genomic = al.getPaddedGenomeSeq(ref, refStart, refStart + ref.size() - 1, qStart, qEnd, false);
+    EXPECT_EQ(query.size(), genomic.size());
+    MatchStats stats;
+    stats.nbPositions = query.size();
+    for (size_t i = 0; i < query.size(); i++) {
+        if (query[i] != genomic[i]) {
+            if (stats.nbMismatches == 0) {
+                stats.nbMatchesFromStart = i;
+            }
+            stats.nbMismatches++;
+            stats.nbMatchesFromEnd = 0;
+        }
+        else {
+            stats.nbMatchesFromEnd++;
+        }
+    }
+    if (stats.nbMismatches == 0) {
+        stats.nbMatchesFromStart = query.size();
+    }
+    return stats;
+}
+
+TEST(bam, match_stats) {
+
+    BamReader reader(RESOURCESDIR "/clipped3.bam");
+    reader.open();
+    uint32_t nbCompared = 0;
+    uint64_t nbMismatches = 0;
+    while (reader.next()) {
+        const BamAlignment& al = reader.current();
+        if (!al.isSplicedRead()) {
+            continue;
+        }
+        // Make up a reference that agrees with the read, apart from every 11th base
+        const int32_t refStart = al.getStart();
+        string ref(al.getEnd() - refStart + 1, 'A');
+        const CigarView cigar = al.getCigarView();
+        int32_t rPos = refStart;
+        int32_t qPos = 0;
+        int32_t intronStart = -1;
+        int32_t intronEnd = -1;
+        for (uint32_t i = 0; i < cigar.size(); i++) {
+            if (cigar.consumesQuery(i) && cigar.consumesReference(i)) {
+                for (uint32_t j = 0; j < cigar.length(i); j++) {
+                    ref[rPos - refStart + j] = seq_nt16_str[bam_seqi(bam_get_seq(al.getRaw()), qPos + j)];
+                }
+            }
+            if (cigar.op(i) == BAM_CREF_SKIP && intronStart < 0) {
+                intronStart = rPos;
+                intronEnd = rPos + cigar.length(i) - 1;
+            }
+            if (cigar.consumesReference(i)) rPos += cigar.length(i);
+            if (cigar.consumesQuery(i)) qPos += cigar.length(i);
+        }
+        for (size_t p = 3; p < ref.size(); p += 11) {
+            ref[p] = ref[p] == 'C' ? 'G' : 'C';
+        }
+        vector<uint8_t> codes(ref.size());
+        for (size_t p = 0; p < ref.size(); p++) {
+            codes[p] = seq_nt16_table[(uint8_t)ref[p]];
+        }
+
+        const int32_t regions[2][2] = { { refStart, intronStart - 1 }, { intronEnd + 1, al.getEnd() } };
+        for (const auto & r : regions) {
+            const MatchStats expected = paddedMatchStats(al, ref, refStart, r[0], r[1]);
+            const MatchStats actual = al.compareWithReference(codes.data(), refStart, codes.size(), r[0], r[1]);
+            EXPECT_EQ(actual.nbPositions, expected.nbPositions);
+            EXPECT_EQ(actual.nbMismatches, expected.nbMismatches);
+            EXPECT_EQ(actual.nbMatchesFromStart, expected.nbMatchesFromStart);
+            EXPECT_EQ(actual.nbMatchesFromEnd, expected.nbMatchesFromEnd);
+            nbMismatches += actual.nbMismatches;
+        }
+        nbCompared++;
+    }
+    reader.close();
+    EXPECT_EQ(nbCompared, 135);
+    EXPECT_GT(nbMismatches, 0);
+}
+
 TEST(bam, padding) {
     
     vector<CigarOp> cigar = CigarOp::createFullCigarFromString("2S14M2I1M1737N8M14S");
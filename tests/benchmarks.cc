@@ -0,0 +1,188 @@
+//  ********************************************************************
+//  This file is part of Portcullis.
+//
+//  Portcullis is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  Portcullis is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with Portcullis.  If not, see <http://www.gnu.org/licenses/>.
+//  *******************************************************************
+
+/**
+ * Microbenchmarks for a few of the hot paths in the library.  These aren't part
+ * of the unit tests, so are only built on request with "make benchmarks" from
+ * the tests directory.
+ */
+
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+using std::cout;
+using std::endl;
+using std::make_shared;
+using std::shared_ptr;
+using std::string;
+using std::thread;
+using std::vector;
+
+#include <boost/timer/timer.hpp>
+
+#include <portcullis/bam/depth_parser.hpp>
+#include <portcullis/arena.hpp>
+#include <portcullis/intron.hpp>
+#include <portcullis/junction.hpp>
+#include <portcullis/junction_map.hpp>
+#include <portcullis/seq_utils.hpp>
+using portcullis::Arena;
+using portcullis::ArenaAllocator;
+using portcullis::ArenaPtr;
+using portcullis::Intron;
+using portcullis::IntronKey;
+using portcullis::Junction;
+using portcullis::JunctionMap;
+using portcullis::bam::DepthParser;
+using portcullis::bam::RefSeq;
+using portcullis::SeqUtils;
+using portcullis::SimdLevel;
+
+// Random sequence in mixed case, with the odd ambiguous base
+static string randomSeq(std::mt19937& rng, const size_t length) {
+	const string bases = "ACGTNacgtnACGTacgtRYKMSW";
+	std::uniform_int_distribution<size_t> pick(0, bases.size() - 1);
+	std::uniform_int_distribution<size_t> ambiguous(0, 200);
+	string seq(length, 'A');
+	for (size_t i = 0; i < length; i++) {
+		seq[i] = bases[pick(rng) % (ambiguous(rng) == 0 ? bases.size() : 14)];
+	}
+	return seq;
+}
+
+/**
+ * Compares the time taken to allocate junctions with and without an arena per
+ * thread, with many threads allocating at once
+ */
+static void arenaAllocation() {
+	const size_t nbJunctions = 5000;
+	RefSeq ref(0, "seq", 100000000);
+	for (size_t nbThreads : {1, 16, 64}) {
+		double times[2];
+		for (int useArena = 0; useArena < 2; useArena++) {
+			vector<JunctionMap> maps(nbThreads);
+			boost::timer::cpu_timer timer;
+			vector<thread> threads;
+			for (size_t t = 0; t < nbThreads; t++) {
+				threads.emplace_back([&, t]() {
+					ArenaPtr arena = useArena ? make_shared<Arena>() : nullptr;
+					JunctionMap junctions;
+					for (size_t i = 0; i < nbJunctions; i++) {
+						shared_ptr<Intron> intron = std::allocate_shared<Intron>(ArenaAllocator<Intron>(arena), ref, i * 100, i * 100 + 50);
+						junctions.insert(IntronKey(*intron), std::allocate_shared<Junction>(ArenaAllocator<Junction>(arena), intron, i * 100 - 20, i * 100 + 70));
+					}
+					maps[t] = std::move(junctions);
+				});
+			}
+			for (auto & th : threads) {
+				th.join();
+			}
+			maps.clear();
+			times[useArena] = (double)timer.elapsed().wall / 1.0e6;
+		}
+		cout << "Allocating " << nbJunctions << " junctions in each of " << nbThreads << " threads: "
+			 << times[0] << "ms separately, " << times[1] << "ms from arenas" << endl;
+	}
+}
+
+/**
+ * Times the sequence kernels at each instruction set the CPU supports, over
+ * sequences the length of the junction anchors and flanks
+ */
+static void simdKernels() {
+	const SimdLevel best = SeqUtils::getSimdLevel();
+	const size_t nbSeqs = 100000;
+	std::mt19937 rng(42);
+	vector<string> x;
+	vector<string> y;
+	for (size_t i = 0; i < nbSeqs; i++) {
+		x.push_back(randomSeq(rng, 81));
+		y.push_back(randomSeq(rng, 81));
+	}
+	for (SimdLevel level : {SimdLevel::SCALAR, SimdLevel::SSSE3, SimdLevel::AVX2}) {
+		SeqUtils::setSimdLevel(level);
+		if (SeqUtils::getSimdLevel() != level) {
+			continue;
+		}
+		// Deep copies, so the timings don't include unsharing any strings
+		vector<string> a;
+		vector<string> b;
+		for (size_t i = 0; i < nbSeqs; i++) {
+			a.push_back(string(x[i].data(), x[i].size()));
+			b.push_back(string(y[i].data(), y[i].size()));
+		}
+		uint64_t sum = 0;
+		boost::timer::cpu_timer timer;
+		for (size_t i = 0; i < nbSeqs; i++) {
+			sum += SeqUtils::hammingDistance(a[i], b[i]);
+		}
+		const string hammingTime = timer.format(3, "%ws");
+		timer.start();
+		for (auto & s : a) {
+			SeqUtils::reverseComplementInPlace(s);
+		}
+		const string revcompTime = timer.format(3, "%ws");
+		timer.start();
+		for (auto & s : b) {
+			SeqUtils::makeClean(&s[0], s.size());
+		}
+		const string cleanTime = timer.format(3, "%ws");
+		cout << "SIMD level " << (int)level << ": hamming " << hammingTime << " (" << sum << ")"
+			 << "; reverse complement " << revcompTime << "; clean " << cleanTime << endl;
+	}
+	SeqUtils::setSimdLevel(best);
+}
+
+/**
+ * Times the pileup and difference array depth engines over each BAM file, with
+ * and without gapped alignments
+ */
+static void depthEngines(const vector<string>& bamFiles) {
+	for (const string& bamFile : bamFiles) {
+		for (bool gapped : {true, false}) {
+			double times[2];
+			size_t total = 0;
+			for (int usePileup = 0; usePileup < 2; usePileup++) {
+				boost::timer::cpu_timer timer;
+				DepthParser dp(bamFile, 0, gapped, 1, usePileup == 1);
+				vector<uint32_t> batch;
+				while (dp.loadNextBatch(batch)) {
+					total += batch.size();
+				}
+				times[usePileup] = timer.elapsed().wall / 1000000.0;
+			}
+			cout << bamFile << (gapped ? " (gapped)" : "") << ": difference array " << times[0]
+				 << "ms; pileup " << times[1] << "ms (" << total << " positions)" << endl;
+		}
+	}
+}
+
+int main(int argc, char *argv[]) {
+	arenaAllocation();
+	simdKernels();
+	// Any BAM files given on the command line are used instead of the test data
+	vector<string> bamFiles(argv + 1, argv + argc);
+	if (bamFiles.empty()) {
+		bamFiles = {RESOURCESDIR "/sorted.bam", RESOURCESDIR "/clipped3.bam"};
+	}
+	depthEngines(bamFiles);
+	return 0;
+}
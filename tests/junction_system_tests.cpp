@@ -0,0 +1,584 @@
+//  ********************************************************************
+//  This file is part of Portcullis.
+//
+//  Portcullis is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  Portcullis is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with Portcullis.  If not, see <http://www.gnu.org/licenses/>.
+//  *******************************************************************
+
+#include <gtest/gtest.h>
+
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+using std::endl;
+using std::thread;
+using std::vector;
+
+#include <boost/algorithm/string.hpp>
+#include <boost/filesystem.hpp>
+
+#include <htslib/sam.h>
+
+#include <portcullis/bam/bam_reader.hpp>
+#include <portcullis/bam/bam_writer.hpp>
+#include <portcullis/bam/genome_mapper.hpp>
+#include <portcullis/junction_system.hpp>
+#include <portcullis/rule_parser.hpp>
+#include <portcullis/vicinity_scanner.hpp>
+using namespace portcullis::bam;
+using portcullis::CanonicalSS;
+using portcullis::JunctionException;
+using portcullis::JunctionSystem;
+using portcullis::JunctionTable;
+using portcullis::JuncResultMap;
+using portcullis::RuleFilter;
+using portcullis::VicinityScanner;
+
+
+TEST(junction_system, region_windows) {
+
+    string bamFile = RESOURCESDIR "/clipped3.bam";
+
+    // Process whole BAM in one go
+    BamReader reader(bamFile);
+    reader.open();
+    shared_ptr<RefSeqPtrList> refs = reader.createRefList();
+    JunctionSystem all(refs);
+    uint64_t allSpliced = 0;
+    while (reader.next()) {
+        if (all.addJunctions(reader.current())) {
+            allSpliced++;
+        }
+    }
+    EXPECT_EQ(all.size(), 1);
+    EXPECT_EQ(allSpliced, 135);
+    EXPECT_EQ(all.getNbJunctionAlignments(), 135);
+
+    // Now split the target sequence into windows.  The junction starts in the
+    // second window but most of its supporting alignments start in the first.
+    const int32_t refId = all.getJunctionAt(0)->getIntron()->ref.index;
+    const int32_t refLength = refs->at(refId)->length;
+    vector<int32_t> bounds = {0, 6442600, 6442700, refLength};
+    uint32_t nbJuncs = 0;
+    uint32_t nbAlignments = 0;
+    for (size_t i = 0; i < bounds.size() - 1; i++) {
+        JunctionSystem window(refs);
+        reader.setRegion(refId, bounds[i], bounds[i + 1]);
+        while (reader.next()) {
+            window.addJunctionsInRegion(reader.current(), bounds[i], bounds[i + 1]);
+        }
+        nbJuncs += window.size();
+        for (auto& j : window.getJunctions()) {
+            nbAlignments += j->getNbSplicedAlignments();
+        }
+        EXPECT_EQ(window.size(), i == 1 ? 1 : 0);
+    }
+    reader.close();
+
+    EXPECT_EQ(nbJuncs, all.size());
+    EXPECT_EQ(nbAlignments, all.getJunctionAt(0)->getNbSplicedAlignments());
+}
+
+TEST(junction_system, target_flanking_and_coverage) {
+
+    string bamFile = RESOURCESDIR "/clipped3.bam";
+
+    BamReader reader(bamFile);
+    reader.open();
+    shared_ptr<RefSeqPtrList> refs = reader.createRefList();
+    JunctionSystem js(refs);
+    while (reader.next()) {
+        js.addJunctions(reader.current());
+    }
+    ASSERT_EQ(js.size(), 1);
+    JunctionPtr j = js.getJunctionAt(0);
+
+    // Whole file passes
+    js.findFlankingAlignments(bamFile);
+    js.calcCoverage(bamFile, Strandedness::UNSTRANDED);
+    const uint32_t upstream = j->getNbUpstreamFlankingAlignments();
+    const uint32_t downstream = j->getNbDownstreamFlankingAlignments();
+    const double coverage = j->getCoverage();
+    EXPECT_GT(upstream + downstream, 0);
+
+    // Single pass over the target sequence
+    vector<JunctionList> targetJunctions;
+    js.groupJunctionsByTarget(refs->size(), targetJunctions);
+    const int32_t refId = j->getIntron()->ref.index;
+    EXPECT_EQ(targetJunctions[refId].size(), 1);
+    j->setNbUpstreamFlankingAlignments(0);
+    j->setNbDownstreamFlankingAlignments(0);
+    JunctionSystem::calcTargetFlankingAndCoverage(reader, refId, targetJunctions[refId]);
+    reader.close();
+
+    EXPECT_EQ(j->getNbUpstreamFlankingAlignments(), upstream);
+    EXPECT_EQ(j->getNbDownstreamFlankingAlignments(), downstream);
+    EXPECT_DOUBLE_EQ(j->getCoverage(), coverage);
+}
+
+TEST(junction_system, multiply_spliced_mismatches) {
+
+    boost::filesystem::create_directories("temp");
+    string genomeFile = "temp/spombe.III.mismatches.fa";
+    std::ifstream src(RESOURCESDIR "/spombe.III.fa", std::ios::binary);
+    std::ofstream dst(genomeFile.c_str(), std::ios::binary);
+    dst << src.rdbuf();
+    dst.close();
+    GenomeMapper gmap(genomeFile);
+    gmap.buildFastaIndex();
+    gmap.loadFastaIndex();
+    int len = -1;
+    string seq = gmap.fetchBases("III", &len);
+    boost::to_upper(seq);
+
+    // A read with two introns, matching the genome apart from one base in the
+    // middle exon, which is in the anchors of both junctions
+    string middle = seq.substr(10110, 10);
+    middle[5] = middle[5] == 'A' ? 'C' : 'A';
+    string read = seq.substr(10000, 10) + middle + seq.substr(10220, 10);
+    string headerText = string("@SQ\tSN:III\tLN:") + std::to_string(len) + "\n";
+    bam_hdr_t* header = sam_hdr_parse(headerText.size(), headerText.c_str());
+    string line = "read1\t0\tIII\t10001\t60\t10M100N10M100N10M\t*\t0\t0\t" + read + "\t*";
+    kstring_t ks = {line.size(), line.size() + 1, &line[0]};
+    bam1_t* b = bam_init1();
+    ASSERT_EQ(sam_parse1(&ks, header, b), 0);
+    BamAlignment al(b, false, Strandedness::UNSTRANDED, Orientation::FR);
+
+    shared_ptr<RefSeqPtrList> refs = make_shared<RefSeqPtrList>();
+    refs->push_back(make_shared<RefSeq>(0, "III", len));
+    JunctionSystem js(refs);
+    GenomeBuffer buffer(gmap, "III", 1000);
+    EXPECT_TRUE(js.addJunctionsInRegion(al, INT32_MIN, INT32_MAX, &buffer));
+    ASSERT_EQ(js.size(), 2);
+    for (auto & j : js.getJunctions()) {
+        // The other intron isn't counted as mismatches
+        j->calcMismatchStats();
+        EXPECT_DOUBLE_EQ(j->getMeanMismatches(), 1.0);
+    }
+
+    bam_destroy1(b);
+    bam_hdr_destroy(header);
+    boost::filesystem::remove(genomeFile);
+    boost::filesystem::remove(genomeFile + ".fai");
+}
+
+TEST(junction_system, flanking_sweep) {
+
+    string bamFile = RESOURCESDIR "/clipped3.bam";
+
+    BamReader reader(bamFile);
+    reader.open();
+    shared_ptr<RefSeqPtrList> refs = reader.createRefList();
+    vector<std::pair<int32_t, int32_t>> spans;
+    int32_t refId = -1;
+    while (reader.next()) {
+        const BamAlignment& al = reader.current();
+        spans.push_back(std::make_pair(al.getStart(), al.getEnd()));
+        refId = al.getReferenceId();
+    }
+    reader.close();
+    ASSERT_FALSE(spans.empty());
+
+    // Junctions of varying lengths spread over the alignments, some nested
+    // or overlapping, and some with nothing nearby
+    const int32_t first = spans.front().first - 500;
+    const int32_t last = spans.back().second + 500;
+    const RefSeq& ref = *refs->at(refId);
+    JunctionList juncs;
+    for (int32_t i = 0; i < 40; i++) {
+        const int32_t start = first + (int32_t)((int64_t)(last - first) * i / 40);
+        const int32_t end = start + 20 + (i * 137) % 3000;
+        shared_ptr<Intron> intron = make_shared<Intron>(RefSeq(ref.index, ref.name, ref.length), start, end);
+        juncs.push_back(make_shared<Junction>(intron, start - 10 - (i * 31) % 200, end + 10 + (i * 53) % 200));
+    }
+    JunctionSystem js(juncs);
+    js.findFlankingAlignments(bamFile);
+
+    // Same rules as the old per junction region query
+    size_t nbFlanked = 0;
+    for (auto & j : js.getJunctions()) {
+        uint32_t upstream = 0;
+        uint32_t downstream = 0;
+        for (const auto & s : spans) {
+            if (j->getIntron()->start > s.first && j->getLeftAncStart() <= s.second) {
+                upstream++;
+            }
+            if (j->getRightAncEnd() >= s.first && j->getIntron()->end < s.first) {
+                downstream++;
+            }
+        }
+        EXPECT_EQ(j->getNbUpstreamFlankingAlignments(), upstream);
+        EXPECT_EQ(j->getNbDownstreamFlankingAlignments(), downstream);
+        if (upstream + downstream > 0) {
+            nbFlanked++;
+        }
+    }
+    EXPECT_GT(nbFlanked, 5);
+}
+
+// Checks the flanking alignment counts and coverage scores from the fused
+// single pass match those from the multipass route over a separate unspliced BAM
+TEST(junction_system, fused_metrics) {
+
+    boost::filesystem::create_directories("temp");
+    string bamFile = RESOURCESDIR "/clipped3.bam";
+    path unsplicedFile("temp/clipped3.unspliced.bam");
+
+    // Split out the unspliced alignments, as the multipass route needs
+    BamReader reader(bamFile);
+    reader.open();
+    shared_ptr<RefSeqPtrList> refs = reader.createRefList();
+    BamWriter writer(unsplicedFile);
+    writer.enableIndexing(false);
+    writer.open(reader.getHeader());
+    int32_t refId = -1;
+    int32_t first = INT32_MAX;
+    int32_t last = 0;
+    while (reader.next()) {
+        const BamAlignment& al = reader.current();
+        if (!al.isMapped()) {
+            continue;
+        }
+        if (!al.isSplicedRead()) {
+            writer.write(al);
+        }
+        refId = al.getReferenceId();
+        first = std::min(first, al.getStart());
+        last = std::max(last, al.getEnd());
+    }
+    writer.close();
+    reader.close();
+    ASSERT_GE(refId, 0);
+    const RefSeq& ref = *refs->at(refId);
+
+    // As well as the junctions found in the BAM, add some more spread over the
+    // alignments so there's plenty to compare
+    auto extraJunctions = [&]() {
+        JunctionList juncs;
+        for (int32_t i = 0; i < 40; i++) {
+            const int32_t start = first - 500 + (int32_t)((int64_t)(last - first + 1000) * i / 40);
+            const int32_t end = start + 20 + (i * 137) % 3000;
+            shared_ptr<Intron> intron = make_shared<Intron>(RefSeq(ref.index, ref.name, ref.length), start, end);
+            juncs.push_back(make_shared<Junction>(intron, start - 10 - (i * 31) % 200, end + 10 + (i * 53) % 200));
+        }
+        return juncs;
+    };
+
+    // Multipass: find junctions, then sweep the unspliced BAM
+    JunctionSystem multipass(refs);
+    reader.open();
+    while (reader.next()) {
+        multipass.addJunctions(reader.current());
+    }
+    reader.close();
+    ASSERT_GT(multipass.size(), 0);
+    JunctionList multipassJuncs = extraJunctions();
+    multipassJuncs.insert(multipassJuncs.end(), multipass.getJunctions().begin(), multipass.getJunctions().end());
+    BamReader unspliced(unsplicedFile);
+    unspliced.open();
+    JunctionSystem::calcTargetFlankingAndCoverage(unspliced, refId, multipassJuncs);
+    unspliced.close();
+
+    // Fused: junctions are added to the scanner as they are found, alongside
+    // the unspliced alignments, in a single pass over the original BAM
+    JunctionSystem fused(refs);
+    JunctionList fusedJuncs = extraJunctions();
+    std::sort(fusedJuncs.begin(), fusedJuncs.end(), [](const JunctionPtr& a, const JunctionPtr& b) {
+        return a->getLeftAncStart() < b->getLeftAncStart();
+    });
+    size_t nextExtra = 0;
+    VicinityScanner scanner(ref.length, 0);
+    reader.open();
+    while (reader.next()) {
+        const BamAlignment& al = reader.current();
+        scanner.advance(al.getPosition());
+        for (; nextExtra < fusedJuncs.size() && fusedJuncs[nextExtra]->getLeftAncStart() <= al.getPosition(); nextExtra++) {
+            scanner.addJunction(fusedJuncs[nextExtra]);
+        }
+        const size_t nbJunctions = fused.size();
+        const bool spliced = fused.addJunctions(al);
+        for (size_t i = nbJunctions; i < fused.size(); i++) {
+            scanner.addJunction(fused.getJunctionAt(i));
+        }
+        if (!spliced && al.isMapped()) {
+            scanner.addAlignment(al);
+        }
+    }
+    reader.close();
+    for (; nextExtra < fusedJuncs.size(); nextExtra++) {
+        scanner.addJunction(fusedJuncs[nextExtra]);
+    }
+    scanner.finish();
+    EXPECT_EQ(scanner.getBackfillStart(), 0);
+    scanner.finishBackfill();
+    fusedJuncs.insert(fusedJuncs.end(), fused.getJunctions().begin(), fused.getJunctions().end());
+
+    // Compare junction by junction
+    ASSERT_EQ(fusedJuncs.size(), multipassJuncs.size());
+    auto byPosition = [](const JunctionPtr& a, const JunctionPtr& b) {
+        return a->getIntron()->start != b->getIntron()->start ?
+               a->getIntron()->start < b->getIntron()->start :
+               a->getIntron()->end < b->getIntron()->end;
+    };
+    std::sort(fusedJuncs.begin(), fusedJuncs.end(), byPosition);
+    std::sort(multipassJuncs.begin(), multipassJuncs.end(), byPosition);
+    size_t nbFlanked = 0;
+    size_t nbCovered = 0;
+    for (size_t i = 0; i < fusedJuncs.size(); i++) {
+        const Junction& f = *fusedJuncs[i];
+        const Junction& m = *multipassJuncs[i];
+        ASSERT_EQ(f.getIntron()->start, m.getIntron()->start);
+        ASSERT_EQ(f.getIntron()->end, m.getIntron()->end);
+        EXPECT_EQ(f.getLeftAncStart(), m.getLeftAncStart());
+        EXPECT_EQ(f.getRightAncEnd(), m.getRightAncEnd());
+        EXPECT_EQ(f.getNbUpstreamFlankingAlignments(), m.getNbUpstreamFlankingAlignments());
+        EXPECT_EQ(f.getNbDownstreamFlankingAlignments(), m.getNbDownstreamFlankingAlignments());
+        EXPECT_DOUBLE_EQ(f.getCoverage(), m.getCoverage());
+        if (f.getNbUpstreamFlankingAlignments() + f.getNbDownstreamFlankingAlignments() > 0) {
+            nbFlanked++;
+        }
+        if (f.getCoverage() != 0.0) {
+            nbCovered++;
+        }
+    }
+    EXPECT_GT(nbFlanked, 5);
+    EXPECT_GT(nbCovered, 5);
+
+    boost::filesystem::remove(unsplicedFile);
+    boost::filesystem::remove(writer.getIndexFile());
+}
+
+TEST(junction_system, arena) {
+
+    string bamFile = RESOURCESDIR "/clipped3.bam";
+
+    BamReader reader(bamFile);
+    reader.open();
+    shared_ptr<RefSeqPtrList> refs = reader.createRefList();
+    JunctionSystem js(refs);
+    ArenaPtr arena = make_shared<Arena>();
+    js.setArena(arena);
+    while (reader.next()) {
+        js.addJunctions(reader.current());
+    }
+    reader.close();
+    ASSERT_EQ(js.size(), 1);
+    EXPECT_EQ(js.getJunctionAt(0)->getNbSplicedAlignments(), 135);
+    EXPECT_GT(arena->getNbBytes(), sizeof(Junction) + sizeof(Intron));
+    EXPECT_EQ(arena->getNbBlocks(), 1);
+    EXPECT_THROW(js.setArena(nullptr), JunctionException);
+
+    // Junctions keep the arena alive after the junction system has gone
+    JunctionPtr j = js.getJunctionAt(0);
+    js = JunctionSystem();
+    arena.reset();
+    EXPECT_EQ(j->getNbSplicedAlignments(), 135);
+}
+
+TEST(junction_system, junction_map) {
+
+    const RefSeq r1(0, "seq_1", 100000000);
+    const RefSeq r2(1, "seq_2", 100000000);
+    JunctionMap junctions;
+    EXPECT_EQ(junctions.find(IntronKey(0, 100, 200)), nullptr);
+
+    // Enough junctions to make the table grow several times, including some
+    // with the same position on different targets
+    JunctionList juncs;
+    for (int32_t i = 0; i < 1000; i++) {
+        const RefSeq& ref = i % 2 == 0 ? r1 : r2;
+        juncs.push_back(make_shared<Junction>(make_shared<Intron>(ref, (i / 2) * 100, (i / 2) * 100 + 50), (i / 2) * 100 - 20, (i / 2) * 100 + 70));
+        junctions.insert(IntronKey(*(juncs.back()->getIntron())), juncs.back());
+    }
+    EXPECT_EQ(junctions.size(), 1000);
+    for (auto& j : juncs) {
+        EXPECT_EQ(junctions.find(IntronKey(*(j->getIntron()))), j);
+    }
+    EXPECT_EQ(junctions.find(IntronKey(0, 100, 151)), nullptr);
+    EXPECT_EQ(junctions.find(IntronKey(2, 100, 150)), nullptr);
+
+    // Replacing a junction doesn't change the size
+    JunctionPtr replacement = make_shared<Junction>(make_shared<Intron>(r2, 100, 150), 80, 170);
+    junctions.insert(IntronKey(1, 100, 150), replacement);
+    EXPECT_EQ(junctions.size(), 1000);
+    EXPECT_EQ(junctions.find(IntronKey(1, 100, 150)), replacement);
+    EXPECT_EQ(junctions.find(IntronKey(0, 100, 150)), juncs[2]);
+
+    // Lookups through the junction system
+    JunctionSystem js(juncs);
+    EXPECT_EQ(js.getJunction(Intron(r1, 100, 150)), juncs[2]);
+    EXPECT_EQ(js.getJunction(IntronKey(1, 100, 150)), juncs[3]);
+    EXPECT_EQ(js.getJunction(IntronKey(1, 100, 151)), nullptr);
+
+    junctions.clear();
+    EXPECT_TRUE(junctions.empty());
+    EXPECT_EQ(junctions.find(IntronKey(0, 100, 150)), nullptr);
+}
+
+TEST(junction_system, concatenate_and_sort) {
+
+    const RefSeq r1(0, "seq_1", 100000000);
+    const RefSeq r2(1, "seq_2", 100000000);
+    JunctionList first;
+    first.push_back(make_shared<Junction>(make_shared<Intron>(r1, 100, 200), 50, 250));
+    first.push_back(make_shared<Junction>(make_shared<Intron>(r1, 500, 600), 470, 610));
+    JunctionList second;
+    second.push_back(make_shared<Junction>(make_shared<Intron>(r2, 100, 200), 50, 250));
+    JunctionSystem a(first);
+    JunctionSystem b(second);
+
+    JunctionSystem all;
+    all.concatenate(a);
+    all.concatenate(b);
+    EXPECT_EQ(a.size(), 0);
+    EXPECT_EQ(b.size(), 0);
+    ASSERT_EQ(all.size(), 3);
+    EXPECT_TRUE(all.isSorted());
+    for (size_t i = 0; i < all.size(); i++) {
+        EXPECT_EQ(all.getJunctionAt(i)->getId(), i);
+    }
+    EXPECT_EQ(all.getJunction(IntronKey(1, 100, 200)), second[0]);
+
+    // Enough junctions in reverse order to be sorted in several slices
+    JunctionList juncs;
+    for (int32_t i = 50000; i > 0; i--) {
+        const RefSeq& ref = i % 3 == 0 ? r2 : r1;
+        juncs.push_back(make_shared<Junction>(make_shared<Intron>(ref, i * 10, i * 10 + (i % 7) * 5 + 50), i * 10 - 20, i * 10 + 100));
+    }
+    JunctionSystem parallel(juncs);
+    JunctionSystem serial(juncs);
+    EXPECT_FALSE(parallel.isSorted());
+    parallel.sort(3);
+    serial.sort();
+    EXPECT_TRUE(parallel.isSorted());
+    ASSERT_EQ(parallel.size(), serial.size());
+    for (size_t i = 0; i < parallel.size(); i++) {
+        ASSERT_EQ(parallel.getJunctionAt(i), serial.getJunctionAt(i));
+    }
+}
+
+TEST(junction_system, table) {
+
+    const RefSeq r1(0, "seq_1", 1000);
+    const RefSeq r2(1, "seq_2", 1000);
+    JunctionList juncs;
+    juncs.push_back(make_shared<Junction>(make_shared<Intron>(r1, 100, 200), 50, 250));
+    juncs.push_back(make_shared<Junction>(make_shared<Intron>(r2, 300, 400), 280, 450));
+    juncs.push_back(make_shared<Junction>(make_shared<Intron>(r1, 500, 600), 470, 610));
+    juncs[0]->setDonorAndAcceptorMotif("GT", "AG");
+    juncs[1]->setEntropy(1.5);
+    juncs[2]->setSuspicious(true);
+    juncs[2]->setJunctionAnchorDepth(3, 7);
+    JunctionSystem js(juncs);
+
+    JunctionTable table = js.createTable();
+    ASSERT_EQ(table.size(), 3);
+    EXPECT_EQ(table.getRefNames().size(), 2);
+    EXPECT_EQ(table.getRefIds()[0], table.getRefIds()[2]);
+    EXPECT_EQ(table.getRefName(1), "seq_2");
+    EXPECT_EQ(table.getStarts()[1], 300);
+    EXPECT_EQ(table.getEnds()[2], 600);
+    EXPECT_EQ(table.getLeftAncStarts()[0], 50);
+    EXPECT_EQ(table.getRightAncEnds()[1], 450);
+    EXPECT_EQ(table.getSpliceSiteTypes()[0], CanonicalSS::CANONICAL);
+    EXPECT_EQ(table.getStringValue("ss_type", 0), juncs[0]->getStringFromName("ss_type"));
+    EXPECT_EQ(table.getStringValue("refname", 2), "seq_1");
+    EXPECT_THROW(table.getStringValue("entropy", 0), JunctionException);
+
+    // Every numeric property matches the junctions
+    for (const string name : {"nb_raw_aln", "entropy", "suspicious", "intron_score", "dist_2_up_junc"}) {
+        const vector<double>& col = table.getNumericColumn(name);
+        ASSERT_EQ(col.size(), 3);
+        for (size_t i = 0; i < juncs.size(); i++) {
+            EXPECT_DOUBLE_EQ(col[i], juncs[i]->getValueFromName(name));
+        }
+    }
+    EXPECT_DOUBLE_EQ(table.getNumericColumn("entropy")[1], 1.5);
+    EXPECT_DOUBLE_EQ(table.getNumericColumn("suspicious")[2], 1.0);
+    EXPECT_THROW(table.getNumericColumn("refname"), JunctionException);
+
+    EXPECT_EQ(table.getJunctionAnchorDepthColumn(3)[2], 7);
+    EXPECT_EQ(table.getJunctionAnchorDepthColumn(3)[0], 0);
+
+    // Only the requested numeric columns
+    JunctionTable partial(juncs, vector<string>({"entropy", "suspicious"}));
+    ASSERT_EQ(partial.size(), 3);
+    EXPECT_EQ(partial.getRefName(1), "seq_2");
+    EXPECT_DOUBLE_EQ(partial.getNumericColumn("entropy")[1], 1.5);
+    EXPECT_THROW(partial.getNumericColumn("nb_raw_aln"), JunctionException);
+    EXPECT_THROW(partial.getJunctionAnchorDepthColumn(0), JunctionException);
+    EXPECT_THROW(table.getJunctionAnchorDepthColumn(Junction::JAD_NAMES.size()), JunctionException);
+    EXPECT_THROW(JunctionTable(juncs, vector<string>({"refname"})), JunctionException);
+
+    // Rules are evaluated against the table
+    boost::filesystem::create_directories("temp");
+    path ruleFile("temp/table_rules.json");
+    std::ofstream rules(ruleFile.c_str());
+    rules << "{ \"parameters\": {"
+          << " \"entropy.1\": { \"operator\": \"gt\", \"value\": 1.0 },"
+          << " \"suspicious.1\": { \"operator\": \"eq\", \"value\": 1 },"
+          << " \"refname.1\": { \"operator\": \"in\", \"value\": [\"seq_1\"] } },"
+          << " \"expression\": \"entropy.1 | (suspicious.1 & refname.1)\" }" << endl;
+    rules.close();
+    JunctionList pass, fail;
+    JuncResultMap results;
+    map<string, int> counts = RuleFilter::filter(ruleFile, juncs, pass, fail, "test", results);
+    ASSERT_EQ(pass.size(), 2);
+    EXPECT_EQ(pass[0], juncs[1]);
+    EXPECT_EQ(pass[1], juncs[2]);
+    ASSERT_EQ(fail.size(), 1);
+    EXPECT_EQ(fail[0], juncs[0]);
+    EXPECT_EQ(counts["entropy.1 GT 1"], 1);
+    EXPECT_EQ(counts["suspicious.1 EQ 1"], 1);
+    EXPECT_EQ(counts.count("refname.1 IN seq_1"), 0);
+    boost::filesystem::remove(ruleFile);
+}
+
+/**
+ * Builds junctions from a separate arena in each of several threads at once
+ */
+TEST(junction_system, arena_threads) {
+
+    const size_t nbJunctions = 5000;
+    const size_t nbThreads = 4;
+    RefSeq ref(0, "seq", 100000000);
+
+    vector<JunctionMap> maps(nbThreads);
+    vector<ArenaPtr> arenas(nbThreads);
+    vector<thread> threads;
+    for (size_t t = 0; t < nbThreads; t++) {
+        threads.emplace_back([&, t]() {
+            arenas[t] = make_shared<Arena>();
+            for (size_t i = 0; i < nbJunctions; i++) {
+                shared_ptr<Intron> intron = std::allocate_shared<Intron>(ArenaAllocator<Intron>(arenas[t]), ref, i * 100, i * 100 + 50);
+                maps[t].insert(IntronKey(*intron), std::allocate_shared<Junction>(ArenaAllocator<Junction>(arenas[t]), intron, i * 100 - 20, i * 100 + 70));
+            }
+        });
+    }
+    for (auto& th : threads) {
+        th.join();
+    }
+    for (size_t t = 0; t < nbThreads; t++) {
+        EXPECT_EQ(maps[t].size(), nbJunctions);
+        EXPECT_GT(arenas[t]->getNbBlocks(), 1);
+        // The junctions keep their arena alive
+        arenas[t].reset();
+        JunctionPtr j = maps[t].find(IntronKey(0, 4200, 4250));
+        ASSERT_TRUE(j != nullptr);
+        EXPECT_EQ(j->getLeftAncStart(), 4180);
+        EXPECT_EQ(j->getRightAncEnd(), 4270);
+    }
+}
+
@@ -146,3 +146,27 @@ TEST(junction, coverage2) {
     
     EXPECT_LT(cvg2, 0);
 }
+
+/**
+ * Coverage calculated from windows around the splice sites should match that
+ * calculated from the levels across the whole target sequence
+ */
+TEST(junction, coverage_windows) {
+    
+    shared_ptr<Intron> l(new Intron(rd5, 20, 30));
+    Junction j3(l, 10, 40);
+    
+    vector<uint32_t> coverage3{ 10,10,10,10,10,10,10,10,10,10,
+                                10,10,10,10,10,8,6,4,3,2,
+                                0,0,0,0,0,0,0,0,0,0,
+                                2,3,4,7,8,10,10,10,10,10,
+                                10,10,10,10,10,10,10,10,10,10}; 
+    
+    vector<uint32_t> donor(coverage3.begin(), coverage3.begin() + 21);
+    vector<uint32_t> acceptor(coverage3.begin() + 30, coverage3.end());
+    
+    double dense = j3.calcCoverage(coverage3);
+    double sparse = j3.calcCoverage(donor, 0, acceptor, 30, coverage3.size());
+    
+    EXPECT_DOUBLE_EQ(dense, sparse);
+}
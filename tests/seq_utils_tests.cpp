@@ -18,13 +18,17 @@
 #include <gtest/gtest.h>
 
 #include <iostream>
+#include <random>
+#include <vector>
 using std::cout;
 using std::endl;
+using std::vector;
 
 #include <boost/filesystem.hpp>
 
 #include <portcullis/seq_utils.hpp>
 using portcullis::SeqUtils;
+using portcullis::SimdLevel;
 
 
 TEST(seq_utils, hamming) {
@@ -46,3 +50,74 @@ TEST(seq_utils, rev_comp) {
     EXPECT_EQ(SeqUtils::reverseComplement("ATGC"), "GCAT");    
 }
 
+
+TEST(seq_utils, rev_comp_in_place) {
+
+    string seq("acgtNRYacg");
+    SeqUtils::reverseComplementInPlace(seq);
+    EXPECT_EQ(seq, "cgtRYNacgt");
+
+    string empty;
+    SeqUtils::reverseComplementInPlace(empty);
+    EXPECT_EQ(empty, "");
+}
+
+TEST(seq_utils, make_clean) {
+
+    EXPECT_EQ(SeqUtils::makeClean("acgtRYNnACGT-"), "ACGTNNNNACGTN");
+}
+
+// Random sequence in mixed case, with the odd ambiguous base
+static string randomSeq(std::mt19937& rng, const size_t length) {
+    const string bases = "ACGTNacgtnACGTacgtRYKMSW";
+    std::uniform_int_distribution<size_t> pick(0, bases.size() - 1);
+    std::uniform_int_distribution<size_t> ambiguous(0, 200);
+    string seq(length, 'A');
+    for (size_t i = 0; i < length; i++) {
+        seq[i] = bases[pick(rng) % (ambiguous(rng) == 0 ? bases.size() : 14)];
+    }
+    return seq;
+}
+
+/**
+ * Checks every instruction set the CPU supports gives the same results as the
+ * scalar kernels, at lengths either side of the block sizes.  See
+ * benchmarks.cc for timings.
+ */
+TEST(seq_utils, simd_kernels) {
+
+    const SimdLevel best = SeqUtils::getSimdLevel();
+    std::mt19937 rng(42);
+    vector<string> seqs;
+    for (size_t length : {0, 1, 15, 16, 17, 31, 32, 33, 63, 64, 65, 100, 1000}) {
+        seqs.push_back(randomSeq(rng, length));
+    }
+
+    SeqUtils::setSimdLevel(SimdLevel::SCALAR);
+    vector<uint32_t> hamming;
+    vector<string> revcomp;
+    vector<string> clean;
+    const size_t nbPairs = seqs.size();
+    for (size_t i = 0; i < nbPairs; i++) {
+        seqs.push_back(randomSeq(rng, seqs[i].size()));
+        hamming.push_back(SeqUtils::hammingDistance(seqs[i], seqs[nbPairs + i]));
+    }
+    for (const auto & s : seqs) {
+        revcomp.push_back(SeqUtils::reverseComplement(s));
+        clean.push_back(SeqUtils::makeClean(s));
+    }
+
+    for (SimdLevel level : {SimdLevel::SSSE3, SimdLevel::AVX2}) {
+        SeqUtils::setSimdLevel(level);
+        for (size_t i = 0; i < hamming.size(); i++) {
+            EXPECT_EQ(SeqUtils::hammingDistance(seqs[i], seqs[nbPairs + i]), hamming[i]);
+        }
+        for (size_t i = 0; i < seqs.size(); i++) {
+            EXPECT_EQ(SeqUtils::reverseComplement(seqs[i]), revcomp[i]);
+            EXPECT_EQ(SeqUtils::makeClean(seqs[i]), clean[i]);
+        }
+    }
+
+    SeqUtils::setSimdLevel(best);
+    EXPECT_EQ(SeqUtils::getSimdLevel(), best);
+}